@@ -0,0 +1,347 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalBench.cpp : Entry point for calbench, which times the calendar
+* library on calendars it generates, so the figures quoted for it can
+* be reproduced
+*
+*********************************************************************/
+
+#include "stdafx.h"
+#include <stdlib.h>
+#include <string.h>
+#include <Windows.h>
+#include <stdio.h>
+#include "../calendar-reader/CalendarLib.h"
+
+#define BENCH_PEOPLE		200		// Distinct contacts the generated entries name
+#define BENCH_LOOKUPS		1000	// Indexed lookups timed per run
+#define BENCH_CONTENT		4096	// Bytes of content per entry in the scan benchmark
+#define BENCH_SCANS			10		// Scans timed per run
+
+typedef struct _BenchBuffer
+{
+	unsigned char *Data;
+	size_t Length;
+	size_t Capacity;
+	bool Failed;
+} BenchBuffer;
+
+/// <summary>
+/// Appends len bytes to the buffer, growing it as needed
+/// </summary>
+void PutBytes(BenchBuffer *b, const void *p, size_t len)
+{
+	if (b->Failed)
+	{
+		return;
+	}
+
+	if (b->Length + len > b->Capacity)
+	{
+		size_t capacity = b->Capacity ? b->Capacity : 64 * 1024;
+		while (capacity < b->Length + len)
+		{
+			capacity *= 2;
+		}
+
+		unsigned char *grown = (unsigned char *)realloc(b->Data, capacity);
+		if (!grown)
+		{
+			b->Failed = true;
+			return;
+		}
+		b->Data = grown;
+		b->Capacity = capacity;
+	}
+
+	memcpy(b->Data + b->Length, p, len);
+	b->Length += len;
+}
+
+void PutType(BenchBuffer *b, unsigned char type)
+{
+	PutBytes(b, &type, 1);
+}
+
+void PutUInt(BenchBuffer *b, uint32_t value)
+{
+	PutBytes(b, &value, sizeof(value));
+}
+
+void PutIntElement(BenchBuffer *b, unsigned char type, int value)
+{
+	PutType(b, type);
+	PutUInt(b, 4);
+	PutUInt(b, (uint32_t)value);
+}
+
+void PutTripleElement(BenchBuffer *b, unsigned char type, int x, int y, int z)
+{
+	PutType(b, type);
+	PutUInt(b, 12);
+	PutUInt(b, (uint32_t)x);
+	PutUInt(b, (uint32_t)y);
+	PutUInt(b, (uint32_t)z);
+}
+
+void PutShortString(BenchBuffer *b, const char *s)
+{
+	uint16_t len = (uint16_t)strlen(s);
+	PutBytes(b, &len, sizeof(len));
+	PutBytes(b, s, len);
+}
+
+void PutLongElement(BenchBuffer *b, unsigned char type, const char *s, size_t len)
+{
+	PutType(b, type);
+	PutUInt(b, (uint32_t)len);
+	PutBytes(b, s, len);
+}
+
+void PutContactElement(BenchBuffer *b, unsigned char type, int person)
+{
+	char name[32], email[48];
+	sprintf_s(name, sizeof(name), "User %d", person);
+	sprintf_s(email, sizeof(email), "user%d@contoso.com", person);
+
+	PutType(b, type);
+	PutUInt(b, (uint32_t)(1 + 2 + strlen(name) + 1 + 2 + strlen(email)));
+	PutType(b, 0);	// CONTACTNAME
+	PutShortString(b, name);
+	PutType(b, 1);	// CONTACTEMAIL
+	PutShortString(b, email);
+}
+
+/// <summary>
+/// Generates a CAL buffer of count entries, each with a sender, up to
+/// three recipients, a subject and contentLength bytes of content
+/// </summary>
+unsigned char *GenerateCalendar(int count, size_t contentLength, size_t *len)
+{
+	BenchBuffer b = { 0 };
+	char subject[64];
+	char *content = (char *)malloc(contentLength ? contentLength : 1);
+	if (!content)
+	{
+		return NULL;
+	}
+
+	// Filler words, so a needle has to be compared at many positions
+	for (size_t i = 0; i < contentLength; i++)
+	{
+		content[i] = "the project budget was reviewed "[i % 32];
+	}
+
+	PutIntElement(&b, VERSION, 1);
+	PutIntElement(&b, ENTRYCOUNT, count);
+
+	for (int i = 0; i < count; i++)
+	{
+		PutType(&b, NEWENTRY);
+		PutUInt(&b, 0);
+		PutIntElement(&b, ENTRYTYPE, MEETING);
+		PutContactElement(&b, SENDER, (i * 7) % BENCH_PEOPLE);
+		for (int r = 0; r < i % 4; r++)
+		{
+			PutContactElement(&b, RECIPIENT, (i * 13 + r * 31) % BENCH_PEOPLE);
+		}
+		PutTripleElement(&b, STARTTIME, 8 + i % 9, (i % 4) * 15, 0);
+		PutType(&b, TIMEZONE);
+		PutShortString(&b, "UTC");
+		PutTripleElement(&b, DURATION, 1, 0, 0);
+		PutTripleElement(&b, STARTDATE, 2017, 1 + i % 12, 1 + i % 28);
+
+		sprintf_s(subject, sizeof(subject), "Weekly sync %d", i);
+		PutLongElement(&b, SUBJECT, subject, strlen(subject));
+		if (contentLength)
+		{
+			PutLongElement(&b, CONTENT, content, contentLength);
+		}
+	}
+
+	PutType(&b, END);
+	PutUInt(&b, 0);
+	free(content);
+
+	if (b.Failed)
+	{
+		free(b.Data);
+		return NULL;
+	}
+
+	*len = b.Length;
+	return b.Data;
+}
+
+/// <summary>
+/// Returns seconds elapsed since start, a QueryPerformanceCounter value
+/// </summary>
+double SecondsSince(LARGE_INTEGER start)
+{
+	LARGE_INTEGER now, frequency;
+	QueryPerformanceCounter(&now);
+	QueryPerformanceFrequency(&frequency);
+	return (double)(now.QuadPart - start.QuadPart) / (double)frequency.QuadPart;
+}
+
+/// <summary>
+/// Times FindEntriesByContact over a calendar of count entries, once
+/// with the contact index and once scanning the entries
+/// </summary>
+HRESULT BenchContacts(int count)
+{
+	HRESULT hr = S_FALSE;
+	HANDLE indexed = NULL, scanned = NULL;
+	unsigned int *out = NULL;
+	unsigned char *p;
+	size_t len;
+	LARGE_INTEGER start;
+	double withIndex, withoutIndex;
+	int found = 0;
+
+	p = GenerateCalendar(count, 0, &len);
+	out = (unsigned int *)calloc(count, sizeof(unsigned int));
+	if (!p || !out)
+	{
+		goto EXIT;
+	}
+
+	indexed = ParseCalendarFileBuffer(p, len);
+	scanned = ParseCalendarFileBuffer(p, len);
+	if (!indexed || !scanned || BuildCalendarContactIndex(indexed) != S_OK)
+	{
+		goto EXIT;
+	}
+
+	QueryPerformanceCounter(&start);
+	for (int i = 0; i < BENCH_LOOKUPS; i++)
+	{
+		found += FindEntriesByContact(indexed, "user7@contoso.com", out, count);
+	}
+	withIndex = SecondsSince(start) / BENCH_LOOKUPS;
+
+	QueryPerformanceCounter(&start);
+	for (int i = 0; i < BENCH_LOOKUPS / 100; i++)
+	{
+		found -= 100 * FindEntriesByContact(scanned, "user7@contoso.com", out, count);
+	}
+	withoutIndex = SecondsSince(start) / (BENCH_LOOKUPS / 100);
+
+	if (found != 0)
+	{
+		printf("-> ERROR: the index and the scan disagree\n");
+		goto EXIT;
+	}
+
+	printf("-> contacts: %d entries, %.2f us per lookup with the index, %.2f us without\n",
+		count, withIndex * 1e6, withoutIndex * 1e6);
+	hr = S_OK;
+
+EXIT:
+	DestroyCalendar(indexed);
+	DestroyCalendar(scanned);
+	free(out);
+	free(p);
+	return hr;
+}
+
+/// <summary>
+/// Times FindEntriesContainingInBuffer and FindEntriesContaining over the
+/// content of a calendar of about megabytes MB.  The needle does not occur,
+/// so every byte is scanned, but its first and last bytes often do
+/// </summary>
+HRESULT BenchScan(int megabytes)
+{
+	HRESULT hr = S_FALSE;
+	HANDLE cal = NULL;
+	unsigned char *p;
+	size_t len;
+	LARGE_INTEGER start;
+	double inBuffer, inCalendar;
+	const char *needles[] = { "the budget forecast" };
+	int count = (int)(((size_t)megabytes << 20) / BENCH_CONTENT);
+	int found = 0;
+
+	p = GenerateCalendar(count, BENCH_CONTENT, &len);
+	if (!p)
+	{
+		goto EXIT;
+	}
+
+	cal = ParseCalendarFileBuffer(p, len);
+	if (!cal)
+	{
+		goto EXIT;
+	}
+
+	QueryPerformanceCounter(&start);
+	for (int i = 0; i < BENCH_SCANS; i++)
+	{
+		found += FindEntriesContainingInBuffer(p, len, needles, 1, CALFIELD(CONTENT), NULL, 0);
+	}
+	inBuffer = SecondsSince(start) / BENCH_SCANS;
+
+	QueryPerformanceCounter(&start);
+	for (int i = 0; i < BENCH_SCANS; i++)
+	{
+		found += FindEntriesContaining(cal, needles, 1, CALFIELD(CONTENT), NULL, 0);
+	}
+	inCalendar = SecondsSince(start) / BENCH_SCANS;
+
+	if (found != 0)
+	{
+		printf("-> ERROR: the needle was found\n");
+		goto EXIT;
+	}
+
+	printf("-> scan: %d MB of content, %.2f GB/s in the buffer, %.2f GB/s in the parsed calendar\n",
+		megabytes, count * (double)BENCH_CONTENT / inBuffer / 1e9, count * (double)BENCH_CONTENT / inCalendar / 1e9);
+	hr = S_OK;
+
+EXIT:
+	DestroyCalendar(cal);
+	free(p);
+	return hr;
+}
+
+/// <summary>
+/// Entry point.  Call calbench.exe with a benchmark name and its optional
+/// size; every benchmark prints what it measured
+/// </summary>
+int main(int argc, char* argv[])
+{
+	printf("------------------------------------------------------\n");
+	printf("Microsoft Security Risk Detection Demo: calbench\n");
+
+	for (int bug = BUG_1; bug <= BUG_10; bug++)
+	{
+		DisableBug(bug);
+	}
+	DisableBug(TRYEXCEPT);
+
+	if (argc >= 2 && 0 == strcmp(argv[1], "contacts"))
+	{
+		int count = argc >= 3 ? atoi(argv[2]) : 20000;
+		if (count > 0)
+		{
+			return BenchContacts(count);
+		}
+	}
+
+	if (argc >= 2 && 0 == strcmp(argv[1], "scan"))
+	{
+		int megabytes = argc >= 3 ? atoi(argv[2]) : 64;
+		if (megabytes > 0 && megabytes <= 1024)
+		{
+			return BenchScan(megabytes);
+		}
+	}
+
+	printf("Usage: calbench.exe:\n");
+	printf("    contacts [entries]   FindEntriesByContact with and without the index (20000)\n");
+	printf("    scan [megabytes]     FindEntriesContaining over entry content (64)\n");
+	return -1;
+}
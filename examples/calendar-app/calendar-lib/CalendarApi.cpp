@@ -14,65 +14,1318 @@
 #include <stdint.h>
 #include <iostream>
 #include <fstream>
+#include "CalendarArena.h"
 #include "CalendarStructures.h"
+#include "CalendarFraming.h"
+#include "CalendarStringTable.h"
+#include "CalendarContactIndex.h"
+#include "CalendarIntervalIndex.h"
+#include "CalendarStartOrder.h"
+#include "CalendarTime.h"
+#include "CalendarTimeZone.h"
+#include "CalendarFreeBusy.h"
+#include "CalendarQuery.h"
+#include "CalendarTextIndex.h"
+#include "CalendarBloom.h"
+#include "CalendarSnapshot.h"
+#include "CalendarFingerprint.h"
+#include "CalendarDiff.h"
+#include "CalendarMerge.h"
+#include "CalendarReparse.h"
+#include "CalendarJournal.h"
+#include "CalendarColumns.h"
+#include "CalendarParseCache.h"
+#include "CalendarScan.h"
 #include "CalendarParser.h"
 
 using namespace std;
 
 Calendar *ParseInput(unsigned char *in, size_t len);
-CalendarEntry *CopyCalendarEntry(CalendarEntry *srcEntry);
+Calendar *ParseInputEx(unsigned char *in, size_t len, const CalParseOptions *pOptions);
+CalendarEntry *CopyCalendarEntry(CalendarEntry *srcEntry, bool share);
+
+/// <summary>
+/// Rebuilds the indexes over entry content a calendar carries after its
+/// entries change.  An index that cannot be rebuilt is dropped and lookups
+/// fall back to a scan
+/// </summary>
+static void RefreshContentIndexes(Calendar *pCalendar)
+{
+	CalArena *previous = SetCalendarArena(pCalendar);
+
+	if (pCalendar->ContactIndex)
+	{
+		DestroyContactIndex(pCalendar->ContactIndex);
+		pCalendar->ContactIndex = BuildContactIndex(pCalendar);
+	}
+
+	if (pCalendar->IntervalIndex)
+	{
+		DestroyIntervalIndex(pCalendar->IntervalIndex);
+		pCalendar->IntervalIndex = BuildIntervalIndex(pCalendar);
+	}
+
+	if (pCalendar->StartOrder)
+	{
+		DestroyStartOrder(pCalendar->StartOrder);
+		pCalendar->StartOrder = BuildStartOrder(pCalendar);
+	}
+
+	if (pCalendar->TextIndex)
+	{
+		DestroyTextIndex(pCalendar->TextIndex);
+		pCalendar->TextIndex = BuildTextIndex(&pCalendar, 1);
+	}
+
+	if (pCalendar->Bloom)
+	{
+		CalBloom *pBloom = BuildBloom(pCalendar, pCalendar->Bloom->Fields, pCalendar->Bloom->BitsPerKey);
+		DestroyBloom(pCalendar->Bloom);
+		pCalendar->Bloom = pBloom;
+	}
+
+	SetThreadArena(previous);
+}
+
+/// <summary>
+/// Rebuilds the indexes a calendar carries after its entries change
+/// </summary>
+static void RefreshCalendarIndexes(Calendar *pCalendar)
+{
+	CalArena *previous = SetCalendarArena(pCalendar);
+
+	// The entries no longer match the buffer they were parsed from
+	CalFree(pCalendar->EntryFrames);
+	pCalendar->EntryFrames = NULL;
+
+	if (!BuildEntryTable(pCalendar))
+	{
+		pCalendar->EntryTable = NULL;
+	}
+
+	SetThreadArena(previous);
+	RefreshContentIndexes(pCalendar);
+}
+
+/// <summary>
+/// Returns entry i in list order, from the entry table when there is one
+/// </summary>
+static CalendarEntry *EntryAt(Calendar *pCalendar, unsigned int i)
+{
+	if (pCalendar->EntryTable)
+	{
+		return i < pCalendar->EntryTableCount ? pCalendar->EntryTable[i] : NULL;
+	}
+
+	CalendarEntry *e = pCalendar->Entry;
+	while (e && i--)
+	{
+		e = e->NextEntry;
+	}
+	return e;
+}
+
+/// <summary>
+/// Copies the entries of src into a new list, skipping those whose
+/// fingerprint is in pSeen (if not NULL) and adding the rest.  The copies
+/// intern their strings in the thread's string table.  Returns NULL with
+/// *failed set if memory ran out
+/// </summary>
+static CalendarEntry *CopyCalendarEntries(Calendar *src, CalFingerprintSet *pSeen, bool *failed)
+{
+	// The string and blob values of a heap calendar are shared with the
+	// copies.  Other calendars release theirs all at once, so are copied
+	bool share = src->Storage == HEAPSTORAGE;
+
+	CalendarEntry *temp = NULL, *copy = NULL;
+	*failed = false;
+	for (CalendarEntry *srcEntry = src->Entry; srcEntry; srcEntry = srcEntry->NextEntry)
+	{
+		if (pSeen)
+		{
+			int added = AddFingerprint(pSeen, srcEntry->Fingerprint, 0);
+			if (added < 0)
+			{
+				goto ERROR_EXIT;
+			}
+			if (!added)
+			{
+				continue;
+			}
+		}
+
+		CalendarEntry *next = CopyCalendarEntry(srcEntry, share);
+		if (!next)
+		{
+			goto ERROR_EXIT;
+		}
+
+		if (temp) temp->NextEntry = next;
+		else copy = next;
+
+		next->PreviousEntry = temp;
+		temp = next;
+	}
+	return copy;
+
+ERROR_EXIT:
+	DestroyCalendarEntry(copy);
+	*failed = true;
+	return NULL;
+}
+
+/// <summary>
+/// Appends copies of the entries of src to dst, a heap calendar, skipping
+/// those whose fingerprint is in pSeen (if not NULL) and adding the rest.
+/// On failure dst is left as it was
+/// </summary>
+static HRESULT AppendCalendarCopies(Calendar *dst, Calendar *src, CalFingerprintSet *pSeen)
+{
+	CalendarEntry *dstEntry = dst->Entry;
+	bool failed;
+
+	// Strings copied into a calendar with a string table are interned there
+	CalStringTable *previousStrings = SetThreadStringTable(dst->Strings);
+	CalendarEntry *copy = CopyCalendarEntries(src, pSeen, &failed);
+	SetThreadStringTable(previousStrings);
+
+	if (failed)
+	{
+		return S_FALSE;
+	}
+	if (!copy)
+	{
+		return S_OK;
+	}
+
+	if (dstEntry)
+	{
+		// The entry table, when there is one, saves walking to the tail
+		dstEntry = dst->EntryTableCount ? EntryAt(dst, dst->EntryTableCount - 1) : dstEntry;
+		while (dstEntry->NextEntry) dstEntry = dstEntry->NextEntry;
+		dstEntry->NextEntry = copy;
+		copy->PreviousEntry = dstEntry;
+	}
+	else
+	{
+		dst->Entry = copy;
+	}
+	RefreshCalendarIndexes(dst);
+	return S_OK;
+}
+
+/// <summary>
+/// Returns true if the entries of src can be moved into another heap
+/// calendar rather than copied: each is a heap allocation of its own,
+/// none of its strings belong to the string table of src and src is not
+/// shared
+/// </summary>
+static bool CanMoveCalendarEntries(Calendar *src)
+{
+	return src->Storage == HEAPSTORAGE && !src->Strings && !src->Flags;
+}
 
 #define DllExport   __declspec( dllexport )
 
-extern "C"
-{
-	DllExport /*extern*/ unsigned int BugBitmask = ~0;
+extern "C"
+{
+	DllExport /*extern*/ unsigned int BugBitmask = ~0;
+
+	DllExport Calendar *ParseCalendarFileBuffer(unsigned char *in, size_t len)
+	{
+		printf("-> Parsing CAL file buffer\n");
+		return ParseInput(in, len);
+	}
+
+	/// <summary>
+	/// Parses a CAL file buffer subject to the limits in pOptions (which may be
+	/// NULL); a parse that exceeds a limit fails and releases everything
+	/// </summary>
+	DllExport Calendar *ParseCalendarFileBufferEx(unsigned char *in, size_t len, const CalParseOptions *pOptions)
+	{
+		printf("-> Parsing CAL file buffer\n");
+		return ParseInputEx(in, len, pOptions);
+	}
+
+	/// <summary>
+	/// Releases a calendar returned by ParseCalendarFileBuffer or
+	/// ParseCalendarFileBufferEx, with its indexes.  Calendars that belong to
+	/// a parser or a parse cache or live in caller memory are left alone,
+	/// and snapshots are unmapped
+	/// </summary>
+	DllExport void DestroyCalendar(Calendar *pCalendar)
+	{
+		// The library's own overload takes void *
+		DestroyCalendar((void *)pCalendar);
+	}
+
+	/// <summary>
+	/// Updates a heap calendar parsed with CALPARSE_TRACK_ENTRIES after an
+	/// edit to its buffer, re-parsing only the entries the edit touches.
+	/// removedLength bytes at editOffset of the buffer it was parsed from
+	/// were replaced by insertedLength bytes to give in; pOptions must be
+	/// the options it was parsed with.  Entries whose bytes did not change
+	/// are kept, and ENTRYCOUNT and END are checked as a parse would.
+	/// Of the parse budgets only MaxEntries covers the whole calendar; the
+	/// others apply to the entries re-parsed, so an edit can succeed on a
+	/// buffer a full parse under them would reject.  Returns S_FALSE if the
+	/// edited buffer does not parse, leaving the calendar as it was
+	/// </summary>
+	DllExport HRESULT ReparseCalendarFileBuffer(Calendar *pCalendar, unsigned char *in, size_t len,
+		size_t editOffset, size_t removedLength, size_t insertedLength, const CalParseOptions *pOptions)
+	{
+		if (!pCalendar || !in || pCalendar->Storage != HEAPSTORAGE || pCalendar->Flags) return -1;
+
+		printf("-> Re-parsing edited CAL file buffer\n");
+		CalArena *previous = SetCalendarArena(pCalendar);
+		HRESULT hr = ReparseCalendarEdit(pCalendar, in, len, editOffset, removedLength, insertedLength, pOptions);
+		SetThreadArena(previous);
+		if (hr == S_OK)
+		{
+			RefreshContentIndexes(pCalendar);
+		}
+		return hr;
+	}
+
+	DllExport CalParser *CreateCalendarParser()
+	{
+		return CreateCalParser();
+	}
+
+	/// <summary>
+	/// Parses a CAL file buffer into memory retained by the parser. The
+	/// Calendar returned must not be destroyed; it stays valid until the
+	/// parser is used again, reset or destroyed
+	/// </summary>
+	DllExport Calendar *ParseCalendarFileBufferWithParser(CalParser *pParser, unsigned char *in, size_t len)
+	{
+		if (!pParser)
+		{
+			return NULL;
+		}
+
+		printf("-> Parsing CAL file buffer\n");
+		return CalParserParse(pParser, in, len);
+	}
+
+	/// <summary>
+	/// Sets the options applied to every subsequent parse by the parser
+	/// </summary>
+	DllExport HRESULT SetCalendarParserOptions(CalParser *pParser, const CalParseOptions *pOptions)
+	{
+		if (!pParser || !pOptions)
+		{
+			return S_FALSE;
+		}
+
+		pParser->Options = *pOptions;
+		return S_OK;
+	}
+
+	DllExport void ResetCalendarParser(CalParser *pParser)
+	{
+		if (pParser)
+		{
+			ResetCalParser(pParser);
+		}
+	}
+
+	DllExport void DestroyCalendarParser(CalParser *pParser)
+	{
+		DestroyCalParser(pParser);
+	}
+
+	/// <summary>
+	/// Computes the exact number of bytes ParseCalendarInto needs
+	/// for the buffer, from its framing alone
+	/// </summary>
+	DllExport HRESULT CalendarRequiredSize(unsigned char *in, size_t len, size_t *bytes)
+	{
+		if (!in || !bytes)
+		{
+			return S_FALSE;
+		}
+		return ComputeCalendarSize(in, len, bytes);
+	}
+
+	/// <summary>
+	/// Parses a CAL file buffer into a single caller-owned block of at least
+	/// CalendarRequiredSize bytes, aligned to 16 bytes, without touching the
+	/// heap.  The Calendar returned lives in that block and must not be destroyed.
+	/// Its UTC times are unresolved until ResolveCalendarTimeZones is called
+	/// </summary>
+	DllExport Calendar *ParseCalendarInto(unsigned char *in, size_t len, void *mem, size_t bytes)
+	{
+		printf("-> Parsing CAL file buffer\n");
+		return ParseInputInto(in, len, mem, bytes);
+	}
+
+	DllExport HRESULT MergeCalendars(void *dest, void *source)
+	{
+		Calendar *dst = (Calendar *)dest;
+		Calendar *src = (Calendar *)source;
+
+		if (!dst || !src) return -1;
+		if (src->Version != dst->Version) return -1;
+		if (src->Fields != dst->Fields) return -1; // Parsed with other field masks
+		if (dst->Storage != HEAPSTORAGE || dst->Flags) return -1; // Only heap calendars can be appended to
+
+		return AppendCalendarCopies(dst, src, NULL);
+	}
+
+	/// <summary>
+	/// Merges like MergeCalendars, but skips the entries of source whose
+	/// fingerprint is already in dest or earlier in source, so merging
+	/// overlapping feeds keeps one copy of each entry.  Fingerprints hash
+	/// the elements a field mask left out as absent, so both calendars
+	/// must have been parsed with the same one
+	/// </summary>
+	DllExport HRESULT MergeCalendarsDedup(void *dest, void *source)
+	{
+		Calendar *dst = (Calendar *)dest;
+		Calendar *src = (Calendar *)source;
+
+		if (!dst || !src) return -1;
+		if (src->Version != dst->Version) return -1;
+		if (src->Fields != dst->Fields) return -1;
+		if (dst->Storage != HEAPSTORAGE || dst->Flags) return -1;
+
+		CalFingerprintSet *pSeen = CreateFingerprintSet(dst->EntryTableCount + src->EntryTableCount);
+		if (!pSeen)
+		{
+			return S_FALSE;
+		}
+
+		for (CalendarEntry *e = dst->Entry; e; e = e->NextEntry)
+		{
+			if (AddFingerprint(pSeen, e->Fingerprint, 0) < 0)
+			{
+				DestroyFingerprintSet(pSeen);
+				return S_FALSE;
+			}
+		}
+
+		HRESULT hr = AppendCalendarCopies(dst, src, pSeen);
+		DestroyFingerprintSet(pSeen);
+		return hr;
+	}
+
+	/// <summary>
+	/// Merges the entries of dest and of count source calendars into dest,
+	/// a heap calendar, in order of start.  The inputs are expected to be
+	/// in start order already and are merged k ways through a heap; one
+	/// that is not is sorted first.  Entries with equal starts keep the
+	/// order of dest and then sources, and entries without a start go last.
+	/// The entries of a heap source without a string table are moved, which
+	/// leaves it empty; those of other sources are copied.  Every source
+	/// must have been parsed with the field mask of dest.  On failure
+	/// nothing is changed
+	/// </summary>
+	DllExport HRESULT MergeCalendarsSorted(void *dest, void **sources, unsigned int count)
+	{
+		Calendar *dst = (Calendar *)dest;
+		Calendar **srcs = (Calendar **)sources;
+		HRESULT hr = S_FALSE;
+
+		if (!dst || (!srcs && count)) return -1;
+		if (dst->Storage != HEAPSTORAGE || dst->Flags) return -1;
+
+		for (unsigned int i = 0; i < count; i++)
+		{
+			if (!srcs[i] || srcs[i] == dst || srcs[i]->Version != dst->Version || srcs[i]->Fields != dst->Fields) return -1;
+		}
+
+		// A source listed twice would have its entries moved twice
+		CalFingerprintSet *pSources = CreateFingerprintSet(count);
+		if (!pSources)
+		{
+			return S_FALSE;
+		}
+		for (unsigned int i = 0; i < count; i++)
+		{
+			uint64_t key[2] = { (uint64_t)(uintptr_t)srcs[i], 0 };
+			int added = AddFingerprint(pSources, key, i);
+			if (added <= 0)
+			{
+				DestroyFingerprintSet(pSources);
+				return added < 0 ? S_FALSE : -1;
+			}
+		}
+		DestroyFingerprintSet(pSources);
+
+		CalendarEntry **lists = (CalendarEntry **)calloc(count + 1, sizeof(CalendarEntry *));
+		if (!lists)
+		{
+			return S_FALSE;
+		}
+
+		lists[0] = dst->Entry;
+		CalStringTable *previousStrings = SetThreadStringTable(dst->Strings);
+		for (unsigned int i = 0; i < count; i++)
+		{
+			bool failed = false;
+			lists[i + 1] = CanMoveCalendarEntries(srcs[i]) ? srcs[i]->Entry : CopyCalendarEntries(srcs[i], NULL, &failed);
+			if (failed)
+			{
+				SetThreadStringTable(previousStrings);
+				goto EXIT;
+			}
+		}
+		SetThreadStringTable(previousStrings);
+
+		if (!MergeEntryListsByStart(lists, count + 1))
+		{
+			goto EXIT;
+		}
+
+		dst->Entry = lists[0];
+		lists[0] = NULL;
+		for (unsigned int i = 0; i < count; i++)
+		{
+			if (CanMoveCalendarEntries(srcs[i]))
+			{
+				srcs[i]->Entry = NULL;
+				RefreshCalendarIndexes(srcs[i]);
+			}
+		}
+		RefreshCalendarIndexes(dst);
+		hr = S_OK;
+
+EXIT:
+		// Copies not merged are released; moved lists still belong to
+		// their sources
+		for (unsigned int i = 0; hr != S_OK && i < count; i++)
+		{
+			if (!CanMoveCalendarEntries(srcs[i]))
+			{
+				DestroyCalendarEntry(lists[i + 1]);
+			}
+		}
+		free(lists);
+		return hr;
+	}
+
+	/// <summary>
+	/// Calls visitor with each entry added to, removed from or changed in
+	/// newCalendar relative to oldCalendar, matching entries by key, a
+	/// CALDIFF_KEY value.  Both must have been parsed with the same field
+	/// mask.  Returns the number of changes, or -1 on failure
+	/// </summary>
+	DllExport int DiffCalendars(Calendar *oldCalendar, Calendar *newCalendar, unsigned int key, CalDiffVisitor visitor, void *context)
+	{
+		if (!oldCalendar || !newCalendar || !visitor) return -1;
+		if (key != CALDIFF_KEY_FINGERPRINT && key != CALDIFF_KEY_SENDER_START) return -1;
+
+		return CompareCalendars(oldCalendar, newCalendar, key, visitor, context);
+	}
+
+	/// <summary>
+	/// Diffs two CAL file buffers like DiffCalendars without parsing the
+	/// entries whose bytes did not change.  The entries passed to visitor
+	/// are valid only during the call
+	/// </summary>
+	DllExport int DiffCalendarFileBuffers(unsigned char *oldIn, size_t oldLen, unsigned char *newIn, size_t newLen, unsigned int key, CalDiffVisitor visitor, void *context)
+	{
+		if (!oldIn || !newIn || !visitor) return -1;
+		if (key != CALDIFF_KEY_FINGERPRINT && key != CALDIFF_KEY_SENDER_START) return -1;
+
+		return CompareCalendarBuffers(oldIn, oldLen, newIn, newLen, key, visitor, context);
+	}
+
+	/// <summary>
+	/// Builds the contact email index of a heap calendar, replacing any it
+	/// has.  Use CALPARSE_INDEX_CONTACTS to index parser-owned calendars
+	/// </summary>
+	DllExport HRESULT BuildCalendarContactIndex(Calendar *pCalendar)
+	{
+		if (!pCalendar || pCalendar->Storage != HEAPSTORAGE || pCalendar->Flags)
+		{
+			return S_FALSE;
+		}
+
+		DestroyContactIndex(pCalendar->ContactIndex);
+		pCalendar->ContactIndex = BuildContactIndex(pCalendar);
+		return pCalendar->ContactIndex ? S_OK : S_FALSE;
+	}
+
+	/// <summary>
+	/// Finds the entries sent by or addressed to an email, ignoring case and
+	/// surrounding whitespace.  Writes up to n ascending entry indices to out
+	/// and returns how many entries match, or -1 on failure.  Calendars
+	/// without a contact index are scanned
+	/// </summary>
+	DllExport int FindEntriesByContact(Calendar *pCalendar, const char *email, unsigned int *out, unsigned int n)
+	{
+		if (!pCalendar || !email)
+		{
+			return -1;
+		}
+		return FindContactEntries(pCalendar, email, out, n);
+	}
+
+	/// <summary>
+	/// Builds the time interval index of a heap calendar, replacing any it
+	/// has.  Use CALPARSE_INDEX_INTERVALS to index parser-owned calendars
+	/// </summary>
+	DllExport HRESULT BuildCalendarIntervalIndex(Calendar *pCalendar)
+	{
+		if (!pCalendar || pCalendar->Storage != HEAPSTORAGE || pCalendar->Flags)
+		{
+			return S_FALSE;
+		}
+
+		DestroyIntervalIndex(pCalendar->IntervalIndex);
+		pCalendar->IntervalIndex = BuildIntervalIndex(pCalendar);
+		return pCalendar->IntervalIndex ? S_OK : S_FALSE;
+	}
+
+	/// <summary>
+	/// Finds the entries overlapping [start, end), in seconds since 1970 UTC,
+	/// as given by their StartDate, StartTime, TimeZone and Duration.  Writes up to n entry
+	/// indices to out in start order and returns how many entries overlap,
+	/// or -1 on failure.  Entries without a StartDate are never found
+	/// </summary>
+	DllExport int FindEntriesInRange(Calendar *pCalendar, int64_t start, int64_t end, unsigned int *out, unsigned int n)
+	{
+		if (!pCalendar)
+		{
+			return -1;
+		}
+		return FindIntervalEntries(pCalendar, start, end, out, n);
+	}
+
+	/// <summary>
+	/// Finds every pair of overlapping entries.  Writes up to n pairs to out
+	/// and returns how many pairs overlap, or -1 on failure
+	/// </summary>
+	DllExport int FindConflictingEntries(Calendar *pCalendar, CalConflict *out, unsigned int n)
+	{
+		if (!pCalendar)
+		{
+			return -1;
+		}
+		return FindIntervalConflicts(pCalendar, out, n);
+	}
+
+	/// <summary>
+	/// Finds every pair of overlapping entries sent by or addressed to an
+	/// email, as FindConflictingEntries does for the whole calendar
+	/// </summary>
+	DllExport int FindContactConflicts(Calendar *pCalendar, const char *email, CalConflict *out, unsigned int n)
+	{
+		if (!pCalendar || !email)
+		{
+			return -1;
+		}
+		return FindContactIntervalConflicts(pCalendar, email, out, n);
+	}
+
+	/// <summary>
+	/// Sets the tzdata directory TIMEZONE names are loaded from; by default
+	/// TZDIR, else /usr/share/zoneinfo.  Abbreviations such as "EST" and
+	/// offsets such as "+05:30" resolve without it.  Empties the zone cache.
+	/// The default suits Unix hosts; Windows has no tzdata directory, so
+	/// callers there set TZDIR or call this before naming zones
+	/// </summary>
+	DllExport HRESULT SetCalendarTimeZoneDirectory(const char *path)
+	{
+		if (!path)
+		{
+			return S_FALSE;
+		}
+		return SetTimeZoneDirectory(path) ? S_OK : S_FALSE;
+	}
+
+	/// <summary>
+	/// Resolves the TIMEZONE of every entry and stores its UTC start and end,
+	/// for calendars parsed with CALPARSE_SKIP_TIME_ZONES or by
+	/// ParseCalendarInto, then refreshes the fingerprints and indexes that
+	/// depend on them
+	/// </summary>
+	DllExport HRESULT ResolveCalendarTimeZones(Calendar *pCalendar)
+	{
+		if (!pCalendar || pCalendar->Storage == SNAPSHOTSTORAGE || pCalendar->Flags)
+		{
+			return -1;
+		}
+
+		ResolveCalendarTimes(pCalendar);
+		FingerprintCalendar(pCalendar);
+		RefreshContentIndexes(pCalendar);
+		return S_OK;
+	}
+
+	DllExport int GetCalendarEntryCount(Calendar *pCalendar)
+	{
+		return pCalendar->EntryCount;
+	}
+
+	/// <summary>
+	/// Returns entry i, counting from zero in file order, or NULL past the
+	/// last entry
+	/// </summary>
+	DllExport CalendarEntry *GetCalendarEntryAt(Calendar *pCalendar, unsigned int i)
+	{
+		if (!pCalendar)
+		{
+			return NULL;
+		}
+		return EntryAt(pCalendar, i);
+	}
+
+	/// <summary>
+	/// Reads fields of up to count entries from entry first, in file order,
+	/// in one call: element j of each column in pColumns that is not NULL
+	/// gets the field of entry first + j.  Strings are returned in place,
+	/// with their lengths.  Returns how many entries were read
+	/// </summary>
+	DllExport int GetCalendarEntryColumns(Calendar *pCalendar, unsigned int first, unsigned int count, const CalEntryColumns *pColumns)
+	{
+		if (!pCalendar || !pColumns)
+		{
+			return -1;
+		}
+		return FillEntryColumns(pCalendar, first, count, pColumns);
+	}
+
+	/// <summary>
+	/// GetCalendarEntryColumns for the entries at indexes, such as those a
+	/// lookup or query returned; element j of each column gets the field of
+	/// entry indexes[j].  Returns -1 if an index is past the last entry
+	/// </summary>
+	DllExport int GetCalendarEntryColumnsAt(Calendar *pCalendar, const unsigned int *indexes, unsigned int count, const CalEntryColumns *pColumns)
+	{
+		if (!pCalendar || !pColumns || (count && !indexes))
+		{
+			return -1;
+		}
+		return FillEntryColumnsAt(pCalendar, indexes, count, pColumns);
+	}
+
+	/// <summary>
+	/// Builds the start-ordered view of a heap calendar, replacing any it
+	/// has.  Use CALPARSE_SORT_BY_START for parser-owned calendars
+	/// </summary>
+	DllExport HRESULT BuildCalendarStartOrder(Calendar *pCalendar)
+	{
+		if (!pCalendar || pCalendar->Storage != HEAPSTORAGE || pCalendar->Flags)
+		{
+			return S_FALSE;
+		}
+
+		DestroyStartOrder(pCalendar->StartOrder);
+		pCalendar->StartOrder = BuildStartOrder(pCalendar);
+		return pCalendar->StartOrder ? S_OK : S_FALSE;
+	}
+
+	/// <summary>
+	/// Returns the number of entries in the start-ordered view, which leaves
+	/// out entries without a StartDate, or -1 if the view was not built
+	/// </summary>
+	DllExport int GetStartOrderedEntryCount(Calendar *pCalendar)
+	{
+		if (!pCalendar || !pCalendar->StartOrder)
+		{
+			return -1;
+		}
+		return (int)pCalendar->StartOrder->Count;
+	}
+
+	/// <summary>
+	/// Returns entry i of the start-ordered view; entries starting together
+	/// keep their file order
+	/// </summary>
+	DllExport CalendarEntry *GetStartOrderedEntryAt(Calendar *pCalendar, unsigned int i)
+	{
+		if (!pCalendar || !pCalendar->StartOrder || i >= pCalendar->StartOrder->Count)
+		{
+			return NULL;
+		}
+		return EntryAt(pCalendar, GetStartOrderItems(pCalendar->StartOrder)[i].Entry);
+	}
+
+	/// <summary>
+	/// Returns the position in the start-ordered view of the first entry
+	/// starting at or after t, in seconds since 1970 UTC; the count of the view
+	/// if there is none, or -1 if the view was not built
+	/// </summary>
+	DllExport int FindFirstEntryAtOrAfter(Calendar *pCalendar, int64_t t)
+	{
+		if (!pCalendar || !pCalendar->StartOrder)
+		{
+			return -1;
+		}
+		return (int)FindFirstStartAtOrAfter(pCalendar->StartOrder, t);
+	}
+
+	/// <summary>
+	/// Creates a free/busy bitmap of slotSeconds slots over [start, end) and
+	/// marks busy every slot an entry of any of the calendars overlaps.  The
+	/// window is cut to whole slots.  Release it with DestroyCalendarFreeBusy
+	/// </summary>
+	DllExport CalFreeBusy *CreateCalendarFreeBusy(Calendar **calendars, unsigned int count, int64_t start, int64_t end, unsigned int slotSeconds)
+	{
+		if (!calendars && count)
+		{
+			return NULL;
+		}
+
+		CalFreeBusy *pMap = CreateFreeBusy(start, end, slotSeconds);
+		if (!pMap)
+		{
+			return NULL;
+		}
 
-	DllExport Calendar *ParseCalendarFileBuffer(unsigned char *in, size_t len)
+		for (unsigned int i = 0; i < count; i++)
+		{
+			if (!calendars[i] || !RasterizeFreeBusy(calendars[i], pMap))
+			{
+				DestroyFreeBusy(pMap);
+				return NULL;
+			}
+		}
+		return pMap;
+	}
+
+	DllExport void DestroyCalendarFreeBusy(CalFreeBusy *pMap)
 	{
-		printf("-> Parsing CAL file buffer\n");
-		return ParseInput(in, len);
+		DestroyFreeBusy(pMap);
 	}
 
-	DllExport HRESULT MergeCalendars(void *dest, void *source)
+	/// <summary>
+	/// Combines bitmaps made over the same window into pDest.  With
+	/// CALFREEBUSY_ANY a slot is busy if anyone is busy; with CALFREEBUSY_ALL
+	/// only if everyone is.  Like the other free/busy exports, returns -1 for
+	/// bad arguments, and for bitmaps over other windows
+	/// </summary>
+	DllExport HRESULT CombineCalendarFreeBusy(CalFreeBusy *pDest, CalFreeBusy **maps, unsigned int count, int op)
 	{
-		Calendar *dst = (Calendar *)dest;
-		Calendar *src = (Calendar *)source;
+		if (!pDest || (!maps && count))
+		{
+			return -1;
+		}
+		return CombineFreeBusy(pDest, maps, count, op) ? S_OK : -1;
+	}
 
-		if (!dst || !src) return -1;
-		if (src->Version != dst->Version) return -1;
-		CalendarEntry *srcEntry = src->Entry;
-		CalendarEntry *dstEntry = dst->Entry;
+	/// <summary>
+	/// Returns the number of slots in a bitmap, or -1 for none
+	/// </summary>
+	DllExport int GetFreeBusySlotCount(CalFreeBusy *pMap)
+	{
+		if (!pMap)
+		{
+			return -1;
+		}
+		return (int)pMap->SlotCount;
+	}
+
+	DllExport bool IsFreeBusySlotBusy(CalFreeBusy *pMap, unsigned int slot)
+	{
+		if (!pMap || slot >= pMap->SlotCount)
+		{
+			return false;
+		}
+		return (pMap->Bits[slot / 64] >> (slot % 64)) & 1;
+	}
+
+	/// <summary>
+	/// Finds the first run of free slots at least durationSeconds long and
+	/// writes when it begins to *start.  Returns S_FALSE if there is none
+	/// and -1 for bad arguments
+	/// </summary>
+	DllExport HRESULT FindFirstFreeSlot(CalFreeBusy *pMap, unsigned int durationSeconds, int64_t *start)
+	{
+		if (!pMap || !start)
+		{
+			return -1;
+		}
+		return FindFreeBusyRun(pMap, durationSeconds, start) ? S_OK : S_FALSE;
+	}
+
+	/// <summary>
+	/// Finds the first time in [start, end), on slotSeconds boundaries, at
+	/// which every calendar is free for durationSeconds.  Returns S_FALSE if
+	/// there is no such time and -1 on failure
+	/// </summary>
+	DllExport HRESULT FindFirstCommonFreeSlot(Calendar **calendars, unsigned int count, int64_t start, int64_t end, unsigned int slotSeconds, unsigned int durationSeconds, int64_t *found)
+	{
+		if (!found)
+		{
+			return -1;
+		}
+
+		CalFreeBusy *pMap = CreateCalendarFreeBusy(calendars, count, start, end, slotSeconds);
+		if (!pMap)
+		{
+			return -1;
+		}
+
+		HRESULT hr = FindFreeBusyRun(pMap, durationSeconds, found) ? S_OK : S_FALSE;
+		DestroyFreeBusy(pMap);
+		return hr;
+	}
+
+	/// <summary>
+	/// Compiles a filter query (see CalendarQuery.cpp for the grammar) into
+	/// a plan that can be run over any number of calendars.  Compiling the
+	/// same text again returns the cached plan.  Returns NULL and prints the
+	/// reason for a malformed query
+	/// </summary>
+	DllExport CalQuery *CompileCalendarQuery(const char *text)
+	{
+		if (!text)
+		{
+			return NULL;
+		}
+		return CompileQuery(text);
+	}
+
+	DllExport void DestroyCalendarQuery(CalQuery *pQuery)
+	{
+		ReleaseQuery(pQuery);
+	}
+
+	/// <summary>
+	/// Runs a compiled query over a calendar.  Writes up to n ascending
+	/// entry indices to out and returns how many entries match, or -1 on
+	/// failure
+	/// </summary>
+	DllExport int RunCalendarQuery(CalQuery *pQuery, Calendar *pCalendar, unsigned int *out, unsigned int n)
+	{
+		if (!pQuery || !pCalendar)
+		{
+			return -1;
+		}
+		return RunQuery(pQuery, pCalendar, out, out ? n : 0);
+	}
 
-		CalendarEntry *temp = NULL, *copy = NULL;
-		temp = CopyCalendarEntry(srcEntry);
-		copy = temp;
-		srcEntry = srcEntry->NextEntry;
+	/// <summary>
+	/// Runs a compiled query over several calendars.  Writes up to n
+	/// (calendar, entry) matches to out and returns how many there are
+	/// </summary>
+	DllExport int RunCalendarQueryOnMany(CalQuery *pQuery, Calendar **calendars, unsigned int count, CalQueryMatch *out, unsigned int n)
+	{
+		if (!pQuery || (!calendars && count))
+		{
+			return -1;
+		}
 
-		while (srcEntry)
+		for (unsigned int i = 0; i < count; i++)
 		{
-			if (temp) temp->NextEntry = CopyCalendarEntry(srcEntry); // todo, set prev
-			if (!temp)
+			if (!calendars[i])
 			{
-				goto ERROR_EXIT;
+				return -1;
 			}
+		}
+		return RunQueryOnCalendars(pQuery, calendars, count, out, out ? n : 0);
+	}
 
-			temp = temp->NextEntry;
-			srcEntry = srcEntry->NextEntry;
+	/// <summary>
+	/// Builds the Subject, Location and Content word index of a heap
+	/// calendar, replacing any it has.  Use CALPARSE_INDEX_TEXT to index
+	/// parser-owned calendars
+	/// </summary>
+	DllExport HRESULT BuildCalendarTextIndex(Calendar *pCalendar)
+	{
+		if (!pCalendar || pCalendar->Storage != HEAPSTORAGE || pCalendar->Flags)
+		{
+			return S_FALSE;
 		}
 
-		while (dstEntry->NextEntry) dstEntry = dstEntry->NextEntry;
-		dstEntry->NextEntry = copy; // todo set prev
+		DestroyTextIndex(pCalendar->TextIndex);
+		pCalendar->TextIndex = BuildTextIndex(&pCalendar, 1);
+		return pCalendar->TextIndex ? S_OK : S_FALSE;
+	}
+
+	/// <summary>
+	/// Finds the entries whose Subject, Location or Content contain every
+	/// word of text (CALTEXT_ALL), any of them (CALTEXT_ANY) or all of them
+	/// adjacent and in order (CALTEXT_PHRASE).  Words ignore ASCII case and
+	/// punctuation.  Writes up to n ascending entry indices to out and
+	/// returns how many entries match, or -1 on failure.  Calendars without
+	/// a text index are scanned
+	/// </summary>
+	DllExport int SearchCalendarText(Calendar *pCalendar, const char *text, int mode, unsigned int *out, unsigned int n)
+	{
+		if (!pCalendar || !text || mode < CALTEXT_ALL || mode > CALTEXT_PHRASE)
+		{
+			return -1;
+		}
+		return FindTextEntries(pCalendar, text, mode, out, n);
+	}
+
+	/// <summary>
+	/// Builds one word index over many calendars, kept apart from them so it
+	/// can be saved and searched without them.  Release it with
+	/// DestroyCalendarTextCorpus
+	/// </summary>
+	DllExport CalTextCorpus *CreateCalendarTextCorpus(Calendar **calendars, unsigned int count)
+	{
+		if (!calendars && count)
+		{
+			return NULL;
+		}
+
+		for (unsigned int i = 0; i < count; i++)
+		{
+			if (!calendars[i])
+			{
+				return NULL;
+			}
+		}
+
+		CalTextCorpus *pCorpus = (CalTextCorpus *)CalCalloc(1, sizeof(CalTextCorpus));
+		if (!pCorpus)
+		{
+			return NULL;
+		}
+
+		pCorpus->Index = BuildTextIndex(calendars, count);
+		if (!pCorpus->Index)
+		{
+			CalFree(pCorpus);
+			return NULL;
+		}
+		return pCorpus;
+	}
+
+	/// <summary>
+	/// Writes a corpus index to a file that LoadCalendarTextCorpus maps back
+	/// </summary>
+	DllExport HRESULT SaveCalendarTextCorpus(CalTextCorpus *pCorpus, const char *path)
+	{
+		if (!pCorpus || !path)
+		{
+			return S_FALSE;
+		}
+		return SaveTextIndex(pCorpus->Index, path) ? S_OK : S_FALSE;
+	}
+
+	/// <summary>
+	/// Maps a saved corpus index read-only; searches read it in place
+	/// </summary>
+	DllExport CalTextCorpus *LoadCalendarTextCorpus(const char *path)
+	{
+		if (!path)
+		{
+			return NULL;
+		}
+		return MapTextIndex(path);
+	}
+
+	DllExport void DestroyCalendarTextCorpus(CalTextCorpus *pCorpus)
+	{
+		DestroyTextCorpus(pCorpus);
+	}
+
+	/// <summary>
+	/// Searches a corpus index like SearchCalendarText.  Writes up to n
+	/// matches to out, ordered by calendar then entry, and returns how many
+	/// there are, or -1 on failure
+	/// </summary>
+	DllExport int SearchCalendarTextCorpus(CalTextCorpus *pCorpus, const char *text, int mode, CalQueryMatch *out, unsigned int n)
+	{
+		if (!pCorpus || !text || mode < CALTEXT_ALL || mode > CALTEXT_PHRASE)
+		{
+			return -1;
+		}
+		return SearchTextIndex(pCorpus->Index, text, mode, out, n);
+	}
+
+	/// <summary>
+	/// Finds the entries holding any of the needles, compared byte for byte,
+	/// in one of the string elements in fields: CALFIELD bits of LOCATION,
+	/// TIMEZONE, SUBJECT, CONTENT and CONTENTTYPE.  Writes up to n ascending
+	/// entry indices to out and returns how many entries match, or -1 on
+	/// failure
+	/// </summary>
+	DllExport int FindEntriesContaining(Calendar *pCalendar, const char **needles, unsigned int count, unsigned int fields, unsigned int *out, unsigned int n)
+	{
+		CalNeedleSet set;
+
+		if (!pCalendar || !needles || !(fields & CALSCAN_FIELDS) || !InitNeedleSet(&set, needles, count))
+		{
+			return -1;
+		}
+		return ScanEntriesForNeedles(pCalendar, &set, fields, out, out ? n : 0);
+	}
+
+	/// <summary>
+	/// Like FindEntriesContaining, but scans the string elements of a CAL
+	/// file buffer in place instead of a parsed calendar.  Entries are
+	/// numbered in file order.  Returns -1 if the buffer is malformed
+	/// </summary>
+	DllExport int FindEntriesContainingInBuffer(unsigned char *in, size_t len, const char **needles, unsigned int count, unsigned int fields, unsigned int *out, unsigned int n)
+	{
+		CalNeedleSet set;
+
+		if (!in || !needles || !(fields & CALSCAN_FIELDS) || !InitNeedleSet(&set, needles, count))
+		{
+			return -1;
+		}
+		return ScanBufferForNeedles(in, len, &set, fields, out, out ? n : 0);
+	}
+
+	/// <summary>
+	/// Builds the Bloom filter of a heap calendar over the elements in
+	/// fields, CALFIELD bits of SENDER, RECIPIENT, TIMEZONE and LOCATION,
+	/// at bitsPerKey bits per distinct value, replacing any it has.  Zero
+	/// selects the sender and recipient emails at CALBLOOM_DEFAULT_BITS.
+	/// Use CALPARSE_BUILD_BLOOM for parser-owned calendars
+	/// </summary>
+	DllExport HRESULT BuildCalendarBloom(Calendar *pCalendar, unsigned int fields, unsigned int bitsPerKey)
+	{
+		if (!pCalendar || pCalendar->Storage != HEAPSTORAGE || pCalendar->Flags)
+		{
+			return S_FALSE;
+		}
+
+		CalBloom *pBloom = BuildBloom(pCalendar,
+			fields ? fields : CALBLOOM_DEFAULT_FIELDS,
+			bitsPerKey ? bitsPerKey : CALBLOOM_DEFAULT_BITS);
+		if (!pBloom)
+		{
+			return S_FALSE;
+		}
+
+		DestroyBloom(pCalendar->Bloom);
+		pCalendar->Bloom = pBloom;
 		return S_OK;
+	}
 
-	ERROR_EXIT:
-		DestroyCalendarEntry(copy);
-		return S_FALSE;
+	/// <summary>
+	/// Returns the Bloom filter a calendar carries, or NULL.  It belongs to
+	/// the calendar
+	/// </summary>
+	DllExport CalBloom *GetCalendarBloom(Calendar *pCalendar)
+	{
+		return pCalendar ? pCalendar->Bloom : NULL;
 	}
 
-	DllExport int GetCalendarEntryCount(Calendar *pCalendar)
+	/// <summary>
+	/// Writes a Bloom filter to a file, to be kept alongside the CAL file
+	/// it describes and read back with LoadCalendarBloom
+	/// </summary>
+	DllExport HRESULT SaveCalendarBloom(CalBloom *pBloom, const char *path)
 	{
-		return pCalendar->EntryCount;
+		if (!pBloom || !path)
+		{
+			return S_FALSE;
+		}
+		return SaveBloom(pBloom, path) ? S_OK : S_FALSE;
+	}
+
+	/// <summary>
+	/// Reads a saved Bloom filter.  Release it with DestroyCalendarBloom
+	/// </summary>
+	DllExport CalBloom *LoadCalendarBloom(const char *path)
+	{
+		if (!path)
+		{
+			return NULL;
+		}
+		return LoadBloom(path);
+	}
+
+	/// <summary>
+	/// Releases a filter from LoadCalendarBloom.  Filters a calendar
+	/// carries are released with the calendar
+	/// </summary>
+	DllExport void DestroyCalendarBloom(CalBloom *pBloom)
+	{
+		DestroyBloom(pBloom);
+	}
+
+	/// <summary>
+	/// Tests a value against many Bloom filters, so only the calendars that
+	/// may hold it need to be parsed.  type is SENDER or RECIPIENT for an
+	/// email in that role, TIMEZONE or LOCATION.  Writes up to n ascending
+	/// indices of the candidate filters to out and returns how many there
+	/// are, or -1 on failure.  A filter never misses a value its calendar
+	/// holds; a filter not built over type always reports a candidate
+	/// </summary>
+	DllExport int ProbeCalendarBlooms(CalBloom **filters, unsigned int count, int type, const char *key, unsigned int *out, unsigned int n)
+	{
+		if ((!filters && count) || !key)
+		{
+			return -1;
+		}
+
+		for (unsigned int i = 0; i < count; i++)
+		{
+			if (!filters[i])
+			{
+				return -1;
+			}
+		}
+		return ProbeBlooms(filters, count, type, key, out, out ? n : 0);
+	}
+
+	/// <summary>
+	/// Writes a parsed calendar, with its entries and the indexes it carries,
+	/// to a snapshot file that MapCalendarSnapshot loads without parsing.
+	/// Snapshots are only read by builds of the same pointer size
+	/// </summary>
+	DllExport HRESULT SaveCalendarSnapshot(Calendar *pCalendar, const char *path)
+	{
+		if (!pCalendar || !path)
+		{
+			return S_FALSE;
+		}
+		return SaveSnapshot(pCalendar, path, NULL) ? S_OK : S_FALSE;
+	}
+
+	/// <summary>
+	/// Maps a snapshot file read-only and returns its calendar, which every
+	/// accessor and query takes like a parsed one.  It cannot be merged into
+	/// or re-indexed.  Release it with UnmapCalendarSnapshot
+	/// </summary>
+	DllExport Calendar *MapCalendarSnapshot(const char *path)
+	{
+		if (!path)
+		{
+			return NULL;
+		}
+		return MapSnapshot(path, 0);
+	}
+
+	DllExport void UnmapCalendarSnapshot(Calendar *pCalendar)
+	{
+		if (pCalendar && pCalendar->Flags) return;
+
+		UnmapSnapshot(pCalendar);
+	}
+
+	/// <summary>
+	/// Creates a cache of parsed calendars keyed by a 128-bit hash of the
+	/// CAL file buffer and the parse options.  Calendars are kept in memory
+	/// up to MaxMemoryBytes and MaxMemoryCalendars, least recently used
+	/// evicted first, and as snapshot files in Directory, if given, up to
+	/// MaxDiskBytes.  Files left in Directory by earlier runs are reused
+	/// </summary>
+	DllExport CalParseCache *CreateCalendarParseCache(const CalParseCacheOptions *pOptions)
+	{
+		if (!pOptions)
+		{
+			return NULL;
+		}
+		return CreateParseCache(pOptions);
+	}
+
+	/// <summary>
+	/// Parses a CAL file buffer through a cache.  A buffer seen before is
+	/// returned from memory or mapped from its snapshot file instead of
+	/// being parsed.  The calendar is shared and read-only: the calls that
+	/// merge into, index or destroy a calendar reject it.  Release it with
+	/// ReleaseCachedCalendar
+	/// </summary>
+	DllExport Calendar *ParseCalendarFileBufferCached(CalParseCache *pCache, unsigned char *in, size_t len)
+	{
+		if (!pCache || !in)
+		{
+			return NULL;
+		}
+		return ParseCached(pCache, in, len);
+	}
+
+	DllExport HRESULT ReleaseCachedCalendar(CalParseCache *pCache, Calendar *pCalendar)
+	{
+		if (!pCache || !pCalendar)
+		{
+			return S_FALSE;
+		}
+		return ReleaseCached(pCache, pCalendar) ? S_OK : S_FALSE;
+	}
+
+	/// <summary>
+	/// Reads the hit, miss and eviction counters and the size of each tier
+	/// </summary>
+	DllExport HRESULT GetCalendarParseCacheStats(CalParseCache *pCache, CalParseCacheStats *pStats)
+	{
+		if (!pCache || !pStats)
+		{
+			return S_FALSE;
+		}
+
+		GetParseCacheStats(pCache, pStats);
+		return S_OK;
+	}
+
+	/// <summary>
+	/// Destroys a cache once every calendar it returned has been released.
+	/// Its snapshot files are kept for the next run
+	/// </summary>
+	DllExport void DestroyCalendarParseCache(CalParseCache *pCache)
+	{
+		DestroyParseCache(pCache);
+	}
+
+	/// <summary>
+	/// Opens the CAL file at basePath with its journal, basePath.journal,
+	/// which is created if there is none.  The calendar holds the entries
+	/// of the base followed by every batch appended to the journal.  Once
+	/// the journal grows past CompactBytes a background thread folds it
+	/// into a fresh base file.  The options cannot filter or index the
+	/// entries, and of the parse budgets only MaxEntries, which covers the
+	/// base and every batch, is taken; lookups on the calendar scan it.
+	/// Calls on one journal must come from one thread at a time
+	/// </summary>
+	DllExport CalJournal *OpenCalendarJournal(const char *basePath, const CalJournalOptions *pOptions)
+	{
+		if (!basePath || !pOptions)
+		{
+			return NULL;
+		}
+
+		printf("-> Opening CAL file journal\n");
+		return OpenJournal(basePath, pOptions);
+	}
+
+	/// <summary>
+	/// Returns the calendar of a journal, which every accessor and query
+	/// takes like a parsed one.  It belongs to the journal and grows with
+	/// each append, so the calls that change or destroy calendars reject
+	/// it; merging from it copies its entries
+	/// </summary>
+	DllExport Calendar *GetCalendarJournalCalendar(CalJournal *pJournal)
+	{
+		return pJournal ? pJournal->Calendar : NULL;
+	}
+
+	/// <summary>
+	/// Appends whole entries, from their NEWENTRY elements and without a
+	/// header or END, to a journal and its calendar.  They are written as
+	/// one batch and flushed to disk once.  Returns S_FALSE if they do not
+	/// parse and -1 if the journal could not be written; either way nothing
+	/// is appended
+	/// </summary>
+	DllExport HRESULT AppendCalendarJournal(CalJournal *pJournal, unsigned char *in, size_t len)
+	{
+		if (!pJournal || !in) return -1;
+
+		printf("-> Appending to CAL file journal\n");
+		return AppendJournal(pJournal, in, len);
+	}
+
+	/// <summary>
+	/// Folds a journal into a fresh base file in the background.  With
+	/// wait, returns once everything appended before the call is in the
+	/// base, or S_FALSE if the files could not be written
+	/// </summary>
+	DllExport HRESULT CompactCalendarJournal(CalJournal *pJournal, bool wait)
+	{
+		if (!pJournal) return -1;
+
+		return CompactJournal(pJournal, wait);
+	}
+
+	/// <summary>
+	/// Lets a running compaction finish, then closes a journal and destroys
+	/// its calendar
+	/// </summary>
+	DllExport void CloseCalendarJournal(CalJournal *pJournal)
+	{
+		CloseJournal(pJournal);
 	}
 
 	DllExport CalendarEntry *GetFirstCalendarEntry(Calendar *pCalendar)
@@ -160,6 +1413,59 @@ extern "C"
 		return S_OK;
 	}
 
+	/// <summary>
+	/// Returns the start of an entry in seconds since 1970 UTC, resolved from
+	/// its StartDate, StartTime and TimeZone when it was parsed.  Entries whose
+	/// TimeZone could not be resolved are taken to be in UTC
+	/// </summary>
+	DllExport HRESULT GetStartTimestamp(CalendarEntry *pEntry, int64_t *t)
+	{
+		if (!pEntry || !t)
+		{
+			return S_FALSE;
+		}
+		return GetEntryStart(pEntry, t) ? S_OK : S_FALSE;
+	}
+
+	/// <summary>
+	/// Returns the end of an entry (its start plus Duration) in seconds since
+	/// 1970 UTC
+	/// </summary>
+	DllExport HRESULT GetEndTimestamp(CalendarEntry *pEntry, int64_t *t)
+	{
+		int64_t start;
+		if (!pEntry || !t)
+		{
+			return S_FALSE;
+		}
+		return GetEntryInterval(pEntry, &start, t) ? S_OK : S_FALSE;
+	}
+
+	/// <summary>
+	/// Writes the 128-bit fingerprint of an entry, computed from its content
+	/// when it was parsed, to fingerprint[0] and fingerprint[1].  Entries with
+	/// the same type, UTC times, sender and recipient emails, text and
+	/// attachments have the same fingerprint
+	/// </summary>
+	DllExport HRESULT GetEntryFingerprint(CalendarEntry *pEntry, uint64_t *fingerprint)
+	{
+		if (!pEntry || !fingerprint)
+		{
+			return S_FALSE;
+		}
+		fingerprint[0] = pEntry->Fingerprint[0];
+		fingerprint[1] = pEntry->Fingerprint[1];
+		return S_OK;
+	}
+
+	/// <summary>
+	/// Returns whether the TimeZone of an entry was resolved to a known zone
+	/// </summary>
+	DllExport bool IsTimeZoneResolved(CalendarEntry *pEntry)
+	{
+		return pEntry && (pEntry->TimeFlags & CALTIME_ZONE_KNOWN);
+	}
+
 	DllExport char *GetTimeZone(CalendarEntry *pEntry)
 	{
 		return (char *)pEntry->TimeZone->Short.Value;
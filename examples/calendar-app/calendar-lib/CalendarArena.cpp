@@ -0,0 +1,394 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarArena.cpp:  contains the arena allocator and the CalParser
+* context that parses calendars into retained, reusable memory
+*
+*********************************************************************/
+
+#include "stdafx.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include "CalendarArena.h"
+#include "CalendarParser.h"
+#include "CalendarStructures.h"
+
+#define ARENA_BLOCK_DATA(b) ((unsigned char *)(b) + ARENA_BLOCK_HEADER)
+
+#define CALPARSER_INITIAL_ARENA (64 * 1024)
+
+Calendar *ParseInput(unsigned char *in, size_t len);
+Calendar *ParseInputEx(unsigned char *in, size_t len, const CalParseOptions *pOptions);
+
+static __declspec(thread) CalArena *ThreadArena = NULL;
+static __declspec(thread) size_t ThreadBudget = 0;
+static __declspec(thread) size_t ThreadAllocated = 0;
+
+static CalArenaBlock *CreateArenaBlock(size_t size)
+{
+	CalArenaBlock *b = (CalArenaBlock *)malloc(ARENA_BLOCK_HEADER + size);
+	if (!b)
+	{
+		return NULL;
+	}
+
+	b->Next = NULL;
+	b->Size = size;
+	b->Used = 0;
+	return b;
+}
+
+CalArena *CreateArena(size_t blockSize)
+{
+	CalArena *a = (CalArena *)calloc(1, sizeof(CalArena));
+	if (!a)
+	{
+		return NULL;
+	}
+
+	a->BlockSize = ARENA_ALIGN(blockSize);
+	return a;
+}
+
+/// <summary>
+/// Initializes an arena that hands out the len bytes at mem and never
+/// allocates; mem must be ARENA_ALIGNMENT aligned
+/// </summary>
+bool InitFixedArena(CalArena *a, void *mem, size_t len)
+{
+	memset(a, 0, sizeof(CalArena));
+	if (!mem || ((uintptr_t)mem & (ARENA_ALIGNMENT - 1)) || len < ARENA_BLOCK_HEADER)
+	{
+		return false;
+	}
+
+	CalArenaBlock *b = (CalArenaBlock *)mem;
+	b->Next = NULL;
+	b->Size = len - ARENA_BLOCK_HEADER;
+	b->Used = 0;
+
+	a->First = a->Current = b;
+	a->Fixed = true;
+	return true;
+}
+
+/// <summary>
+/// Returns len bytes of uninitialized memory from the arena, adding a
+/// block (at least twice the size of the previous one) if the current one is full
+/// </summary>
+void *ArenaAlloc(CalArena *a, size_t len)
+{
+	if (len > SIZE_MAX - ARENA_BLOCK_HEADER - ARENA_ALIGNMENT)
+	{
+		return NULL;
+	}
+	len = ARENA_ALIGN(len);
+
+	CalArenaBlock *b = a->Current;
+	if (!b || b->Size - b->Used < len)
+	{
+		if (a->Fixed)
+		{
+			return NULL;
+		}
+
+		size_t size = a->BlockSize;
+		while (size < len)
+		{
+			size *= 2;
+		}
+
+		CalArenaBlock *pNew = CreateArenaBlock(size);
+		if (!pNew)
+		{
+			return NULL;
+		}
+
+		if (b)
+		{
+			b->Next = pNew;
+		}
+		else
+		{
+			a->First = pNew;
+		}
+
+		a->Current = b = pNew;
+		a->BlockSize = size * 2;
+	}
+
+	void *p = ARENA_BLOCK_DATA(b) + b->Used;
+	b->Used += len;
+	return p;
+}
+
+/// <summary>
+/// Returns true if p points into memory handed out by the arena
+/// </summary>
+bool ArenaContains(CalArena *a, const void *p)
+{
+	for (CalArenaBlock *b = a->First; b; b = b->Next)
+	{
+		const unsigned char *data = ARENA_BLOCK_DATA(b);
+		if ((const unsigned char *)p >= data && (const unsigned char *)p < data + b->Size)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+/// <summary>
+/// Releases everything allocated from the arena while keeping its memory.
+/// Multiple blocks are coalesced into one so the next fill needs no allocation
+/// </summary>
+void ResetArena(CalArena *a)
+{
+	CalArenaBlock *b = a->First;
+	if (!b)
+	{
+		return;
+	}
+
+	if (b->Next && !a->Fixed)
+	{
+		size_t total = 0;
+		while (b)
+		{
+			CalArenaBlock *next = b->Next;
+			total += b->Size;
+			free(b);
+			b = next;
+		}
+
+		// If this fails the arena simply starts over empty
+		a->First = CreateArenaBlock(total);
+		a->BlockSize = total * 2;
+		b = a->First;
+	}
+
+	if (b)
+	{
+		b->Used = 0;
+	}
+	a->Current = b;
+}
+
+void DestroyArena(CalArena *a)
+{
+	if (!a) return;
+	if (a->Fixed) return;
+
+	CalArenaBlock *b = a->First;
+	while (b)
+	{
+		CalArenaBlock *next = b->Next;
+		free(b);
+		b = next;
+	}
+	free(a);
+}
+
+/// <summary>
+/// Installs the arena that serves CalMalloc/CalCalloc on the calling thread
+/// (NULL for the heap) and returns the previously installed one
+/// </summary>
+CalArena *SetThreadArena(CalArena *a)
+{
+	CalArena *previous = ThreadArena;
+	ThreadArena = a;
+	return previous;
+}
+
+CalArena *GetThreadArena()
+{
+	return ThreadArena;
+}
+
+/// <summary>
+/// Installs the arena that holds the calendar's structures, or the heap
+/// for a heap calendar, so that those freed or replaced while it is
+/// installed go back to their owner.  Returns the previously installed one
+/// </summary>
+CalArena *SetCalendarArena(Calendar *pCalendar)
+{
+	return SetThreadArena(pCalendar->Arena);
+}
+
+size_t SetThreadAllocationBudget(size_t maxBytes)
+{
+	size_t previous = ThreadBudget;
+	ThreadBudget = maxBytes;
+	ThreadAllocated = 0;
+	return previous;
+}
+
+/// <summary>
+/// Charges len bytes against the thread's allocation budget, returning
+/// false if that would exceed it
+/// </summary>
+static bool ChargeAllocation(size_t len)
+{
+	if (!ThreadBudget)
+	{
+		return true;
+	}
+
+	if (len > ThreadBudget - ThreadAllocated)
+	{
+		printf("-> ERROR: allocation budget of %zu bytes exceeded\n", ThreadBudget);
+		return false;
+	}
+
+	ThreadAllocated += len;
+	return true;
+}
+
+void *CalMalloc(size_t len)
+{
+	if (!ChargeAllocation(len))
+	{
+		return NULL;
+	}
+
+	if (ThreadArena)
+	{
+		return ArenaAlloc(ThreadArena, len);
+	}
+	return malloc(len);
+}
+
+void *CalCalloc(size_t count, size_t size)
+{
+	if (size && count > SIZE_MAX / size)
+	{
+		return NULL;
+	}
+
+	if (!ChargeAllocation(count * size))
+	{
+		return NULL;
+	}
+
+	if (ThreadArena)
+	{
+		void *p = ArenaAlloc(ThreadArena, count * size);
+		if (p)
+		{
+			memset(p, 0, count * size);
+		}
+		return p;
+	}
+	return calloc(count, size);
+}
+
+/// <summary>
+/// Frees heap memory; memory owned by the installed arena is only
+/// released when the arena is reset.  Code that frees part of a calendar
+/// it did not just allocate installs the calendar's own arena first with
+/// SetCalendarArena
+/// </summary>
+void CalFree(void *p)
+{
+	if (!p) return;
+	if (ThreadArena && ArenaContains(ThreadArena, p))
+	{
+		return;
+	}
+	free(p);
+}
+
+CalParser *CreateCalParser()
+{
+	CalParser *pParser = (CalParser *)calloc(1, sizeof(CalParser));
+	if (!pParser)
+	{
+		return NULL;
+	}
+
+	pParser->Arena = CreateArena(CALPARSER_INITIAL_ARENA);
+	if (!pParser->Arena)
+	{
+		free(pParser);
+		return NULL;
+	}
+
+	return pParser;
+}
+
+/// <summary>
+/// Parses the buffer into the parser's arena.  The previous result is
+/// released first; the Calendar returned stays valid until the next
+/// CalParserParse, ResetCalParser or DestroyCalParser call
+/// </summary>
+Calendar *CalParserParse(CalParser *pParser, unsigned char *in, size_t len)
+{
+	ResetCalParser(pParser);
+
+	CalArena *previous = SetThreadArena(pParser->Arena);
+	Calendar *pCalendar = ParseInputEx(in, len, &pParser->Options);
+	SetThreadArena(previous);
+
+	if (!pCalendar)
+	{
+		ResetArena(pParser->Arena);
+		return NULL;
+	}
+
+	pCalendar->Storage = PARSERSTORAGE;
+	pParser->Calendar = pCalendar;
+	return pCalendar;
+}
+
+void ResetCalParser(CalParser *pParser)
+{
+	pParser->Calendar = NULL;
+	ResetArena(pParser->Arena);
+}
+
+void DestroyCalParser(CalParser *pParser)
+{
+	if (!pParser) return;
+	DestroyArena(pParser->Arena);
+	free(pParser);
+}
+
+/// <summary>
+/// Parses the buffer into the bytes at mem (ARENA_ALIGNMENT aligned) without
+/// any heap allocation, leaving UTC times unresolved; ComputeCalendarSize
+/// returns the size required
+/// </summary>
+Calendar *ParseInputInto(unsigned char *in, size_t len, void *mem, size_t bytes)
+{
+	CalArena arena;
+	if (!InitFixedArena(&arena, mem, bytes))
+	{
+		return NULL;
+	}
+
+	// The arena itself is kept at the start of the block, so the calendar
+	// can name the owner of its structures
+	CalArena *pArena = (CalArena *)ArenaAlloc(&arena, sizeof(CalArena));
+	if (!pArena)
+	{
+		return NULL;
+	}
+	*pArena = arena;
+
+	// Zones are resolved on request, so parsing into caller memory reads
+	// no tzdata files
+	CalParseOptions options = { 0 };
+	options.Flags = CALPARSE_SKIP_TIME_ZONES;
+
+	CalArena *previous = SetThreadArena(pArena);
+	Calendar *pCalendar = ParseInputEx(in, len, &options);
+	SetThreadArena(previous);
+
+	if (pCalendar)
+	{
+		pCalendar->Storage = CALLERSTORAGE;
+	}
+	return pCalendar;
+}
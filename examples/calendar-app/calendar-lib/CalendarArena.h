@@ -0,0 +1,67 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarArena.h:  contains the arena allocator used to parse
+* calendars into reusable memory, and the CalParser context
+*
+*********************************************************************/
+
+#pragma once
+
+#include <stddef.h>
+#include "CalendarParser.h"
+
+#define ARENA_ALIGNMENT 16
+#define ARENA_ALIGN(x) (((x) + (ARENA_ALIGNMENT - 1)) & ~((size_t)ARENA_ALIGNMENT - 1))
+#define ARENA_BLOCK_HEADER ARENA_ALIGN(sizeof(CalArenaBlock))
+
+typedef struct _CalArenaBlock
+{
+	struct _CalArenaBlock *Next;
+	size_t Size;
+	size_t Used;
+} CalArenaBlock;
+
+typedef struct _CalArena
+{
+	CalArenaBlock *First;
+	CalArenaBlock *Current;
+	size_t BlockSize;	// Size of the next block to be allocated
+	bool Fixed;			// Arena over caller memory; never grows or frees its block
+} CalArena;
+
+typedef struct _CalParser
+{
+	CalArena *Arena;
+	struct _Calendar *Calendar;	// Result of the last parse; valid until the next reset
+	CalParseOptions Options;	// Applied to every parse
+} CalParser;
+
+CalArena *CreateArena(size_t blockSize);
+bool InitFixedArena(CalArena *a, void *mem, size_t len);
+void *ArenaAlloc(CalArena *a, size_t len);
+bool ArenaContains(CalArena *a, const void *p);
+void ResetArena(CalArena *a);
+void DestroyArena(CalArena *a);
+
+// All calendar structures are allocated through these; they are served from
+// the arena installed on the calling thread, or from the heap if there is none
+CalArena *SetThreadArena(CalArena *a);
+CalArena *GetThreadArena();
+CalArena *SetCalendarArena(struct _Calendar *pCalendar);
+void *CalMalloc(size_t len);
+void *CalCalloc(size_t count, size_t size);
+void CalFree(void *p);
+
+// Caps the total bytes CalMalloc/CalCalloc hand out on the calling thread
+// (0 for no cap) and resets the running count; returns the previous cap
+size_t SetThreadAllocationBudget(size_t maxBytes);
+
+CalParser *CreateCalParser();
+struct _Calendar *CalParserParse(CalParser *pParser, unsigned char *in, size_t len);
+void ResetCalParser(CalParser *pParser);
+void DestroyCalParser(CalParser *pParser);
+
+struct _Calendar *ParseInputInto(unsigned char *in, size_t len, void *mem, size_t bytes);
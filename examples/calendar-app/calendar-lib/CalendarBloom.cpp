@@ -0,0 +1,427 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarBloom.cpp:  contains the per-calendar Bloom filters, so a
+* store of many calendars can rule out most of them for a given email
+* without parsing them
+*
+*********************************************************************/
+
+#include "stdafx.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "CalendarArena.h"
+#include "CalendarHash.h"
+#include "CalendarBloom.h"
+
+#pragma warning (disable: 4996) // Suppress compiler warning re: use of fopen
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define BLOOM_PREFETCH(p)	_mm_prefetch((const char *)(p), _MM_HINT_T0)
+#elif defined(__GNUC__) || defined(__clang__)
+#define BLOOM_PREFETCH(p)	__builtin_prefetch(p)
+#else
+#define BLOOM_PREFETCH(p)
+#endif
+
+#define BLOOM_HEADER		((sizeof(CalBloom) + 63) & ~(size_t)63)
+#define BLOOM_BLOCKS(p)		((uint64_t *)((unsigned char *)(p) + BLOOM_HEADER))
+
+// Filters probed ahead of the current one in a batch
+#define BLOOM_PREFETCH_DISTANCE	8
+
+// The largest filter loaded from disk
+#define BLOOM_MAX_SIZE		(64 * 1024 * 1024)
+
+// Keys are hashed with a different seed for each kind, so a location
+// never answers for an email
+enum BloomKeyKind
+{
+	BLOOMKEY_EMAIL = 1,
+	BLOOMKEY_TIMEZONE,
+	BLOOMKEY_LOCATION
+};
+
+typedef struct _CalBloomKeys
+{
+	uint64_t *Hashes;
+	size_t Count;
+	size_t Capacity;
+	unsigned char *Scratch;		// Normalized key being hashed
+	size_t ScratchLength;
+} CalBloomKeys;
+
+static int BloomKeyKind(int type)
+{
+	switch (type)
+	{
+	case SENDER:
+	case RECIPIENT:	return BLOOMKEY_EMAIL;
+	case TIMEZONE:	return BLOOMKEY_TIMEZONE;
+	case LOCATION:	return BLOOMKEY_LOCATION;
+	default:		return 0;
+	}
+}
+
+/// <summary>
+/// Hashes a key after trimming surrounding whitespace and lowercasing
+/// ASCII letters, the same normalization as the contact index
+/// </summary>
+static bool HashBloomKey(const unsigned char *p, size_t len, int kind, unsigned char **scratch, size_t *scratchLength, uint64_t *hash)
+{
+	while (len && isspace(p[0]))
+	{
+		p++;
+		len--;
+	}
+	while (len && isspace(p[len - 1]))
+	{
+		len--;
+	}
+
+	if (len > *scratchLength)
+	{
+		unsigned char *grown = (unsigned char *)realloc(*scratch, len);
+		if (!grown)
+		{
+			return false;
+		}
+		*scratch = grown;
+		*scratchLength = len;
+	}
+
+	for (size_t i = 0; i < len; i++)
+	{
+		unsigned char c = p[i];
+		(*scratch)[i] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+	}
+
+	*hash = CalHash64(*scratch, len, (uint64_t)kind);
+	return true;
+}
+
+/// <summary>
+/// Sets in mask the HashCount bits a key uses within its block
+/// </summary>
+static void BloomBlockMask(uint64_t hash, unsigned int hashCount, uint64_t *mask)
+{
+	uint64_t x = hash;
+
+	memset(mask, 0, CALBLOOM_BLOCK_WORDS * sizeof(uint64_t));
+	for (unsigned int i = 0; i < hashCount; i++)
+	{
+		x = x * 0x9e3779b97f4a7c15ULL + 0x632be59bd9b4e019ULL;
+		unsigned int bit = (unsigned int)(x >> 55);		// 0..511
+		mask[bit / 64] |= 1ULL << (bit % 64);
+	}
+}
+
+static uint32_t BloomBlockIndex(uint64_t hash, uint32_t blockCount)
+{
+	return (uint32_t)(((hash >> 32) * blockCount) >> 32);
+}
+
+static bool AddBloomKey(CalBloomKeys *k, CalString *s, int kind)
+{
+	uint64_t hash;
+
+	if (!s)
+	{
+		return true;
+	}
+
+	const unsigned char *p = (s->StringType == LONGSTRING) ? s->Long.Value : s->Short.Value;
+	size_t len = (s->StringType == LONGSTRING) ? s->Long.Length : s->Short.Length;
+	if (!p)
+	{
+		return true;
+	}
+
+	if (k->Count == k->Capacity)
+	{
+		size_t capacity = k->Capacity ? k->Capacity * 2 : 256;
+		uint64_t *grown = (uint64_t *)realloc(k->Hashes, capacity * sizeof(uint64_t));
+		if (!grown)
+		{
+			return false;
+		}
+		k->Hashes = grown;
+		k->Capacity = capacity;
+	}
+
+	if (!HashBloomKey(p, len, kind, &k->Scratch, &k->ScratchLength, &hash))
+	{
+		return false;
+	}
+	k->Hashes[k->Count++] = hash;
+	return true;
+}
+
+static int CompareHashes(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/// <summary>
+/// Builds a filter over the elements in fields (CALFIELD bits of SENDER,
+/// RECIPIENT, TIMEZONE and LOCATION) of every entry, sized for the
+/// distinct keys at bitsPerKey bits each
+/// </summary>
+CalBloom *BuildBloom(Calendar *pCalendar, unsigned int fields, unsigned int bitsPerKey)
+{
+	CalBloomKeys k;
+	CalBloom *pBloom = NULL;
+	uint64_t mask[CALBLOOM_BLOCK_WORDS];
+
+	memset(&k, 0, sizeof(k));
+	fields &= CALBLOOM_FIELDS;
+	if (!fields || !bitsPerKey || bitsPerKey > CALBLOOM_MAX_BITS)
+	{
+		return NULL;
+	}
+
+	for (CalendarEntry *e = pCalendar->Entry; e; e = e->NextEntry)
+	{
+		bool ok = true;
+
+		if ((fields & CALFIELD(SENDER)) && e->Sender)
+		{
+			ok = AddBloomKey(&k, e->Sender->Email, BLOOMKEY_EMAIL);
+		}
+		if (fields & CALFIELD(RECIPIENT))
+		{
+			for (Contact *c = e->Recipient; c && ok; c = c->NextContact)
+			{
+				ok = AddBloomKey(&k, c->Email, BLOOMKEY_EMAIL);
+			}
+		}
+		if (ok && (fields & CALFIELD(TIMEZONE)))
+		{
+			ok = AddBloomKey(&k, e->TimeZone, BLOOMKEY_TIMEZONE);
+		}
+		if (ok && (fields & CALFIELD(LOCATION)))
+		{
+			ok = AddBloomKey(&k, e->Location, BLOOMKEY_LOCATION);
+		}
+
+		if (!ok)
+		{
+			goto ERROR_EXIT;
+		}
+	}
+
+	{
+		// Size for distinct keys; the same email usually recurs many times
+		size_t distinct = 0;
+		qsort(k.Hashes, k.Count, sizeof(uint64_t), CompareHashes);
+		for (size_t i = 0; i < k.Count; i++)
+		{
+			if (i == 0 || k.Hashes[i] != k.Hashes[i - 1])
+			{
+				k.Hashes[distinct++] = k.Hashes[i];
+			}
+		}
+
+		uint64_t bits = (uint64_t)distinct * bitsPerKey;
+		uint64_t blocks = (bits + CALBLOOM_BLOCK_BITS - 1) / CALBLOOM_BLOCK_BITS;
+		uint64_t size = BLOOM_HEADER + max(blocks, (uint64_t)1) * CALBLOOM_BLOCK_WORDS * sizeof(uint64_t);
+		if (size > BLOOM_MAX_SIZE)
+		{
+			printf("-> ERROR: Bloom filter too large\n");
+			goto ERROR_EXIT;
+		}
+
+		pBloom = (CalBloom *)CalCalloc(1, (size_t)size);
+		if (!pBloom)
+		{
+			goto ERROR_EXIT;
+		}
+
+		// k = bits per key * ln 2 minimizes the false positive rate
+		pBloom->Magic = CALBLOOM_MAGIC;
+		pBloom->Version = CALBLOOM_VERSION;
+		pBloom->Size = (uint32_t)size;
+		pBloom->Fields = fields;
+		pBloom->BitsPerKey = bitsPerKey;
+		pBloom->HashCount = min(max((bitsPerKey * 693 + 500) / 1000, 1U), (unsigned int)CALBLOOM_MAX_HASHES);
+		pBloom->BlockCount = (uint32_t)max(blocks, (uint64_t)1);
+		pBloom->KeyCount = (uint32_t)distinct;
+
+		uint64_t *blockBits = BLOOM_BLOCKS(pBloom);
+		for (size_t i = 0; i < distinct; i++)
+		{
+			uint64_t *block = blockBits + (size_t)BloomBlockIndex(k.Hashes[i], pBloom->BlockCount) * CALBLOOM_BLOCK_WORDS;
+
+			BloomBlockMask(k.Hashes[i], pBloom->HashCount, mask);
+			for (int w = 0; w < CALBLOOM_BLOCK_WORDS; w++)
+			{
+				block[w] |= mask[w];
+			}
+		}
+	}
+
+ERROR_EXIT:
+	free(k.Hashes);
+	free(k.Scratch);
+	return pBloom;
+}
+
+void DestroyBloom(CalBloom *pBloom)
+{
+	CalFree(pBloom);
+}
+
+bool SaveBloom(const CalBloom *pBloom, const char *path)
+{
+	FILE *f = fopen(path, "wb");
+	bool ok;
+
+	if (!f)
+	{
+		printf("-> ERROR: cannot create %s\n", path);
+		return false;
+	}
+
+	ok = fwrite(pBloom, 1, pBloom->Size, f) == pBloom->Size;
+	ok = (fclose(f) == 0) && ok;
+	if (!ok)
+	{
+		printf("-> ERROR: cannot write %s\n", path);
+	}
+	return ok;
+}
+
+/// <summary>
+/// Checks the header of a filter of at most bytes bytes, read from a file
+/// or mapped from a snapshot, so probes can trust it
+/// </summary>
+bool ValidateBloom(const CalBloom *pBloom, uint64_t bytes)
+{
+	return bytes >= sizeof(CalBloom) &&
+		pBloom->Magic == CALBLOOM_MAGIC && pBloom->Version == CALBLOOM_VERSION &&
+		pBloom->BlockCount && pBloom->Size <= BLOOM_MAX_SIZE && pBloom->Size <= bytes &&
+		pBloom->Size == BLOOM_HEADER + (uint64_t)pBloom->BlockCount * CALBLOOM_BLOCK_WORDS * sizeof(uint64_t) &&
+		pBloom->HashCount && pBloom->HashCount <= CALBLOOM_MAX_HASHES &&
+		(pBloom->Fields & CALBLOOM_FIELDS) && !(pBloom->Fields & ~CALBLOOM_FIELDS);
+}
+
+/// <summary>
+/// Reads a saved filter.  Returns NULL if the file is missing or is not a
+/// valid filter
+/// </summary>
+CalBloom *LoadBloom(const char *path)
+{
+	CalBloom header;
+	CalBloom *pBloom = NULL;
+
+	FILE *f = fopen(path, "rb");
+	if (!f)
+	{
+		printf("-> ERROR: cannot open %s\n", path);
+		return NULL;
+	}
+
+	if (fread(&header, 1, sizeof(header), f) != sizeof(header) || !ValidateBloom(&header, BLOOM_MAX_SIZE))
+	{
+		printf("-> ERROR: %s is not a valid Bloom filter\n", path);
+		goto ERROR_EXIT;
+	}
+
+	pBloom = (CalBloom *)CalMalloc(header.Size);
+	if (!pBloom)
+	{
+		goto ERROR_EXIT;
+	}
+
+	memcpy(pBloom, &header, sizeof(header));
+	fseek(f, 0L, SEEK_SET);
+	if (fread(pBloom, 1, header.Size, f) != header.Size || memcmp(pBloom, &header, sizeof(header)))
+	{
+		printf("-> ERROR: %s is truncated\n", path);
+		CalFree(pBloom);
+		pBloom = NULL;
+	}
+
+ERROR_EXIT:
+	fclose(f);
+	return pBloom;
+}
+
+/// <summary>
+/// Tests one key against many filters.  type is SENDER or RECIPIENT for an
+/// email in that role, TIMEZONE or LOCATION.  Writes up to n indices of the
+/// filters that may hold the key to out and returns how many there are, or
+/// -1 for an unknown type.  A filter that does not cover the type always
+/// may: one over recipients alone says nothing about senders
+///
+/// The key is hashed once; each filter then costs one block read, and the
+/// blocks of the next filters are prefetched while the current one is
+/// tested
+/// </summary>
+int ProbeBlooms(CalBloom **filters, unsigned int count, int type, const char *key, unsigned int *out, unsigned int n)
+{
+	uint64_t masks[CALBLOOM_MAX_HASHES + 1][CALBLOOM_BLOCK_WORDS];
+	bool hasMask[CALBLOOM_MAX_HASHES + 1] = { false };
+	unsigned char *scratch = NULL;
+	size_t scratchLength = 0;
+	uint64_t hash;
+	int found = 0;
+
+	int kind = BloomKeyKind(type);
+	if (!kind)
+	{
+		return -1;
+	}
+
+	bool hashed = HashBloomKey((const unsigned char *)key, strlen(key), kind, &scratch, &scratchLength, &hash);
+	free(scratch);
+	if (!hashed)
+	{
+		return -1;
+	}
+
+	unsigned int cover = CALFIELD(type);
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		if (i + BLOOM_PREFETCH_DISTANCE < count)
+		{
+			const CalBloom *ahead = filters[i + BLOOM_PREFETCH_DISTANCE];
+			BLOOM_PREFETCH(BLOOM_BLOCKS(ahead) + (size_t)BloomBlockIndex(hash, ahead->BlockCount) * CALBLOOM_BLOCK_WORDS);
+		}
+
+		const CalBloom *pBloom = filters[i];
+		bool maybe = true;
+
+		if ((pBloom->Fields & cover) == cover)
+		{
+			unsigned int k = pBloom->HashCount;
+			if (!hasMask[k])
+			{
+				BloomBlockMask(hash, k, masks[k]);
+				hasMask[k] = true;
+			}
+
+			const uint64_t *block = BLOOM_BLOCKS(pBloom) + (size_t)BloomBlockIndex(hash, pBloom->BlockCount) * CALBLOOM_BLOCK_WORDS;
+			uint64_t missing = 0;
+			for (int w = 0; w < CALBLOOM_BLOCK_WORDS; w++)
+			{
+				missing |= masks[k][w] & ~block[w];
+			}
+			maybe = !missing;
+		}
+
+		if (maybe)
+		{
+			if ((unsigned int)found < n) out[found] = i;
+			if (found < INT_MAX) found++;
+		}
+	}
+	return found;
+}
@@ -0,0 +1,51 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarBloom.h:  contains the per-calendar Bloom filters over
+* contact emails, time zones and locations
+*
+*********************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include "CalendarStructures.h"
+
+#define CALBLOOM_MAGIC			0x4d4c4243	// "CBLM"
+#define CALBLOOM_VERSION		1
+
+// The elements a filter can cover, as CALFIELD bits
+#define CALBLOOM_FIELDS			(CALFIELD(SENDER) | CALFIELD(RECIPIENT) | CALFIELD(TIMEZONE) | CALFIELD(LOCATION))
+#define CALBLOOM_DEFAULT_FIELDS	(CALFIELD(SENDER) | CALFIELD(RECIPIENT))
+
+#define CALBLOOM_DEFAULT_BITS	10			// Bits per key; about a 1% false positive rate
+#define CALBLOOM_MAX_BITS		64
+#define CALBLOOM_MAX_HASHES		16
+
+// Each key sets all its bits inside one 512-bit block, so a probe reads
+// a single cache line of the filter
+#define CALBLOOM_BLOCK_WORDS	8
+#define CALBLOOM_BLOCK_BITS		(CALBLOOM_BLOCK_WORDS * 64)
+
+// A filter is one allocation, saved to disk byte for byte.  The blocks
+// follow the header
+typedef struct _CalBloom
+{
+	uint32_t Magic;
+	uint32_t Version;
+	uint32_t Size;				// Bytes in the filter, header included
+	uint32_t Fields;			// CALFIELD bits of the elements added
+	uint32_t BitsPerKey;
+	uint32_t HashCount;
+	uint32_t BlockCount;
+	uint32_t KeyCount;			// Distinct keys added
+} CalBloom;
+
+CalBloom *BuildBloom(Calendar *pCalendar, unsigned int fields, unsigned int bitsPerKey);
+void DestroyBloom(CalBloom *pBloom);
+bool SaveBloom(const CalBloom *pBloom, const char *path);
+CalBloom *LoadBloom(const char *path);
+bool ValidateBloom(const CalBloom *pBloom, uint64_t bytes);
+int ProbeBlooms(CalBloom **filters, unsigned int count, int type, const char *key, unsigned int *out, unsigned int n);
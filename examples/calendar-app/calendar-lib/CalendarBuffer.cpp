@@ -17,6 +17,15 @@ void DestroyBuffer(Buffer *b)
 	return;
 }
 
+void InitBuffer(Buffer *b, unsigned char *in, size_t len)
+{
+	b->begin = in;
+	b->end = in + len;
+	b->current = b->begin;
+	b->len = len;
+	b->leftover = b->len;
+}
+
 Buffer *CreateBuffer(unsigned char *in, size_t len)
 {
 	Buffer *b = (Buffer *)calloc(1, sizeof(Buffer));
@@ -25,10 +34,6 @@ Buffer *CreateBuffer(unsigned char *in, size_t len)
 		return b;
 	}
 
-	b->begin = in;
-	b->end = in + len;
-	b->current = b->begin;
-	b->len = len;
-	b->leftover = b->len;
+	InitBuffer(b, in, len);
 	return b;
 }
\ No newline at end of file
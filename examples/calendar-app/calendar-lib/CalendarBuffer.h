@@ -34,6 +34,7 @@ typedef struct _Buffer
 
 #define BUFFER_GETCURRENT(b) b->current
 
+void InitBuffer(Buffer *b, unsigned char *in, size_t len);
 void DestroyBuffer(Buffer *b);
 
 Buffer *CreateBuffer(unsigned char *in, size_t len);
\ No newline at end of file
@@ -0,0 +1,162 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarColumns.cpp:  contains the batched field accessors.  Each
+* call walks its entries once and writes the fields asked for into
+* caller arrays, so reading a field of every entry costs one call
+* rather than one per entry and field
+*
+*********************************************************************/
+
+#include "stdafx.h"
+#include <string.h>
+#include "CalendarTime.h"
+#include "CalendarColumns.h"
+
+static inline CalStringRef RefCalString(const CalString *s)
+{
+	CalStringRef ref = { NULL, 0 };
+
+	if (s)
+	{
+		if (s->StringType == SHORTSTRING)
+		{
+			ref.Value = (const char *)s->Short.Value;
+			ref.Length = s->Short.Length;
+		}
+		else
+		{
+			ref.Value = (const char *)s->Long.Value;
+			ref.Length = s->Long.Length;
+		}
+	}
+	return ref;
+}
+
+/// <summary>
+/// Returns the CALFIELD bits of the elements an entry has
+/// </summary>
+static unsigned int GetEntryFields(const CalendarEntry *e)
+{
+	unsigned int fields = CALFIELD(ENTRYTYPE);
+
+	if (e->Sender) fields |= CALFIELD(SENDER);
+	if (e->Recipient) fields |= CALFIELD(RECIPIENT);
+	if (e->Location) fields |= CALFIELD(LOCATION);
+	if (e->StartTime) fields |= CALFIELD(STARTTIME);
+	if (e->TimeZone) fields |= CALFIELD(TIMEZONE);
+	if (e->Duration) fields |= CALFIELD(DURATION);
+	if (e->StartDate) fields |= CALFIELD(STARTDATE);
+	if (e->Subject) fields |= CALFIELD(SUBJECT);
+	if (e->Content) fields |= CALFIELD(CONTENT);
+	if (e->Attachments && e->Attachments->Count) fields |= CALFIELD(ATTACHMENT);
+	if (e->ContentType) fields |= CALFIELD(CONTENTTYPE);
+	if (e->StructuredBlob) fields |= CALFIELD(STRUCTBLOB);
+	return fields;
+}
+
+/// <summary>
+/// Writes the fields of entry e to element i of each column asked for
+/// </summary>
+static inline void FillEntryRow(const CalEntryColumns *c, unsigned int i, CalendarEntry *e)
+{
+	static const CalDate noDate = { 0 };
+	static const CalTime noTime = { 0 };
+
+	if (c->Entries) c->Entries[i] = e;
+	if (c->Types) c->Types[i] = (int)e->EntryType;
+	if (c->Fields) c->Fields[i] = GetEntryFields(e);
+	if (c->StartDates) c->StartDates[i] = e->StartDate ? *e->StartDate : noDate;
+	if (c->StartTimes) c->StartTimes[i] = e->StartTime ? *e->StartTime : noTime;
+	if (c->Durations) c->Durations[i] = e->Duration ? *e->Duration : noTime;
+	if (c->UtcStarts) c->UtcStarts[i] = (e->TimeFlags & CALTIME_HAS_START) ? e->UtcStart : CALCOLUMN_NO_TIME;
+	if (c->UtcEnds) c->UtcEnds[i] = (e->TimeFlags & CALTIME_HAS_END) ? e->UtcEnd : CALCOLUMN_NO_TIME;
+	if (c->SenderNames) c->SenderNames[i] = RefCalString(e->Sender ? e->Sender->Name : NULL);
+	if (c->SenderEmails) c->SenderEmails[i] = RefCalString(e->Sender ? e->Sender->Email : NULL);
+	if (c->Locations) c->Locations[i] = RefCalString(e->Location);
+	if (c->TimeZones) c->TimeZones[i] = RefCalString(e->TimeZone);
+	if (c->Subjects) c->Subjects[i] = RefCalString(e->Subject);
+	if (c->Contents) c->Contents[i] = RefCalString(e->Content);
+	if (c->ContentTypes) c->ContentTypes[i] = RefCalString(e->ContentType);
+	if (c->AttachmentCounts) c->AttachmentCounts[i] = e->Attachments ? (unsigned int)e->Attachments->Count : 0;
+
+	if (c->RecipientCounts)
+	{
+		unsigned int recipients = 0;
+		for (Contact *r = e->Recipient; r; r = r->NextContact)
+		{
+			recipients++;
+		}
+		c->RecipientCounts[i] = recipients;
+	}
+}
+
+/// <summary>
+/// Fills the columns for up to count entries from entry first, in list
+/// order.  Returns how many were filled: fewer than count past the last
+/// entry
+/// </summary>
+int FillEntryColumns(Calendar *pCalendar, unsigned int first, unsigned int count, const CalEntryColumns *pColumns)
+{
+	unsigned int filled = 0;
+
+	if (pCalendar->EntryTable)
+	{
+		unsigned int n = pCalendar->EntryTableCount;
+		if (first >= n)
+		{
+			return 0;
+		}
+
+		filled = count < n - first ? count : n - first;
+		CalendarEntry **entries = pCalendar->EntryTable + first;
+		for (unsigned int i = 0; i < filled; i++)
+		{
+			FillEntryRow(pColumns, i, entries[i]);
+		}
+		return (int)filled;
+	}
+
+	CalendarEntry *e = pCalendar->Entry;
+	for (unsigned int i = 0; e && i < first; i++)
+	{
+		e = e->NextEntry;
+	}
+	for (; e && filled < count; e = e->NextEntry)
+	{
+		FillEntryRow(pColumns, filled++, e);
+	}
+	return (int)filled;
+}
+
+/// <summary>
+/// Fills element i of the columns for entry indexes[i], as returned by the
+/// lookups and queries.  Returns count, or -1, with nothing filled, if an
+/// index is past the last entry
+/// </summary>
+int FillEntryColumnsAt(Calendar *pCalendar, const unsigned int *indexes, unsigned int count, const CalEntryColumns *pColumns)
+{
+	CalendarEntry **entries = pCalendar->EntryTable;
+	unsigned int n = pCalendar->EntryTableCount;
+
+	if (!entries)
+	{
+		return -1;
+	}
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		if (indexes[i] >= n)
+		{
+			return -1;
+		}
+	}
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		FillEntryRow(pColumns, i, entries[indexes[i]]);
+	}
+	return (int)count;
+}
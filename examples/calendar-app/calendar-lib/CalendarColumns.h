@@ -0,0 +1,49 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarColumns.h:  contains the batched field accessors, which fill
+* caller arrays with one field of many entries each
+*
+*********************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include "CalendarStructures.h"
+
+#define CALCOLUMN_NO_TIME	INT64_MIN	// In UtcStarts and UtcEnds where the entry has no such time
+
+// The bytes of a string field, left in place in the calendar; NULL with a
+// Length of zero where the entry does not have the field
+typedef struct _CalStringRef
+{
+	const char *Value;
+	unsigned int Length;
+} CalStringRef;
+
+// Caller arrays with an element per entry filled; NULL columns are skipped
+typedef struct _CalEntryColumns
+{
+	CalendarEntry **Entries;
+	int *Types;						// enum EntryType
+	unsigned int *Fields;			// CALFIELD bits of the elements the entry has
+	CalDate *StartDates;			// Zero where the entry has none
+	CalTime *StartTimes;
+	CalTime *Durations;
+	int64_t *UtcStarts;				// Seconds since 1970 UTC, as GetStartTimestamp
+	int64_t *UtcEnds;
+	CalStringRef *SenderNames;
+	CalStringRef *SenderEmails;
+	CalStringRef *Locations;
+	CalStringRef *TimeZones;
+	CalStringRef *Subjects;
+	CalStringRef *Contents;
+	CalStringRef *ContentTypes;
+	unsigned int *RecipientCounts;
+	unsigned int *AttachmentCounts;
+} CalEntryColumns;
+
+int FillEntryColumns(Calendar *pCalendar, unsigned int first, unsigned int count, const CalEntryColumns *pColumns);
+int FillEntryColumnsAt(Calendar *pCalendar, const unsigned int *indexes, unsigned int count, const CalEntryColumns *pColumns);
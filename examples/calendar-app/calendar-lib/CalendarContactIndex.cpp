@@ -0,0 +1,420 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarContactIndex.cpp:  contains the index from contact email
+* to the entries that name it as sender or recipient, so per-user
+* lookups do not walk every entry
+*
+*********************************************************************/
+
+#include "stdafx.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "CalendarArena.h"
+#include "CalendarHash.h"
+#include "CalendarContactIndex.h"
+
+#define CONTACTINDEX_ALIGN(x)	(((x) + 7) & ~(size_t)7)
+#define CONTACTINDEX_SLOTS(p)	((CalContactSlot *)((unsigned char *)(p) + (p)->Slots))
+#define CONTACTINDEX_AT(p, off)	((unsigned char *)(p) + (off))
+
+// Queries up to this many bytes are normalized on the stack
+#define CONTACTINDEX_QUERY_LENGTH 256
+
+typedef struct _CalContactItem
+{
+	uint64_t Hash;
+	const unsigned char *Key;
+	unsigned int KeyLength;
+	unsigned int Entry;
+} CalContactItem;
+
+static const unsigned char *TrimEmail(const unsigned char *p, size_t *len)
+{
+	while (*len && isspace(p[0]))
+	{
+		p++;
+		(*len)--;
+	}
+	while (*len && isspace(p[*len - 1]))
+	{
+		(*len)--;
+	}
+	return p;
+}
+
+static unsigned char LowerAscii(unsigned char c)
+{
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+/// <summary>
+/// Writes the normalized form of an email (surrounding whitespace removed,
+/// ASCII letters lowercased) to dst and returns its length
+/// </summary>
+static size_t NormalizeEmail(const unsigned char *src, size_t len, unsigned char *dst)
+{
+	src = TrimEmail(src, &len);
+	for (size_t i = 0; i < len; i++)
+	{
+		dst[i] = LowerAscii(src[i]);
+	}
+	return len;
+}
+
+static int CompareContactItems(const void *a, const void *b)
+{
+	const CalContactItem *x = (const CalContactItem *)a;
+	const CalContactItem *y = (const CalContactItem *)b;
+
+	if (x->Hash != y->Hash) return x->Hash < y->Hash ? -1 : 1;
+	if (x->KeyLength != y->KeyLength) return x->KeyLength < y->KeyLength ? -1 : 1;
+
+	int c = memcmp(x->Key, y->Key, x->KeyLength);
+	if (c) return c;
+
+	if (x->Entry != y->Entry) return x->Entry < y->Entry ? -1 : 1;
+	return 0;
+}
+
+static bool SameContactKey(const CalContactItem *x, const CalContactItem *y)
+{
+	return x->Hash == y->Hash && x->KeyLength == y->KeyLength && !memcmp(x->Key, y->Key, x->KeyLength);
+}
+
+static bool ContactHasEmail(Contact *c)
+{
+	return c->Email && c->Email->Short.Value;
+}
+
+// Visits the sender of an entry, then each of its recipients
+static Contact *FirstEntryContact(CalendarEntry *e)
+{
+	return e->Sender ? e->Sender : e->Recipient;
+}
+
+static Contact *NextEntryContact(CalendarEntry *e, Contact *c)
+{
+	return (c == e->Sender) ? e->Recipient : c->NextContact;
+}
+
+/// <summary>
+/// Builds the contact index for a calendar from the emails of every
+/// sender and recipient.  Entries are numbered in list order from zero
+/// </summary>
+CalContactIndex *BuildContactIndex(Calendar *pCalendar)
+{
+	CalContactItem *items = NULL;
+	unsigned char *keys = NULL;
+	CalContactIndex *pIndex = NULL;
+	size_t itemCount = 0;
+	size_t keyBytes = 0;
+	unsigned int entryCount = 0;
+
+	// First pass: size the scratch arrays
+	for (CalendarEntry *e = pCalendar->Entry; e; e = e->NextEntry)
+	{
+		for (Contact *c = FirstEntryContact(e); c; c = NextEntryContact(e, c))
+		{
+			if (ContactHasEmail(c))
+			{
+				itemCount++;
+				keyBytes += c->Email->Short.Length;
+			}
+		}
+		entryCount++;
+	}
+
+	// The scratch allocations are released before returning
+	items = (CalContactItem *)CalMalloc((itemCount ? itemCount : 1) * sizeof(CalContactItem));
+	keys = (unsigned char *)CalMalloc(keyBytes ? keyBytes : 1);
+	if (!items || !keys)
+	{
+		goto ERROR_EXIT;
+	}
+
+	{
+		// Second pass: normalize every email and tag it with its entry
+		size_t i = 0;
+		unsigned char *k = keys;
+		unsigned int entry = 0;
+
+		for (CalendarEntry *e = pCalendar->Entry; e; e = e->NextEntry, entry++)
+		{
+			for (Contact *c = FirstEntryContact(e); c; c = NextEntryContact(e, c))
+			{
+				if (ContactHasEmail(c))
+				{
+					items[i].Key = k;
+					items[i].KeyLength = (unsigned int)NormalizeEmail(c->Email->Short.Value, c->Email->Short.Length, k);
+					items[i].Hash = CalHash64(k, items[i].KeyLength, 0);
+					items[i].Entry = entry;
+					k += items[i].KeyLength;
+					i++;
+				}
+			}
+		}
+
+		qsort(items, itemCount, sizeof(CalContactItem), CompareContactItems);
+
+		// Count distinct emails and distinct (email, entry) pairs
+		unsigned int keyCount = 0;
+		size_t postingCount = 0;
+		size_t distinctKeyBytes = 0;
+
+		for (i = 0; i < itemCount; i++)
+		{
+			if (i == 0 || !SameContactKey(&items[i], &items[i - 1]))
+			{
+				keyCount++;
+				postingCount++;
+				distinctKeyBytes += items[i].KeyLength;
+			}
+			else if (items[i].Entry != items[i - 1].Entry)
+			{
+				postingCount++;
+			}
+		}
+
+		// Keep the load factor at or below one half
+		unsigned int capacity = 1;
+		while (capacity < keyCount * 2)
+		{
+			capacity *= 2;
+		}
+
+		size_t slotsOffset = CONTACTINDEX_ALIGN(sizeof(CalContactIndex));
+		size_t postingsOffset = slotsOffset + capacity * sizeof(CalContactSlot);
+		size_t keysOffset = postingsOffset + postingCount * sizeof(unsigned int);
+		size_t size = CONTACTINDEX_ALIGN(keysOffset + distinctKeyBytes);
+
+		if (size > UINT_MAX)
+		{
+			printf("-> ERROR: contact index too large\n");
+			goto ERROR_EXIT;
+		}
+
+		pIndex = (CalContactIndex *)CalCalloc(1, size);
+		if (!pIndex)
+		{
+			goto ERROR_EXIT;
+		}
+
+		pIndex->Size = size;
+		pIndex->EntryCount = entryCount;
+		pIndex->KeyCount = keyCount;
+		pIndex->Capacity = capacity;
+		pIndex->Slots = (unsigned int)slotsOffset;
+
+		CalContactSlot *slots = CONTACTINDEX_SLOTS(pIndex);
+		unsigned int *postings = (unsigned int *)CONTACTINDEX_AT(pIndex, postingsOffset);
+		unsigned int posting = 0;
+		size_t keyOffset = keysOffset;
+		CalContactSlot *slot = NULL;
+
+		for (i = 0; i < itemCount; i++)
+		{
+			if (i == 0 || !SameContactKey(&items[i], &items[i - 1]))
+			{
+				unsigned int j = (unsigned int)items[i].Hash & (capacity - 1);
+				while (slots[j].PostingCount)
+				{
+					j = (j + 1) & (capacity - 1);
+				}
+
+				slot = &slots[j];
+				slot->Hash = items[i].Hash;
+				slot->Key = (unsigned int)keyOffset;
+				slot->KeyLength = items[i].KeyLength;
+				slot->Postings = (unsigned int)(postingsOffset + posting * sizeof(unsigned int));
+				memcpy(CONTACTINDEX_AT(pIndex, keyOffset), items[i].Key, items[i].KeyLength);
+				keyOffset += items[i].KeyLength;
+			}
+			else if (items[i].Entry == items[i - 1].Entry)
+			{
+				continue;	// Sender and recipient, or named twice
+			}
+
+			postings[posting++] = items[i].Entry;
+			slot->PostingCount++;
+		}
+	}
+
+	CalFree(items);
+	CalFree(keys);
+	return pIndex;
+
+ERROR_EXIT:
+	CalFree(items);
+	CalFree(keys);
+	return NULL;
+}
+
+void DestroyContactIndex(CalContactIndex *pIndex)
+{
+	CalFree(pIndex);
+}
+
+static bool InImage(uint64_t size, uint64_t offset, uint64_t length)
+{
+	return offset <= size && length <= size - offset;
+}
+
+/// <summary>
+/// Checks that an index of at most bytes bytes, such as one mapped from a
+/// snapshot, stays inside itself, leaves an empty slot to end every probe
+/// and names only entries below entryCount, so lookups can trust it
+/// </summary>
+bool ValidateContactIndex(const CalContactIndex *pIndex, uint64_t bytes, unsigned int entryCount)
+{
+	if (bytes < sizeof(CalContactIndex) || pIndex->Size > bytes || pIndex->EntryCount != entryCount)
+	{
+		return false;
+	}
+
+	uint64_t size = pIndex->Size;
+	if (!pIndex->Capacity || (pIndex->Capacity & (pIndex->Capacity - 1)) || pIndex->KeyCount >= pIndex->Capacity ||
+		(pIndex->Slots & 7) || !InImage(size, pIndex->Slots, (uint64_t)pIndex->Capacity * sizeof(CalContactSlot)))
+	{
+		return false;
+	}
+
+	const CalContactSlot *slots = CONTACTINDEX_SLOTS(pIndex);
+	unsigned int used = 0;
+	for (unsigned int i = 0; i < pIndex->Capacity; i++)
+	{
+		const CalContactSlot *slot = &slots[i];
+		if (!slot->PostingCount)
+		{
+			continue;
+		}
+
+		if ((slot->Postings & 3) || !InImage(size, slot->Key, slot->KeyLength) ||
+			!InImage(size, slot->Postings, (uint64_t)slot->PostingCount * sizeof(unsigned int)))
+		{
+			return false;
+		}
+
+		const unsigned int *postings = (const unsigned int *)CONTACTINDEX_AT(pIndex, slot->Postings);
+		for (unsigned int k = 0; k < slot->PostingCount; k++)
+		{
+			if (postings[k] >= entryCount)
+			{
+				return false;
+			}
+		}
+		used++;
+	}
+	return used == pIndex->KeyCount;
+}
+
+/// <summary>
+/// Compares a stored email with a normalized key without copying it
+/// </summary>
+static bool EmailMatches(CalString *email, const unsigned char *key, size_t keyLength)
+{
+	size_t len = email->Short.Length;
+	const unsigned char *p = TrimEmail(email->Short.Value, &len);
+
+	if (len != keyLength)
+	{
+		return false;
+	}
+
+	for (size_t i = 0; i < len; i++)
+	{
+		if (LowerAscii(p[i]) != key[i])
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/// <summary>
+/// Scans every entry for a normalized email; used when a calendar has no
+/// contact index
+/// </summary>
+static int ScanContactEntries(Calendar *pCalendar, const unsigned char *key, size_t keyLength, unsigned int *out, unsigned int n)
+{
+	unsigned int found = 0;
+	unsigned int entry = 0;
+
+	for (CalendarEntry *e = pCalendar->Entry; e; e = e->NextEntry, entry++)
+	{
+		for (Contact *c = FirstEntryContact(e); c; c = NextEntryContact(e, c))
+		{
+			if (ContactHasEmail(c) && EmailMatches(c->Email, key, keyLength))
+			{
+				if (found < n) out[found] = entry;
+				found++;
+				break;
+			}
+		}
+	}
+
+	return (int)found;
+}
+
+/// <summary>
+/// Finds the entries whose sender or recipients include an email, compared
+/// after normalization.  Writes up to n ascending entry indices to out and
+/// returns the total number of matching entries, or -1 on failure
+/// </summary>
+int FindContactEntries(Calendar *pCalendar, const char *email, unsigned int *out, unsigned int n)
+{
+	unsigned char buffer[CONTACTINDEX_QUERY_LENGTH];
+	unsigned char *key = buffer;
+	size_t length = strlen(email);
+	int found = 0;
+
+	if (!out)
+	{
+		n = 0;
+	}
+
+	if (length > CONTACTINDEX_QUERY_LENGTH)
+	{
+		key = (unsigned char *)CalMalloc(length);
+		if (!key)
+		{
+			return -1;
+		}
+	}
+
+	length = NormalizeEmail((const unsigned char *)email, length, key);
+
+	CalContactIndex *pIndex = pCalendar->ContactIndex;
+	if (!pIndex)
+	{
+		found = ScanContactEntries(pCalendar, key, length, out, n);
+	}
+	else
+	{
+		uint64_t hash = CalHash64(key, length, 0);
+		CalContactSlot *slots = CONTACTINDEX_SLOTS(pIndex);
+		unsigned int i = (unsigned int)hash & (pIndex->Capacity - 1);
+
+		while (slots[i].PostingCount)
+		{
+			if (slots[i].Hash == hash && slots[i].KeyLength == length && !memcmp(CONTACTINDEX_AT(pIndex, slots[i].Key), key, length))
+			{
+				unsigned int *postings = (unsigned int *)CONTACTINDEX_AT(pIndex, slots[i].Postings);
+				if (n) memcpy(out, postings, min(n, slots[i].PostingCount) * sizeof(unsigned int));
+				found = (int)slots[i].PostingCount;
+				break;
+			}
+			i = (i + 1) & (pIndex->Capacity - 1);
+		}
+	}
+
+	if (key != buffer)
+	{
+		CalFree(key);
+	}
+	return found;
+}
@@ -0,0 +1,39 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarContactIndex.h:  contains the index from contact email
+* to the entries that name it as sender or recipient
+*
+*********************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include "CalendarStructures.h"
+
+// The index is a single allocation; the slots, postings and key bytes
+// that follow the header are addressed by offsets from its start
+typedef struct _CalContactSlot
+{
+	uint64_t Hash;
+	unsigned int Key;			// Offset of the normalized email
+	unsigned int KeyLength;
+	unsigned int Postings;		// Offset of the ascending entry indices
+	unsigned int PostingCount;	// Zero for an empty slot
+} CalContactSlot;
+
+typedef struct _CalContactIndex
+{
+	size_t Size;				// Bytes in the allocation, header included
+	unsigned int EntryCount;	// Entries in the calendar when it was built
+	unsigned int KeyCount;		// Distinct emails
+	unsigned int Capacity;		// Slots; a power of two
+	unsigned int Slots;			// Offset of the slot array
+} CalContactIndex;
+
+CalContactIndex *BuildContactIndex(Calendar *pCalendar);
+void DestroyContactIndex(CalContactIndex *pIndex);
+bool ValidateContactIndex(const CalContactIndex *pIndex, uint64_t bytes, unsigned int entryCount);
+int FindContactEntries(Calendar *pCalendar, const char *email, unsigned int *out, unsigned int n);
@@ -0,0 +1,414 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarDiff.cpp:  contains the comparison of two versions of a
+* calendar.  Entries are matched through a hash table of their keys,
+* so a diff costs time linear in the number of entries
+*
+*********************************************************************/
+
+#include "stdafx.h"
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "CalendarFraming.h"
+#include "CalendarFingerprint.h"
+#include "CalendarReparse.h"
+#include "CalendarDiff.h"
+
+#define DIFF_NONE	UINT_MAX
+
+// Entries of one version taking part in a diff
+typedef struct _CalDiffSide
+{
+	CalendarEntry **Entries;
+	const unsigned int *Indices;	// Index reported for each entry; NULL for its position
+	unsigned int Count;
+} CalDiffSide;
+
+/// <summary>
+/// Matches each old key to an equal new key not matched before, in order,
+/// so repeated keys pair up first with first.  Returns the array of the
+/// new key matched by each old key (DIFF_NONE if none), or NULL if memory
+/// ran out
+/// </summary>
+static unsigned int *MatchDiffKeys(uint64_t (*oldKeys)[2], unsigned int oldCount, uint64_t (*newKeys)[2], unsigned int newCount)
+{
+	unsigned int *match = (unsigned int *)malloc((oldCount ? oldCount : 1) * sizeof(unsigned int));
+	unsigned int *next = (unsigned int *)malloc((newCount ? newCount : 1) * sizeof(unsigned int));
+	unsigned int *cursor = (unsigned int *)malloc((newCount ? newCount : 1) * sizeof(unsigned int));
+	CalFingerprintSet *pFirst = CreateFingerprintSet(newCount);
+
+	if (!match || !next || !cursor || !pFirst)
+	{
+		goto ERROR_EXIT;
+	}
+
+	// Chain the new entries with the same key in order, from the first;
+	// cursor holds the tail of each chain while it is built
+	for (unsigned int j = 0; j < newCount; j++)
+	{
+		int added = AddFingerprint(pFirst, newKeys[j], j);
+		if (added < 0)
+		{
+			goto ERROR_EXIT;
+		}
+
+		next[j] = DIFF_NONE;
+		if (added)
+		{
+			cursor[j] = j;
+		}
+		else
+		{
+			unsigned int first = (unsigned int)FindFingerprint(pFirst, newKeys[j]);
+			next[cursor[first]] = j;
+			cursor[first] = j;
+		}
+	}
+
+	// From here cursor holds, for the first of each chain, the next new
+	// entry of that key not yet matched
+	for (unsigned int j = 0; j < newCount; j++)
+	{
+		if (FindFingerprint(pFirst, newKeys[j]) == (int)j)
+		{
+			cursor[j] = j;
+		}
+	}
+
+	for (unsigned int i = 0; i < oldCount; i++)
+	{
+		int first = FindFingerprint(pFirst, oldKeys[i]);
+		match[i] = first < 0 ? DIFF_NONE : cursor[first];
+		if (match[i] != DIFF_NONE)
+		{
+			cursor[first] = next[match[i]];
+		}
+	}
+
+	free(next);
+	free(cursor);
+	DestroyFingerprintSet(pFirst);
+	return match;
+
+ERROR_EXIT:
+	free(match);
+	free(next);
+	free(cursor);
+	DestroyFingerprintSet(pFirst);
+	return NULL;
+}
+
+static void GetDiffKeys(const CalDiffSide *pSide, unsigned int key, uint64_t (*keys)[2])
+{
+	for (unsigned int i = 0; i < pSide->Count; i++)
+	{
+		if (key == CALDIFF_KEY_SENDER_START)
+		{
+			GetEntrySenderStartKey(pSide->Entries[i], keys[i]);
+		}
+		else
+		{
+			keys[i][0] = pSide->Entries[i]->Fingerprint[0];
+			keys[i][1] = pSide->Entries[i]->Fingerprint[1];
+		}
+	}
+}
+
+static void ReportDiff(CalDiffVisitor visitor, void *context, enum CalDiffKind kind,
+	const CalDiffSide *pOld, unsigned int i, const CalDiffSide *pNew, unsigned int j)
+{
+	CalDiffChange change;
+
+	change.Kind = kind;
+	change.OldEntry = (i != DIFF_NONE) ? pOld->Entries[i] : NULL;
+	change.NewEntry = (j != DIFF_NONE) ? pNew->Entries[j] : NULL;
+	change.OldIndex = (i == DIFF_NONE) ? 0 : pOld->Indices ? pOld->Indices[i] : i;
+	change.NewIndex = (j == DIFF_NONE) ? 0 : pNew->Indices ? pNew->Indices[j] : j;
+	visitor(&change, context);
+}
+
+/// <summary>
+/// Reports the differences between two sets of entries: removed and
+/// changed entries in old order, then added entries in new order.  Returns
+/// how many were reported, or -1 if memory ran out
+/// </summary>
+static int DiffEntries(const CalDiffSide *pOld, const CalDiffSide *pNew, unsigned int key, CalDiffVisitor visitor, void *context)
+{
+	int reported = -1;
+	unsigned int *match = NULL;
+	bool *matched = (bool *)calloc(pNew->Count ? pNew->Count : 1, sizeof(bool));
+	uint64_t (*oldKeys)[2] = (uint64_t (*)[2])malloc((pOld->Count ? pOld->Count : 1) * sizeof(uint64_t[2]));
+	uint64_t (*newKeys)[2] = (uint64_t (*)[2])malloc((pNew->Count ? pNew->Count : 1) * sizeof(uint64_t[2]));
+
+	if (!matched || !oldKeys || !newKeys)
+	{
+		goto EXIT;
+	}
+
+	GetDiffKeys(pOld, key, oldKeys);
+	GetDiffKeys(pNew, key, newKeys);
+
+	match = MatchDiffKeys(oldKeys, pOld->Count, newKeys, pNew->Count);
+	if (!match)
+	{
+		goto EXIT;
+	}
+
+	reported = 0;
+	for (unsigned int i = 0; i < pOld->Count; i++)
+	{
+		unsigned int j = match[i];
+		if (j == DIFF_NONE)
+		{
+			ReportDiff(visitor, context, CALDIFF_REMOVED, pOld, i, pNew, DIFF_NONE);
+			reported++;
+			continue;
+		}
+
+		matched[j] = true;
+		CalendarEntry *a = pOld->Entries[i];
+		CalendarEntry *b = pNew->Entries[j];
+		if (a->Fingerprint[0] != b->Fingerprint[0] || a->Fingerprint[1] != b->Fingerprint[1])
+		{
+			ReportDiff(visitor, context, CALDIFF_CHANGED, pOld, i, pNew, j);
+			reported++;
+		}
+	}
+
+	for (unsigned int j = 0; j < pNew->Count; j++)
+	{
+		if (!matched[j])
+		{
+			ReportDiff(visitor, context, CALDIFF_ADDED, pOld, DIFF_NONE, pNew, j);
+			reported++;
+		}
+	}
+
+EXIT:
+	free(match);
+	free(matched);
+	free(oldKeys);
+	free(newKeys);
+	return reported;
+}
+
+/// <summary>
+/// Lists the entries of a calendar in order
+/// </summary>
+static CalendarEntry **ListDiffEntries(Calendar *pCalendar, unsigned int *count)
+{
+	unsigned int n = 0;
+	for (CalendarEntry *e = pCalendar->Entry; e; e = e->NextEntry)
+	{
+		n++;
+	}
+
+	CalendarEntry **entries = (CalendarEntry **)malloc((n ? n : 1) * sizeof(CalendarEntry *));
+	if (!entries)
+	{
+		return NULL;
+	}
+
+	n = 0;
+	for (CalendarEntry *e = pCalendar->Entry; e; e = e->NextEntry)
+	{
+		entries[n++] = e;
+	}
+	*count = n;
+	return entries;
+}
+
+/// <summary>
+/// Compares two versions of a calendar and calls visitor with each entry
+/// added, removed or changed.  Entries are matched by key, a CALDIFF_KEY
+/// value; matched entries with the same fingerprint are unchanged and not
+/// reported.  Removed and changed entries come first, in the order of the
+/// old version, then added entries in the order of the new one.  Calendars
+/// parsed with different field masks are refused, since the elements one
+/// left out would show every entry as changed.  Returns how many changes
+/// were reported, or -1 on failure
+/// </summary>
+int CompareCalendars(Calendar *pOld, Calendar *pNew, unsigned int key, CalDiffVisitor visitor, void *context)
+{
+	CalDiffSide sides[2];
+	int reported = -1;
+
+	if (pOld->Fields != pNew->Fields)
+	{
+		return -1;
+	}
+
+	memset(sides, 0, sizeof(sides));
+	sides[0].Entries = ListDiffEntries(pOld, &sides[0].Count);
+	sides[1].Entries = ListDiffEntries(pNew, &sides[1].Count);
+	if (sides[0].Entries && sides[1].Entries)
+	{
+		reported = DiffEntries(&sides[0], &sides[1], key, visitor, context);
+	}
+
+	free(sides[0].Entries);
+	free(sides[1].Entries);
+	return reported;
+}
+
+/// <summary>
+/// Parses the entries of a buffered CAL file whose frames are listed in
+/// indices, in ascending order.  The frames are gathered to the front of
+/// frames first.  Returns NULL if there are none, or the parse failed
+/// (*failed set)
+/// </summary>
+static Calendar *ParseDiffEntries(unsigned char *in, int version, CalEntryFrame *frames, const unsigned int *indices, unsigned int count, bool *failed)
+{
+	*failed = false;
+
+	if (!count)
+	{
+		return NULL;
+	}
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		frames[i] = frames[indices[i]];
+	}
+
+	Calendar *pCalendar = ParseEntryFrames(version, in, frames, count, NULL);
+	*failed = !pCalendar;
+	return pCalendar;
+}
+
+/// <summary>
+/// Frames the entries of a buffered CAL file; returns NULL if the framing
+/// is invalid or memory ran out
+/// </summary>
+static CalEntryFrame *FrameDiffBuffer(unsigned char *in, size_t len, int *version, unsigned int *count)
+{
+	int n = FrameBufferEntries(in, len, version, NULL, 0);
+	if (n < 0)
+	{
+		return NULL;
+	}
+
+	CalEntryFrame *frames = (CalEntryFrame *)malloc((n ? n : 1) * sizeof(CalEntryFrame));
+	if (!frames)
+	{
+		return NULL;
+	}
+
+	FrameBufferEntries(in, len, version, frames, (unsigned int)n);
+	*count = (unsigned int)n;
+	return frames;
+}
+
+/// <summary>
+/// Compares two versions of a buffered CAL file as CompareCalendars does,
+/// reporting entry indices in NEWENTRY order.  Entries whose bytes are the
+/// same in both are unchanged and never parsed; only the rest are parsed
+/// and matched by key.  The entries passed to visitor are valid only during
+/// the call.  Returns how many changes were reported, or -1 if either
+/// buffer does not parse or memory ran out
+/// </summary>
+int CompareCalendarBuffers(unsigned char *oldIn, size_t oldLen, unsigned char *newIn, size_t newLen, unsigned int key, CalDiffVisitor visitor, void *context)
+{
+	int reported = -1;
+	int oldVersion, newVersion;
+	unsigned int oldCount = 0, newCount = 0, oldLeft = 0, newLeft = 0;
+	unsigned int *match = NULL, *oldIndices = NULL, *newIndices = NULL;
+	bool *matched = NULL;
+	Calendar *pOldRest = NULL, *pNewRest = NULL;
+	CalDiffSide sides[2];
+	bool failed;
+
+	memset(sides, 0, sizeof(sides));
+	CalEntryFrame *oldFrames = FrameDiffBuffer(oldIn, oldLen, &oldVersion, &oldCount);
+	CalEntryFrame *newFrames = FrameDiffBuffer(newIn, newLen, &newVersion, &newCount);
+	if (!oldFrames || !newFrames)
+	{
+		goto EXIT;
+	}
+
+	// Pair entries with identical bytes first; the frame hashes are laid
+	// out as keys, 128 bits apart
+	{
+		uint64_t (*oldKeys)[2] = (uint64_t (*)[2])malloc((oldCount ? oldCount : 1) * sizeof(uint64_t[2]));
+		uint64_t (*newKeys)[2] = (uint64_t (*)[2])malloc((newCount ? newCount : 1) * sizeof(uint64_t[2]));
+		if (oldKeys && newKeys)
+		{
+			for (unsigned int i = 0; i < oldCount; i++)
+			{
+				memcpy(oldKeys[i], oldFrames[i].Hash, sizeof(oldKeys[i]));
+			}
+			for (unsigned int j = 0; j < newCount; j++)
+			{
+				memcpy(newKeys[j], newFrames[j].Hash, sizeof(newKeys[j]));
+			}
+			match = MatchDiffKeys(oldKeys, oldCount, newKeys, newCount);
+		}
+		free(oldKeys);
+		free(newKeys);
+	}
+
+	matched = (bool *)calloc(newCount ? newCount : 1, sizeof(bool));
+	oldIndices = (unsigned int *)malloc((oldCount ? oldCount : 1) * sizeof(unsigned int));
+	newIndices = (unsigned int *)malloc((newCount ? newCount : 1) * sizeof(unsigned int));
+	if (!match || !matched || !oldIndices || !newIndices)
+	{
+		goto EXIT;
+	}
+
+	for (unsigned int i = 0; i < oldCount; i++)
+	{
+		if (match[i] == DIFF_NONE)
+		{
+			oldIndices[oldLeft++] = i;
+		}
+		else
+		{
+			matched[match[i]] = true;
+		}
+	}
+	for (unsigned int j = 0; j < newCount; j++)
+	{
+		if (!matched[j])
+		{
+			newIndices[newLeft++] = j;
+		}
+	}
+
+	pOldRest = ParseDiffEntries(oldIn, oldVersion, oldFrames, oldIndices, oldLeft, &failed);
+	if (failed)
+	{
+		goto EXIT;
+	}
+	pNewRest = ParseDiffEntries(newIn, newVersion, newFrames, newIndices, newLeft, &failed);
+	if (failed)
+	{
+		goto EXIT;
+	}
+
+	sides[0].Indices = oldIndices;
+	sides[1].Indices = newIndices;
+	if ((pOldRest && !(sides[0].Entries = ListDiffEntries(pOldRest, &sides[0].Count))) ||
+		(pNewRest && !(sides[1].Entries = ListDiffEntries(pNewRest, &sides[1].Count))))
+	{
+		goto EXIT;
+	}
+
+	reported = DiffEntries(&sides[0], &sides[1], key, visitor, context);
+
+EXIT:
+	free(sides[0].Entries);
+	free(sides[1].Entries);
+	DestroyCalendar(pOldRest);
+	DestroyCalendar(pNewRest);
+	free(match);
+	free(matched);
+	free(oldIndices);
+	free(newIndices);
+	free(oldFrames);
+	free(newFrames);
+	return reported;
+}
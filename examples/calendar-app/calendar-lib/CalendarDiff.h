@@ -0,0 +1,39 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarDiff.h:  contains the comparison of two versions of a
+* calendar into the entries added, removed and changed
+*
+*********************************************************************/
+
+#pragma once
+
+#include <stddef.h>
+#include "CalendarStructures.h"
+
+// Keys entries of the two versions are matched by
+#define CALDIFF_KEY_FINGERPRINT		0	// Same content; an edited entry is removed and added
+#define CALDIFF_KEY_SENDER_START	1	// Same sender email and UTC start; an edited entry is changed
+
+enum CalDiffKind
+{
+	CALDIFF_ADDED,
+	CALDIFF_REMOVED,
+	CALDIFF_CHANGED
+};
+
+typedef struct _CalDiffChange
+{
+	enum CalDiffKind Kind;
+	CalendarEntry *OldEntry;	// NULL when added
+	CalendarEntry *NewEntry;	// NULL when removed
+	unsigned int OldIndex;		// Entry index in the old version; zero when added
+	unsigned int NewIndex;		// Entry index in the new version; zero when removed
+} CalDiffChange;
+
+typedef void (*CalDiffVisitor)(const CalDiffChange *pChange, void *context);
+
+int CompareCalendars(Calendar *pOld, Calendar *pNew, unsigned int key, CalDiffVisitor visitor, void *context);
+int CompareCalendarBuffers(unsigned char *oldIn, size_t oldLen, unsigned char *newIn, size_t newLen, unsigned int key, CalDiffVisitor visitor, void *context);
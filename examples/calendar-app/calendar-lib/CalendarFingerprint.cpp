@@ -0,0 +1,352 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarFingerprint.cpp:  contains the functions that fingerprint
+* calendar entries and the hash set of fingerprints used to skip
+* entries already present when merging
+*
+*********************************************************************/
+
+#include "stdafx.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "CalendarHash.h"
+#include "CalendarTime.h"
+#include "CalendarFingerprint.h"
+
+#define FINGERPRINT_SEED		0x50524e46	// "FNRP"
+
+// Emails are case-folded this many bytes at a time on the stack
+#define FINGERPRINT_CHUNK		256
+
+// Digests of the fields, in the order they are combined
+enum FingerprintField
+{
+	FPFIELD_ENTRYTYPE,
+	FPFIELD_TIME,
+	FPFIELD_SENDER,
+	FPFIELD_RECIPIENT,
+	FPFIELD_LOCATION,
+	FPFIELD_SUBJECT,
+	FPFIELD_CONTENT,
+	FPFIELD_CONTENTTYPE,
+	FPFIELD_ATTACHMENT,
+	FPFIELD_STRUCTBLOB,
+	FPFIELD_COUNT
+};
+
+/// <summary>
+/// Folds digest d into the running digest acc, so the result depends on
+/// the order digests are combined in
+/// </summary>
+static void MixDigest(uint64_t acc[2], const uint64_t d[2])
+{
+	uint64_t pair[4] = { acc[0], acc[1], d[0], d[1] };
+	CalHash128(pair, sizeof(pair), FINGERPRINT_SEED, acc);
+}
+
+static void HashString(const CalString *s, uint64_t seed, uint64_t out[2])
+{
+	const unsigned char *p = (s->StringType == LONGSTRING) ? s->Long.Value : s->Short.Value;
+	size_t len = (s->StringType == LONGSTRING) ? s->Long.Length : s->Short.Length;
+	CalHash128(p ? p : (const unsigned char *)"", p ? len : 0, seed, out);
+}
+
+/// <summary>
+/// Hashes an email with surrounding whitespace removed and ASCII letters
+/// lowercased, as the contact index compares them
+/// </summary>
+static void HashEmail(const CalString *s, uint64_t out[2])
+{
+	unsigned char chunk[FINGERPRINT_CHUNK];
+	const unsigned char *p = s ? s->Short.Value : NULL;
+	size_t len = p ? s->Short.Length : 0;
+
+	while (len && isspace(p[0]))
+	{
+		p++;
+		len--;
+	}
+	while (len && isspace(p[len - 1]))
+	{
+		len--;
+	}
+
+	out[0] = FINGERPRINT_SEED;
+	out[1] = len;
+	do
+	{
+		size_t n = len < FINGERPRINT_CHUNK ? len : FINGERPRINT_CHUNK;
+		uint64_t d[2];
+
+		for (size_t i = 0; i < n; i++)
+		{
+			unsigned char c = p[i];
+			chunk[i] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+		}
+
+		CalHash128(chunk, n, SENDER, d);
+		MixDigest(out, d);
+		p += n;
+		len -= n;
+	} while (len);
+}
+
+/// <summary>
+/// Hashes when an entry takes place.  Resolved entries are compared by their
+/// UTC interval, so the same meeting given in two time zones matches; the
+/// zone name is included only when it could not be resolved
+/// </summary>
+static void HashEntryTime(const CalendarEntry *e, uint64_t out[2])
+{
+	int64_t t[4] = { 0, 0, (int64_t)(e->TimeFlags & (CALTIME_HAS_START | CALTIME_HAS_END | CALTIME_ZONE_KNOWN)), 0 };
+
+	if (e->TimeFlags & CALTIME_HAS_START)
+	{
+		t[0] = e->UtcStart;
+	}
+	if (e->TimeFlags & CALTIME_HAS_END)
+	{
+		t[1] = e->UtcEnd;
+	}
+
+	CalHash128(t, sizeof(t), STARTTIME, out);
+	if (!(e->TimeFlags & CALTIME_ZONE_KNOWN) && e->TimeZone)
+	{
+		uint64_t d[2];
+		HashString(e->TimeZone, TIMEZONE, d);
+		MixDigest(out, d);
+	}
+}
+
+/// <summary>
+/// Computes the fingerprint of an entry: a CalHash128 over its type, UTC
+/// times, sender and recipient emails, Location, Subject, Content,
+/// ContentType, attachments and structured blob.  Contact names are not
+/// included and recipients are taken in any order, so feeds that describe
+/// the same meeting differently in those respects still match.  Elements
+/// not materialized, as when fields are projected, are hashed as absent
+/// </summary>
+void FingerprintEntry(CalendarEntry *pEntry)
+{
+	uint64_t fields[FPFIELD_COUNT][2];
+	uint64_t d[2];
+
+	memset(fields, 0, sizeof(fields));
+
+	int64_t type = pEntry->EntryType;
+	CalHash128(&type, sizeof(type), ENTRYTYPE, fields[FPFIELD_ENTRYTYPE]);
+	HashEntryTime(pEntry, fields[FPFIELD_TIME]);
+
+	if (pEntry->Sender)
+	{
+		HashEmail(pEntry->Sender->Email, fields[FPFIELD_SENDER]);
+	}
+
+	// Summed, so the order recipients are listed in does not matter
+	for (Contact *c = pEntry->Recipient; c; c = c->NextContact)
+	{
+		HashEmail(c->Email, d);
+		fields[FPFIELD_RECIPIENT][0] += d[0];
+		fields[FPFIELD_RECIPIENT][1] += d[1];
+	}
+
+	if (pEntry->Location)
+	{
+		HashString(pEntry->Location, LOCATION, fields[FPFIELD_LOCATION]);
+	}
+	if (pEntry->Subject)
+	{
+		HashString(pEntry->Subject, SUBJECT, fields[FPFIELD_SUBJECT]);
+	}
+	if (pEntry->Content)
+	{
+		HashString(pEntry->Content, CONTENT, fields[FPFIELD_CONTENT]);
+	}
+	if (pEntry->ContentType)
+	{
+		HashString(pEntry->ContentType, CONTENTTYPE, fields[FPFIELD_CONTENTTYPE]);
+	}
+
+	if (pEntry->Attachments && pEntry->Attachments->Attachment)
+	{
+		fields[FPFIELD_ATTACHMENT][1] = (uint64_t)pEntry->Attachments->Count;
+		for (int i = 0; i < pEntry->Attachments->Count; i++)
+		{
+			const Attachment *a = &pEntry->Attachments->Attachment[i];
+			if (a->Name)
+			{
+				HashString(a->Name, ATTACHMENT, d);
+				MixDigest(fields[FPFIELD_ATTACHMENT], d);
+			}
+			if (a->Blob && a->Blob->Data)
+			{
+				CalHash128(a->Blob->Data, a->Blob->Length, ATTACHMENT, d);
+				MixDigest(fields[FPFIELD_ATTACHMENT], d);
+			}
+		}
+	}
+
+	if (pEntry->StructuredBlob && pEntry->StructuredBlob->Data)
+	{
+		CalHash128(pEntry->StructuredBlob->Data, pEntry->StructuredBlob->TotalLength, STRUCTBLOB, fields[FPFIELD_STRUCTBLOB]);
+	}
+
+	CalHash128(fields, sizeof(fields), FINGERPRINT_SEED, pEntry->Fingerprint);
+}
+
+/// <summary>
+/// Computes the key that identifies an entry across edits to its content:
+/// its sender email, compared as in the fingerprint, and its UTC start
+/// </summary>
+void GetEntrySenderStartKey(const CalendarEntry *pEntry, uint64_t key[2])
+{
+	uint64_t d[2];
+	int64_t start = (pEntry->TimeFlags & CALTIME_HAS_START) ? pEntry->UtcStart : 0;
+
+	HashEmail(pEntry->Sender ? pEntry->Sender->Email : NULL, key);
+	CalHash128(&start, sizeof(start), STARTTIME, d);
+	MixDigest(key, d);
+}
+
+/// <summary>
+/// Fingerprints every entry of a calendar whose times have been resolved
+/// </summary>
+void FingerprintCalendar(Calendar *pCalendar)
+{
+	for (CalendarEntry *e = pCalendar->Entry; e; e = e->NextEntry)
+	{
+		FingerprintEntry(e);
+	}
+}
+
+//////////////////////////////////////////
+//
+// Fingerprint set
+//
+//////////////////////////////////////////
+
+static unsigned int FingerprintSetCapacity(unsigned int expected)
+{
+	// Keep the load factor at or below one half
+	unsigned int capacity = 16;
+	while (capacity < 0x80000000U && capacity / 2 < expected)
+	{
+		capacity *= 2;
+	}
+	return capacity;
+}
+
+/// <summary>
+/// Creates an empty set sized for expected fingerprints; it grows past them
+/// </summary>
+CalFingerprintSet *CreateFingerprintSet(unsigned int expected)
+{
+	// calloc rather than CalMalloc: a set is a temporary that outlives no arena
+	CalFingerprintSet *pSet = (CalFingerprintSet *)calloc(1, sizeof(CalFingerprintSet));
+	if (!pSet)
+	{
+		return NULL;
+	}
+
+	pSet->Capacity = FingerprintSetCapacity(expected);
+	pSet->Slots = (CalFingerprintSlot *)calloc(pSet->Capacity, sizeof(CalFingerprintSlot));
+	if (!pSet->Slots)
+	{
+		free(pSet);
+		return NULL;
+	}
+	return pSet;
+}
+
+static CalFingerprintSlot *FindFingerprintSlot(CalFingerprintSet *pSet, const uint64_t fingerprint[2])
+{
+	unsigned int mask = pSet->Capacity - 1;
+	unsigned int i = (unsigned int)fingerprint[0] & mask;
+
+	while (pSet->Slots[i].Value &&
+		(pSet->Slots[i].Fingerprint[0] != fingerprint[0] || pSet->Slots[i].Fingerprint[1] != fingerprint[1]))
+	{
+		i = (i + 1) & mask;
+	}
+	return &pSet->Slots[i];
+}
+
+static bool GrowFingerprintSet(CalFingerprintSet *pSet)
+{
+	CalFingerprintSet grown = *pSet;
+
+	if (pSet->Capacity >= 0x80000000U)
+	{
+		return false;
+	}
+
+	// From the heap like the set itself, whatever arena is installed
+	grown.Capacity = pSet->Capacity * 2;
+	grown.Slots = (CalFingerprintSlot *)calloc(grown.Capacity, sizeof(CalFingerprintSlot));
+	if (!grown.Slots)
+	{
+		return false;
+	}
+
+	for (unsigned int i = 0; i < pSet->Capacity; i++)
+	{
+		if (pSet->Slots[i].Value)
+		{
+			*FindFingerprintSlot(&grown, pSet->Slots[i].Fingerprint) = pSet->Slots[i];
+		}
+	}
+
+	free(pSet->Slots);
+	*pSet = grown;
+	return true;
+}
+
+/// <summary>
+/// Adds a fingerprint with a value (below INT_MAX) to return from
+/// FindFingerprint.  Returns 1 if it was added, 0 if it was already in the
+/// set, which keeps its first value, or -1 if the set could not grow
+/// </summary>
+int AddFingerprint(CalFingerprintSet *pSet, const uint64_t fingerprint[2], unsigned int value)
+{
+	CalFingerprintSlot *slot = FindFingerprintSlot(pSet, fingerprint);
+	if (slot->Value)
+	{
+		return 0;
+	}
+
+	if ((pSet->Count + 1) * 2 > pSet->Capacity)
+	{
+		if (!GrowFingerprintSet(pSet))
+		{
+			return -1;
+		}
+		slot = FindFingerprintSlot(pSet, fingerprint);
+	}
+
+	slot->Fingerprint[0] = fingerprint[0];
+	slot->Fingerprint[1] = fingerprint[1];
+	slot->Value = value + 1;
+	pSet->Count++;
+	return 1;
+}
+
+/// <summary>
+/// Returns the value a fingerprint was added with, or -1 if it is not in
+/// the set
+/// </summary>
+int FindFingerprint(CalFingerprintSet *pSet, const uint64_t fingerprint[2])
+{
+	CalFingerprintSlot *slot = FindFingerprintSlot(pSet, fingerprint);
+	return slot->Value ? (int)(slot->Value - 1) : -1;
+}
+
+void DestroyFingerprintSet(CalFingerprintSet *pSet)
+{
+	if (!pSet) return;
+	free(pSet->Slots);
+	free(pSet);
+}
@@ -0,0 +1,37 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarFingerprint.h:  contains the 128-bit fingerprints that
+* identify calendar entries by content, and the hash set used to
+* find entries whose fingerprint was seen before
+*
+*********************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include "CalendarStructures.h"
+
+typedef struct _CalFingerprintSlot
+{
+	uint64_t Fingerprint[2];
+	unsigned int Value;			// Caller's value plus one; zero for an empty slot
+} CalFingerprintSlot;
+
+typedef struct _CalFingerprintSet
+{
+	unsigned int Capacity;		// Slots; a power of two
+	unsigned int Count;
+	CalFingerprintSlot *Slots;
+} CalFingerprintSet;
+
+void FingerprintEntry(CalendarEntry *pEntry);
+void FingerprintCalendar(Calendar *pCalendar);
+void GetEntrySenderStartKey(const CalendarEntry *pEntry, uint64_t key[2]);
+
+CalFingerprintSet *CreateFingerprintSet(unsigned int expected);
+int AddFingerprint(CalFingerprintSet *pSet, const uint64_t fingerprint[2], unsigned int value);
+int FindFingerprint(CalFingerprintSet *pSet, const uint64_t fingerprint[2]);
+void DestroyFingerprintSet(CalFingerprintSet *pSet);
@@ -0,0 +1,579 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarFraming.cpp:  contains routines that walk the framing of a
+* buffered CAL file without materializing a Calendar
+*
+*********************************************************************/
+
+#include "stdafx.h"
+#include "CalendarParser.h"
+#include "CalendarBuffer.h"
+#include "CalendarArena.h"
+#include "CalendarStructures.h"
+#include "CalendarScan.h"
+#include "CalendarHash.h"
+#include "CalendarFraming.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+//////////////////////////////////////////
+//
+// Sizing pass
+//
+// These mirror, element by element, every allocation ParseInput makes while
+// parsing a well-formed file.  Any allocation added to the parser must be
+// accounted for here as well, or ParseCalendarInto will run out of memory.
+//
+//////////////////////////////////////////
+
+static bool AddAllocation(size_t *total, size_t len)
+{
+	size_t aligned = ARENA_ALIGN(len);
+	if (aligned < len || *total > SIZE_MAX - aligned)
+	{
+		return false;
+	}
+	*total += aligned;
+	return true;
+}
+
+/// <summary>
+/// Accounts for the CalString (and value, if not inline) of a string element
+/// </summary>
+static bool SizeCalString(Buffer *pBuffer, CalStringType type, size_t *total)
+{
+	size_t len;
+	if (type == SHORTSTRING)
+	{
+		if (BUFFER_LEFTOVER(pBuffer) < sizeof(uint16_t))
+		{
+			return false;
+		}
+		len = BUFFER_GETUSHORT(pBuffer);
+		BUFFER_ADVANCE(pBuffer, sizeof(uint16_t));
+	}
+	else
+	{
+		if (BUFFER_LEFTOVER(pBuffer) < sizeof(uint32_t))
+		{
+			return false;
+		}
+		len = BUFFER_GETUINT(pBuffer);
+		BUFFER_ADVANCE(pBuffer, sizeof(uint32_t));
+		if (len == UINT_MAX)
+		{
+			return false;
+		}
+	}
+
+	if (BUFFER_LEFTOVER(pBuffer) < len)
+	{
+		return false;
+	}
+	BUFFER_ADVANCE(pBuffer, len);
+
+	if (len > CALSTRING_INLINE_LENGTH && !AddAllocation(total, len + 1))
+	{
+		return false;
+	}
+	return AddAllocation(total, sizeof(CalString));
+}
+
+static bool SizeContact(Buffer *pBuffer, size_t *total)
+{
+	uint32_t len = BUFFER_GETUINT(pBuffer);
+	BUFFER_ADVANCE(pBuffer, sizeof(len));
+	if (BUFFER_LEFTOVER(pBuffer) < len)
+	{
+		return false;
+	}
+
+	bool hasName = false, hasEmail = false;
+	while (len >= 3)
+	{
+		char contactElementType = BUFFER_GETCHAR(pBuffer);
+		BUFFER_ADVANCE(pBuffer, 1);
+		len -= 1;
+		unsigned char *currbuf = BUFFER_GETCURRENT(pBuffer);
+
+		if (contactElementType == CONTACTNAME || contactElementType == CONTACTEMAIL)
+		{
+			bool *seen = contactElementType == CONTACTNAME ? &hasName : &hasEmail;
+			if (*seen || !SizeCalString(pBuffer, SHORTSTRING, total))
+			{
+				return false;
+			}
+			*seen = true;
+		}
+		else
+		{
+			if (BUFFER_LEFTOVER(pBuffer) < sizeof(uint32_t))
+			{
+				return false;
+			}
+			uint32_t elen = BUFFER_GETUINT(pBuffer);
+			BUFFER_ADVANCE(pBuffer, sizeof(elen));
+			if (BUFFER_LEFTOVER(pBuffer) < elen)
+			{
+				return false;
+			}
+			BUFFER_ADVANCE(pBuffer, elen);
+		}
+
+		ptrdiff_t diff = BUFFER_GETCURRENT(pBuffer) - currbuf;
+		if ((uint32_t)diff > len)
+		{
+			return false;
+		}
+		len -= (uint32_t)diff;
+	}
+
+	return hasName && hasEmail && AddAllocation(total, sizeof(Contact));
+}
+
+static bool SizeTriple(Buffer *pBuffer, size_t size, size_t *total)
+{
+	uint32_t len = BUFFER_GETUINT(pBuffer);
+	BUFFER_ADVANCE(pBuffer, sizeof(len));
+	if (BUFFER_LEFTOVER(pBuffer) < len || len != 3 * sizeof(unsigned int))
+	{
+		return false;
+	}
+	BUFFER_ADVANCE(pBuffer, len);
+	return AddAllocation(total, size);
+}
+
+static bool SizeAttachments(Buffer *pBuffer, size_t *total)
+{
+	uint32_t attachmentCount = BUFFER_GETUINT(pBuffer);
+	BUFFER_ADVANCE(pBuffer, sizeof(attachmentCount));
+	if (attachmentCount > UINT_MAX / sizeof(Attachment))
+	{
+		return false;
+	}
+
+	if (!AddAllocation(total, sizeof(Attachments)) ||
+		!AddAllocation(total, attachmentCount * sizeof(Attachment)))
+	{
+		return false;
+	}
+
+	for (uint32_t i = 0; i < attachmentCount; i++)
+	{
+		if (!SizeCalString(pBuffer, SHORTSTRING, total))
+		{
+			return false;
+		}
+
+		if (BUFFER_LEFTOVER(pBuffer) < 4)
+		{
+			return false;
+		}
+		uint32_t len = BUFFER_GETUINT(pBuffer);
+		BUFFER_ADVANCE(pBuffer, sizeof(len));
+		if (BUFFER_LEFTOVER(pBuffer) < len)
+		{
+			return false;
+		}
+		BUFFER_ADVANCE(pBuffer, len);
+
+		if (!AddAllocation(total, sizeof(Blob)) || !AddAllocation(total, len))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool SizeStructuredBlob(Buffer *pBuffer, size_t *total)
+{
+	uint32_t totlen = BUFFER_GETUINT(pBuffer);
+	BUFFER_ADVANCE(pBuffer, sizeof(totlen));
+	if (BUFFER_LEFTOVER(pBuffer) < totlen || totlen < 4)
+	{
+		return false;
+	}
+
+	uint32_t elementLength = BUFFER_GETUINT(pBuffer);
+	if (!elementLength || totlen - 4 < elementLength)
+	{
+		return false;
+	}
+	uint32_t elementCount = (totlen - 4) / elementLength;
+	BUFFER_ADVANCE(pBuffer, totlen);
+
+	return AddAllocation(total, sizeof(StructuredBlob)) &&
+		AddAllocation(total, (size_t)elementCount * elementLength);
+}
+
+static bool SkipFramedElement(Buffer *pBuffer)
+{
+	uint32_t len = BUFFER_GETUINT(pBuffer);
+	BUFFER_ADVANCE(pBuffer, sizeof(len));
+	if (BUFFER_LEFTOVER(pBuffer) < len)
+	{
+		return false;
+	}
+	BUFFER_ADVANCE(pBuffer, len);
+	return true;
+}
+
+/// <summary>
+/// Computes the exact number of bytes (including the arena block header
+/// and the arena kept after it) ParseCalendarInto needs to parse the
+/// buffer.  Returns S_FALSE if the framing is invalid; such a buffer would
+/// also be rejected by the parser
+/// </summary>
+HRESULT ComputeCalendarSize(unsigned char *in, size_t len, size_t *bytes)
+{
+	Buffer buffer;
+	Buffer *pBuffer = &buffer;
+	InitBuffer(pBuffer, in, len);
+
+	size_t total = ARENA_BLOCK_HEADER + ARENA_ALIGN(sizeof(CalArena));
+	size_t entryCount = 0;
+	bool hasEntry = false;
+	bool ok = true;
+
+	while (ok && BUFFER_LEFTOVER(pBuffer) >= 5)
+	{
+		char elementType = BUFFER_GETCHAR(pBuffer);
+		BUFFER_ADVANCE(pBuffer, 1);
+
+		switch (elementType)
+		{
+		case VERSION:
+		case ENTRYCOUNT:
+		case ENTRYTYPE:
+			ok = BUFFER_GETUINT(pBuffer) == 4 && BUFFER_LEFTOVER(pBuffer) >= 8;
+			if (ok)
+			{
+				BUFFER_ADVANCE(pBuffer, 8);
+			}
+			break;
+
+		case NEWENTRY:
+			if (!hasEntry)
+			{
+				ok = AddAllocation(&total, sizeof(Calendar));
+				hasEntry = true;
+			}
+			ok = ok && AddAllocation(&total, sizeof(CalendarEntry)) && SkipFramedElement(pBuffer);
+			entryCount++;
+			break;
+
+		case SENDER:
+		case RECIPIENT:
+			ok = SizeContact(pBuffer, &total);
+			break;
+
+		case LOCATION:
+		case SUBJECT:
+		case CONTENT:
+		case CONTENTTYPE:
+			ok = SizeCalString(pBuffer, LONGSTRING, &total);
+			break;
+
+		case TIMEZONE:
+			ok = SizeCalString(pBuffer, SHORTSTRING, &total);
+			break;
+
+		case STARTTIME:
+		case DURATION:
+			ok = SizeTriple(pBuffer, sizeof(CalTime), &total);
+			break;
+
+		case STARTDATE:
+			ok = SizeTriple(pBuffer, sizeof(CalDate), &total);
+			break;
+
+		case ATTACHMENT:
+			ok = SizeAttachments(pBuffer, &total);
+			break;
+
+		case STRUCTBLOB:
+			ok = SizeStructuredBlob(pBuffer, &total);
+			break;
+
+		case END:
+			// The entry table is allocated once the entries are known
+			if (!hasEntry || entryCount > SIZE_MAX / sizeof(CalendarEntry *) ||
+				!AddAllocation(&total, entryCount * sizeof(CalendarEntry *)))
+			{
+				return S_FALSE;
+			}
+			*bytes = total;
+			return S_OK;
+
+		default:
+			ok = SkipFramedElement(pBuffer);
+			break;
+		}
+	}
+
+	// Either the framing is broken or there is no END element
+	return S_FALSE;
+}
+
+//////////////////////////////////////////
+//
+// Scanning pass
+//
+// Searches the string payloads in place, skipping every other element with
+// the sizing routines above.
+//
+//////////////////////////////////////////
+
+/// <summary>
+/// Scans the value of a string element for the needles and moves past it
+/// </summary>
+static bool ScanStringElement(Buffer *pBuffer, CalStringType type, const CalNeedleSet *pSet, bool *hit)
+{
+	size_t len;
+	if (type == SHORTSTRING)
+	{
+		if (BUFFER_LEFTOVER(pBuffer) < sizeof(uint16_t))
+		{
+			return false;
+		}
+		len = BUFFER_GETUSHORT(pBuffer);
+		BUFFER_ADVANCE(pBuffer, sizeof(uint16_t));
+	}
+	else
+	{
+		if (BUFFER_LEFTOVER(pBuffer) < sizeof(uint32_t))
+		{
+			return false;
+		}
+		len = BUFFER_GETUINT(pBuffer);
+		BUFFER_ADVANCE(pBuffer, sizeof(uint32_t));
+		if (len == UINT_MAX)
+		{
+			return false;
+		}
+	}
+
+	if (BUFFER_LEFTOVER(pBuffer) < len)
+	{
+		return false;
+	}
+
+	*hit = ContainsAnyNeedle(pSet, BUFFER_GETCURRENT(pBuffer), len);
+	BUFFER_ADVANCE(pBuffer, len);
+	return true;
+}
+
+/// <summary>
+/// Finds the entries of a buffered CAL file with a needle in any of the
+/// string elements in fields, without parsing it.  Entries are numbered
+/// by their NEWENTRY elements from zero, which is list order for a parse
+/// without filters.  Writes up to n ascending entry indices to out and
+/// returns how many entries match, or -1 if the framing is invalid
+/// </summary>
+int ScanBufferForNeedles(unsigned char *in, size_t len, const CalNeedleSet *pSet, unsigned int fields, unsigned int *out, unsigned int n)
+{
+	Buffer buffer;
+	Buffer *pBuffer = &buffer;
+	InitBuffer(pBuffer, in, len);
+
+	size_t scratch = 0;			// The sizing routines need somewhere to count
+	int64_t entry = -1;
+	bool matched = false;
+	int found = 0;
+	bool ok = true;
+
+	while (ok && BUFFER_LEFTOVER(pBuffer) >= 5)
+	{
+		char elementType = BUFFER_GETCHAR(pBuffer);
+		BUFFER_ADVANCE(pBuffer, 1);
+		scratch = 0;
+
+		if ((unsigned char)elementType < 32 && (CALSCAN_FIELDS & fields & CALFIELD(elementType)))
+		{
+			bool hit = false;
+			ok = ScanStringElement(pBuffer, elementType == TIMEZONE ? SHORTSTRING : LONGSTRING, pSet, &hit);
+			if (ok && hit && entry >= 0 && !matched)
+			{
+				if ((unsigned int)found < n) out[found] = (unsigned int)entry;
+				if (found < INT_MAX) found++;
+				matched = true;
+			}
+			continue;
+		}
+
+		switch (elementType)
+		{
+		case VERSION:
+		case ENTRYCOUNT:
+		case ENTRYTYPE:
+			ok = BUFFER_GETUINT(pBuffer) == 4 && BUFFER_LEFTOVER(pBuffer) >= 8;
+			if (ok)
+			{
+				BUFFER_ADVANCE(pBuffer, 8);
+			}
+			break;
+
+		case NEWENTRY:
+			entry++;
+			matched = false;
+			ok = entry < UINT_MAX && SkipFramedElement(pBuffer);
+			break;
+
+		case SENDER:
+		case RECIPIENT:
+			ok = SizeContact(pBuffer, &scratch);
+			break;
+
+		case LOCATION:
+		case SUBJECT:
+		case CONTENT:
+		case CONTENTTYPE:
+			ok = SizeCalString(pBuffer, LONGSTRING, &scratch);
+			break;
+
+		case TIMEZONE:
+			ok = SizeCalString(pBuffer, SHORTSTRING, &scratch);
+			break;
+
+		case STARTTIME:
+		case DURATION:
+		case STARTDATE:
+			ok = SizeTriple(pBuffer, 0, &scratch);
+			break;
+
+		case ATTACHMENT:
+			ok = SizeAttachments(pBuffer, &scratch);
+			break;
+
+		case STRUCTBLOB:
+			ok = SizeStructuredBlob(pBuffer, &scratch);
+			break;
+
+		case END:
+			return found;
+
+		default:
+			ok = SkipFramedElement(pBuffer);
+			break;
+		}
+	}
+
+	// Either the framing is broken or there is no END element
+	return -1;
+}
+
+//////////////////////////////////////////
+//
+// Entry framing pass
+//
+// Finds the bytes each entry takes, skipping elements with the sizing
+// routines above, so entries can be compared or parsed on their own.
+//
+//////////////////////////////////////////
+
+static void CloseEntryFrame(unsigned char *in, int64_t entry, size_t end, CalEntryFrame *out, unsigned int n)
+{
+	if (entry >= 0 && entry < (int64_t)n)
+	{
+		CalEntryFrame *f = &out[entry];
+		f->Length = end - f->Offset;
+		CalHash128(in + f->Offset, f->Length, 0, f->Hash);
+	}
+}
+
+/// <summary>
+/// Finds the bytes of every entry of a buffered CAL file, without parsing
+/// it, and stores the VERSION value in *version.  Writes the frames of the
+/// first n entries to out and returns how many entries there are, or -1 if
+/// the framing is invalid
+/// </summary>
+int FrameBufferEntries(unsigned char *in, size_t len, int *version, CalEntryFrame *out, unsigned int n)
+{
+	Buffer buffer;
+	Buffer *pBuffer = &buffer;
+	InitBuffer(pBuffer, in, len);
+
+	size_t scratch = 0;			// The sizing routines need somewhere to count
+	int64_t entry = -1;
+	bool ok = true;
+
+	*version = 0;
+	while (ok && BUFFER_LEFTOVER(pBuffer) >= 5)
+	{
+		size_t offset = (size_t)(BUFFER_GETCURRENT(pBuffer) - in);
+		char elementType = BUFFER_GETCHAR(pBuffer);
+		BUFFER_ADVANCE(pBuffer, 1);
+		scratch = 0;
+
+		switch (elementType)
+		{
+		case VERSION:
+		case ENTRYCOUNT:
+		case ENTRYTYPE:
+			ok = BUFFER_GETUINT(pBuffer) == 4 && BUFFER_LEFTOVER(pBuffer) >= 8;
+			if (ok)
+			{
+				if (elementType == VERSION)
+				{
+					*version = *(int32_t *)(BUFFER_GETCURRENT(pBuffer) + 4);
+				}
+				BUFFER_ADVANCE(pBuffer, 8);
+			}
+			break;
+
+		case NEWENTRY:
+			CloseEntryFrame(in, entry, offset, out, n);
+			entry++;
+			if (entry < (int64_t)n)
+			{
+				out[entry].Offset = offset;
+			}
+			ok = entry < INT_MAX && SkipFramedElement(pBuffer);
+			break;
+
+		case SENDER:
+		case RECIPIENT:
+			ok = SizeContact(pBuffer, &scratch);
+			break;
+
+		case LOCATION:
+		case SUBJECT:
+		case CONTENT:
+		case CONTENTTYPE:
+			ok = SizeCalString(pBuffer, LONGSTRING, &scratch);
+			break;
+
+		case TIMEZONE:
+			ok = SizeCalString(pBuffer, SHORTSTRING, &scratch);
+			break;
+
+		case STARTTIME:
+		case DURATION:
+		case STARTDATE:
+			ok = SizeTriple(pBuffer, 0, &scratch);
+			break;
+
+		case ATTACHMENT:
+			ok = SizeAttachments(pBuffer, &scratch);
+			break;
+
+		case STRUCTBLOB:
+			ok = SizeStructuredBlob(pBuffer, &scratch);
+			break;
+
+		case END:
+			CloseEntryFrame(in, entry, offset, out, n);
+			return (int)(entry + 1);
+
+		default:
+			ok = SkipFramedElement(pBuffer);
+			break;
+		}
+	}
+
+	// Either the framing is broken or there is no END element
+	return -1;
+}
@@ -0,0 +1,27 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarFraming.h:  contains routines that walk the framing of a
+* buffered CAL file without materializing a Calendar
+*
+*********************************************************************/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The bytes of one entry in a buffered CAL file: its NEWENTRY element and
+// every element up to the next NEWENTRY or the END element
+typedef struct _CalEntryFrame
+{
+	size_t Offset;
+	size_t Length;
+	uint64_t Hash[2];		// CalHash128 of the bytes
+} CalEntryFrame;
+
+HRESULT ComputeCalendarSize(unsigned char *in, size_t len, size_t *bytes);
+int ScanBufferForNeedles(unsigned char *in, size_t len, const struct _CalNeedleSet *pSet, unsigned int fields, unsigned int *out, unsigned int n);
+int FrameBufferEntries(unsigned char *in, size_t len, int *version, CalEntryFrame *out, unsigned int n);
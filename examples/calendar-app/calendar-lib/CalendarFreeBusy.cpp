@@ -0,0 +1,387 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarFreeBusy.cpp:  contains the rasterization of calendars into
+* fixed-resolution free/busy bitmaps, the vector kernels that combine
+* them, and the search for a free run of slots
+*
+*********************************************************************/
+
+#include "stdafx.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "CalendarArena.h"
+#include "CalendarTime.h"
+#include "CalendarIntervalIndex.h"
+#include "CalendarFreeBusy.h"
+
+// The combining kernel is picked when the library is compiled; build with
+// /arch:AVX2 (or -mavx2) to get the 256-bit version on x64
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define FREEBUSY_AVX2
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define FREEBUSY_NEON
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FREEBUSY_SSE2
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#define FREEBUSY_WORD_BITS	64
+#define FREEBUSY_WORD_BLOCK	4		// Words per 256-bit block
+#define FREEBUSY_MAX_SLOTS	(1U << 26)
+
+/// <summary>
+/// Returns the index of the lowest set bit of a nonzero word
+/// </summary>
+static unsigned int LowestSetBit(uint64_t x)
+{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+	unsigned long i;
+	_BitScanForward64(&i, x);
+	return (unsigned int)i;
+#elif defined(__GNUC__) || defined(__clang__)
+	return (unsigned int)__builtin_ctzll(x);
+#else
+	unsigned int i = 0;
+	while (!(x & 1))
+	{
+		x >>= 1;
+		i++;
+	}
+	return i;
+#endif
+}
+
+// Sets the padding bits past the last slot so they never read as free
+static void MarkFreeBusyPadding(CalFreeBusy *pMap)
+{
+	unsigned int used = pMap->SlotCount / FREEBUSY_WORD_BITS;
+	unsigned int bits = pMap->SlotCount % FREEBUSY_WORD_BITS;
+
+	if (bits)
+	{
+		pMap->Bits[used++] |= ~0ULL << bits;
+	}
+	for (unsigned int i = used; i < pMap->WordCount; i++)
+	{
+		pMap->Bits[i] = ~0ULL;
+	}
+}
+
+/// <summary>
+/// Creates an all-free bitmap of the whole slots of slotSeconds that fit
+/// in [start, end).  Returns NULL if the window holds no slot or too many
+/// </summary>
+CalFreeBusy *CreateFreeBusy(int64_t start, int64_t end, unsigned int slotSeconds)
+{
+	if (!slotSeconds || end <= start)
+	{
+		return NULL;
+	}
+
+	uint64_t slots = ((uint64_t)end - (uint64_t)start) / slotSeconds;
+	if (!slots || slots > FREEBUSY_MAX_SLOTS)
+	{
+		printf("-> ERROR: free/busy window must hold between 1 and %u slots\n", FREEBUSY_MAX_SLOTS);
+		return NULL;
+	}
+
+	unsigned int words = (unsigned int)((slots + FREEBUSY_WORD_BITS - 1) / FREEBUSY_WORD_BITS);
+	words = (words + FREEBUSY_WORD_BLOCK - 1) & ~(FREEBUSY_WORD_BLOCK - 1);
+
+	size_t bitsOffset = (sizeof(CalFreeBusy) + 31) & ~(size_t)31;
+	CalFreeBusy *pMap = (CalFreeBusy *)CalMalloc(bitsOffset + (size_t)words * sizeof(uint64_t));
+	if (!pMap)
+	{
+		return NULL;
+	}
+
+	pMap->Start = start;
+	pMap->SlotSeconds = slotSeconds;
+	pMap->SlotCount = (unsigned int)slots;
+	pMap->End = start + (int64_t)(slots * slotSeconds);
+	pMap->WordCount = words;
+	pMap->Bits = (uint64_t *)((unsigned char *)pMap + bitsOffset);
+
+	ClearFreeBusy(pMap);
+	return pMap;
+}
+
+void DestroyFreeBusy(CalFreeBusy *pMap)
+{
+	CalFree(pMap);
+}
+
+/// <summary>
+/// Marks every slot of a bitmap free
+/// </summary>
+void ClearFreeBusy(CalFreeBusy *pMap)
+{
+	memset(pMap->Bits, 0, (size_t)pMap->WordCount * sizeof(uint64_t));
+	MarkFreeBusyPadding(pMap);
+}
+
+/// <summary>
+/// Sets bits [first, last) of a bitmap
+/// </summary>
+static void SetBitRange(uint64_t *bits, unsigned int first, unsigned int last)
+{
+	unsigned int w0 = first / FREEBUSY_WORD_BITS;
+	unsigned int w1 = (last - 1) / FREEBUSY_WORD_BITS;
+	uint64_t m0 = ~0ULL << (first % FREEBUSY_WORD_BITS);
+	uint64_t m1 = ~0ULL >> (FREEBUSY_WORD_BITS - 1 - (last - 1) % FREEBUSY_WORD_BITS);
+
+	if (w0 == w1)
+	{
+		bits[w0] |= m0 & m1;
+		return;
+	}
+
+	bits[w0] |= m0;
+	for (unsigned int w = w0 + 1; w < w1; w++)
+	{
+		bits[w] = ~0ULL;
+	}
+	bits[w1] |= m1;
+}
+
+/// <summary>
+/// Marks the slots [start, end) touches busy, after clipping it to the
+/// window.  Empty intervals occupy no slot
+/// </summary>
+static void MarkBusy(CalFreeBusy *pMap, int64_t start, int64_t end)
+{
+	if (start < pMap->Start) start = pMap->Start;
+	if (end > pMap->End) end = pMap->End;
+	if (end <= start)
+	{
+		return;
+	}
+
+	uint64_t slot = pMap->SlotSeconds;
+	unsigned int first = (unsigned int)(((uint64_t)start - (uint64_t)pMap->Start) / slot);
+	unsigned int last = (unsigned int)(((uint64_t)end - (uint64_t)pMap->Start + slot - 1) / slot);
+
+	SetBitRange(pMap->Bits, first, last);
+}
+
+static void MarkBusyInterval(const CalInterval *pInterval, void *context)
+{
+	MarkBusy((CalFreeBusy *)context, pInterval->Start, pInterval->End);
+}
+
+/// <summary>
+/// Adds the time every entry of a calendar occupies to a bitmap, so one
+/// bitmap can take the busy time of many calendars.  A calendar with an
+/// interval index only visits the entries overlapping the window
+/// </summary>
+bool RasterizeFreeBusy(Calendar *pCalendar, CalFreeBusy *pMap)
+{
+	if (pCalendar->IntervalIndex)
+	{
+		return VisitIntervalsInRange(pCalendar, pMap->Start, pMap->End, MarkBusyInterval, pMap);
+	}
+
+	int64_t start, end;
+	for (CalendarEntry *e = pCalendar->Entry; e; e = e->NextEntry)
+	{
+		if (GetEntryInterval(e, &start, &end))
+		{
+			MarkBusy(pMap, start, end);
+		}
+	}
+	return true;
+}
+
+// dst |= src and dst &= src over a whole number of 256-bit blocks
+#if defined(FREEBUSY_AVX2)
+
+static void OrWords(uint64_t *dst, const uint64_t *src, unsigned int words)
+{
+	for (unsigned int i = 0; i < words; i += 4)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_or_si256(a, b));
+	}
+}
+
+static void AndWords(uint64_t *dst, const uint64_t *src, unsigned int words)
+{
+	for (unsigned int i = 0; i < words; i += 4)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_and_si256(a, b));
+	}
+}
+
+#elif defined(FREEBUSY_NEON)
+
+static void OrWords(uint64_t *dst, const uint64_t *src, unsigned int words)
+{
+	for (unsigned int i = 0; i < words; i += 4)
+	{
+		vst1q_u64(dst + i, vorrq_u64(vld1q_u64(dst + i), vld1q_u64(src + i)));
+		vst1q_u64(dst + i + 2, vorrq_u64(vld1q_u64(dst + i + 2), vld1q_u64(src + i + 2)));
+	}
+}
+
+static void AndWords(uint64_t *dst, const uint64_t *src, unsigned int words)
+{
+	for (unsigned int i = 0; i < words; i += 4)
+	{
+		vst1q_u64(dst + i, vandq_u64(vld1q_u64(dst + i), vld1q_u64(src + i)));
+		vst1q_u64(dst + i + 2, vandq_u64(vld1q_u64(dst + i + 2), vld1q_u64(src + i + 2)));
+	}
+}
+
+#elif defined(FREEBUSY_SSE2)
+
+static void OrWords(uint64_t *dst, const uint64_t *src, unsigned int words)
+{
+	for (unsigned int i = 0; i < words; i += 2)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(a, b));
+	}
+}
+
+static void AndWords(uint64_t *dst, const uint64_t *src, unsigned int words)
+{
+	for (unsigned int i = 0; i < words; i += 2)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_and_si128(a, b));
+	}
+}
+
+#else
+
+static void OrWords(uint64_t *dst, const uint64_t *src, unsigned int words)
+{
+	for (unsigned int i = 0; i < words; i++)
+	{
+		dst[i] |= src[i];
+	}
+}
+
+static void AndWords(uint64_t *dst, const uint64_t *src, unsigned int words)
+{
+	for (unsigned int i = 0; i < words; i++)
+	{
+		dst[i] &= src[i];
+	}
+}
+
+#endif
+
+static bool SameFreeBusyWindow(const CalFreeBusy *a, const CalFreeBusy *b)
+{
+	return a->Start == b->Start && a->SlotSeconds == b->SlotSeconds && a->SlotCount == b->SlotCount;
+}
+
+/// <summary>
+/// Combines count bitmaps into pDest, which takes part in the combination
+/// as well.  With CALFREEBUSY_ANY a slot ends up busy if any bitmap has it
+/// busy; with CALFREEBUSY_ALL only if every bitmap does.  All bitmaps must
+/// cover the same window with the same slot length
+/// </summary>
+bool CombineFreeBusy(CalFreeBusy *pDest, CalFreeBusy **maps, unsigned int count, int op)
+{
+	if (op != CALFREEBUSY_ANY && op != CALFREEBUSY_ALL)
+	{
+		return false;
+	}
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		if (!maps[i] || !SameFreeBusyWindow(pDest, maps[i]))
+		{
+			printf("-> ERROR: free/busy bitmaps cover different windows\n");
+			return false;
+		}
+	}
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		if (op == CALFREEBUSY_ANY)
+		{
+			OrWords(pDest->Bits, maps[i]->Bits, pDest->WordCount);
+		}
+		else
+		{
+			AndWords(pDest->Bits, maps[i]->Bits, pDest->WordCount);
+		}
+	}
+	return true;
+}
+
+/// <summary>
+/// Finds the earliest run of free slots at least durationSeconds long and
+/// sets *start to the time its first slot begins.  A zero duration asks
+/// for a single free slot.  Returns false if there is no such run
+/// </summary>
+bool FindFreeBusyRun(const CalFreeBusy *pMap, unsigned int durationSeconds, int64_t *start)
+{
+	uint64_t need = ((uint64_t)durationSeconds + pMap->SlotSeconds - 1) / pMap->SlotSeconds;
+	uint64_t run = 0;
+	uint64_t runStart = 0;
+
+	if (!need)
+	{
+		need = 1;
+	}
+
+	for (unsigned int w = 0; w < pMap->WordCount; w++)
+	{
+		uint64_t busy = pMap->Bits[w];
+		unsigned int bit = 0;
+
+		if (busy == ~0ULL)
+		{
+			run = 0;
+			runStart = (uint64_t)(w + 1) * FREEBUSY_WORD_BITS;
+			continue;
+		}
+
+		// Alternate between the free bits before the next busy bit and the
+		// busy bits that follow them
+		while (bit < FREEBUSY_WORD_BITS)
+		{
+			uint64_t rest = busy >> bit;
+			unsigned int freeBits = rest ? LowestSetBit(rest) : FREEBUSY_WORD_BITS - bit;
+
+			run += freeBits;
+			if (run >= need)
+			{
+				*start = pMap->Start + (int64_t)(runStart * pMap->SlotSeconds);
+				return true;
+			}
+
+			bit += freeBits;
+			if (bit == FREEBUSY_WORD_BITS)
+			{
+				break;
+			}
+
+			uint64_t idle = ~busy >> bit;
+			bit = idle ? bit + LowestSetBit(idle) : FREEBUSY_WORD_BITS;
+			run = 0;
+			runStart = (uint64_t)w * FREEBUSY_WORD_BITS + bit;
+		}
+	}
+
+	return false;
+}
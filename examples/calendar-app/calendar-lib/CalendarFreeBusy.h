@@ -0,0 +1,38 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarFreeBusy.h:  contains the free/busy bitmaps that calendars
+* are rasterized into for scheduling across many attendees
+*
+*********************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include "CalendarStructures.h"
+
+// CombineFreeBusy operations
+#define CALFREEBUSY_ANY		0	// A slot is busy if it is busy in any bitmap
+#define CALFREEBUSY_ALL		1	// A slot is busy only if it is busy in every bitmap
+
+// Bit i of the bitmap is set when the slot starting at
+// Start + i * SlotSeconds is busy.  The words follow the header in the
+// same allocation and are padded to a multiple of four with busy bits
+typedef struct _CalFreeBusy
+{
+	int64_t Start;
+	int64_t End;
+	unsigned int SlotSeconds;
+	unsigned int SlotCount;
+	unsigned int WordCount;
+	uint64_t *Bits;
+} CalFreeBusy;
+
+CalFreeBusy *CreateFreeBusy(int64_t start, int64_t end, unsigned int slotSeconds);
+void DestroyFreeBusy(CalFreeBusy *pMap);
+void ClearFreeBusy(CalFreeBusy *pMap);
+bool RasterizeFreeBusy(Calendar *pCalendar, CalFreeBusy *pMap);
+bool CombineFreeBusy(CalFreeBusy *pDest, CalFreeBusy **maps, unsigned int count, int op);
+bool FindFreeBusyRun(const CalFreeBusy *pMap, unsigned int durationSeconds, int64_t *start);
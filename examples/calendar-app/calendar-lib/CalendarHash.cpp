@@ -0,0 +1,135 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarHash.cpp:  contains the hash functions used by the calendar
+* lookup tables, indexes and caches
+*
+*********************************************************************/
+
+#include "stdafx.h"
+#include "CalendarHash.h"
+
+/// <summary>
+/// Hashes len bytes at p (MurmurHash64A); reads the input 8 bytes at a time
+/// </summary>
+uint64_t CalHash64(const void *p, size_t len, uint64_t seed)
+{
+	const uint64_t m = 0xc6a4a7935bd1e995ULL;
+	const int r = 47;
+
+	const unsigned char *data = (const unsigned char *)p;
+	const unsigned char *end = data + (len & ~(size_t)7);
+	uint64_t h = seed ^ (len * m);
+
+	while (data != end)
+	{
+		uint64_t k;
+		memcpy(&k, data, sizeof(k));
+		data += sizeof(k);
+
+		k *= m;
+		k ^= k >> r;
+		k *= m;
+
+		h ^= k;
+		h *= m;
+	}
+
+	switch (len & 7)
+	{
+	case 7: h ^= (uint64_t)data[6] << 48;
+	case 6: h ^= (uint64_t)data[5] << 40;
+	case 5: h ^= (uint64_t)data[4] << 32;
+	case 4: h ^= (uint64_t)data[3] << 24;
+	case 3: h ^= (uint64_t)data[2] << 16;
+	case 2: h ^= (uint64_t)data[1] << 8;
+	case 1: h ^= (uint64_t)data[0];
+		h *= m;
+	}
+
+	h ^= h >> r;
+	h *= m;
+	h ^= h >> r;
+	return h;
+}
+
+static inline uint64_t RotateLeft64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t FinalMix64(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+/// <summary>
+/// Hashes len bytes at p to 128 bits (MurmurHash3_x64_128), for keys that
+/// stand in for the content itself.  Reads the input 16 bytes at a time in
+/// two independent lanes, so it is also faster than CalHash64 on long inputs
+/// </summary>
+void CalHash128(const void *p, size_t len, uint64_t seed, uint64_t out[2])
+{
+	const uint64_t c1 = 0x87c37b91114253d5ULL;
+	const uint64_t c2 = 0x4cf5ad432745937fULL;
+
+	const unsigned char *data = (const unsigned char *)p;
+	const unsigned char *end = data + (len & ~(size_t)15);
+	uint64_t h1 = seed;
+	uint64_t h2 = seed;
+
+	while (data != end)
+	{
+		uint64_t k1, k2;
+		memcpy(&k1, data, sizeof(k1));
+		memcpy(&k2, data + 8, sizeof(k2));
+		data += 16;
+
+		k1 *= c1; k1 = RotateLeft64(k1, 31); k1 *= c2; h1 ^= k1;
+		h1 = RotateLeft64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+
+		k2 *= c2; k2 = RotateLeft64(k2, 33); k2 *= c1; h2 ^= k2;
+		h2 = RotateLeft64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+	}
+
+	uint64_t k1 = 0, k2 = 0;
+	switch (len & 15)
+	{
+	case 15: k2 ^= (uint64_t)data[14] << 48;
+	case 14: k2 ^= (uint64_t)data[13] << 40;
+	case 13: k2 ^= (uint64_t)data[12] << 32;
+	case 12: k2 ^= (uint64_t)data[11] << 24;
+	case 11: k2 ^= (uint64_t)data[10] << 16;
+	case 10: k2 ^= (uint64_t)data[9] << 8;
+	case 9: k2 ^= (uint64_t)data[8];
+		k2 *= c2; k2 = RotateLeft64(k2, 33); k2 *= c1; h2 ^= k2;
+	case 8: k1 ^= (uint64_t)data[7] << 56;
+	case 7: k1 ^= (uint64_t)data[6] << 48;
+	case 6: k1 ^= (uint64_t)data[5] << 40;
+	case 5: k1 ^= (uint64_t)data[4] << 32;
+	case 4: k1 ^= (uint64_t)data[3] << 24;
+	case 3: k1 ^= (uint64_t)data[2] << 16;
+	case 2: k1 ^= (uint64_t)data[1] << 8;
+	case 1: k1 ^= (uint64_t)data[0];
+		k1 *= c1; k1 = RotateLeft64(k1, 31); k1 *= c2; h1 ^= k1;
+	}
+
+	h1 ^= len;
+	h2 ^= len;
+	h1 += h2;
+	h2 += h1;
+	h1 = FinalMix64(h1);
+	h2 = FinalMix64(h2);
+	h1 += h2;
+	h2 += h1;
+
+	out[0] = h1;
+	out[1] = h2;
+}
@@ -0,0 +1,17 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarHash.h:  contains the hash functions used by the calendar
+* lookup tables, indexes and caches
+*
+*********************************************************************/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint64_t CalHash64(const void *p, size_t len, uint64_t seed);
+void CalHash128(const void *p, size_t len, uint64_t seed, uint64_t out[2]);
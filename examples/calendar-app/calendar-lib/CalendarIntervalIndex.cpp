@@ -0,0 +1,467 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarIntervalIndex.cpp:  contains the index over the time
+* intervals entries occupy.  Range queries walk an implicit interval
+* tree over the start-sorted array; conflicts are found by a sweep
+*
+*********************************************************************/
+
+#include "stdafx.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "CalendarArena.h"
+#include "CalendarSort.h"
+#include "CalendarTime.h"
+#include "CalendarContactIndex.h"
+#include "CalendarIntervalIndex.h"
+
+#define INTERVALINDEX_ALIGN(x)		(((x) + 7) & ~(size_t)7)
+#define INTERVALINDEX_AT(p, off)	((unsigned char *)(p) + (off))
+#define INTERVALINDEX_INTERVALS(p)	((CalInterval *)INTERVALINDEX_AT(p, (p)->Intervals))
+#define INTERVALINDEX_POSITIONS(p)	((unsigned int *)INTERVALINDEX_AT(p, (p)->Positions))
+
+// Subtrees at or below this level are scanned rather than descended
+#define INTERVALINDEX_SCAN_LEVEL 3
+
+typedef struct _CalIntervalFrame
+{
+	int64_t Node;
+	int Level;
+	bool LeftDone;
+} CalIntervalFrame;
+
+static int CompareIntervals(const void *a, const void *b)
+{
+	const CalInterval *x = (const CalInterval *)a;
+	const CalInterval *y = (const CalInterval *)b;
+
+	if (x->Start != y->Start) return x->Start < y->Start ? -1 : 1;
+	if (x->Entry != y->Entry) return x->Entry < y->Entry ? -1 : 1;
+	return 0;
+}
+
+/// <summary>
+/// Fills in MaxEnd for every node of the implicit tree over n start-sorted
+/// intervals and returns the level of the root
+/// </summary>
+static int IndexIntervalTree(CalInterval *a, int64_t n)
+{
+	int64_t i, lastNode = 0, lastMax = 0;
+	int k;
+
+	if (n <= 0)
+	{
+		return -1;
+	}
+
+	// Leaves are the even nodes
+	for (i = 0; i < n; i += 2)
+	{
+		lastNode = i;
+		lastMax = a[i].MaxEnd = a[i].End;
+	}
+
+	for (k = 1; (1LL << k) <= n; k++)
+	{
+		int64_t x = 1LL << (k - 1), first = (x << 1) - 1, step = x << 2;
+
+		for (i = first; i < n; i += step)
+		{
+			int64_t left = a[i - x].MaxEnd;
+			int64_t right = (i + x < n) ? a[i + x].MaxEnd : lastMax;	// Right subtree may be partly missing
+			int64_t e = a[i].End;
+
+			if (left > e) e = left;
+			if (right > e) e = right;
+			a[i].MaxEnd = e;
+		}
+
+		// Track the rightmost node of this level to stand in for missing subtrees
+		lastNode = ((lastNode >> k) & 1) ? lastNode - x : lastNode + x;
+		if (lastNode < n && a[lastNode].MaxEnd > lastMax)
+		{
+			lastMax = a[lastNode].MaxEnd;
+		}
+	}
+
+	return k - 1;
+}
+
+/// <summary>
+/// Builds the interval index for a calendar.  Entries are numbered in list
+/// order from zero; those without a valid interval are left out
+/// </summary>
+CalIntervalIndex *BuildIntervalIndex(Calendar *pCalendar)
+{
+	unsigned int entryCount = 0;
+	unsigned int count = 0;
+	int64_t start, end;
+
+	for (CalendarEntry *e = pCalendar->Entry; e; e = e->NextEntry)
+	{
+		if (GetEntryInterval(e, &start, &end))
+		{
+			count++;
+		}
+		entryCount++;
+	}
+
+	size_t intervalsOffset = INTERVALINDEX_ALIGN(sizeof(CalIntervalIndex));
+	size_t positionsOffset = intervalsOffset + (size_t)count * sizeof(CalInterval);
+	size_t size = INTERVALINDEX_ALIGN(positionsOffset + (size_t)entryCount * sizeof(unsigned int));
+
+	if (positionsOffset > UINT_MAX)
+	{
+		printf("-> ERROR: interval index too large\n");
+		return NULL;
+	}
+
+	CalIntervalIndex *pIndex = (CalIntervalIndex *)CalCalloc(1, size);
+	if (!pIndex)
+	{
+		return NULL;
+	}
+
+	pIndex->Size = size;
+	pIndex->EntryCount = entryCount;
+	pIndex->Count = count;
+	pIndex->Intervals = (unsigned int)intervalsOffset;
+	pIndex->Positions = (unsigned int)positionsOffset;
+
+	CalInterval *intervals = INTERVALINDEX_INTERVALS(pIndex);
+	unsigned int *positions = INTERVALINDEX_POSITIONS(pIndex);
+	unsigned int i = 0, entry = 0;
+
+	for (CalendarEntry *e = pCalendar->Entry; e; e = e->NextEntry, entry++)
+	{
+		if (GetEntryInterval(e, &start, &end))
+		{
+			intervals[i].Start = start;
+			intervals[i].End = end;
+			intervals[i].Entry = entry;
+			i++;
+		}
+	}
+
+	// Intervals were gathered in entry order, so the stable sort breaks
+	// ties by entry as CompareIntervals does
+	if (!CalRadixSort64(intervals, count, sizeof(CalInterval)))
+	{
+		CalFree(pIndex);
+		return NULL;
+	}
+
+	memset(positions, 0xFF, (size_t)entryCount * sizeof(unsigned int));
+	for (i = 0; i < count; i++)
+	{
+		positions[intervals[i].Entry] = i;
+	}
+
+	pIndex->RootLevel = IndexIntervalTree(intervals, count);
+	return pIndex;
+}
+
+void DestroyIntervalIndex(CalIntervalIndex *pIndex)
+{
+	CalFree(pIndex);
+}
+
+static bool InImage(uint64_t size, uint64_t offset, uint64_t length)
+{
+	return offset <= size && length <= size - offset;
+}
+
+/// <summary>
+/// Checks that an index of at most bytes bytes, such as one mapped from a
+/// snapshot, stays inside itself, has the tree shape its Count gives and
+/// names only entries below entryCount, so walks can trust it
+/// </summary>
+bool ValidateIntervalIndex(const CalIntervalIndex *pIndex, uint64_t bytes, unsigned int entryCount)
+{
+	if (bytes < sizeof(CalIntervalIndex) || pIndex->Size > bytes || pIndex->EntryCount != entryCount || pIndex->Count > entryCount)
+	{
+		return false;
+	}
+
+	uint64_t size = pIndex->Size;
+	if ((pIndex->Intervals & 7) || (pIndex->Positions & 3) ||
+		!InImage(size, pIndex->Intervals, (uint64_t)pIndex->Count * sizeof(CalInterval)) ||
+		!InImage(size, pIndex->Positions, (uint64_t)entryCount * sizeof(unsigned int)))
+	{
+		return false;
+	}
+
+	// The root sits on the level IndexIntervalTree gives Count
+	int level = -1;
+	while ((uint64_t)pIndex->Count >> (level + 1))
+	{
+		level++;
+	}
+	if (pIndex->RootLevel != level)
+	{
+		return false;
+	}
+
+	const CalInterval *a = INTERVALINDEX_INTERVALS(pIndex);
+	const unsigned int *positions = INTERVALINDEX_POSITIONS(pIndex);
+	for (unsigned int i = 0; i < pIndex->Count; i++)
+	{
+		if (a[i].Entry >= entryCount || positions[a[i].Entry] != i)
+		{
+			return false;
+		}
+	}
+	for (unsigned int e = 0; e < entryCount; e++)
+	{
+		if (positions[e] != CALINTERVAL_NONE && positions[e] >= pIndex->Count)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/// <summary>
+/// Returns the calendar's interval index, or builds a temporary one that
+/// the caller releases when *temporary is set
+/// </summary>
+static CalIntervalIndex *AcquireIntervalIndex(Calendar *pCalendar, bool *temporary)
+{
+	*temporary = !pCalendar->IntervalIndex;
+	return *temporary ? BuildIntervalIndex(pCalendar) : pCalendar->IntervalIndex;
+}
+
+static void ReleaseIntervalIndex(CalIntervalIndex *pIndex, bool temporary)
+{
+	if (temporary)
+	{
+		DestroyIntervalIndex(pIndex);
+	}
+}
+
+static void AddFound(unsigned int entry, unsigned int *out, unsigned int n, int *found)
+{
+	if ((unsigned int)*found < n) out[*found] = entry;
+	if (*found < INT_MAX) (*found)++;
+}
+
+/// <summary>
+/// Walks the implicit tree and calls visit for each interval overlapping
+/// [start, end), in start order
+/// </summary>
+static void WalkIntervals(CalIntervalIndex *pIndex, int64_t start, int64_t end, CalIntervalVisitor visit, void *context)
+{
+	CalInterval *a = INTERVALINDEX_INTERVALS(pIndex);
+	int64_t count = pIndex->Count;
+	CalIntervalFrame stack[64];
+	int depth = 0;
+
+	if (pIndex->RootLevel >= 0)
+	{
+		stack[depth].Node = (1LL << pIndex->RootLevel) - 1;
+		stack[depth].Level = pIndex->RootLevel;
+		stack[depth++].LeftDone = false;
+	}
+
+	// Nodes are visited in order, so matches come out sorted by start
+	while (depth)
+	{
+		CalIntervalFrame f = stack[--depth];
+
+		if (f.Level <= INTERVALINDEX_SCAN_LEVEL)
+		{
+			int64_t first = f.Node >> f.Level << f.Level;
+			int64_t last = first + (1LL << (f.Level + 1)) - 1;
+			if (last > count) last = count;
+
+			for (int64_t i = first; i < last && a[i].Start < end; i++)
+			{
+				if (start < a[i].End)
+				{
+					visit(&a[i], context);
+				}
+			}
+		}
+		else if (!f.LeftDone)
+		{
+			// The left child may lie past the end of a partial tree
+			int64_t left = f.Node - (1LL << (f.Level - 1));
+
+			stack[depth].Node = f.Node;
+			stack[depth].Level = f.Level;
+			stack[depth++].LeftDone = true;
+
+			if (left >= count || a[left].MaxEnd > start)
+			{
+				stack[depth].Node = left;
+				stack[depth].Level = f.Level - 1;
+				stack[depth++].LeftDone = false;
+			}
+		}
+		else if (f.Node < count && a[f.Node].Start < end)
+		{
+			if (start < a[f.Node].End)
+			{
+				visit(&a[f.Node], context);
+			}
+
+			stack[depth].Node = f.Node + (1LL << (f.Level - 1));
+			stack[depth].Level = f.Level - 1;
+			stack[depth++].LeftDone = false;
+		}
+	}
+}
+
+/// <summary>
+/// Calls visit for each interval overlapping [start, end), in start order.
+/// Returns false if a temporary index could not be built
+/// </summary>
+bool VisitIntervalsInRange(Calendar *pCalendar, int64_t start, int64_t end, CalIntervalVisitor visit, void *context)
+{
+	bool temporary;
+	CalIntervalIndex *pIndex = AcquireIntervalIndex(pCalendar, &temporary);
+	if (!pIndex)
+	{
+		return false;
+	}
+
+	WalkIntervals(pIndex, start, end, visit, context);
+
+	ReleaseIntervalIndex(pIndex, temporary);
+	return true;
+}
+
+typedef struct _CalFoundEntries
+{
+	unsigned int *Out;
+	unsigned int N;
+	int Found;
+} CalFoundEntries;
+
+static void AddFoundInterval(const CalInterval *pInterval, void *context)
+{
+	CalFoundEntries *f = (CalFoundEntries *)context;
+	AddFound(pInterval->Entry, f->Out, f->N, &f->Found);
+}
+
+/// <summary>
+/// Finds the entries overlapping [start, end).  Writes up to n entry
+/// indices to out, ordered by start time, and returns how many entries
+/// overlap (saturating at INT_MAX), or -1 on failure
+/// </summary>
+int FindIntervalEntries(Calendar *pCalendar, int64_t start, int64_t end, unsigned int *out, unsigned int n)
+{
+	CalFoundEntries f = { out, n, 0 };
+
+	if (!VisitIntervalsInRange(pCalendar, start, end, AddFoundInterval, &f))
+	{
+		return -1;
+	}
+	return f.Found;
+}
+
+/// <summary>
+/// Reports every overlapping pair among count start-sorted intervals
+/// </summary>
+static void SweepConflicts(const CalInterval *a, unsigned int count, CalConflict *out, unsigned int n, int *found)
+{
+	for (unsigned int i = 0; i < count; i++)
+	{
+		for (unsigned int j = i + 1; j < count && a[j].Start < a[i].End; j++)
+		{
+			// Only an empty interval at the same start fails to overlap here
+			if (a[j].End > a[i].Start)
+			{
+				if ((unsigned int)*found < n)
+				{
+					out[*found].First = a[i].Entry;
+					out[*found].Second = a[j].Entry;
+				}
+				if (*found < INT_MAX) (*found)++;
+			}
+		}
+	}
+}
+
+/// <summary>
+/// Finds every pair of overlapping entries.  Writes up to n pairs to out,
+/// ordered by the start of their first entry, and returns how many pairs
+/// overlap (saturating at INT_MAX), or -1 on failure
+/// </summary>
+int FindIntervalConflicts(Calendar *pCalendar, CalConflict *out, unsigned int n)
+{
+	bool temporary;
+	CalIntervalIndex *pIndex = AcquireIntervalIndex(pCalendar, &temporary);
+	if (!pIndex)
+	{
+		return -1;
+	}
+
+	int found = 0;
+	SweepConflicts(INTERVALINDEX_INTERVALS(pIndex), pIndex->Count, out, n, &found);
+
+	ReleaseIntervalIndex(pIndex, temporary);
+	return found;
+}
+
+/// <summary>
+/// Finds every pair of overlapping entries among those sent by or
+/// addressed to an email, as FindIntervalConflicts does for the calendar
+/// </summary>
+int FindContactIntervalConflicts(Calendar *pCalendar, const char *email, CalConflict *out, unsigned int n)
+{
+	unsigned int *entries = NULL;
+	CalInterval *intervals = NULL;
+	int found = -1;
+
+	bool temporary;
+	CalIntervalIndex *pIndex = AcquireIntervalIndex(pCalendar, &temporary);
+	if (!pIndex)
+	{
+		return -1;
+	}
+
+	int entryCount = FindContactEntries(pCalendar, email, NULL, 0);
+	if (entryCount < 0)
+	{
+		goto EXIT;
+	}
+
+	entries = (unsigned int *)CalMalloc((entryCount ? entryCount : 1) * sizeof(unsigned int));
+	intervals = (CalInterval *)CalMalloc((entryCount ? entryCount : 1) * sizeof(CalInterval));
+	if (!entries || !intervals)
+	{
+		goto EXIT;
+	}
+
+	{
+		// Gather the contact's intervals through the entry positions
+		CalInterval *all = INTERVALINDEX_INTERVALS(pIndex);
+		unsigned int *positions = INTERVALINDEX_POSITIONS(pIndex);
+		unsigned int count = 0;
+
+		FindContactEntries(pCalendar, email, entries, entryCount);
+		for (int i = 0; i < entryCount; i++)
+		{
+			if (entries[i] < pIndex->EntryCount && positions[entries[i]] != CALINTERVAL_NONE)
+			{
+				intervals[count++] = all[positions[entries[i]]];
+			}
+		}
+
+		qsort(intervals, count, sizeof(CalInterval), CompareIntervals);
+
+		found = 0;
+		SweepConflicts(intervals, count, out, n, &found);
+	}
+
+EXIT:
+	CalFree(entries);
+	CalFree(intervals);
+	ReleaseIntervalIndex(pIndex, temporary);
+	return found;
+}
@@ -0,0 +1,56 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarIntervalIndex.h:  contains the index over the time intervals
+* entries occupy, used for range and conflict queries
+*
+*********************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include "CalendarStructures.h"
+
+#define CALINTERVAL_NONE 0xFFFFFFFF
+
+// Intervals are kept sorted by start and laid out as an implicit binary
+// tree: the node at index i on level k has children i - 2^(k-1) and
+// i + 2^(k-1), and MaxEnd is the greatest End in its subtree
+typedef struct _CalInterval
+{
+	int64_t Start;
+	int64_t End;
+	int64_t MaxEnd;
+	unsigned int Entry;
+	unsigned int Reserved;
+} CalInterval;
+
+// The index is a single allocation; the intervals and positions that
+// follow the header are addressed by offsets from its start
+typedef struct _CalIntervalIndex
+{
+	size_t Size;				// Bytes in the allocation, header included
+	unsigned int EntryCount;	// Entries in the calendar when it was built
+	unsigned int Count;			// Entries with a valid interval
+	int RootLevel;				// Level of the root node; -1 when empty
+	unsigned int Intervals;		// Offset of the Count sorted intervals
+	unsigned int Positions;		// Offset of each entry's interval, or CALINTERVAL_NONE
+} CalIntervalIndex;
+
+typedef struct _CalConflict
+{
+	unsigned int First;		// Entry that starts first
+	unsigned int Second;
+} CalConflict;
+
+typedef void (*CalIntervalVisitor)(const CalInterval *pInterval, void *context);
+
+CalIntervalIndex *BuildIntervalIndex(Calendar *pCalendar);
+void DestroyIntervalIndex(CalIntervalIndex *pIndex);
+bool ValidateIntervalIndex(const CalIntervalIndex *pIndex, uint64_t bytes, unsigned int entryCount);
+bool VisitIntervalsInRange(Calendar *pCalendar, int64_t start, int64_t end, CalIntervalVisitor visit, void *context);
+int FindIntervalEntries(Calendar *pCalendar, int64_t start, int64_t end, unsigned int *out, unsigned int n);
+int FindIntervalConflicts(Calendar *pCalendar, CalConflict *out, unsigned int n);
+int FindContactIntervalConflicts(Calendar *pCalendar, const char *email, CalConflict *out, unsigned int n);
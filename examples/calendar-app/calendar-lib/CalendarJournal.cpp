@@ -0,0 +1,874 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarJournal.cpp:  contains the append-only journal of a CAL
+* file.  Entries appended are written to a side file as one batch and
+* flushed to disk once, then linked onto the calendar in memory, so an
+* append costs the size of its entries.  Opening replays the batches
+* over the base file.  A background thread folds the journal into a
+* fresh base file once it grows past a size
+*
+*********************************************************************/
+
+#include "stdafx.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "CalendarArena.h"
+#include "CalendarHash.h"
+#include "CalendarFraming.h"
+#include "CalendarReparse.h"
+#include "CalendarJournal.h"
+
+extern "C"
+{
+	extern unsigned int BugBitmask;
+}
+
+Calendar *ParseInputEx(unsigned char *in, size_t len, const CalParseOptions *pOptions);
+
+#define JOURNAL_IO_CHUNK	(1 << 30)		// Largest single ReadFile or WriteFile
+
+//////////////////////////////////////////
+//
+// Files
+//
+//////////////////////////////////////////
+
+static bool FormatJournalPath(char *path, const char *basePath, const char *suffix)
+{
+	int n = snprintf(path, CALJOURNAL_MAX_PATH, "%s%s", basePath, suffix);
+	return n > 0 && n < CALJOURNAL_MAX_PATH;
+}
+
+static bool ReadJournalBytes(HANDLE file, uint64_t offset, unsigned char *p, size_t len)
+{
+	LARGE_INTEGER at;
+	DWORD read;
+
+	at.QuadPart = (LONGLONG)offset;
+	if (!SetFilePointerEx(file, at, NULL, FILE_BEGIN))
+	{
+		return false;
+	}
+
+	while (len)
+	{
+		DWORD chunk = len > JOURNAL_IO_CHUNK ? JOURNAL_IO_CHUNK : (DWORD)len;
+		if (!ReadFile(file, p, chunk, &read, NULL) || !read)
+		{
+			return false;
+		}
+		p += read;
+		len -= read;
+	}
+	return true;
+}
+
+static bool WriteJournalBytes(HANDLE file, uint64_t offset, const unsigned char *p, size_t len)
+{
+	LARGE_INTEGER at;
+	DWORD written;
+
+	at.QuadPart = (LONGLONG)offset;
+	if (!SetFilePointerEx(file, at, NULL, FILE_BEGIN))
+	{
+		return false;
+	}
+
+	while (len)
+	{
+		DWORD chunk = len > JOURNAL_IO_CHUNK ? JOURNAL_IO_CHUNK : (DWORD)len;
+		if (!WriteFile(file, p, chunk, &written, NULL) || !written)
+		{
+			return false;
+		}
+		p += written;
+		len -= written;
+	}
+	return true;
+}
+
+/// <summary>
+/// Cuts a file back to length and flushes it to disk
+/// </summary>
+static bool TruncateJournalFile(HANDLE file, uint64_t length)
+{
+	LARGE_INTEGER at;
+
+	at.QuadPart = (LONGLONG)length;
+	return SetFilePointerEx(file, at, NULL, FILE_BEGIN) && SetEndOfFile(file) && FlushFileBuffers(file);
+}
+
+/// <summary>
+/// Reads up to limit bytes from the start of a file into a buffer from
+/// malloc.  Returns NULL, with the error left for GetLastError, if the
+/// file cannot be read
+/// </summary>
+static unsigned char *ReadJournalFile(const char *path, uint64_t limit, size_t *len)
+{
+	LARGE_INTEGER fileSize;
+	unsigned char *data = NULL;
+
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return NULL;
+	}
+
+	if (GetFileSizeEx(file, &fileSize))
+	{
+		uint64_t length = (uint64_t)fileSize.QuadPart < limit ? (uint64_t)fileSize.QuadPart : limit;
+		if (length <= SIZE_MAX)
+		{
+			data = (unsigned char *)malloc(length ? (size_t)length : 1);
+			if (data && !ReadJournalBytes(file, 0, data, (size_t)length))
+			{
+				free(data);
+				data = NULL;
+			}
+			*len = (size_t)length;
+		}
+	}
+
+	CloseHandle(file);
+	return data;
+}
+
+/// <summary>
+/// Writes a file in full and flushes it to disk, under a name nothing
+/// reads until it is renamed
+/// </summary>
+static bool WriteJournalFile(const char *path, const unsigned char *p, size_t len)
+{
+	HANDLE file = CreateFileA(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	bool ok = WriteJournalBytes(file, 0, p, len) && FlushFileBuffers(file);
+	CloseHandle(file);
+	if (!ok)
+	{
+		DeleteFileA(path);
+	}
+	return ok;
+}
+
+static HANDLE OpenJournalForAppend(const char *path)
+{
+	return CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+}
+
+static bool ReplaceJournalFile(const char *from, const char *to)
+{
+	return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != FALSE;
+}
+
+//////////////////////////////////////////
+//
+// Layout
+//
+//////////////////////////////////////////
+
+static void DescribeJournalBase(CalJournalHeader *pHeader, const unsigned char *base, size_t len)
+{
+	pHeader->Magic = CALJOURNAL_MAGIC;
+	pHeader->Version = CALJOURNAL_VERSION;
+	pHeader->BaseLength = len;
+	pHeader->BaseHash = CalHash64(base, len, 0);
+}
+
+/// <summary>
+/// Returns true if the journal, whose header is given, was written over
+/// the base file
+/// </summary>
+static bool IsJournalBase(const CalJournalHeader *pHeader, const unsigned char *base, size_t len)
+{
+	return pHeader->BaseLength == len && pHeader->BaseHash == CalHash64(base, len, 0);
+}
+
+/// <summary>
+/// Returns the length of the batches of a journal that are whole and
+/// intact, with the header, and counts their entries and bytes.  A batch
+/// cut short by a crash, and anything after it, is not counted
+/// </summary>
+static size_t CheckJournalBatches(const unsigned char *journal, size_t len, unsigned int *entries, size_t *payload)
+{
+	size_t at = sizeof(CalJournalHeader);
+	CalJournalBatch batch;
+
+	*entries = 0;
+	*payload = 0;
+	while (len - at >= sizeof(batch))
+	{
+		memcpy(&batch, journal + at, sizeof(batch));
+		if (batch.Magic != CALJOURNAL_BATCH_MAGIC || !batch.EntryCount || batch.EntryCount > UINT_MAX - *entries ||
+			batch.Length > len - at - sizeof(batch) ||
+			batch.Hash != CalHash64(journal + at + sizeof(batch), (size_t)batch.Length, batch.EntryCount))
+		{
+			break;
+		}
+
+		*entries += batch.EntryCount;
+		*payload += (size_t)batch.Length;
+		at += sizeof(batch) + (size_t)batch.Length;
+	}
+	return at;
+}
+
+/// <summary>
+/// Finds the entries of a base file, from the first NEWENTRY element to
+/// the END element, and checks its header as a parse would
+/// </summary>
+static bool FrameJournalBase(unsigned char *base, size_t len, int *version, unsigned int *count, size_t *start, size_t *end)
+{
+	int entryCount;
+
+	int n = FrameBufferEntries(base, len, version, NULL, 0);
+	if (n <= 0 || !ReadHeaderInt(base, len, REPARSE_INT_ELEMENT, ENTRYCOUNT, &entryCount))
+	{
+		printf("-> ERROR: The base CAL file does not frame into entries\n");
+		return false;
+	}
+
+	CalEntryFrame *frames = (CalEntryFrame *)malloc(n * sizeof(CalEntryFrame));
+	if (!frames)
+	{
+		return false;
+	}
+
+	FrameBufferEntries(base, len, version, frames, (unsigned int)n);
+	*start = frames[0].Offset;
+	*end = frames[n - 1].Offset + frames[n - 1].Length;
+	*count = (unsigned int)n;
+	free(frames);
+
+	if (*start != REPARSE_HEADER)
+	{
+		printf("-> ERROR: E#1 and E#2 must be VERSION and ENTRYCOUNT\n");
+		return false;
+	}
+	if (IsBugDisabled(BUG_5) && entryCount != n)
+	{
+		printf("-> ERROR: ENTRYCOUNT value does match file contents\n");
+		return false;
+	}
+	return true;
+}
+
+/// <summary>
+/// Lays out the entries of a base file, between start and end, followed by
+/// those of the journal batches up to journalLength, as one CAL file of
+/// count entries.  Returns it in a buffer from malloc
+/// </summary>
+static unsigned char *JoinJournal(int version, const unsigned char *base, size_t start, size_t end,
+	const unsigned char *journal, size_t journalLength, size_t payload, unsigned int count, size_t *len)
+{
+	CalJournalBatch batch;
+
+	*len = REPARSE_HEADER + (end - start) + payload + REPARSE_END_ELEMENT;
+	unsigned char *joined = (unsigned char *)malloc(*len);
+	if (!joined)
+	{
+		return NULL;
+	}
+
+	PutHeaderInt(joined, VERSION, version);
+	PutHeaderInt(joined + REPARSE_INT_ELEMENT, ENTRYCOUNT, (int)count);
+	memcpy(joined + REPARSE_HEADER, base + start, end - start);
+
+	size_t out = REPARSE_HEADER + (end - start);
+	for (size_t at = sizeof(CalJournalHeader); at < journalLength; at += sizeof(batch) + (size_t)batch.Length)
+	{
+		memcpy(&batch, journal + at, sizeof(batch));
+		memcpy(joined + out, journal + at + sizeof(batch), (size_t)batch.Length);
+		out += (size_t)batch.Length;
+	}
+
+	memset(joined + out, 0, REPARSE_END_ELEMENT);
+	joined[out] = END;
+	return joined;
+}
+
+//////////////////////////////////////////
+//
+// Compaction
+//
+//////////////////////////////////////////
+
+/// <summary>
+/// Folds the batches written so far into a fresh base file.  The new base
+/// is written beside the old one first; then, with appends held off, the
+/// batches written meanwhile go to a new journal that names it as its
+/// base, and the two are renamed into place, journal first.  A crash
+/// between the renames leaves a journal whose base is the .compact file,
+/// which OpenJournal finishes renaming
+/// </summary>
+static bool FoldJournal(CalJournal *pJournal)
+{
+	bool folded = false, renamed = false;
+	unsigned char *base = NULL, *journal = NULL, *joined = NULL, *next = NULL;
+	size_t baseLength, journalLength, joinedLength, payload, start, end;
+	unsigned int baseCount, journalCount;
+	int version;
+	uint64_t length;
+	CalJournalHeader header;
+	char compactPath[CALJOURNAL_MAX_PATH];
+	char tempPath[CALJOURNAL_MAX_PATH];
+
+	if (!FormatJournalPath(compactPath, pJournal->BasePath, CALJOURNAL_COMPACT_SUFFIX) ||
+		!FormatJournalPath(tempPath, pJournal->BasePath, CALJOURNAL_TEMP_SUFFIX))
+	{
+		return false;
+	}
+
+	AcquireSRWLockShared(&pJournal->Lock);
+	length = pJournal->JournalBytes;
+	bool failed = pJournal->Failed;
+	ReleaseSRWLockShared(&pJournal->Lock);
+
+	if (failed)
+	{
+		return false;
+	}
+	if (length == sizeof(CalJournalHeader))
+	{
+		return true;
+	}
+
+	// The batches before length no longer change, and only this thread
+	// replaces the base, so both are read without the lock
+	base = ReadJournalFile(pJournal->BasePath, UINT64_MAX, &baseLength);
+	journal = ReadJournalFile(pJournal->JournalPath, length, &journalLength);
+	if (!base || !journal || journalLength != length ||
+		!FrameJournalBase(base, baseLength, &version, &baseCount, &start, &end) ||
+		CheckJournalBatches(journal, journalLength, &journalCount, &payload) != journalLength)
+	{
+		printf("-> ERROR: Could not read the journal to compact it\n");
+		goto EXIT;
+	}
+
+	joined = JoinJournal(version, base, start, end, journal, journalLength, payload, baseCount + journalCount, &joinedLength);
+	if (!joined || !WriteJournalFile(compactPath, joined, joinedLength))
+	{
+		printf("-> ERROR: Could not write the compacted CAL file\n");
+		goto EXIT;
+	}
+	DescribeJournalBase(&header, joined, joinedLength);
+
+	AcquireSRWLockExclusive(&pJournal->Lock);
+	{
+		size_t tailLength = (size_t)(pJournal->JournalBytes - length);
+		next = (unsigned char *)malloc(sizeof(header) + tailLength);
+		if (next && !pJournal->Failed)
+		{
+			memcpy(next, &header, sizeof(header));
+			if (ReadJournalBytes(pJournal->File, length, next + sizeof(header), tailLength) &&
+				WriteJournalFile(tempPath, next, sizeof(header) + tailLength))
+			{
+				CloseHandle(pJournal->File);
+				renamed = ReplaceJournalFile(tempPath, pJournal->JournalPath);
+				if (renamed && !ReplaceJournalFile(compactPath, pJournal->BasePath))
+				{
+					// The journal follows a base only reopening will put in place
+					printf("-> ERROR: Could not replace the base CAL file\n");
+					pJournal->Failed = true;
+				}
+
+				pJournal->File = OpenJournalForAppend(pJournal->JournalPath);
+				if (pJournal->File == INVALID_HANDLE_VALUE)
+				{
+					pJournal->Failed = true;
+				}
+				if (renamed)
+				{
+					pJournal->JournalBytes = sizeof(header) + tailLength;
+					pJournal->JournalEntries -= journalCount;
+					pJournal->BaseHash = header.BaseHash;
+				}
+				folded = renamed && !pJournal->Failed;
+			}
+		}
+	}
+	ReleaseSRWLockExclusive(&pJournal->Lock);
+
+	if (!renamed)
+	{
+		DeleteFileA(tempPath);
+		DeleteFileA(compactPath);
+	}
+
+EXIT:
+	free(base);
+	free(journal);
+	free(joined);
+	free(next);
+	return folded;
+}
+
+static DWORD WINAPI CompactJournalThread(LPVOID context)
+{
+	CalJournal *pJournal = (CalJournal *)context;
+	bool folded = FoldJournal(pJournal);
+
+	AcquireSRWLockExclusive(&pJournal->Lock);
+	pJournal->Compacted = folded;
+	pJournal->Compacting = false;
+	ReleaseSRWLockExclusive(&pJournal->Lock);
+	return 0;
+}
+
+/// <summary>
+/// Waits for the compaction thread, if one was started, to finish
+/// </summary>
+static void JoinCompactor(CalJournal *pJournal)
+{
+	if (pJournal->Compactor)
+	{
+		WaitForSingleObject(pJournal->Compactor, INFINITE);
+		CloseHandle(pJournal->Compactor);
+		pJournal->Compactor = NULL;
+	}
+}
+
+/// <summary>
+/// Starts a compaction thread unless one is still running
+/// </summary>
+static bool StartCompactor(CalJournal *pJournal)
+{
+	AcquireSRWLockShared(&pJournal->Lock);
+	bool running = pJournal->Compacting;
+	ReleaseSRWLockShared(&pJournal->Lock);
+
+	if (running)
+	{
+		return true;
+	}
+
+	JoinCompactor(pJournal);
+	pJournal->Compacting = true;
+	pJournal->Compactor = CreateThread(NULL, 0, CompactJournalThread, pJournal, 0, NULL);
+	if (!pJournal->Compactor)
+	{
+		pJournal->Compacting = false;
+		return false;
+	}
+	return true;
+}
+
+//////////////////////////////////////////
+//
+// Journal
+//
+//////////////////////////////////////////
+
+/// <summary>
+/// Reads the journal of a base file, creating an empty one if there is
+/// none, and finishes a compaction that stopped between its renames.
+/// Returns the base and the journal in buffers from malloc
+/// </summary>
+static bool LoadJournalFiles(CalJournal *pJournal, unsigned char **base, size_t *baseLength, unsigned char **journal, size_t *journalLength)
+{
+	CalJournalHeader header;
+	char compactPath[CALJOURNAL_MAX_PATH];
+	char tempPath[CALJOURNAL_MAX_PATH];
+
+	if (!FormatJournalPath(compactPath, pJournal->BasePath, CALJOURNAL_COMPACT_SUFFIX) ||
+		!FormatJournalPath(tempPath, pJournal->BasePath, CALJOURNAL_TEMP_SUFFIX))
+	{
+		return false;
+	}
+
+	*base = ReadJournalFile(pJournal->BasePath, UINT64_MAX, baseLength);
+	if (!*base)
+	{
+		printf("-> ERROR: Could not read the base CAL file\n");
+		return false;
+	}
+
+	*journal = ReadJournalFile(pJournal->JournalPath, UINT64_MAX, journalLength);
+	if (!*journal)
+	{
+		if (GetLastError() != ERROR_FILE_NOT_FOUND)
+		{
+			printf("-> ERROR: Could not read the journal\n");
+			return false;
+		}
+
+		*journal = (unsigned char *)malloc(sizeof(header));
+		if (!*journal)
+		{
+			return false;
+		}
+
+		DescribeJournalBase(&header, *base, *baseLength);
+		memcpy(*journal, &header, sizeof(header));
+		*journalLength = sizeof(header);
+		if (!WriteJournalFile(tempPath, *journal, sizeof(header)) || !ReplaceJournalFile(tempPath, pJournal->JournalPath))
+		{
+			printf("-> ERROR: Could not create the journal\n");
+			return false;
+		}
+	}
+
+	if (*journalLength < sizeof(header))
+	{
+		printf("-> ERROR: The journal has no header\n");
+		return false;
+	}
+
+	memcpy(&header, *journal, sizeof(header));
+	if (header.Magic != CALJOURNAL_MAGIC || header.Version != CALJOURNAL_VERSION)
+	{
+		printf("-> ERROR: Not a calendar journal\n");
+		return false;
+	}
+
+	if (!IsJournalBase(&header, *base, *baseLength))
+	{
+		// A compaction renamed the journal but not the base it follows
+		free(*base);
+		*base = ReadJournalFile(compactPath, UINT64_MAX, baseLength);
+		if (!*base || !IsJournalBase(&header, *base, *baseLength) || !ReplaceJournalFile(compactPath, pJournal->BasePath))
+		{
+			printf("-> ERROR: The journal does not follow the base CAL file\n");
+			return false;
+		}
+		printf("-> Finished an interrupted journal compaction\n");
+	}
+
+	// Whatever an interrupted compaction left behind is not needed
+	DeleteFileA(compactPath);
+	DeleteFileA(tempPath);
+
+	pJournal->BaseHash = header.BaseHash;
+	return true;
+}
+
+/// <summary>
+/// Opens the journal of the CAL file at basePath, replays it over the
+/// base and parses the two as one calendar.  A batch cut short by a crash
+/// is cut off the journal.  The calendar carries CALENDAR_JOURNALED, so
+/// only the journal changes it and its EntryTable keeps TableCapacity
+/// </summary>
+CalJournal *OpenJournal(const char *basePath, const CalJournalOptions *pOptions)
+{
+	unsigned char *base = NULL, *journal = NULL, *joined = NULL;
+	size_t baseLength = 0, journalLength = 0, joinedLength, validLength, payload, start, end;
+	unsigned int baseCount, journalCount;
+	int version;
+
+	if (pOptions->ParseOptions.Flags & (CALPARSE_FILTER_TYPE | CALPARSE_FILTER_WINDOW))
+	{
+		printf("-> ERROR: A journal cannot filter its entries\n");
+		return NULL;
+	}
+	if (pOptions->ParseOptions.Flags & CALJOURNAL_INDEX_FLAGS)
+	{
+		printf("-> ERROR: A journal cannot index its entries\n");
+		return NULL;
+	}
+
+	// Appends are parsed a batch at a time, but reopening and compacting
+	// parse the whole file: a budget only MaxEntries tracks across batches
+	// could let appends that succeeded leave a journal that does not reopen
+	const CalParseLimits *pLimits = &pOptions->ParseOptions.Limits;
+	if (pLimits->MaxElements || pLimits->MaxAllocationBytes || pLimits->MaxMilliseconds || pOptions->ParseOptions.MaxZoneLoads)
+	{
+		printf("-> ERROR: A journal takes no parse budget but MaxEntries\n");
+		return NULL;
+	}
+
+	CalJournal *pJournal = (CalJournal *)calloc(1, sizeof(CalJournal));
+	if (!pJournal)
+	{
+		return NULL;
+	}
+
+	InitializeSRWLock(&pJournal->Lock);
+	pJournal->File = INVALID_HANDLE_VALUE;
+	pJournal->Options = *pOptions;
+	pJournal->Options.ParseOptions.Flags &= ~CALPARSE_TRACK_ENTRIES;
+	if (!pJournal->Options.CompactBytes)
+	{
+		pJournal->Options.CompactBytes = CALJOURNAL_DEFAULT_COMPACT_BYTES;
+	}
+
+	if (!FormatJournalPath(pJournal->BasePath, basePath, "") ||
+		!FormatJournalPath(pJournal->JournalPath, basePath, CALJOURNAL_SUFFIX) ||
+		!LoadJournalFiles(pJournal, &base, &baseLength, &journal, &journalLength))
+	{
+		goto ERROR_EXIT;
+	}
+
+	validLength = CheckJournalBatches(journal, journalLength, &journalCount, &payload);
+	if (!FrameJournalBase(base, baseLength, &version, &baseCount, &start, &end))
+	{
+		goto ERROR_EXIT;
+	}
+	if (journalCount > UINT_MAX - baseCount)
+	{
+		goto ERROR_EXIT;
+	}
+
+	joined = JoinJournal(version, base, start, end, journal, validLength, payload, baseCount + journalCount, &joinedLength);
+	if (!joined)
+	{
+		goto ERROR_EXIT;
+	}
+
+	pJournal->Calendar = ParseInputEx(joined, joinedLength, &pJournal->Options.ParseOptions);
+	if (!pJournal->Calendar || !pJournal->Calendar->EntryTable ||
+		pJournal->Calendar->EntryTableCount != baseCount + journalCount)
+	{
+		printf("-> ERROR: The base CAL file and its journal do not parse\n");
+		goto ERROR_EXIT;
+	}
+
+	pJournal->File = OpenJournalForAppend(pJournal->JournalPath);
+	if (pJournal->File == INVALID_HANDLE_VALUE)
+	{
+		printf("-> ERROR: Could not open the journal for appending\n");
+		goto ERROR_EXIT;
+	}
+	if (validLength != journalLength)
+	{
+		printf("-> Discarding %llu bytes of an incomplete journal batch\n", (unsigned long long)(journalLength - validLength));
+		if (!TruncateJournalFile(pJournal->File, validLength))
+		{
+			goto ERROR_EXIT;
+		}
+	}
+
+	pJournal->Calendar->Flags |= CALENDAR_JOURNALED;
+	pJournal->Version = version;
+	pJournal->TableCapacity = pJournal->Calendar->EntryTableCount;
+	pJournal->JournalBytes = validLength;
+	pJournal->JournalEntries = journalCount;
+	goto EXIT;
+
+ERROR_EXIT:
+	CloseJournal(pJournal);
+	pJournal = NULL;
+
+EXIT:
+	free(base);
+	free(journal);
+	free(joined);
+	return pJournal;
+}
+
+/// <summary>
+/// Makes room in the calendar's EntryTable for count entries, doubling it
+/// so a run of appends copies it a logarithmic number of times.  Nothing
+/// else rebuilds the table: CALENDAR_JOURNALED keeps the calendar from
+/// every call that changes entries
+/// </summary>
+static bool ReserveJournalTable(CalJournal *pJournal, unsigned int count)
+{
+	Calendar *pCalendar = pJournal->Calendar;
+
+	if (count <= pJournal->TableCapacity)
+	{
+		return true;
+	}
+
+	unsigned int capacity = pJournal->TableCapacity > UINT_MAX / 2 ? UINT_MAX : pJournal->TableCapacity * 2;
+	if (capacity < count)
+	{
+		capacity = count;
+	}
+
+	CalendarEntry **table = (CalendarEntry **)CalMalloc((size_t)capacity * sizeof(CalendarEntry *));
+	if (!table)
+	{
+		return false;
+	}
+
+	memcpy(table, pCalendar->EntryTable, pCalendar->EntryTableCount * sizeof(CalendarEntry *));
+	CalFree(pCalendar->EntryTable);
+	pCalendar->EntryTable = table;
+	pJournal->TableCapacity = capacity;
+	return true;
+}
+
+/// <summary>
+/// Appends whole entries, from their NEWENTRY elements, to the journal as
+/// one batch and to the end of the calendar.  The entries are parsed
+/// first, and added to the calendar only once the batch is on disk.
+/// Returns S_FALSE if they do not parse and -1 if the journal could not be
+/// written; either way nothing is appended
+/// </summary>
+HRESULT AppendJournal(CalJournal *pJournal, unsigned char *in, size_t len)
+{
+	HRESULT hr = S_FALSE;
+	Calendar *pCalendar = pJournal->Calendar;
+	Calendar *pParsed = NULL;
+	CalEntryFrame *frames = NULL;
+	CalendarEntry **fresh = NULL;
+	unsigned char *batch = NULL;
+	CalJournalBatch header;
+	CalParseOptions options = pJournal->Options.ParseOptions;
+	unsigned int n = pCalendar->EntryTableCount;
+	unsigned int total;
+	bool compact = false;
+
+	options.Flags &= REPARSE_ENTRY_FLAGS;
+
+	int count = FrameEntryRegion(in, 0, len, &frames);
+	if (count <= 0)
+	{
+		printf("-> ERROR: Entries appended must start with NEWENTRY and be whole\n");
+		goto EXIT;
+	}
+
+	total = n + (unsigned int)count;
+	if (total < n || (options.Limits.MaxEntries && total > options.Limits.MaxEntries))
+	{
+		printf("-> ERROR: entry budget of %u exceeded\n", options.Limits.MaxEntries);
+		goto EXIT;
+	}
+
+	fresh = (CalendarEntry **)calloc(count, sizeof(CalendarEntry *));
+	batch = (unsigned char *)malloc(sizeof(header) + len);
+	if (!fresh || !batch)
+	{
+		goto EXIT;
+	}
+
+	pParsed = ParseEntryFrames(pJournal->Version, in, frames, (unsigned int)count, &options);
+	if (!pParsed || !TakeParsedEntries(pCalendar, pParsed, fresh))
+	{
+		printf("-> ERROR: Could not parse the appended entries\n");
+		goto EXIT;
+	}
+
+	if (!ReserveJournalTable(pJournal, total))
+	{
+		goto EXIT;
+	}
+
+	header.Magic = CALJOURNAL_BATCH_MAGIC;
+	header.EntryCount = (uint32_t)count;
+	header.Length = len;
+	header.Hash = CalHash64(in, len, header.EntryCount);
+	memcpy(batch, &header, sizeof(header));
+	memcpy(batch + sizeof(header), in, len);
+
+	AcquireSRWLockExclusive(&pJournal->Lock);
+	if (pJournal->Failed)
+	{
+		printf("-> ERROR: The journal failed and takes no more appends\n");
+		hr = -1;
+	}
+	else if (!WriteJournalBytes(pJournal->File, pJournal->JournalBytes, batch, sizeof(header) + len) ||
+		!FlushFileBuffers(pJournal->File))
+	{
+		printf("-> ERROR: Could not write the journal\n");
+		hr = -1;
+
+		// Cut off whatever part of the batch was written
+		if (!TruncateJournalFile(pJournal->File, pJournal->JournalBytes))
+		{
+			pJournal->Failed = true;
+		}
+	}
+	else
+	{
+		pJournal->JournalBytes += sizeof(header) + len;
+		pJournal->JournalEntries += (unsigned int)count;
+		compact = pJournal->JournalBytes >= pJournal->Options.CompactBytes;
+		hr = S_OK;
+	}
+	ReleaseSRWLockExclusive(&pJournal->Lock);
+
+	if (hr != S_OK)
+	{
+		goto EXIT;
+	}
+
+	// Nothing can fail from here.  Link the entries on after the last
+	for (int i = 0; i < count; i++)
+	{
+		CalendarEntry *previous = pCalendar->EntryTable[n + i - 1];
+		previous->NextEntry = fresh[i];
+		fresh[i]->PreviousEntry = previous;
+		pCalendar->EntryTable[n + i] = fresh[i];
+	}
+	pCalendar->EntryTableCount = total;
+	pCalendar->EntryCount = (int)total;
+
+	if (compact)
+	{
+		StartCompactor(pJournal);
+	}
+
+EXIT:
+	if (hr != S_OK && fresh)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			DestroyCalendarEntry(fresh[i]);
+		}
+	}
+	DestroyCalendar(pParsed);
+	free(frames);
+	free(fresh);
+	free(batch);
+	return hr;
+}
+
+/// <summary>
+/// Starts folding the journal into a fresh base file in the background.
+/// With wait, a compaction already running is let finish and another
+/// folds everything appended before the call, and the result is returned
+/// </summary>
+HRESULT CompactJournal(CalJournal *pJournal, bool wait)
+{
+	if (wait)
+	{
+		JoinCompactor(pJournal);
+	}
+
+	if (!StartCompactor(pJournal))
+	{
+		return -1;
+	}
+
+	if (!wait)
+	{
+		return S_OK;
+	}
+
+	JoinCompactor(pJournal);
+	return pJournal->Compacted ? S_OK : S_FALSE;
+}
+
+/// <summary>
+/// Waits for a running compaction, closes the journal and destroys its
+/// calendar
+/// </summary>
+void CloseJournal(CalJournal *pJournal)
+{
+	if (!pJournal)
+	{
+		return;
+	}
+
+	JoinCompactor(pJournal);
+	if (pJournal->File != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(pJournal->File);
+	}
+	if (pJournal->Calendar)
+	{
+		pJournal->Calendar->Flags &= ~CALENDAR_JOURNALED;
+		DestroyCalendar(pJournal->Calendar);
+	}
+	free(pJournal);
+}
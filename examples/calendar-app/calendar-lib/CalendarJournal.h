@@ -0,0 +1,75 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarJournal.h:  contains the append-only journal of entries
+* kept beside a CAL file, and its background compaction
+*
+*********************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include "CalendarStructures.h"
+
+#define CALJOURNAL_MAX_PATH				260
+#define CALJOURNAL_SUFFIX				".journal"		// The journal of base.cal is base.cal.journal
+#define CALJOURNAL_TEMP_SUFFIX			".journal.tmp"
+#define CALJOURNAL_COMPACT_SUFFIX		".compact"		// The next base, while a compaction writes it
+#define CALJOURNAL_MAGIC				0x4A4C4143		// "CALJ"
+#define CALJOURNAL_BATCH_MAGIC			0x424C4143		// "CALB"
+#define CALJOURNAL_VERSION				1
+#define CALJOURNAL_DEFAULT_COMPACT_BYTES	(16 * 1024 * 1024)
+
+// Parse flags that build indexes, which a journal does not take: keeping
+// them would cost every append a rebuild over the whole calendar
+#define CALJOURNAL_INDEX_FLAGS			(CALPARSE_INDEX_CONTACTS | CALPARSE_INDEX_INTERVALS | CALPARSE_SORT_BY_START | CALPARSE_INDEX_TEXT | CALPARSE_BUILD_BLOOM)
+
+typedef struct _CalJournalOptions
+{
+	uint64_t CompactBytes;			// Journal size that starts a compaction; zero for CALJOURNAL_DEFAULT_COMPACT_BYTES
+	CalParseOptions ParseOptions;	// Applied to the base and every append; no entry filters, indexes or budgets but MaxEntries
+} CalJournalOptions;
+
+// The start of a journal file; batches follow it
+typedef struct _CalJournalHeader
+{
+	uint32_t Magic;				// CALJOURNAL_MAGIC
+	uint32_t Version;			// CALJOURNAL_VERSION
+	uint64_t BaseLength;		// Of the base file the batches are appended to
+	uint64_t BaseHash;			// CalHash64 of it
+} CalJournalHeader;
+
+// One append: the header, then Length bytes of whole entries
+typedef struct _CalJournalBatch
+{
+	uint32_t Magic;				// CALJOURNAL_BATCH_MAGIC
+	uint32_t EntryCount;
+	uint64_t Length;
+	uint64_t Hash;				// CalHash64 of the entries
+} CalJournalBatch;
+
+typedef struct _CalJournal
+{
+	SRWLOCK Lock;				// Guards the journal file between appends and the compactor
+	CalJournalOptions Options;
+	char BasePath[CALJOURNAL_MAX_PATH];
+	char JournalPath[CALJOURNAL_MAX_PATH];
+	struct _Calendar *Calendar;	// The base with the journal replayed over it
+	unsigned int TableCapacity;	// Entries the calendar's EntryTable has room for
+	int Version;				// VERSION of the base
+	HANDLE File;				// The journal, open for appending
+	uint64_t JournalBytes;		// Length of the batches written, with the header
+	unsigned int JournalEntries;
+	uint64_t BaseHash;
+	HANDLE Compactor;			// Compaction thread, if one was started
+	bool Compacting;			// Until the thread is done
+	bool Compacted;				// Whether the last compaction folded the journal
+	bool Failed;				// The files could not be brought back in step; no more appends
+} CalJournal;
+
+CalJournal *OpenJournal(const char *basePath, const CalJournalOptions *pOptions);
+HRESULT AppendJournal(CalJournal *pJournal, unsigned char *in, size_t len);
+HRESULT CompactJournal(CalJournal *pJournal, bool wait);
+void CloseJournal(CalJournal *pJournal);
@@ -0,0 +1,266 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarMerge.cpp:  contains the k-way merge that relinks many entry
+* lists into one ordered by start.  Lists already in start order are
+* merged through a binary heap of their heads, so k lists of N entries
+* in all merge in O(N log k)
+*
+*********************************************************************/
+
+#include "stdafx.h"
+#include <stdlib.h>
+#include "CalendarSort.h"
+#include "CalendarTime.h"
+#include "CalendarMerge.h"
+
+// An entry of a list that was not in start order, sorted by its start
+typedef struct _CalMergeItem
+{
+	int64_t Start;
+	CalendarEntry *Entry;
+} CalMergeItem;
+
+// The timed entries of one list, in start order
+typedef struct _CalMergeRun
+{
+	CalendarEntry *Head;
+	int64_t Start;				// Start of Head
+} CalMergeRun;
+
+/// <summary>
+/// Counts the entries of a list with a start and checks they are in
+/// ascending order of it; entries without a start are not considered
+/// </summary>
+static bool IsListInStartOrder(CalendarEntry *e, unsigned int *timed)
+{
+	bool ordered = true;
+	int64_t start, last = INT64_MIN;
+
+	*timed = 0;
+	for (; e; e = e->NextEntry)
+	{
+		if (GetEntryStart(e, &start))
+		{
+			ordered = ordered && start >= last;
+			last = start;
+			(*timed)++;
+		}
+	}
+	return ordered;
+}
+
+/// <summary>
+/// Returns true if run a comes before run b: by the start of its head,
+/// then by list, so entries with equal starts keep the order of the lists
+/// </summary>
+static bool RunPrecedes(const CalMergeRun *runs, unsigned int a, unsigned int b)
+{
+	return runs[a].Start < runs[b].Start || (runs[a].Start == runs[b].Start && a < b);
+}
+
+static void SiftRunDown(const CalMergeRun *runs, unsigned int *heap, unsigned int size, unsigned int i)
+{
+	unsigned int run = heap[i];
+
+	for (;;)
+	{
+		unsigned int child = 2 * i + 1;
+		if (child >= size)
+		{
+			break;
+		}
+		if (child + 1 < size && RunPrecedes(runs, heap[child + 1], heap[child]))
+		{
+			child++;
+		}
+		if (!RunPrecedes(runs, heap[child], run))
+		{
+			break;
+		}
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = run;
+}
+
+/// <summary>
+/// Relinks the lists once those not in start order have their timed
+/// entries sorted, one after another, in items, setting PreviousEntry as
+/// well as NextEntry.  Cannot fail
+/// </summary>
+static CalendarEntry *LinkInStartOrder(CalendarEntry **lists, unsigned int count, const bool *sorted,
+	const CalMergeItem *items, CalMergeRun *runs, unsigned int *heap)
+{
+	// Split each list into its run of timed entries and the entries
+	// without a start, chained in list order after all the others
+	CalendarEntry *untimed = NULL, **untimedTail = &untimed, *untimedLast = NULL;
+	const CalMergeItem *item = items;
+	unsigned int heapSize = 0;
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		CalendarEntry **runTail = &runs[i].Head;
+		unsigned int runLength = 0;
+		int64_t start;
+
+		for (CalendarEntry *e = lists[i], *next; e; e = next)
+		{
+			next = e->NextEntry;
+			if (!GetEntryStart(e, &start))
+			{
+				*untimedTail = e;
+				untimedTail = &e->NextEntry;
+				e->PreviousEntry = untimedLast;
+				untimedLast = e;
+			}
+			else
+			{
+				if (sorted[i])
+				{
+					*runTail = e;
+					runTail = &e->NextEntry;
+				}
+				runLength++;
+			}
+		}
+
+		if (!sorted[i])
+		{
+			for (unsigned int j = 0; j < runLength; j++, item++)
+			{
+				*runTail = item->Entry;
+				runTail = &item->Entry->NextEntry;
+			}
+		}
+		*runTail = NULL;
+
+		if (runs[i].Head)
+		{
+			GetEntryStart(runs[i].Head, &runs[i].Start);
+			heap[heapSize++] = i;
+		}
+	}
+	*untimedTail = NULL;
+
+	for (unsigned int i = heapSize / 2; i-- > 0;)
+	{
+		SiftRunDown(runs, heap, heapSize, i);
+	}
+
+	// Take the earliest head until every run is used up
+	CalendarEntry *head = NULL, **tail = &head, *last = NULL;
+	while (heapSize)
+	{
+		CalMergeRun *run = &runs[heap[0]];
+		CalendarEntry *e = run->Head;
+
+		*tail = e;
+		tail = &e->NextEntry;
+		e->PreviousEntry = last;
+		last = e;
+
+		run->Head = e->NextEntry;
+		if (run->Head)
+		{
+			GetEntryStart(run->Head, &run->Start);
+		}
+		else
+		{
+			heap[0] = heap[--heapSize];
+		}
+		if (heapSize)
+		{
+			SiftRunDown(runs, heap, heapSize, 0);
+		}
+	}
+	*tail = untimed;
+	if (untimed)
+	{
+		untimed->PreviousEntry = last;
+	}
+
+	return head;
+}
+
+/// <summary>
+/// Relinks count entry lists into one, in lists[0], ordered by start.
+/// Entries with equal starts keep the order of their lists and, within a
+/// list, their own order; entries without a start follow all the others
+/// in the same order.  A list not already in start order is sorted first.
+/// Returns false, leaving every list as it was, if memory ran out
+/// </summary>
+bool MergeEntryListsByStart(CalendarEntry **lists, unsigned int count)
+{
+	bool merged = false;
+	size_t unsortedCount = 0;
+	unsigned int timed;
+
+	CalMergeRun *runs = (CalMergeRun *)calloc(count ? count : 1, sizeof(CalMergeRun));
+	unsigned int *heap = (unsigned int *)malloc((count ? count : 1) * sizeof(unsigned int));
+	bool *sorted = (bool *)calloc(count ? count : 1, sizeof(bool));
+	CalMergeItem *items = NULL;
+
+	if (!runs || !heap || !sorted)
+	{
+		goto EXIT;
+	}
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		sorted[i] = IsListInStartOrder(lists[i], &timed);
+		if (!sorted[i])
+		{
+			unsortedCount += timed;
+		}
+	}
+
+	// Sort the lists that need it before relinking anything, since that
+	// can fail
+	if (unsortedCount)
+	{
+		items = (CalMergeItem *)malloc(unsortedCount * sizeof(CalMergeItem));
+		if (!items)
+		{
+			goto EXIT;
+		}
+
+		size_t at = 0;
+		for (unsigned int i = 0; i < count; i++)
+		{
+			if (sorted[i])
+			{
+				continue;
+			}
+
+			size_t first = at;
+			for (CalendarEntry *e = lists[i]; e; e = e->NextEntry)
+			{
+				if (GetEntryStart(e, &items[at].Start))
+				{
+					items[at++].Entry = e;
+				}
+			}
+			if (!CalRadixSort64(items + first, at - first, sizeof(CalMergeItem)))
+			{
+				goto EXIT;
+			}
+		}
+	}
+
+	lists[0] = LinkInStartOrder(lists, count, sorted, items, runs, heap);
+	for (unsigned int i = 1; i < count; i++)
+	{
+		lists[i] = NULL;
+	}
+	merged = true;
+
+EXIT:
+	free(runs);
+	free(heap);
+	free(sorted);
+	free(items);
+	return merged;
+}
@@ -0,0 +1,15 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarMerge.h:  contains the k-way merge of entry lists into
+* start order
+*
+*********************************************************************/
+
+#pragma once
+
+#include "CalendarStructures.h"
+
+bool MergeEntryListsByStart(CalendarEntry **lists, unsigned int count);
@@ -0,0 +1,801 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarParseCache.cpp:  contains the cache of parsed calendars, so a
+* CAL file buffer seen before costs a hash and a lookup instead of a
+* parse.  Calendars are kept in memory, most recently used first, and
+* optionally as snapshot files in a directory that outlives the process
+*
+*********************************************************************/
+
+#include "stdafx.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "CalendarHash.h"
+#include "CalendarContactIndex.h"
+#include "CalendarIntervalIndex.h"
+#include "CalendarStartOrder.h"
+#include "CalendarTextIndex.h"
+#include "CalendarBloom.h"
+#include "CalendarSnapshot.h"
+#include "CalendarFraming.h"
+#include "CalendarParseCache.h"
+
+Calendar *ParseInputEx(unsigned char *in, size_t len, const CalParseOptions *pOptions);
+
+#define CALCACHE_INITIAL_BUCKETS	64
+#define CALCACHE_SUFFIX				".csnp"
+
+// The cache structures are shared by every thread using the cache, so they
+// are allocated with malloc rather than CalMalloc; the calendars themselves
+// are parsed onto the heap as usual
+
+enum CacheLookup
+{
+	CACHE_DISKHIT,
+	CACHE_MISS
+};
+
+// Calendars evicted while the lock is held, destroyed once it is released
+typedef struct _CalCacheVictims
+{
+	Calendar **Calendars;
+	unsigned int Count;
+	unsigned int Capacity;
+} CalCacheVictims;
+
+/// <summary>
+/// Hashes the parse options, so calendars parsed with other options,
+/// such as by another process sharing the directory, never match
+/// </summary>
+static uint64_t HashParseOptions(const CalParseOptions *o)
+{
+	CalParseOptions normalized;
+
+	// Copied field by field so padding does not reach the hash
+	memset(&normalized, 0, sizeof(normalized));
+	normalized.Flags = o->Flags;
+	normalized.Limits.MaxAllocationBytes = o->Limits.MaxAllocationBytes;
+	normalized.Limits.MaxEntries = o->Limits.MaxEntries;
+	normalized.Limits.MaxRecipients = o->Limits.MaxRecipients;
+	normalized.Limits.MaxAttachments = o->Limits.MaxAttachments;
+	normalized.Limits.MaxElements = o->Limits.MaxElements;
+	normalized.Limits.MaxMilliseconds = o->Limits.MaxMilliseconds;
+	normalized.FieldMask = o->FieldMask;
+	normalized.EntryType = o->EntryType;
+	normalized.WindowStart = o->WindowStart;
+	normalized.WindowEnd = o->WindowEnd;
+	normalized.BloomFields = o->BloomFields;
+	normalized.BloomBitsPerKey = o->BloomBitsPerKey;
+	normalized.MaxZoneLoads = o->MaxZoneLoads;
+	return CalHash64(&normalized, sizeof(normalized), CALSNAP_MAGIC);
+}
+
+static void FormatCachePath(CalParseCache *pCache, const uint64_t key[2], const char *suffix, char *path)
+{
+	snprintf(path, CALCACHE_MAX_PATH, "%s/%016llx%016llx%s", pCache->Directory,
+		(unsigned long long)key[0], (unsigned long long)key[1], suffix);
+}
+
+/// <summary>
+/// Reads the key back from the name of a cache file; false for other names
+/// </summary>
+static bool ParseCacheFileName(const char *name, uint64_t key[2])
+{
+	key[0] = key[1] = 0;
+	for (int i = 0; i < 32; i++)
+	{
+		char c = name[i];
+		int digit = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+		if (digit < 0)
+		{
+			return false;
+		}
+		key[i / 16] = (key[i / 16] << 4) | (uint64_t)digit;
+	}
+	return strcmp(name + 32, CALCACHE_SUFFIX) == 0;
+}
+
+static size_t MeasureString(const CalString *s)
+{
+	if (!s)
+	{
+		return 0;
+	}
+
+	const unsigned char *value = (s->StringType == LONGSTRING) ? s->Long.Value : s->Short.Value;
+	size_t length = (s->StringType == LONGSTRING) ? s->Long.Length : s->Short.Length;
+	return sizeof(CalString) + ((value && value != s->Inline) ? length + 1 : 0);
+}
+
+static size_t MeasureContacts(const Contact *c)
+{
+	size_t bytes = 0;
+	for (; c; c = c->NextContact)
+	{
+		bytes += sizeof(Contact) + MeasureString(c->Name) + MeasureString(c->Email);
+	}
+	return bytes;
+}
+
+/// <summary>
+/// Estimates the heap bytes a parsed calendar holds, for the memory limit.
+/// Interned strings are counted once per use
+/// </summary>
+static size_t MeasureCalendar(Calendar *pCalendar)
+{
+	size_t bytes = sizeof(Calendar) + pCalendar->EntryTableCount * sizeof(CalendarEntry *);
+
+	if (pCalendar->Storage == SNAPSHOTSTORAGE)
+	{
+		return (size_t)GetSnapshotSize(pCalendar);
+	}
+
+	for (CalendarEntry *e = pCalendar->Entry; e; e = e->NextEntry)
+	{
+		bytes += sizeof(CalendarEntry);
+		bytes += MeasureContacts(e->Sender) + MeasureContacts(e->Recipient);
+		bytes += MeasureString(e->Location) + MeasureString(e->TimeZone);
+		bytes += MeasureString(e->Subject) + MeasureString(e->Content) + MeasureString(e->ContentType);
+		bytes += (e->StartTime ? sizeof(CalTime) : 0) + (e->Duration ? sizeof(CalTime) : 0) + (e->StartDate ? sizeof(CalDate) : 0);
+
+		if (e->Attachments)
+		{
+			bytes += sizeof(Attachments);
+			for (int i = 0; i < e->Attachments->Count && e->Attachments->Attachment; i++)
+			{
+				const Attachment *a = &e->Attachments->Attachment[i];
+				bytes += sizeof(Attachment) + MeasureString(a->Name) + (a->Blob ? sizeof(Blob) + a->Blob->Length : 0);
+			}
+		}
+
+		if (e->StructuredBlob)
+		{
+			bytes += sizeof(StructuredBlob) + e->StructuredBlob->TotalLength;
+		}
+	}
+
+	bytes += pCalendar->ContactIndex ? pCalendar->ContactIndex->Size : 0;
+	bytes += pCalendar->IntervalIndex ? pCalendar->IntervalIndex->Size : 0;
+	bytes += pCalendar->StartOrder ? pCalendar->StartOrder->Size : 0;
+	bytes += pCalendar->TextIndex ? (size_t)pCalendar->TextIndex->Size : 0;
+	bytes += pCalendar->Bloom ? pCalendar->Bloom->Size : 0;
+	bytes += pCalendar->EntryFrames ? pCalendar->EntryTableCount * sizeof(CalEntryFrame) : 0;
+	return bytes;
+}
+
+//////////////////////////////////////////
+//
+// Items
+//
+//////////////////////////////////////////
+
+static unsigned int KeyBucket(CalParseCache *pCache, const uint64_t key[2])
+{
+	return (unsigned int)key[0] & (pCache->BucketCount - 1);
+}
+
+static unsigned int CalendarBucket(CalParseCache *pCache, const Calendar *pCalendar)
+{
+	uint64_t x = (uint64_t)(uintptr_t)pCalendar * 0x9e3779b97f4a7c15ULL;
+	return (unsigned int)(x >> 32) & (pCache->BucketCount - 1);
+}
+
+static CalCacheItem *FindCacheItem(CalParseCache *pCache, const uint64_t key[2])
+{
+	CalCacheItem *item = pCache->ByKey[KeyBucket(pCache, key)];
+	while (item && (item->Key[0] != key[0] || item->Key[1] != key[1]))
+	{
+		item = item->NextByKey;
+	}
+	return item;
+}
+
+static CalCacheItem *FindCachedCalendar(CalParseCache *pCache, const Calendar *pCalendar)
+{
+	CalCacheItem *item = pCache->ByCalendar[CalendarBucket(pCache, pCalendar)];
+	while (item && item->Calendar != pCalendar)
+	{
+		item = item->NextByCalendar;
+	}
+	return item;
+}
+
+static void LinkCachedCalendar(CalParseCache *pCache, CalCacheItem *item)
+{
+	unsigned int bucket = CalendarBucket(pCache, item->Calendar);
+	item->NextByCalendar = pCache->ByCalendar[bucket];
+	pCache->ByCalendar[bucket] = item;
+}
+
+static void UnlinkCachedCalendar(CalParseCache *pCache, CalCacheItem *item)
+{
+	CalCacheItem **link = &pCache->ByCalendar[CalendarBucket(pCache, item->Calendar)];
+	while (*link != item)
+	{
+		link = &(*link)->NextByCalendar;
+	}
+	*link = item->NextByCalendar;
+	item->NextByCalendar = NULL;
+}
+
+/// <summary>
+/// Doubles the buckets once there is an item per bucket
+/// </summary>
+static bool GrowCacheBuckets(CalParseCache *pCache)
+{
+	unsigned int count = pCache->BucketCount * 2;
+	CalCacheItem **byKey = (CalCacheItem **)calloc(count, sizeof(CalCacheItem *));
+	CalCacheItem **byCalendar = (CalCacheItem **)calloc(count, sizeof(CalCacheItem *));
+	if (!byKey || !byCalendar)
+	{
+		free(byKey);
+		free(byCalendar);
+		return false;
+	}
+
+	CalCacheItem **oldByKey = pCache->ByKey;
+	unsigned int oldCount = pCache->BucketCount;
+
+	free(pCache->ByCalendar);
+	pCache->ByKey = byKey;
+	pCache->ByCalendar = byCalendar;
+	pCache->BucketCount = count;
+
+	for (unsigned int i = 0; i < oldCount; i++)
+	{
+		CalCacheItem *item = oldByKey[i];
+		while (item)
+		{
+			CalCacheItem *next = item->NextByKey;
+			unsigned int bucket = KeyBucket(pCache, item->Key);
+
+			item->NextByKey = pCache->ByKey[bucket];
+			pCache->ByKey[bucket] = item;
+			if (item->Calendar)
+			{
+				LinkCachedCalendar(pCache, item);
+			}
+			item = next;
+		}
+	}
+	free(oldByKey);
+	return true;
+}
+
+static CalCacheItem *CreateCacheItem(CalParseCache *pCache, const uint64_t key[2])
+{
+	if (pCache->ItemCount >= pCache->BucketCount && !GrowCacheBuckets(pCache))
+	{
+		return NULL;
+	}
+
+	CalCacheItem *item = (CalCacheItem *)calloc(1, sizeof(CalCacheItem));
+	if (!item)
+	{
+		return NULL;
+	}
+
+	unsigned int bucket = KeyBucket(pCache, key);
+	item->Key[0] = key[0];
+	item->Key[1] = key[1];
+	item->NextByKey = pCache->ByKey[bucket];
+	pCache->ByKey[bucket] = item;
+	pCache->ItemCount++;
+	return item;
+}
+
+/// <summary>
+/// Frees an item that holds neither a calendar nor a file
+/// </summary>
+static void RemoveCacheItem(CalParseCache *pCache, CalCacheItem *item)
+{
+	CalCacheItem **link = &pCache->ByKey[KeyBucket(pCache, item->Key)];
+	while (*link != item)
+	{
+		link = &(*link)->NextByKey;
+	}
+	*link = item->NextByKey;
+	pCache->ItemCount--;
+	free(item);
+}
+
+static void UnlinkRecency(CalParseCache *pCache, CalCacheItem *item)
+{
+	if (item->Newer) item->Newer->Older = item->Older;
+	else pCache->Newest = item->Older;
+	if (item->Older) item->Older->Newer = item->Newer;
+	else pCache->Oldest = item->Newer;
+	item->Newer = item->Older = NULL;
+}
+
+static void LinkNewest(CalParseCache *pCache, CalCacheItem *item)
+{
+	item->Older = pCache->Newest;
+	item->Newer = NULL;
+	if (pCache->Newest) pCache->Newest->Newer = item;
+	else pCache->Oldest = item;
+	pCache->Newest = item;
+}
+
+static void UnlinkDiskRecency(CalParseCache *pCache, CalCacheItem *item)
+{
+	if (item->DiskNewer) item->DiskNewer->DiskOlder = item->DiskOlder;
+	else pCache->DiskNewest = item->DiskOlder;
+	if (item->DiskOlder) item->DiskOlder->DiskNewer = item->DiskNewer;
+	else pCache->DiskOldest = item->DiskNewer;
+	item->DiskNewer = item->DiskOlder = NULL;
+}
+
+static void LinkDiskNewest(CalParseCache *pCache, CalCacheItem *item)
+{
+	item->DiskOlder = pCache->DiskNewest;
+	item->DiskNewer = NULL;
+	if (pCache->DiskNewest) pCache->DiskNewest->DiskNewer = item;
+	else pCache->DiskOldest = item;
+	pCache->DiskNewest = item;
+}
+
+/// <summary>
+/// Marks the file of an item on disk as the most recently used
+/// </summary>
+static void TouchCacheFile(CalParseCache *pCache, CalCacheItem *item)
+{
+	UnlinkDiskRecency(pCache, item);
+	LinkDiskNewest(pCache, item);
+}
+
+//////////////////////////////////////////
+//
+// Eviction
+//
+//////////////////////////////////////////
+
+static bool OverMemoryLimit(CalParseCache *pCache)
+{
+	return (pCache->Options.MaxMemoryBytes && pCache->Stats.MemoryBytes > pCache->Options.MaxMemoryBytes) ||
+		(pCache->Options.MaxMemoryCalendars && pCache->Stats.MemoryCalendars > pCache->Options.MaxMemoryCalendars);
+}
+
+/// <summary>
+/// Drops the least recently used calendars that are not in use until the
+/// memory tier is within its limits.  Those with a file stay on disk
+/// </summary>
+static void EvictMemory(CalParseCache *pCache, CalCacheVictims *victims)
+{
+	CalCacheItem *item = pCache->Oldest;
+
+	while (item && OverMemoryLimit(pCache))
+	{
+		CalCacheItem *newer = item->Newer;
+
+		if (!item->References)
+		{
+			if (victims->Count == victims->Capacity)
+			{
+				unsigned int capacity = victims->Capacity ? victims->Capacity * 2 : 16;
+				Calendar **grown = (Calendar **)realloc(victims->Calendars, capacity * sizeof(Calendar *));
+				if (!grown)
+				{
+					return;
+				}
+				victims->Calendars = grown;
+				victims->Capacity = capacity;
+			}
+
+			victims->Calendars[victims->Count++] = item->Calendar;
+			UnlinkRecency(pCache, item);
+			UnlinkCachedCalendar(pCache, item);
+			pCache->Stats.MemoryBytes -= item->MemoryBytes;
+			pCache->Stats.MemoryCalendars--;
+			pCache->Stats.MemoryEvictions++;
+			item->Calendar = NULL;
+			item->MemoryBytes = 0;
+
+			if (!item->DiskBytes)
+			{
+				RemoveCacheItem(pCache, item);
+			}
+		}
+		item = newer;
+	}
+}
+
+static void DropCacheFile(CalParseCache *pCache, CalCacheItem *item)
+{
+	char path[CALCACHE_MAX_PATH];
+
+	FormatCachePath(pCache, item->Key, CALCACHE_SUFFIX, path);
+	DeleteFileA(path);
+	UnlinkDiskRecency(pCache, item);
+	pCache->Stats.DiskBytes -= item->DiskBytes;
+	pCache->Stats.DiskCalendars--;
+	item->DiskBytes = 0;
+
+	if (!item->Calendar)
+	{
+		RemoveCacheItem(pCache, item);
+	}
+}
+
+/// <summary>
+/// Deletes the least recently used files until the disk tier is within its
+/// limit.  Files mapped by the memory tier are in use and kept.  Files
+/// found when the cache was created count as older than any used since
+/// </summary>
+static void EvictDisk(CalParseCache *pCache)
+{
+	CalCacheItem *item = pCache->DiskOldest;
+
+	while (item && pCache->Options.MaxDiskBytes && pCache->Stats.DiskBytes > pCache->Options.MaxDiskBytes)
+	{
+		CalCacheItem *newer = item->DiskNewer;
+
+		if (!(item->Calendar && item->Calendar->Storage == SNAPSHOTSTORAGE))
+		{
+			DropCacheFile(pCache, item);
+			pCache->Stats.DiskEvictions++;
+		}
+		item = newer;
+	}
+}
+
+/// <summary>
+/// Destroys a calendar the cache owns.  Parsed calendars have their
+/// CALENDAR_SHARED flag cleared first; mapped ones, whose flag is in a
+/// read-only view, are unmapped directly
+/// </summary>
+static void DestroyCachedCalendar(Calendar *pCalendar)
+{
+	if (!pCalendar)
+	{
+		return;
+	}
+
+	if (pCalendar->Storage == SNAPSHOTSTORAGE)
+	{
+		UnmapSnapshot(pCalendar);
+		return;
+	}
+
+	pCalendar->Flags &= ~CALENDAR_SHARED;
+	DestroyCalendar(pCalendar);
+}
+
+static void DestroyVictims(CalCacheVictims *victims)
+{
+	for (unsigned int i = 0; i < victims->Count; i++)
+	{
+		DestroyCachedCalendar(victims->Calendars[i]);
+	}
+	free(victims->Calendars);
+}
+
+//////////////////////////////////////////
+//
+// Lookups
+//
+//////////////////////////////////////////
+
+/// <summary>
+/// Writes a calendar to the file for its key.  It is written under another
+/// name and renamed, so readers never map a partial file
+/// </summary>
+static uint64_t SaveCacheFile(CalParseCache *pCache, const uint64_t key[2], Calendar *pCalendar)
+{
+	char suffix[32];
+	char temporary[CALCACHE_MAX_PATH];
+	char path[CALCACHE_MAX_PATH];
+	uint64_t bytes = 0;
+
+	snprintf(suffix, sizeof(suffix), ".%lu.tmp", (unsigned long)GetCurrentThreadId());
+	FormatCachePath(pCache, key, suffix, temporary);
+	FormatCachePath(pCache, key, CALCACHE_SUFFIX, path);
+
+	if (!SaveSnapshot(pCalendar, temporary, &bytes) || !MoveFileExA(temporary, path, MOVEFILE_REPLACE_EXISTING))
+	{
+		DeleteFileA(temporary);
+		return 0;
+	}
+	return bytes;
+}
+
+/// <summary>
+/// Adds a calendar that was mapped or parsed outside the lock and hands out
+/// a reference to it.  If another thread added the same key meanwhile, its
+/// calendar is returned instead and this one destroyed
+/// </summary>
+static Calendar *InsertCached(CalParseCache *pCache, const uint64_t key[2], Calendar *pCalendar, uint64_t diskBytes, int lookup)
+{
+	CalCacheVictims victims = { NULL, 0, 0 };
+	Calendar *duplicate = NULL;
+	size_t memoryBytes = MeasureCalendar(pCalendar);
+
+	AcquireSRWLockExclusive(&pCache->Lock);
+
+	CalCacheItem *item = FindCacheItem(pCache, key);
+	if (!item)
+	{
+		item = CreateCacheItem(pCache, key);
+	}
+
+	if (!item)
+	{
+		duplicate = pCalendar;
+		pCalendar = NULL;
+	}
+	else
+	{
+		if (item->Calendar)
+		{
+			duplicate = pCalendar;
+			pCalendar = item->Calendar;
+			UnlinkRecency(pCache, item);
+		}
+		else
+		{
+			item->Calendar = pCalendar;
+			item->MemoryBytes = memoryBytes;
+			LinkCachedCalendar(pCache, item);
+			pCache->Stats.MemoryBytes += memoryBytes;
+			pCache->Stats.MemoryCalendars++;
+		}
+		LinkNewest(pCache, item);
+
+		if (diskBytes && !item->DiskBytes)
+		{
+			item->DiskBytes = diskBytes;
+			LinkDiskNewest(pCache, item);
+			pCache->Stats.DiskBytes += diskBytes;
+			pCache->Stats.DiskCalendars++;
+		}
+		else if (item->DiskBytes)
+		{
+			TouchCacheFile(pCache, item);
+		}
+
+		item->References++;
+		EvictMemory(pCache, &victims);
+		EvictDisk(pCache);
+	}
+
+	if (lookup == CACHE_DISKHIT)
+	{
+		pCache->Stats.DiskHits++;
+	}
+	else
+	{
+		pCache->Stats.Misses++;
+	}
+
+	ReleaseSRWLockExclusive(&pCache->Lock);
+
+	DestroyCachedCalendar(duplicate);
+	DestroyVictims(&victims);
+	return pCalendar;
+}
+
+/// <summary>
+/// Returns the calendar for a CAL file buffer: from memory if the same
+/// bytes were parsed with the same options before, else mapped from its
+/// snapshot file, else parsed and added to both tiers.  The calendar is
+/// shared and carries CALENDAR_SHARED, so the calls that change or
+/// destroy calendars reject it; release it with ReleaseCached.  Buffers
+/// that fail to parse are not cached
+/// </summary>
+Calendar *ParseCached(CalParseCache *pCache, unsigned char *in, size_t len)
+{
+	uint64_t key[2];
+	char path[CALCACHE_MAX_PATH];
+	Calendar *pCalendar = NULL;
+	bool onDisk = false;
+
+	CalHash128(in, len, pCache->Seed, key);
+
+	AcquireSRWLockExclusive(&pCache->Lock);
+	CalCacheItem *item = FindCacheItem(pCache, key);
+	if (item)
+	{
+		if (item->DiskBytes)
+		{
+			TouchCacheFile(pCache, item);
+		}
+		if (item->Calendar)
+		{
+			item->References++;
+			UnlinkRecency(pCache, item);
+			LinkNewest(pCache, item);
+			pCache->Stats.MemoryHits++;
+			pCalendar = item->Calendar;
+		}
+		onDisk = item->DiskBytes != 0;
+	}
+	ReleaseSRWLockExclusive(&pCache->Lock);
+
+	if (pCalendar)
+	{
+		return pCalendar;
+	}
+
+	if (onDisk)
+	{
+		FormatCachePath(pCache, key, CALCACHE_SUFFIX, path);
+		pCalendar = MapSnapshot(path, CALENDAR_SHARED);
+		if (pCalendar)
+		{
+			return InsertCached(pCache, key, pCalendar, 0, CACHE_DISKHIT);
+		}
+
+		// A damaged or vanished file is forgotten and the buffer parsed again
+		AcquireSRWLockExclusive(&pCache->Lock);
+		item = FindCacheItem(pCache, key);
+		if (item && item->DiskBytes)
+		{
+			DropCacheFile(pCache, item);
+		}
+		ReleaseSRWLockExclusive(&pCache->Lock);
+	}
+
+	pCalendar = ParseInputEx(in, len, &pCache->Options.ParseOptions);
+	if (!pCalendar)
+	{
+		AcquireSRWLockExclusive(&pCache->Lock);
+		pCache->Stats.Misses++;
+		ReleaseSRWLockExclusive(&pCache->Lock);
+		return NULL;
+	}
+
+	uint64_t diskBytes = pCache->Directory[0] ? SaveCacheFile(pCache, key, pCalendar) : 0;
+	pCalendar->Flags |= CALENDAR_SHARED;
+	return InsertCached(pCache, key, pCalendar, diskBytes, CACHE_MISS);
+}
+
+/// <summary>
+/// Gives back a calendar returned by ParseCached.  Once released by every
+/// caller it may be evicted.  False if the cache did not hand it out
+/// </summary>
+bool ReleaseCached(CalParseCache *pCache, Calendar *pCalendar)
+{
+	CalCacheVictims victims = { NULL, 0, 0 };
+	bool released = false;
+
+	AcquireSRWLockExclusive(&pCache->Lock);
+	CalCacheItem *item = FindCachedCalendar(pCache, pCalendar);
+	if (item && item->References)
+	{
+		item->References--;
+		EvictMemory(pCache, &victims);
+		released = true;
+	}
+	ReleaseSRWLockExclusive(&pCache->Lock);
+
+	DestroyVictims(&victims);
+	return released;
+}
+
+void GetParseCacheStats(CalParseCache *pCache, CalParseCacheStats *pStats)
+{
+	AcquireSRWLockShared(&pCache->Lock);
+	*pStats = pCache->Stats;
+	ReleaseSRWLockShared(&pCache->Lock);
+}
+
+//////////////////////////////////////////
+//
+// Lifetime
+//
+//////////////////////////////////////////
+
+/// <summary>
+/// Adds the snapshot files already in the directory to the disk tier, then
+/// trims it to its limit
+/// </summary>
+static void LoadCacheDirectory(CalParseCache *pCache)
+{
+	char pattern[CALCACHE_MAX_PATH];
+	WIN32_FIND_DATAA data;
+	uint64_t key[2];
+
+	snprintf(pattern, sizeof(pattern), "%s/*%s", pCache->Directory, CALCACHE_SUFFIX);
+	HANDLE find = FindFirstFileA(pattern, &data);
+	if (find == INVALID_HANDLE_VALUE)
+	{
+		return;
+	}
+
+	do
+	{
+		uint64_t bytes = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+		if (!ParseCacheFileName(data.cFileName, key) || !bytes || FindCacheItem(pCache, key))
+		{
+			continue;
+		}
+
+		CalCacheItem *item = CreateCacheItem(pCache, key);
+		if (!item)
+		{
+			break;
+		}
+		item->DiskBytes = bytes;
+		LinkDiskNewest(pCache, item);
+		pCache->Stats.DiskBytes += bytes;
+		pCache->Stats.DiskCalendars++;
+	} while (FindNextFileA(find, &data));
+
+	FindClose(find);
+	EvictDisk(pCache);
+}
+
+CalParseCache *CreateParseCache(const CalParseCacheOptions *pOptions)
+{
+	CalParseCache *pCache = (CalParseCache *)calloc(1, sizeof(CalParseCache));
+	if (!pCache)
+	{
+		return NULL;
+	}
+
+	InitializeSRWLock(&pCache->Lock);
+	pCache->Options = *pOptions;
+	pCache->Seed = HashParseOptions(&pOptions->ParseOptions);
+
+	if (pOptions->Directory && pOptions->Directory[0])
+	{
+		// Leaves room for the file name
+		if (strlen(pOptions->Directory) + 48 >= CALCACHE_MAX_PATH)
+		{
+			printf("-> ERROR: cache directory path too long\n");
+			goto ERROR_EXIT;
+		}
+		strcpy(pCache->Directory, pOptions->Directory);
+	}
+	pCache->Options.Directory = pCache->Directory[0] ? pCache->Directory : NULL;
+
+	pCache->BucketCount = CALCACHE_INITIAL_BUCKETS;
+	pCache->ByKey = (CalCacheItem **)calloc(pCache->BucketCount, sizeof(CalCacheItem *));
+	pCache->ByCalendar = (CalCacheItem **)calloc(pCache->BucketCount, sizeof(CalCacheItem *));
+	if (!pCache->ByKey || !pCache->ByCalendar)
+	{
+		goto ERROR_EXIT;
+	}
+
+	if (pCache->Directory[0])
+	{
+		LoadCacheDirectory(pCache);
+	}
+	return pCache;
+
+ERROR_EXIT:
+	DestroyParseCache(pCache);
+	return NULL;
+}
+
+/// <summary>
+/// Destroys the cache and the calendars in its memory tier, which must all
+/// have been released.  The files of the disk tier are kept
+/// </summary>
+void DestroyParseCache(CalParseCache *pCache)
+{
+	if (!pCache)
+	{
+		return;
+	}
+
+	for (unsigned int i = 0; pCache->ByKey && i < pCache->BucketCount; i++)
+	{
+		CalCacheItem *item = pCache->ByKey[i];
+		while (item)
+		{
+			CalCacheItem *next = item->NextByKey;
+			DestroyCachedCalendar(item->Calendar);
+			free(item);
+			item = next;
+		}
+	}
+
+	free(pCache->ByKey);
+	free(pCache->ByCalendar);
+	free(pCache);
+}
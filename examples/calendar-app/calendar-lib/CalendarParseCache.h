@@ -0,0 +1,77 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarParseCache.h:  contains the cache of parsed calendars keyed
+* by the content of their CAL file buffers
+*
+*********************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include "CalendarStructures.h"
+
+#define CALCACHE_MAX_PATH	260
+
+// Limits of zero mean no limit.  Without a Directory there is no disk tier
+typedef struct _CalParseCacheOptions
+{
+	size_t MaxMemoryBytes;
+	unsigned int MaxMemoryCalendars;
+	const char *Directory;		// Holds a snapshot file per cached buffer
+	uint64_t MaxDiskBytes;
+	CalParseOptions ParseOptions;	// Applied to every parse; part of the key
+} CalParseCacheOptions;
+
+typedef struct _CalParseCacheStats
+{
+	uint64_t MemoryHits;
+	uint64_t DiskHits;
+	uint64_t Misses;
+	uint64_t MemoryEvictions;
+	uint64_t DiskEvictions;
+	uint64_t MemoryBytes;
+	uint64_t DiskBytes;
+	unsigned int MemoryCalendars;
+	unsigned int DiskCalendars;
+} CalParseCacheStats;
+
+typedef struct _CalCacheItem
+{
+	uint64_t Key[2];
+	struct _Calendar *Calendar;	// NULL while only on disk
+	size_t MemoryBytes;
+	uint64_t DiskBytes;			// Zero if not on disk
+	unsigned int References;	// Lookups not yet released
+	struct _CalCacheItem *Newer;	// Memory tier, most recently used first
+	struct _CalCacheItem *Older;
+	struct _CalCacheItem *DiskNewer;	// Disk tier, most recently used first
+	struct _CalCacheItem *DiskOlder;
+	struct _CalCacheItem *NextByKey;
+	struct _CalCacheItem *NextByCalendar;
+} CalCacheItem;
+
+typedef struct _CalParseCache
+{
+	SRWLOCK Lock;
+	CalParseCacheOptions Options;
+	char Directory[CALCACHE_MAX_PATH];
+	uint64_t Seed;				// Hash of the parse options
+	CalCacheItem **ByKey;
+	CalCacheItem **ByCalendar;
+	unsigned int BucketCount;	// A power of two
+	unsigned int ItemCount;
+	CalCacheItem *Newest;
+	CalCacheItem *Oldest;
+	CalCacheItem *DiskNewest;
+	CalCacheItem *DiskOldest;
+	CalParseCacheStats Stats;
+} CalParseCache;
+
+CalParseCache *CreateParseCache(const CalParseCacheOptions *pOptions);
+Calendar *ParseCached(CalParseCache *pCache, unsigned char *in, size_t len);
+bool ReleaseCached(CalParseCache *pCache, Calendar *pCalendar);
+void GetParseCacheStats(CalParseCache *pCache, CalParseCacheStats *pStats);
+void DestroyParseCache(CalParseCache *pCache);
@@ -11,7 +11,18 @@
 #include "stdafx.h"
 #include "CalendarParser.h"
 #include "CalendarBuffer.h"
+#include "CalendarArena.h"
 #include "CalendarStructures.h"
+#include "CalendarStringTable.h"
+#include "CalendarContactIndex.h"
+#include "CalendarIntervalIndex.h"
+#include "CalendarStartOrder.h"
+#include "CalendarTextIndex.h"
+#include "CalendarBloom.h"
+#include "CalendarTime.h"
+#include "CalendarTimeZone.h"
+#include "CalendarFingerprint.h"
+#include "CalendarReparse.h"
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -100,7 +111,31 @@ CalString *ParseCalString(Buffer *pBuffer, CalStringType type)
 			return NULL;
 		}
 
-		unsigned char *p = (unsigned char *)malloc(totlen); // Bug #1: alloc too short
+		// Repeated values share one CalString when interning is enabled.  A
+		// length that overflowed totlen above still takes the path below
+		CalStringTable *pStrings = GetThreadStringTable();
+		if (pStrings && totlen > len)
+		{
+			CalString *pszString = InternCalString(pStrings, BUFFER_GETCURRENT(pBuffer), len);
+			if (pszString)
+			{
+				BUFFER_ADVANCE(pBuffer, len);
+			}
+			return pszString;
+		}
+
+		// Short values are stored inline, saving the separate value allocation
+		if (len <= CALSTRING_INLINE_LENGTH)
+		{
+			CalString *pszString = CreateCalStringFromBytes(type, BUFFER_GETCURRENT(pBuffer), len);
+			if (pszString)
+			{
+				BUFFER_ADVANCE(pBuffer, len);
+			}
+			return pszString;
+		}
+
+		unsigned char *p = (unsigned char *)CalMalloc(totlen); // Bug #1: alloc too short
 		if (!p)
 		{
 			return NULL;
@@ -113,7 +148,7 @@ CalString *ParseCalString(Buffer *pBuffer, CalStringType type)
 		CalString *pszString = CreateCalString(type);
 		if (!pszString)
 		{
-			free(p);
+			CalFree(p);
 			return NULL;
 		}
 
@@ -148,7 +183,18 @@ CalString *ParseCalString(Buffer *pBuffer, CalStringType type)
 			return NULL;
 		}
 
-		unsigned char *p = (unsigned char *)malloc(totlen); // Bug #1: alloc too short
+		// Short values are stored inline, saving the separate value allocation
+		if (len <= CALSTRING_INLINE_LENGTH)
+		{
+			CalString *pszString = CreateCalStringFromBytes(type, BUFFER_GETCURRENT(pBuffer), len);
+			if (pszString)
+			{
+				BUFFER_ADVANCE(pBuffer, len);
+			}
+			return pszString;
+		}
+
+		unsigned char *p = (unsigned char *)CalMalloc(totlen); // Bug #1: alloc too short
 		if (!p)
 		{
 			return NULL;
@@ -161,7 +207,7 @@ CalString *ParseCalString(Buffer *pBuffer, CalStringType type)
 		CalString *pszString = CreateCalString(type);
 		if (!pszString)
 		{
-			free(p);
+			CalFree(p);
 			return NULL;
 		}
 
@@ -417,7 +463,7 @@ Blob *ParseBlob(Buffer *pBuffer)
 		return NULL;
 	}
 
-	pBlob->Data = malloc(len);
+	pBlob->Data = CalMalloc(len);
 	if (!pBlob->Data)
 	{
 		goto ERROR_EXIT;
@@ -468,9 +514,9 @@ CalDate *ParseDate(Buffer *pBuffer)
 
 /// <summary>
 /// Reads the content of one or more ATTACHMENT elements from the buffer into
-/// an Attachments object that's returned
+/// an Attachments object that's returned; maxAttachments of 0 means no limit
 /// </summary>
-Attachments *ParseAttachments(Buffer *pBuffer)
+Attachments *ParseAttachments(Buffer *pBuffer, unsigned int maxAttachments)
 {
 	CalString *pszBlobName = NULL;
 	Blob *pBlob = NULL;
@@ -478,6 +524,12 @@ Attachments *ParseAttachments(Buffer *pBuffer)
 	uint32_t attachmentCount = BUFFER_GETUINT(pBuffer);
 	BUFFER_ADVANCE(pBuffer, sizeof(attachmentCount));
 
+	if (maxAttachments && attachmentCount > maxAttachments)
+	{
+		printf("-> ERROR: attachment count %u exceeds budget\n", attachmentCount);
+		return NULL;
+	}
+
 	Attachments *pAttachments = CreateAttachments();
 	if (!pAttachments)
 	{
@@ -521,7 +573,7 @@ Attachments *ParseAttachments(Buffer *pBuffer)
 		}
 	}
 
-	pAttachments->Attachment = (Attachment *)calloc(1, totlen);
+	pAttachments->Attachment = (Attachment *)CalCalloc(1, totlen);
 	if (!pAttachments->Attachment)
 	{
 		goto ERROR_EXIT;
@@ -650,7 +702,7 @@ StructuredBlob *ParseStructuredBlob(Buffer *pBuffer)
 	pUnknown->SegmentLength = elementLength;
 	pUnknown->SegmentCount = elementCount;
 	pUnknown->TotalLength = elementLength * elementCount;
-	pUnknown->Data = calloc(elementCount, elementLength);
+	pUnknown->Data = CalCalloc(elementCount, elementLength);
 	if (!pUnknown->Data)
 	{
 		goto ERROR_EXIT;
@@ -728,11 +780,182 @@ bool IsValidEntry(CalendarEntry *pEntry)
 	return ret;
 }
 
+#define CALFIELD_MANDATORY			(CALFIELD(ENTRYTYPE) | CALFIELD(SENDER) | CALFIELD(STARTTIME) | \
+									CALFIELD(TIMEZONE) | CALFIELD(DURATION))
+
+#define CALFIELD_WINDOW				(CALFIELD(STARTDATE) | CALFIELD(STARTTIME) | CALFIELD(TIMEZONE) | \
+									CALFIELD(DURATION))
+
+// No zone is further than this from UTC, so a date alone bounds the start
+#define FILTER_MAX_ZONE_OFFSET		(26 * 3600)
+
+/// <summary>
+/// Returns the field mask bit of a per-entry element type, or 0 for any
+/// other element
+/// </summary>
+static unsigned int EntryElementField(char elementType)
+{
+	if (elementType < 0 || elementType > STRUCTBLOB)
+	{
+		return 0;
+	}
+	return CALFIELD(elementType) & CALFIELD_ENTRY_ELEMENTS;
+}
+
+static int SkipShortString(Buffer *pBuffer)
+{
+	if (BUFFER_LEFTOVER(pBuffer) < sizeof(uint16_t))
+	{
+		return -1;
+	}
+
+	uint16_t len = BUFFER_GETUSHORT(pBuffer);
+	BUFFER_ADVANCE(pBuffer, sizeof(len));
+	if (BUFFER_LEFTOVER(pBuffer) < len)
+	{
+		return -1;
+	}
+	BUFFER_ADVANCE(pBuffer, len);
+	return 0;
+}
+
+/// <summary>
+/// Advances past an ATTACHMENT element, which carries a count rather than
+/// a length, checking the framing of each name and blob
+/// </summary>
+static int SkipAttachments(Buffer *pBuffer)
+{
+	if (BUFFER_LEFTOVER(pBuffer) < sizeof(uint32_t))
+	{
+		return -1;
+	}
+
+	uint32_t attachmentCount = BUFFER_GETUINT(pBuffer);
+	BUFFER_ADVANCE(pBuffer, sizeof(attachmentCount));
+
+	for (uint32_t i = 0; i < attachmentCount; i++)
+	{
+		if (-1 == SkipShortString(pBuffer) || BUFFER_LEFTOVER(pBuffer) < sizeof(uint32_t) || -1 == SkipElement(pBuffer))
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/// <summary>
+/// Advances past a per-entry element without materializing it
+/// </summary>
+static int SkipEntryElement(Buffer *pBuffer, char elementType)
+{
+	if (elementType == TIMEZONE)
+	{
+		return SkipShortString(pBuffer);
+	}
+	if (elementType == ATTACHMENT)
+	{
+		return SkipAttachments(pBuffer);
+	}
+	return SkipElement(pBuffer);
+}
+
+/// <summary>
+/// Returns true if all mandatory elements of an entry were seen, whether
+/// or not they were materialized
+/// </summary>
+static bool HasMandatoryElements(unsigned int seenFields)
+{
+	if ((seenFields & CALFIELD_MANDATORY) != CALFIELD_MANDATORY)
+	{
+		printf("Invalid CalendarEntry: mandatory element missing (fields %#x)\n", seenFields);
+		return false;
+	}
+	return true;
+}
+
+/// <summary>
+/// Returns true if the entry filters in the options rule an entry out.
+/// Until the entry is complete, only the filters whose deciding elements
+/// have been parsed are applied; once it is, an undecided filter rejects
+/// </summary>
+static bool IsEntryFilteredOut(CalendarEntry *pEntry, const CalParseOptions *pOptions, bool complete)
+{
+	if (pOptions->Flags & CALPARSE_FILTER_TYPE)
+	{
+		if (pEntry->EntryType != NONE ? pEntry->EntryType != pOptions->EntryType : complete)
+		{
+			return true;
+		}
+	}
+
+	if (pOptions->Flags & CALPARSE_FILTER_WINDOW)
+	{
+		int64_t start, end;
+		CalDate *d = pEntry->StartDate;
+
+		if (pEntry->StartDate && pEntry->StartTime && pEntry->TimeZone && pEntry->Duration)
+		{
+			ResolveEntryTimes(pEntry);
+			return !GetEntryInterval(pEntry, &start, &end) || start >= pOptions->WindowEnd || end <= pOptions->WindowStart;
+		}
+
+		// A start date is enough to rule out entries that begin after the window
+		if (d && CalDaysFromCivil(d->Year, d->Month, d->Day) * 86400 - FILTER_MAX_ZONE_OFFSET >= pOptions->WindowEnd)
+		{
+			return true;
+		}
+
+		if (complete)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/// <summary>
+/// Unlinks a filtered-out entry and releases it, putting pReplacement (which
+/// may be NULL) in its place.  Returns the entry that now ends the list
+/// </summary>
+static CalendarEntry *DiscardEntry(Calendar *pCalendar, CalendarEntry *pEntry, CalendarEntry *pReplacement)
+{
+	CalendarEntry *pPrevious = pEntry->PreviousEntry;
+
+	if (pReplacement)
+	{
+		pReplacement->PreviousEntry = pPrevious;
+	}
+
+	if (pPrevious)
+	{
+		pPrevious->NextEntry = pReplacement;
+	}
+	else
+	{
+		pCalendar->Entry = pReplacement;
+	}
+
+	pEntry->NextEntry = NULL;
+	DestroyCalendarEntry(pEntry);
+	return pReplacement ? pReplacement : pPrevious;
+}
+
+Calendar *ParseInputEx(unsigned char *in, size_t len, const CalParseOptions *pOptions);
+
 /// <summary>
 /// The main parsing method; contains a loop that iterates through
 /// all the elements present in the incoming buffered CAL file data
 /// </summary>
 Calendar *ParseInput(unsigned char *in, size_t len)
+{
+	return ParseInputEx(in, len, NULL);
+}
+
+/// <summary>
+/// ParseInput with options; pOptions may be NULL for the defaults
+/// </summary>
+Calendar *ParseInputEx(unsigned char *in, size_t len, const CalParseOptions *pOptions)
 {
 	int version = 0;
 	int entryCount = 0;					// From the file
@@ -744,10 +967,37 @@ Calendar *ParseInput(unsigned char *in, size_t len)
 	Calendar *pCalendar = NULL;
 	CalendarEntry *pCurrentEntry = NULL; // Bug #6: initial pointer to current CalendarEntry is NULL
 
-	Buffer *pBuffer = CreateBuffer(in, len);
-	if (!pBuffer)
+	Buffer buffer;
+	Buffer *pBuffer = &buffer;
+	InitBuffer(pBuffer, in, len);
+
+	// Budgets are counted independently of the Bug #5 running total above
+	static const CalParseLimits noLimits = { 0 };
+	const CalParseLimits *pLimits = pOptions ? &pOptions->Limits : &noLimits;
+	unsigned int entriesSeen = 0;
+	unsigned int recipientsSeen = 0;
+	unsigned int elementsSeen = 0;
+	ULONGLONG startTicks = GetTickCount64();
+	size_t previousBudget = SetThreadAllocationBudget(pLimits->MaxAllocationBytes);
+	unsigned int previousZoneLoads = SetThreadZoneLoadBudget(pOptions ? pOptions->MaxZoneLoads : 0);
+
+	// The string table is created with the Calendar and installed for the parse
+	bool internStrings = pOptions && (pOptions->Flags & CALPARSE_INTERN_STRINGS);
+	CalStringTable *previousStrings = SetThreadStringTable(NULL);
+
+	// With a field mask or an entry filter, elements that are not wanted are
+	// skipped over, and entries are dropped as soon as a filter rules them out
+	unsigned int filterFields = 0;
+	unsigned int keepFields = CALFIELD_ENTRY_ELEMENTS;
+	unsigned int seenFields = 0;
+	bool entryFilteredOut = false;
+	bool selective = pOptions && (pOptions->Flags & (CALPARSE_PROJECT_FIELDS | CALPARSE_FILTER_TYPE | CALPARSE_FILTER_WINDOW));
+
+	if (selective)
 	{
-		return NULL;
+		if (pOptions->Flags & CALPARSE_FILTER_TYPE) filterFields |= CALFIELD(ENTRYTYPE);
+		if (pOptions->Flags & CALPARSE_FILTER_WINDOW) filterFields |= CALFIELD_WINDOW;
+		if (pOptions->Flags & CALPARSE_PROJECT_FIELDS) keepFields = (pOptions->FieldMask & CALFIELD_ENTRY_ELEMENTS) | filterFields;
 	}
 
 	// This is the main parse loop:  it will cycle through
@@ -755,6 +1005,18 @@ Calendar *ParseInput(unsigned char *in, size_t len)
 
 	while (BUFFER_LEFTOVER(pBuffer) >= 5) // Size of smallest element
 	{
+		if (pLimits->MaxElements && ++elementsSeen > pLimits->MaxElements)
+		{
+			printf("-> ERROR: element budget of %u exceeded\n", pLimits->MaxElements);
+			goto ERROR_EXIT;
+		}
+
+		if (pLimits->MaxMilliseconds && GetTickCount64() - startTicks > pLimits->MaxMilliseconds)
+		{
+			printf("-> ERROR: time budget of %ums exceeded\n", pLimits->MaxMilliseconds);
+			goto ERROR_EXIT;
+		}
+
 		enum EntryType entryType = NONE;
 		Contact *pContact = NULL;
 		CalString *pszString = NULL;
@@ -769,6 +1031,30 @@ Calendar *ParseInput(unsigned char *in, size_t len)
 		// Print the element ordinal and type; content will follow
 		printf("-> Parse E#%d-> [Type:%#04x]: ", ++elementCount, elementType);
 
+		unsigned int field = EntryElementField(elementType);
+
+		if (selective && isValidpCurrentEntry && field)
+		{
+			if ((seenFields & field) && elementType != RECIPIENT)
+			{
+				printf("-> ERROR: element must be unique in the entry\n");
+				goto ERROR_EXIT;
+			}
+			seenFields |= field;
+
+			if (entryFilteredOut || !(keepFields & field))
+			{
+				if (-1 == SkipEntryElement(pBuffer, elementType))
+				{
+					printf("-> ERROR: Could not skip element\n");
+					goto ERROR_EXIT;
+				}
+
+				printf("skipped\n");
+				continue;
+			}
+		}
+
 		// Normally a switch statement would be used here instead of a
 		// series of conditionals.  For demonstration purposes, however,
 		// we've opted to use conditionals to ensure each element's type
@@ -801,11 +1087,24 @@ Calendar *ParseInput(unsigned char *in, size_t len)
 				goto ERROR_EXIT;
 			}
 
+			if (pLimits->MaxEntries && (unsigned int)entryCount > pLimits->MaxEntries)
+			{
+				printf("-> ERROR: ENTRYCOUNT %d exceeds budget\n", entryCount);
+				goto ERROR_EXIT;
+			}
+
 			printf("ENTRYCOUNT=%d\n", entryCount);
 		}
 
 		else if (elementType == NEWENTRY) // 0x02
 		{
+			if (pLimits->MaxEntries && ++entriesSeen > pLimits->MaxEntries)
+			{
+				printf("-> ERROR: entry budget of %u exceeded\n", pLimits->MaxEntries);
+				goto ERROR_EXIT;
+			}
+			recipientsSeen = 0;
+
 			if (!isValidpCurrentEntry)
 			{
 				if (entryCount == 0 || version != 1) // currently only support version one
@@ -821,6 +1120,18 @@ Calendar *ParseInput(unsigned char *in, size_t len)
 					printf("-> ERROR: Could not create Calendar\n");
 					goto ERROR_EXIT;
 				}
+				pCalendar->Fields = keepFields;
+
+				if (internStrings)
+				{
+					pCalendar->Strings = CreateStringTable();
+					if (!pCalendar->Strings)
+					{
+						printf("-> ERROR: Could not create string table\n");
+						goto ERROR_EXIT;
+					}
+					SetThreadStringTable(pCalendar->Strings);
+				}
 
 				pCurrentEntry = CreateCalendarEntry();	// Bug #6: where pCurrentEntry should get initialized
 				if (!pCurrentEntry)
@@ -836,7 +1147,7 @@ Calendar *ParseInput(unsigned char *in, size_t len)
 			{
 				// Add second and subsequent entries
 				CalendarEntry *pNextEntry;
-				if (!IsValidEntry(pCurrentEntry))
+				if (selective ? !HasMandatoryElements(seenFields) : !IsValidEntry(pCurrentEntry))
 				{
 					printf("-> ERROR: Invalid CalendarEntry\n");
 					goto ERROR_EXIT;
@@ -849,11 +1160,21 @@ Calendar *ParseInput(unsigned char *in, size_t len)
 					goto ERROR_EXIT;
 				}
 
-				pCurrentEntry->NextEntry = pNextEntry;
-				pNextEntry->PreviousEntry = pCurrentEntry;
+				if (selective && (entryFilteredOut || IsEntryFilteredOut(pCurrentEntry, pOptions, true)))
+				{
+					DiscardEntry(pCalendar, pCurrentEntry, pNextEntry);
+				}
+				else
+				{
+					pCurrentEntry->NextEntry = pNextEntry;
+					pNextEntry->PreviousEntry = pCurrentEntry;
+				}
 				pCurrentEntry = pNextEntry;
 			}
 
+			seenFields = 0;
+			entryFilteredOut = false;
+
 			if (-1 == SkipElement(pBuffer))
 			{
 				printf("-> ERROR: Could not skip element\n");
@@ -932,6 +1253,12 @@ Calendar *ParseInput(unsigned char *in, size_t len)
 				goto ERROR_EXIT;
 			}
 
+			if (pLimits->MaxRecipients && ++recipientsSeen > pLimits->MaxRecipients)
+			{
+				printf("-> ERROR: recipient budget of %u exceeded\n", pLimits->MaxRecipients);
+				goto ERROR_EXIT;
+			}
+
 			pContact = ParseContact(pBuffer);
 			if (!pContact)
 			{
@@ -1232,7 +1559,7 @@ Calendar *ParseInput(unsigned char *in, size_t len)
 				goto ERROR_EXIT;
 			}
 
-			pAttachments = ParseAttachments(pBuffer);
+			pAttachments = ParseAttachments(pBuffer, pLimits->MaxAttachments);
 			if (!pAttachments)
 			{
 				printf("\n-> ERROR: Could not parse ATTACHMENT element\n");
@@ -1318,6 +1645,12 @@ Calendar *ParseInput(unsigned char *in, size_t len)
 
 			printf("Unrecognized element type, skipped\n");
 		}
+
+		// Apply the entry filters as soon as an element they depend on is in
+		if ((filterFields & field) && isValidpCurrentEntry && !entryFilteredOut)
+		{
+			entryFilteredOut = IsEntryFilteredOut(pCurrentEntry, pOptions, false);
+		}
 	}
 
 	if(!hasEndElement)
@@ -1327,18 +1660,120 @@ Calendar *ParseInput(unsigned char *in, size_t len)
 	}
 
 	// Ensure all the mandatory elements are present in the file
-	if (!IsValidEntry(pCurrentEntry))
+	if (selective && isValidpCurrentEntry)
+	{
+		if (!HasMandatoryElements(seenFields))
+		{
+			goto ERROR_EXIT;
+		}
+
+		if (entryFilteredOut || IsEntryFilteredOut(pCurrentEntry, pOptions, true))
+		{
+			pCurrentEntry = DiscardEntry(pCalendar, pCurrentEntry, NULL);
+		}
+	}
+	else if (!IsValidEntry(pCurrentEntry))
+	{
+		goto ERROR_EXIT;
+	}
+
+	if (!BuildEntryTable(pCalendar))
+	{
+		printf("-> ERROR: Could not build entry table\n");
+		goto ERROR_EXIT;
+	}
+
+	// EntryCount describes the file; a filtered Calendar holds fewer entries
+	if (selective)
+	{
+		pCalendar->EntryCount = (int)pCalendar->EntryTableCount;
+	}
+
+	if (!(pOptions && (pOptions->Flags & CALPARSE_SKIP_TIME_ZONES)))
+	{
+		ResolveCalendarTimes(pCalendar);
+	}
+
+	// The window filter resolves the entries it checks, so it is counted too
+	if (IsThreadZoneLoadBudgetExceeded())
 	{
 		goto ERROR_EXIT;
 	}
 
-	DestroyBuffer(pBuffer);
+	FingerprintCalendar(pCalendar);
+
+	if (pOptions && (pOptions->Flags & CALPARSE_TRACK_ENTRIES))
+	{
+		if (!TrackCalendarEntries(pCalendar, in, len))
+		{
+			printf("-> ERROR: Could not record where entries lie\n");
+			goto ERROR_EXIT;
+		}
+	}
+
+	if (pOptions && (pOptions->Flags & CALPARSE_INDEX_CONTACTS))
+	{
+		pCalendar->ContactIndex = BuildContactIndex(pCalendar);
+		if (!pCalendar->ContactIndex)
+		{
+			printf("-> ERROR: Could not build contact index\n");
+			goto ERROR_EXIT;
+		}
+	}
+
+	if (pOptions && (pOptions->Flags & CALPARSE_INDEX_INTERVALS))
+	{
+		pCalendar->IntervalIndex = BuildIntervalIndex(pCalendar);
+		if (!pCalendar->IntervalIndex)
+		{
+			printf("-> ERROR: Could not build interval index\n");
+			goto ERROR_EXIT;
+		}
+	}
+
+	if (pOptions && (pOptions->Flags & CALPARSE_SORT_BY_START))
+	{
+		pCalendar->StartOrder = BuildStartOrder(pCalendar);
+		if (!pCalendar->StartOrder)
+		{
+			printf("-> ERROR: Could not build start order\n");
+			goto ERROR_EXIT;
+		}
+	}
+
+	if (pOptions && (pOptions->Flags & CALPARSE_INDEX_TEXT))
+	{
+		pCalendar->TextIndex = BuildTextIndex(&pCalendar, 1);
+		if (!pCalendar->TextIndex)
+		{
+			printf("-> ERROR: Could not build text index\n");
+			goto ERROR_EXIT;
+		}
+	}
+
+	if (pOptions && (pOptions->Flags & CALPARSE_BUILD_BLOOM))
+	{
+		pCalendar->Bloom = BuildBloom(pCalendar,
+			pOptions->BloomFields ? pOptions->BloomFields : CALBLOOM_DEFAULT_FIELDS,
+			pOptions->BloomBitsPerKey ? pOptions->BloomBitsPerKey : CALBLOOM_DEFAULT_BITS);
+		if (!pCalendar->Bloom)
+		{
+			printf("-> ERROR: Could not build Bloom filter\n");
+			goto ERROR_EXIT;
+		}
+	}
+
+	SetThreadAllocationBudget(previousBudget);
+	SetThreadZoneLoadBudget(previousZoneLoads);
+	SetThreadStringTable(previousStrings);
 	printf("\n");
 
 	return pCalendar;
 
 ERROR_EXIT:
-	DestroyBuffer(pBuffer);
+	SetThreadAllocationBudget(previousBudget);
+	SetThreadZoneLoadBudget(previousZoneLoads);
+	SetThreadStringTable(previousStrings);
 	DestroyCalendar(pCalendar);
 	pCalendar = NULL;
 	return NULL;
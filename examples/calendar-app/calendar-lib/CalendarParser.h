@@ -8,6 +8,11 @@
 *
 *********************************************************************/
 
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
 enum ElementType
 {
 	VERSION,        // 0x00		Mandatory; must be first element
@@ -41,4 +46,54 @@ enum EntryType
 	NONE,
 	MEETING,
 	APPOINTMENT
-};
\ No newline at end of file
+};
+
+// Per-parse resource budgets; a zero field means no limit.  A parse that
+// exceeds any of them fails and releases everything allocated so far
+typedef struct _CalParseLimits
+{
+	size_t MaxAllocationBytes;		// Total bytes allocated for the Calendar
+	unsigned int MaxEntries;		// Checked against ENTRYCOUNT and NEWENTRY elements
+	unsigned int MaxRecipients;		// RECIPIENT elements per entry
+	unsigned int MaxAttachments;	// Attachments per entry
+	unsigned int MaxElements;		// Top-level elements parsed
+	unsigned int MaxMilliseconds;	// Wall-clock time spent parsing
+} CalParseLimits;
+
+// CalParseOptions flags
+#define CALPARSE_INTERN_STRINGS		0x00000001	// Share one CalString per distinct SHORTSTRING value
+#define CALPARSE_INDEX_CONTACTS		0x00000002	// Build the contact email index after parsing
+#define CALPARSE_INDEX_INTERVALS	0x00000004	// Build the time interval index after parsing
+#define CALPARSE_SORT_BY_START		0x00000008	// Build the start-ordered view after parsing
+#define CALPARSE_PROJECT_FIELDS		0x00000010	// Materialize only the elements in FieldMask
+#define CALPARSE_FILTER_TYPE		0x00000020	// Keep only entries of EntryType
+#define CALPARSE_FILTER_WINDOW		0x00000040	// Keep only entries overlapping [WindowStart, WindowEnd)
+#define CALPARSE_INDEX_TEXT			0x00000080	// Build the Subject, Location and Content word index after parsing
+#define CALPARSE_BUILD_BLOOM		0x00000100	// Build the Bloom filter over BloomFields after parsing
+#define CALPARSE_TRACK_ENTRIES		0x00000200	// Record where each entry lies in the buffer, for ReparseCalendarFileBuffer; not with the entry filters
+#define CALPARSE_SKIP_TIME_ZONES	0x00000400	// Leave UTC times unresolved until ResolveCalendarTimeZones; the window filter still resolves the entries it checks
+
+// FieldMask bit for a per-entry element type
+#define CALFIELD(type)				(1U << (type))
+
+// Per-entry elements a field mask can select
+#define CALFIELD_ENTRY_ELEMENTS		(CALFIELD(ENTRYTYPE) | CALFIELD(SENDER) | CALFIELD(RECIPIENT) | \
+									CALFIELD(LOCATION) | CALFIELD(STARTTIME) | CALFIELD(TIMEZONE) | \
+									CALFIELD(DURATION) | CALFIELD(STARTDATE) | CALFIELD(SUBJECT) | \
+									CALFIELD(CONTENT) | CALFIELD(CONTENTTYPE) | CALFIELD(ATTACHMENT) | \
+									CALFIELD(STRUCTBLOB))
+
+// Fields are only ever added at the end, so callers built against an
+// earlier layout keep working
+typedef struct _CalParseOptions
+{
+	CalParseLimits Limits;
+	unsigned int Flags;
+	unsigned int FieldMask;		// CALFIELD bits; elements the filters need are always kept
+	enum EntryType EntryType;
+	int64_t WindowStart;		// Seconds since 1970 UTC
+	int64_t WindowEnd;
+	unsigned int BloomFields;	// CALFIELD bits of SENDER, RECIPIENT, TIMEZONE and LOCATION; zero for the emails
+	unsigned int BloomBitsPerKey;	// Zero for CALBLOOM_DEFAULT_BITS
+	unsigned int MaxZoneLoads;		// TIMEZONE names looked up in the tzdata directory; zero for no limit
+} CalParseOptions;
\ No newline at end of file
@@ -0,0 +1,1078 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarQuery.cpp:  contains the compiler for calendar filter
+* queries, the batch evaluator that runs the compiled plans, and the
+* cache that lets repeated queries share a plan
+*
+* Grammar:
+*
+*	query		:= or
+*	or			:= and { "or" and }
+*	and			:= not { "and" not }
+*	not			:= "not" not | "(" or ")" | predicate
+*	predicate	:= field op value
+*
+*	type					= !=						meeting | appointment
+*	sender recipient contact
+*	subject location
+*	content timezone		= != contains startswith endswith	word | "quoted"
+*	start end				= != < <= > >=				2017-07-01[T09:30[:00]] (UTC)
+*	duration				= != < <= > >=				90 | 45s | 30m | 1h30m | 2d
+*
+* Keywords and text comparisons ignore ASCII case.  contact matches the
+* sender or any recipient by email.  != is the negation of =, and an
+* entry without a start or end fails every other comparison on it
+*
+*********************************************************************/
+
+#include "stdafx.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "CalendarHash.h"
+#include "CalendarTime.h"
+#include "CalendarQuery.h"
+
+#define QUERY_MAX_NODES		256
+#define QUERY_MAX_DEPTH		32
+#define QUERY_CACHE_SIZE	32
+
+enum CalQueryOp
+{
+	QOP_COMPARE,		// Numeric column against Value
+	QOP_MATCH,			// Text field against the string operand
+	QOP_NOT,
+	QOP_AND_BEGIN,
+	QOP_AND_END,
+	QOP_OR_BEGIN,
+	QOP_OR_END
+};
+
+enum CalQueryField
+{
+	QFIELD_TYPE,
+	QFIELD_START,
+	QFIELD_END,
+	QFIELD_DURATION,
+	QFIELD_SENDER,
+	QFIELD_RECIPIENT,
+	QFIELD_CONTACT,
+	QFIELD_SUBJECT,
+	QFIELD_LOCATION,
+	QFIELD_CONTENT,
+	QFIELD_TIMEZONE
+};
+
+enum CalQueryCompare
+{
+	QCMP_EQ,
+	QCMP_NE,
+	QCMP_LT,
+	QCMP_LE,
+	QCMP_GT,
+	QCMP_GE,
+	QCMP_CONTAINS,
+	QCMP_STARTSWITH,
+	QCMP_ENDSWITH
+};
+
+enum CalQueryValueKind
+{
+	QKIND_TYPE,
+	QKIND_TEXT,
+	QKIND_TIME,
+	QKIND_DURATION
+};
+
+enum CalQueryToken
+{
+	QTOK_END,
+	QTOK_WORD,
+	QTOK_STRING,
+	QTOK_LPAREN,
+	QTOK_RPAREN,
+	QTOK_EQ,
+	QTOK_NE,
+	QTOK_LT,
+	QTOK_LE,
+	QTOK_GT,
+	QTOK_GE
+};
+
+enum CalQueryNodeKind
+{
+	QNODE_PREDICATE,
+	QNODE_NOT,
+	QNODE_AND,
+	QNODE_OR
+};
+
+typedef struct _CalQueryFieldName
+{
+	const char *Name;
+	unsigned char Field;
+	unsigned char Kind;
+	unsigned char Cost;		// Rough evaluation cost, used to order operands
+} CalQueryFieldName;
+
+static const CalQueryFieldName QueryFields[] =
+{
+	{ "type",		QFIELD_TYPE,		QKIND_TYPE,		1 },
+	{ "start",		QFIELD_START,		QKIND_TIME,		1 },
+	{ "end",		QFIELD_END,			QKIND_TIME,		1 },
+	{ "duration",	QFIELD_DURATION,	QKIND_DURATION,	1 },
+	{ "sender",		QFIELD_SENDER,		QKIND_TEXT,		4 },
+	{ "recipient",	QFIELD_RECIPIENT,	QKIND_TEXT,		8 },
+	{ "contact",	QFIELD_CONTACT,		QKIND_TEXT,		8 },
+	{ "subject",	QFIELD_SUBJECT,		QKIND_TEXT,		4 },
+	{ "location",	QFIELD_LOCATION,	QKIND_TEXT,		4 },
+	{ "content",	QFIELD_CONTENT,		QKIND_TEXT,		16 },
+	{ "timezone",	QFIELD_TIMEZONE,	QKIND_TEXT,		4 }
+};
+
+typedef struct _CalQueryNode
+{
+	unsigned char Kind;			// QNODE_*
+	unsigned char Field;
+	unsigned char Compare;
+	int Left;
+	int Right;
+	int64_t Value;
+	unsigned int Text;
+	unsigned int TextLength;
+	unsigned int Cost;
+} CalQueryNode;
+
+typedef struct _CalQueryCompiler
+{
+	const char *Source;
+	size_t Position;			// Start of the current token
+	size_t Next;				// Just past the current token
+	int Token;
+	int Depth;
+	bool Failed;
+	CalQueryNode Nodes[QUERY_MAX_NODES];
+	unsigned int NodeCount;
+	char *Strings;				// Unescaped, lowercased string operands
+	unsigned int StringLength;
+	CalQueryStep *Steps;
+	unsigned int StepCount;
+} CalQueryCompiler;
+
+typedef struct _CalQueryBatch
+{
+	unsigned int Count;
+	uint64_t Valid;
+	uint64_t HasStart;
+	uint64_t HasEnd;
+	CalendarEntry *Entries[CALQUERY_BATCH];
+	int64_t Type[CALQUERY_BATCH];
+	int64_t Start[CALQUERY_BATCH];
+	int64_t End[CALQUERY_BATCH];
+	int64_t Duration[CALQUERY_BATCH];
+} CalQueryBatch;
+
+// Compiled plans, most recently used first; each holds a reference
+static CalQuery *QueryCache[QUERY_CACHE_SIZE];
+static SRWLOCK QueryCacheLock = SRWLOCK_INIT;
+
+static char LowerQueryChar(char c)
+{
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static bool IsQueryDelimiter(char c)
+{
+	return c == '\0' || c == ' ' || c == '\t' || c == '\r' || c == '\n' ||
+		c == '(' || c == ')' || c == '"' || c == '=' || c == '!' || c == '<' || c == '>';
+}
+
+static int QueryError(CalQueryCompiler *c, const char *message)
+{
+	if (!c->Failed)
+	{
+		printf("-> ERROR: query column %u: %s\n", (unsigned int)c->Position + 1, message);
+		c->Failed = true;
+	}
+	return -1;
+}
+
+/// <summary>
+/// Moves to the next token of the query text
+/// </summary>
+static void NextQueryToken(CalQueryCompiler *c)
+{
+	const char *s = c->Source;
+	size_t i = c->Next;
+
+	while (s[i] == ' ' || s[i] == '\t' || s[i] == '\r' || s[i] == '\n')
+	{
+		i++;
+	}
+
+	c->Position = i;
+	switch (s[i])
+	{
+	case '\0':	c->Token = QTOK_END; break;
+	case '(':	c->Token = QTOK_LPAREN; i++; break;
+	case ')':	c->Token = QTOK_RPAREN; i++; break;
+	case '=':	c->Token = QTOK_EQ; i++; break;
+	case '<':	c->Token = (s[i + 1] == '=') ? QTOK_LE : QTOK_LT; i += (s[i + 1] == '=') ? 2 : 1; break;
+	case '>':	c->Token = (s[i + 1] == '=') ? QTOK_GE : QTOK_GT; i += (s[i + 1] == '=') ? 2 : 1; break;
+	case '!':
+		if (s[i + 1] != '=')
+		{
+			QueryError(c, "expected !=");
+			c->Token = QTOK_END;
+			return;
+		}
+		c->Token = QTOK_NE;
+		i += 2;
+		break;
+	case '"':
+		for (i++; s[i] && s[i] != '"'; i++)
+		{
+			if (s[i] == '\\' && s[i + 1])
+			{
+				i++;
+			}
+		}
+		if (!s[i])
+		{
+			QueryError(c, "unterminated string");
+			c->Token = QTOK_END;
+			return;
+		}
+		c->Token = QTOK_STRING;
+		i++;
+		break;
+	default:
+		while (!IsQueryDelimiter(s[i]))
+		{
+			i++;
+		}
+		c->Token = QTOK_WORD;
+		break;
+	}
+	c->Next = i;
+}
+
+/// <summary>
+/// Returns true if the current token is the given word, ignoring case
+/// </summary>
+static bool IsQueryWord(CalQueryCompiler *c, const char *word)
+{
+	size_t len = strlen(word);
+	if (c->Token != QTOK_WORD || c->Next - c->Position != len)
+	{
+		return false;
+	}
+
+	for (size_t i = 0; i < len; i++)
+	{
+		if (LowerQueryChar(c->Source[c->Position + i]) != word[i])
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static int NewQueryNode(CalQueryCompiler *c, unsigned char kind, int left, int right)
+{
+	if (c->NodeCount == QUERY_MAX_NODES)
+	{
+		return QueryError(c, "query too long");
+	}
+
+	CalQueryNode *n = &c->Nodes[c->NodeCount];
+	memset(n, 0, sizeof(*n));
+	n->Kind = kind;
+	n->Left = left;
+	n->Right = right;
+
+	if (kind == QNODE_NOT)
+	{
+		n->Cost = c->Nodes[left].Cost;
+	}
+	else if (kind != QNODE_PREDICATE)
+	{
+		n->Cost = c->Nodes[left].Cost + c->Nodes[right].Cost;
+	}
+	return (int)c->NodeCount++;
+}
+
+/// <summary>
+/// Reads an unsigned decimal number of up to maxDigits digits at *p
+/// </summary>
+static bool ReadQueryNumber(const char **p, const char *end, int maxDigits, int64_t *value)
+{
+	int digits = 0;
+	*value = 0;
+
+	while (*p < end && **p >= '0' && **p <= '9' && digits < maxDigits)
+	{
+		*value = *value * 10 + (**p - '0');
+		(*p)++;
+		digits++;
+	}
+	return digits > 0;
+}
+
+/// <summary>
+/// Parses YYYY-MM-DD with an optional THH:MM[:SS] and Z, taken as UTC
+/// </summary>
+static bool ParseQueryTime(const char *p, const char *end, int64_t *t)
+{
+	int64_t year, month, day, hour = 0, minute = 0, second = 0;
+
+	if (!ReadQueryNumber(&p, end, 4, &year) || p == end || *p++ != '-' ||
+		!ReadQueryNumber(&p, end, 2, &month) || p == end || *p++ != '-' ||
+		!ReadQueryNumber(&p, end, 2, &day))
+	{
+		return false;
+	}
+
+	if (p < end && (*p == 'T' || *p == 't'))
+	{
+		p++;
+		if (!ReadQueryNumber(&p, end, 2, &hour) || p == end || *p++ != ':' || !ReadQueryNumber(&p, end, 2, &minute))
+		{
+			return false;
+		}
+		if (p < end && *p == ':')
+		{
+			p++;
+			if (!ReadQueryNumber(&p, end, 2, &second))
+			{
+				return false;
+			}
+		}
+	}
+
+	if (p < end && (*p == 'Z' || *p == 'z'))
+	{
+		p++;
+	}
+
+	if (p != end || month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 59)
+	{
+		return false;
+	}
+
+	*t = CalDaysFromCivil((int)year, (int)month, (int)day) * 86400 + hour * 3600 + minute * 60 + second;
+	return true;
+}
+
+/// <summary>
+/// Parses a duration such as 90, 45s, 30m, 1h30m or 2d into seconds
+/// </summary>
+static bool ParseQueryDuration(const char *p, const char *end, int64_t *seconds)
+{
+	*seconds = 0;
+	if (p == end)
+	{
+		return false;
+	}
+
+	while (p < end)
+	{
+		int64_t n, unit = 1;
+		if (!ReadQueryNumber(&p, end, 9, &n))
+		{
+			return false;
+		}
+
+		if (p < end)
+		{
+			switch (LowerQueryChar(*p++))
+			{
+			case 'd': unit = 86400; break;
+			case 'h': unit = 3600; break;
+			case 'm': unit = 60; break;
+			case 's': unit = 1; break;
+			default: return false;
+			}
+		}
+		*seconds += n * unit;
+	}
+	return true;
+}
+
+/// <summary>
+/// Copies the current word or string token into the string operands,
+/// unescaped and lowercased
+/// </summary>
+static void StoreQueryText(CalQueryCompiler *c, CalQueryNode *n)
+{
+	const char *s = c->Source;
+	size_t i = c->Position, end = c->Next;
+
+	if (c->Token == QTOK_STRING)
+	{
+		i++;
+		end--;
+	}
+
+	n->Text = c->StringLength;
+	for (; i < end; i++)
+	{
+		if (c->Token == QTOK_STRING && s[i] == '\\')
+		{
+			i++;
+		}
+		c->Strings[c->StringLength++] = LowerQueryChar(s[i]);
+	}
+	n->TextLength = c->StringLength - n->Text;
+}
+
+static int ParseQueryOr(CalQueryCompiler *c);
+
+/// <summary>
+/// predicate := field op value
+/// </summary>
+static int ParseQueryPredicate(CalQueryCompiler *c)
+{
+	const CalQueryFieldName *f = NULL;
+
+	for (size_t i = 0; i < sizeof(QueryFields) / sizeof(QueryFields[0]); i++)
+	{
+		if (IsQueryWord(c, QueryFields[i].Name))
+		{
+			f = &QueryFields[i];
+			break;
+		}
+	}
+	if (!f)
+	{
+		return QueryError(c, "expected a field name");
+	}
+	NextQueryToken(c);
+
+	unsigned char compare;
+	switch (c->Token)
+	{
+	case QTOK_EQ: compare = QCMP_EQ; break;
+	case QTOK_NE: compare = QCMP_NE; break;
+	case QTOK_LT: compare = QCMP_LT; break;
+	case QTOK_LE: compare = QCMP_LE; break;
+	case QTOK_GT: compare = QCMP_GT; break;
+	case QTOK_GE: compare = QCMP_GE; break;
+	default:
+		if (IsQueryWord(c, "contains")) compare = QCMP_CONTAINS;
+		else if (IsQueryWord(c, "startswith")) compare = QCMP_STARTSWITH;
+		else if (IsQueryWord(c, "endswith")) compare = QCMP_ENDSWITH;
+		else return QueryError(c, "expected an operator");
+		break;
+	}
+
+	bool ordered = compare >= QCMP_LT && compare <= QCMP_GE;
+	bool textual = compare >= QCMP_CONTAINS;
+	if ((ordered && f->Kind != QKIND_TIME && f->Kind != QKIND_DURATION) ||
+		(textual && f->Kind != QKIND_TEXT))
+	{
+		return QueryError(c, "operator does not apply to this field");
+	}
+	NextQueryToken(c);
+
+	int node = NewQueryNode(c, QNODE_PREDICATE, -1, -1);
+	if (node < 0)
+	{
+		return -1;
+	}
+
+	CalQueryNode *n = &c->Nodes[node];
+	const char *value = c->Source + c->Position;
+	const char *valueEnd = c->Source + c->Next;
+
+	n->Field = f->Field;
+	n->Compare = (compare == QCMP_NE) ? QCMP_EQ : compare;
+	n->Cost = f->Cost;
+
+	if (c->Token != QTOK_WORD && !(c->Token == QTOK_STRING && f->Kind == QKIND_TEXT))
+	{
+		return QueryError(c, "expected a value");
+	}
+
+	switch (f->Kind)
+	{
+	case QKIND_TYPE:
+		if (IsQueryWord(c, "meeting")) n->Value = MEETING;
+		else if (IsQueryWord(c, "appointment")) n->Value = APPOINTMENT;
+		else return QueryError(c, "expected meeting or appointment");
+		break;
+	case QKIND_TIME:
+		if (!ParseQueryTime(value, valueEnd, &n->Value))
+		{
+			return QueryError(c, "expected a date such as 2017-07-01 or 2017-07-01T09:30");
+		}
+		break;
+	case QKIND_DURATION:
+		if (!ParseQueryDuration(value, valueEnd, &n->Value))
+		{
+			return QueryError(c, "expected a duration such as 90, 30m or 1h30m");
+		}
+		break;
+	default:
+		StoreQueryText(c, n);
+		break;
+	}
+	NextQueryToken(c);
+
+	return (compare == QCMP_NE) ? NewQueryNode(c, QNODE_NOT, node, -1) : node;
+}
+
+/// <summary>
+/// not := "not" not | "(" or ")" | predicate
+/// </summary>
+static int ParseQueryNot(CalQueryCompiler *c)
+{
+	int node;
+
+	if (++c->Depth > QUERY_MAX_DEPTH)
+	{
+		return QueryError(c, "query nested too deeply");
+	}
+
+	if (IsQueryWord(c, "not"))
+	{
+		NextQueryToken(c);
+		node = ParseQueryNot(c);
+		if (node >= 0)
+		{
+			node = NewQueryNode(c, QNODE_NOT, node, -1);
+		}
+	}
+	else if (c->Token == QTOK_LPAREN)
+	{
+		NextQueryToken(c);
+		node = ParseQueryOr(c);
+		if (node >= 0 && c->Token != QTOK_RPAREN)
+		{
+			node = QueryError(c, "expected )");
+		}
+		NextQueryToken(c);
+	}
+	else
+	{
+		node = ParseQueryPredicate(c);
+	}
+
+	c->Depth--;
+	return c->Failed ? -1 : node;
+}
+
+static int ParseQueryAnd(CalQueryCompiler *c)
+{
+	int node = ParseQueryNot(c);
+	while (node >= 0 && IsQueryWord(c, "and"))
+	{
+		NextQueryToken(c);
+		int right = ParseQueryNot(c);
+		node = (right < 0) ? -1 : NewQueryNode(c, QNODE_AND, node, right);
+	}
+	return node;
+}
+
+static int ParseQueryOr(CalQueryCompiler *c)
+{
+	int node = ParseQueryAnd(c);
+	while (node >= 0 && IsQueryWord(c, "or"))
+	{
+		NextQueryToken(c);
+		int right = ParseQueryAnd(c);
+		node = (right < 0) ? -1 : NewQueryNode(c, QNODE_OR, node, right);
+	}
+	return node;
+}
+
+static unsigned int EmitQueryStep(CalQueryCompiler *c, unsigned char op, const CalQueryNode *n)
+{
+	CalQueryStep *s = &c->Steps[c->StepCount];
+	memset(s, 0, sizeof(*s));
+	s->Op = op;
+
+	if (n)
+	{
+		s->Field = n->Field;
+		s->Compare = n->Compare;
+		s->Value = n->Value;
+		s->Text = n->Text;
+		s->TextLength = n->TextLength;
+	}
+	return c->StepCount++;
+}
+
+/// <summary>
+/// Emits the postfix steps of a node.  The cheaper operand of AND and OR
+/// goes first, so the costlier one only runs on batches it can change
+/// </summary>
+static void EmitQueryNode(CalQueryCompiler *c, int node)
+{
+	const CalQueryNode *n = &c->Nodes[node];
+
+	switch (n->Kind)
+	{
+	case QNODE_PREDICATE:
+		EmitQueryStep(c, n->Field <= QFIELD_DURATION ? QOP_COMPARE : QOP_MATCH, n);
+		break;
+
+	case QNODE_NOT:
+		EmitQueryNode(c, n->Left);
+		EmitQueryStep(c, QOP_NOT, NULL);
+		break;
+
+	default:
+	{
+		int first = n->Left, second = n->Right;
+		if (c->Nodes[second].Cost < c->Nodes[first].Cost)
+		{
+			first = n->Right;
+			second = n->Left;
+		}
+
+		EmitQueryNode(c, first);
+		unsigned int begin = EmitQueryStep(c, n->Kind == QNODE_AND ? QOP_AND_BEGIN : QOP_OR_BEGIN, NULL);
+		EmitQueryNode(c, second);
+		EmitQueryStep(c, n->Kind == QNODE_AND ? QOP_AND_END : QOP_OR_END, NULL);
+		c->Steps[begin].Jump = c->StepCount;
+		break;
+	}
+	}
+}
+
+/// <summary>
+/// Compiles query text into a new plan with one reference
+/// </summary>
+static CalQuery *BuildQuery(const char *text, size_t len, uint64_t hash)
+{
+	CalQueryCompiler *c = (CalQueryCompiler *)calloc(1, sizeof(CalQueryCompiler));
+	CalQuery *pQuery = NULL;
+	int root;
+
+	if (!c)
+	{
+		return NULL;
+	}
+
+	// String operands are never longer than the text they came from
+	c->Source = text;
+	c->Strings = (char *)malloc(len + 1);
+	if (!c->Strings)
+	{
+		goto ERROR_EXIT;
+	}
+
+	NextQueryToken(c);
+	root = ParseQueryOr(c);
+	if (root >= 0 && c->Token != QTOK_END)
+	{
+		root = QueryError(c, "expected and, or or the end of the query");
+	}
+	if (root < 0)
+	{
+		goto ERROR_EXIT;
+	}
+
+	{
+		// Every node emits at most two steps
+		size_t stepsOffset = (sizeof(CalQuery) + 7) & ~(size_t)7;
+		size_t stringsOffset = stepsOffset + (size_t)c->NodeCount * 2 * sizeof(CalQueryStep);
+		size_t sourceOffset = stringsOffset + c->StringLength;
+
+		pQuery = (CalQuery *)calloc(1, sourceOffset + len + 1);
+		if (!pQuery)
+		{
+			goto ERROR_EXIT;
+		}
+
+		pQuery->References = 1;
+		pQuery->Steps = (CalQueryStep *)((char *)pQuery + stepsOffset);
+		pQuery->Strings = (char *)pQuery + stringsOffset;
+		pQuery->Source = (char *)pQuery + sourceOffset;
+		pQuery->Hash = hash;
+		memcpy(pQuery->Strings, c->Strings, c->StringLength);
+		memcpy(pQuery->Source, text, len + 1);
+
+		c->Steps = pQuery->Steps;
+		EmitQueryNode(c, root);
+		pQuery->StepCount = c->StepCount;
+	}
+
+ERROR_EXIT:
+	free(c->Strings);
+	free(c);
+	return pQuery;
+}
+
+/// <summary>
+/// Compiles a query, or returns the cached plan of an identical query.
+/// Prints the reason and returns NULL for a malformed query.  Release
+/// the plan with ReleaseQuery
+/// </summary>
+CalQuery *CompileQuery(const char *text)
+{
+	size_t len = strlen(text);
+	uint64_t hash = CalHash64(text, len, 0);
+	CalQuery *pQuery = NULL;
+
+	AcquireSRWLockExclusive(&QueryCacheLock);
+	for (int i = 0; i < QUERY_CACHE_SIZE && QueryCache[i]; i++)
+	{
+		if (QueryCache[i]->Hash == hash && !strcmp(QueryCache[i]->Source, text))
+		{
+			pQuery = QueryCache[i];
+			memmove(&QueryCache[1], &QueryCache[0], i * sizeof(CalQuery *));
+			QueryCache[0] = pQuery;
+			InterlockedIncrement(&pQuery->References);
+			break;
+		}
+	}
+	ReleaseSRWLockExclusive(&QueryCacheLock);
+
+	if (pQuery)
+	{
+		return pQuery;
+	}
+
+	// Compiled outside the lock; a racing thread's plan may be cached instead
+	pQuery = BuildQuery(text, len, hash);
+	if (!pQuery)
+	{
+		return NULL;
+	}
+
+	InterlockedIncrement(&pQuery->References);
+
+	AcquireSRWLockExclusive(&QueryCacheLock);
+	CalQuery *pEvicted = QueryCache[QUERY_CACHE_SIZE - 1];
+	memmove(&QueryCache[1], &QueryCache[0], (QUERY_CACHE_SIZE - 1) * sizeof(CalQuery *));
+	QueryCache[0] = pQuery;
+	ReleaseSRWLockExclusive(&QueryCacheLock);
+
+	if (pEvicted)
+	{
+		ReleaseQuery(pEvicted);
+	}
+	return pQuery;
+}
+
+void ReleaseQuery(CalQuery *pQuery)
+{
+	if (pQuery && InterlockedDecrement(&pQuery->References) == 0)
+	{
+		free(pQuery);
+	}
+}
+
+/// <summary>
+/// Returns the mask of the lanes of a column that compare true with v.
+/// All lanes are compared; callers mask off the ones that do not count
+/// </summary>
+static uint64_t CompareColumn(const int64_t *col, unsigned char compare, int64_t v)
+{
+	uint64_t m = 0;
+	unsigned int i;
+
+	switch (compare)
+	{
+	case QCMP_EQ: for (i = 0; i < CALQUERY_BATCH; i++) m |= (uint64_t)(col[i] == v) << i; break;
+	case QCMP_LT: for (i = 0; i < CALQUERY_BATCH; i++) m |= (uint64_t)(col[i] < v) << i; break;
+	case QCMP_LE: for (i = 0; i < CALQUERY_BATCH; i++) m |= (uint64_t)(col[i] <= v) << i; break;
+	case QCMP_GT: for (i = 0; i < CALQUERY_BATCH; i++) m |= (uint64_t)(col[i] > v) << i; break;
+	case QCMP_GE: for (i = 0; i < CALQUERY_BATCH; i++) m |= (uint64_t)(col[i] >= v) << i; break;
+	}
+	return m;
+}
+
+static const unsigned char *GetCalStringBytes(CalString *s, size_t *len)
+{
+	if (!s)
+	{
+		return NULL;
+	}
+
+	if (s->StringType == LONGSTRING)
+	{
+		*len = s->Long.Length;
+		return s->Long.Value;
+	}
+	*len = s->Short.Length;
+	return s->Short.Value;
+}
+
+static bool EqualsLowered(const unsigned char *p, const char *lowered, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+	{
+		if (LowerQueryChar((char)p[i]) != lowered[i])
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool MatchQueryText(CalString *s, unsigned char compare, const char *needle, size_t n)
+{
+	size_t len;
+	const unsigned char *p = GetCalStringBytes(s, &len);
+
+	if (!p)
+	{
+		return false;
+	}
+
+	switch (compare)
+	{
+	case QCMP_EQ:
+		return len == n && EqualsLowered(p, needle, n);
+	case QCMP_STARTSWITH:
+		return len >= n && EqualsLowered(p, needle, n);
+	case QCMP_ENDSWITH:
+		return len >= n && EqualsLowered(p + len - n, needle, n);
+	default:
+		if (!n)
+		{
+			return true;
+		}
+		for (size_t i = 0; i + n <= len; i++)
+		{
+			if (LowerQueryChar((char)p[i]) == needle[0] && EqualsLowered(p + i + 1, needle + 1, n - 1))
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+}
+
+static bool MatchQueryEntry(const CalQuery *pQuery, const CalQueryStep *s, CalendarEntry *e)
+{
+	const char *needle = pQuery->Strings + s->Text;
+	size_t n = s->TextLength;
+
+	switch (s->Field)
+	{
+	case QFIELD_SUBJECT:	return MatchQueryText(e->Subject, s->Compare, needle, n);
+	case QFIELD_LOCATION:	return MatchQueryText(e->Location, s->Compare, needle, n);
+	case QFIELD_CONTENT:	return MatchQueryText(e->Content, s->Compare, needle, n);
+	case QFIELD_TIMEZONE:	return MatchQueryText(e->TimeZone, s->Compare, needle, n);
+	default:
+		break;
+	}
+
+	if (s->Field != QFIELD_RECIPIENT && e->Sender && MatchQueryText(e->Sender->Email, s->Compare, needle, n))
+	{
+		return true;
+	}
+
+	if (s->Field != QFIELD_SENDER)
+	{
+		for (Contact *c = e->Recipient; c; c = c->NextContact)
+		{
+			if (MatchQueryText(c->Email, s->Compare, needle, n))
+			{
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+/// <summary>
+/// Runs the plan over one batch and returns the mask of matching entries.
+/// Each subexpression's mask is exact on the entries in care at that point
+/// and zero elsewhere
+/// </summary>
+static uint64_t EvaluateQueryBatch(const CalQuery *pQuery, const CalQueryBatch *b)
+{
+	uint64_t stack[QUERY_MAX_NODES];
+	uint64_t care[QUERY_MAX_NODES];
+	int sp = 0, cp = 0;
+
+	care[0] = b->Valid;
+
+	for (unsigned int pc = 0; pc < pQuery->StepCount; pc++)
+	{
+		const CalQueryStep *s = &pQuery->Steps[pc];
+
+		switch (s->Op)
+		{
+		case QOP_COMPARE:
+			switch (s->Field)
+			{
+			case QFIELD_TYPE:	stack[sp++] = CompareColumn(b->Type, s->Compare, s->Value) & care[cp]; break;
+			case QFIELD_START:	stack[sp++] = CompareColumn(b->Start, s->Compare, s->Value) & b->HasStart & care[cp]; break;
+			case QFIELD_END:	stack[sp++] = CompareColumn(b->End, s->Compare, s->Value) & b->HasEnd & care[cp]; break;
+			default:			stack[sp++] = CompareColumn(b->Duration, s->Compare, s->Value) & b->HasEnd & care[cp]; break;
+			}
+			break;
+
+		case QOP_MATCH:
+		{
+			uint64_t m = 0;
+			for (unsigned int i = 0; i < b->Count; i++)
+			{
+				if (((care[cp] >> i) & 1) && MatchQueryEntry(pQuery, s, b->Entries[i]))
+				{
+					m |= 1ULL << i;
+				}
+			}
+			stack[sp++] = m;
+			break;
+		}
+
+		case QOP_NOT:
+			stack[sp - 1] = ~stack[sp - 1] & care[cp];
+			break;
+
+		case QOP_AND_BEGIN:
+			if (!stack[sp - 1])
+			{
+				pc = s->Jump - 1;
+				break;
+			}
+			care[cp + 1] = care[cp] & stack[sp - 1];
+			cp++;
+			break;
+
+		case QOP_OR_BEGIN:
+			if (stack[sp - 1] == care[cp])
+			{
+				pc = s->Jump - 1;
+				break;
+			}
+			care[cp + 1] = care[cp] & ~stack[sp - 1];
+			cp++;
+			break;
+
+		case QOP_AND_END:
+			cp--;
+			sp--;
+			stack[sp - 1] &= stack[sp];
+			break;
+
+		case QOP_OR_END:
+			cp--;
+			sp--;
+			stack[sp - 1] |= stack[sp];
+			break;
+		}
+	}
+
+	return stack[0] & b->Valid;
+}
+
+/// <summary>
+/// Gathers the columns of up to CALQUERY_BATCH entries starting at e and
+/// returns the entry after the batch
+/// </summary>
+static CalendarEntry *FillQueryBatch(CalQueryBatch *b, CalendarEntry *e)
+{
+	unsigned int i = 0;
+
+	b->HasStart = 0;
+	b->HasEnd = 0;
+
+	for (; e && i < CALQUERY_BATCH; e = e->NextEntry, i++)
+	{
+		b->Entries[i] = e;
+		b->Type[i] = e->EntryType;
+		b->Start[i] = e->UtcStart;
+		b->End[i] = e->UtcEnd;
+		b->Duration[i] = e->UtcEnd - e->UtcStart;
+		b->HasStart |= (uint64_t)((e->TimeFlags & CALTIME_HAS_START) != 0) << i;
+		b->HasEnd |= (uint64_t)((e->TimeFlags & CALTIME_HAS_END) != 0) << i;
+	}
+
+	b->Count = i;
+	b->Valid = (i == CALQUERY_BATCH) ? ~0ULL : (1ULL << i) - 1;
+
+	// Lanes past the last entry are compared too, so keep them defined
+	for (; i < CALQUERY_BATCH; i++)
+	{
+		b->Type[i] = b->Start[i] = b->End[i] = b->Duration[i] = 0;
+	}
+	return e;
+}
+
+/// <summary>
+/// Runs a plan over a calendar.  Writes up to n ascending indices of the
+/// matching entries to out and returns how many entries match
+/// (saturating at INT_MAX), or -1 on failure
+/// </summary>
+int RunQuery(const CalQuery *pQuery, Calendar *pCalendar, unsigned int *out, unsigned int n)
+{
+	CalQueryBatch *b = (CalQueryBatch *)malloc(sizeof(CalQueryBatch));
+	unsigned int base = 0;
+	int found = 0;
+
+	if (!b)
+	{
+		return -1;
+	}
+
+	for (CalendarEntry *e = pCalendar->Entry; e; base += CALQUERY_BATCH)
+	{
+		e = FillQueryBatch(b, e);
+		uint64_t m = EvaluateQueryBatch(pQuery, b);
+
+		for (unsigned int i = 0; m; i++, m >>= 1)
+		{
+			if (m & 1)
+			{
+				if ((unsigned int)found < n) out[found] = base + i;
+				if (found < INT_MAX) found++;
+			}
+		}
+	}
+
+	free(b);
+	return found;
+}
+
+/// <summary>
+/// Runs a plan over several calendars in turn, as RunQuery does for one.
+/// Matches come out ordered by calendar, then by entry
+/// </summary>
+int RunQueryOnCalendars(const CalQuery *pQuery, Calendar **calendars, unsigned int count, CalQueryMatch *out, unsigned int n)
+{
+	CalQueryBatch *b = (CalQueryBatch *)malloc(sizeof(CalQueryBatch));
+	int found = 0;
+
+	if (!b)
+	{
+		return -1;
+	}
+
+	for (unsigned int c = 0; c < count; c++)
+	{
+		unsigned int base = 0;
+
+		for (CalendarEntry *e = calendars[c]->Entry; e; base += CALQUERY_BATCH)
+		{
+			e = FillQueryBatch(b, e);
+			uint64_t m = EvaluateQueryBatch(pQuery, b);
+
+			for (unsigned int i = 0; m; i++, m >>= 1)
+			{
+				if (m & 1)
+				{
+					if ((unsigned int)found < n)
+					{
+						out[found].Calendar = c;
+						out[found].Entry = base + i;
+					}
+					if (found < INT_MAX) found++;
+				}
+			}
+		}
+	}
+
+	free(b);
+	return found;
+}
@@ -0,0 +1,54 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarQuery.h:  contains the compiler and evaluator for calendar
+* filter queries
+*
+*********************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include "CalendarStructures.h"
+
+// Entries are evaluated in batches of this many, one bit per entry
+#define CALQUERY_BATCH 64
+
+// A compiled query is a postfix program.  Each predicate step pushes the
+// mask of batch entries it matches; the AND/OR begin steps skip their
+// right operand when the left one decides the batch, and narrow the set
+// of entries the right operand has to look at
+typedef struct _CalQueryStep
+{
+	unsigned char Op;			// QOP_*
+	unsigned char Field;		// QFIELD_*
+	unsigned char Compare;		// QCMP_*
+	unsigned char Reserved;
+	unsigned int Jump;			// Step after the matching end step
+	int64_t Value;				// Numeric operand
+	unsigned int Text;			// Offset of the lowercased string operand
+	unsigned int TextLength;
+} CalQueryStep;
+
+typedef struct _CalQuery
+{
+	volatile LONG References;
+	unsigned int StepCount;
+	CalQueryStep *Steps;
+	char *Strings;
+	char *Source;				// Query text, for the plan cache
+	uint64_t Hash;
+} CalQuery;
+
+typedef struct _CalQueryMatch
+{
+	unsigned int Calendar;		// Index into the calendars queried
+	unsigned int Entry;			// Entry index within that calendar
+} CalQueryMatch;
+
+CalQuery *CompileQuery(const char *text);
+void ReleaseQuery(CalQuery *pQuery);
+int RunQuery(const CalQuery *pQuery, Calendar *pCalendar, unsigned int *out, unsigned int n);
+int RunQueryOnCalendars(const CalQuery *pQuery, Calendar **calendars, unsigned int count, CalQueryMatch *out, unsigned int n);
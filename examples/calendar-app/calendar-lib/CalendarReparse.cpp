@@ -0,0 +1,494 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarReparse.cpp:  contains the incremental re-parse of a calendar
+* after an edit to its buffer.  A calendar parsed with
+* CALPARSE_TRACK_ENTRIES records the bytes of each entry; after an edit
+* only the entries the edited bytes fall in are framed again, and of
+* those only the ones whose bytes changed are parsed
+*
+*********************************************************************/
+
+#include "stdafx.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "CalendarArena.h"
+#include "CalendarStringTable.h"
+#include "CalendarFraming.h"
+#include "CalendarReparse.h"
+
+extern "C"
+{
+	extern unsigned int BugBitmask;
+}
+
+Calendar *ParseInputEx(unsigned char *in, size_t len, const CalParseOptions *pOptions);
+CalendarEntry *CopyCalendarEntry(CalendarEntry *srcEntry, bool share);
+
+/// <summary>
+/// Records where each entry of a calendar just parsed from in lies in it.
+/// Fails if the entries do not map one to one onto the buffer's, as when
+/// entries were filtered out
+/// </summary>
+bool TrackCalendarEntries(Calendar *pCalendar, unsigned char *in, size_t len)
+{
+	int version;
+	unsigned int count = pCalendar->EntryTableCount;
+
+	CalEntryFrame *frames = (CalEntryFrame *)CalMalloc((count ? count : 1) * sizeof(CalEntryFrame));
+	if (!frames)
+	{
+		return false;
+	}
+
+	if (FrameBufferEntries(in, len, &version, frames, count) != (int)count)
+	{
+		CalFree(frames);
+		return false;
+	}
+
+	CalFree(pCalendar->EntryFrames);
+	pCalendar->EntryFrames = frames;
+	pCalendar->SourceLength = len;
+	return true;
+}
+
+/// <summary>
+/// Reads the integer element of the given type at offset at of a CAL
+/// file header
+/// </summary>
+bool ReadHeaderInt(unsigned char *in, size_t len, size_t at, unsigned char type, int *value)
+{
+	uint32_t elementLength;
+	int32_t v;
+
+	if (len < at + REPARSE_INT_ELEMENT || in[at] != type)
+	{
+		return false;
+	}
+
+	memcpy(&elementLength, in + at + 1, sizeof(elementLength));
+	memcpy(&v, in + at + 5, sizeof(v));
+	*value = v;
+	return elementLength == sizeof(v);
+}
+
+void PutHeaderInt(unsigned char *p, unsigned char type, int value)
+{
+	uint32_t elementLength = sizeof(int32_t);
+	int32_t v = value;
+
+	p[0] = type;
+	memcpy(p + 1, &elementLength, sizeof(elementLength));
+	memcpy(p + 5, &v, sizeof(v));
+}
+
+/// <summary>
+/// Lays out count entries of in, from frames, as a CAL file of their own
+/// and returns its length; buffer must hold the entries plus
+/// REPARSE_HEADER and REPARSE_END_ELEMENT bytes
+/// </summary>
+static size_t LayOutEntries(unsigned char *buffer, int version, unsigned char *in, const CalEntryFrame *frames, unsigned int count)
+{
+	size_t at = REPARSE_HEADER;
+
+	PutHeaderInt(buffer, VERSION, version);
+	PutHeaderInt(buffer + REPARSE_INT_ELEMENT, ENTRYCOUNT, (int)count);
+	for (unsigned int i = 0; i < count; i++)
+	{
+		memcpy(buffer + at, in + frames[i].Offset, frames[i].Length);
+		at += frames[i].Length;
+	}
+
+	memset(buffer + at, 0, REPARSE_END_ELEMENT);
+	buffer[at] = END;
+	return at + REPARSE_END_ELEMENT;
+}
+
+/// <summary>
+/// Parses count entries of in, from frames, as a CAL file of their own.
+/// Returns NULL unless each becomes an entry of the calendar returned
+/// </summary>
+Calendar *ParseEntryFrames(int version, unsigned char *in, const CalEntryFrame *frames, unsigned int count, const CalParseOptions *pOptions)
+{
+	size_t bytes = REPARSE_HEADER + REPARSE_END_ELEMENT;
+	for (unsigned int i = 0; i < count; i++)
+	{
+		bytes += frames[i].Length;
+	}
+
+	unsigned char *buffer = (unsigned char *)malloc(bytes);
+	if (!buffer)
+	{
+		return NULL;
+	}
+
+	bytes = LayOutEntries(buffer, version, in, frames, count);
+	Calendar *pParsed = ParseInputEx(buffer, bytes, pOptions);
+	free(buffer);
+
+	if (pParsed && pParsed->EntryTableCount != count)
+	{
+		DestroyCalendar(pParsed);
+		pParsed = NULL;
+	}
+	return pParsed;
+}
+
+/// <summary>
+/// Takes the entries of pParsed, returned by ParseEntryFrames, for
+/// pCalendar: unlinked, into fresh.  When pCalendar has a string table
+/// they are copies interned there; otherwise they are moved out of
+/// pParsed.  Returns false, with nothing taken, if memory ran out
+/// </summary>
+bool TakeParsedEntries(Calendar *pCalendar, Calendar *pParsed, CalendarEntry **fresh)
+{
+	unsigned int count = pParsed->EntryTableCount;
+
+	if (!pCalendar->Strings)
+	{
+		memcpy(fresh, pParsed->EntryTable, count * sizeof(CalendarEntry *));
+		pParsed->Entry = NULL;
+	}
+	else
+	{
+		CalStringTable *previousStrings = SetThreadStringTable(pCalendar->Strings);
+		for (unsigned int i = 0; i < count; i++)
+		{
+			fresh[i] = CopyCalendarEntry(pParsed->EntryTable[i], true);
+			if (!fresh[i])
+			{
+				SetThreadStringTable(previousStrings);
+				while (i--)
+				{
+					fresh[i]->NextEntry = NULL;
+					DestroyCalendarEntry(fresh[i]);
+					fresh[i] = NULL;
+				}
+				return false;
+			}
+		}
+		SetThreadStringTable(previousStrings);
+	}
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		fresh[i]->PreviousEntry = NULL;
+		fresh[i]->NextEntry = NULL;
+	}
+	return true;
+}
+
+/// <summary>
+/// Frames the entries of in between start and end; the region is copied
+/// out with an END element after it so the framing stops there.  Returns
+/// the number of entries, with their frames in a buffer from malloc, or
+/// -1 if they do not frame exactly
+/// </summary>
+int FrameEntryRegion(unsigned char *in, size_t start, size_t end, CalEntryFrame **frames)
+{
+	int version, count = -1;
+	size_t len = end - start;
+
+	*frames = NULL;
+	unsigned char *region = (unsigned char *)malloc(len + REPARSE_END_ELEMENT);
+	if (!region)
+	{
+		return -1;
+	}
+
+	memcpy(region, in + start, len);
+	memset(region + len, 0, REPARSE_END_ELEMENT);
+	region[len] = END;
+
+	int n = FrameBufferEntries(region, len + REPARSE_END_ELEMENT, &version, NULL, 0);
+	if (n >= 0)
+	{
+		*frames = (CalEntryFrame *)malloc((n ? n : 1) * sizeof(CalEntryFrame));
+		if (*frames)
+		{
+			FrameBufferEntries(region, len + REPARSE_END_ELEMENT, &version, *frames, (unsigned int)n);
+
+			// The region must be whole entries, ending where END was placed
+			size_t framed = n ? (*frames)[n - 1].Offset + (*frames)[n - 1].Length : 0;
+			if (framed == len && (!n || (*frames)[0].Offset == 0))
+			{
+				count = n;
+				for (int i = 0; i < n; i++)
+				{
+					(*frames)[i].Offset += start;
+				}
+			}
+		}
+	}
+
+	free(region);
+	return count;
+}
+
+/// <summary>
+/// Finds where the END element after the last entry lies, framing from
+/// start, where an entry or END begins
+/// </summary>
+static bool FindEndElement(unsigned char *in, size_t len, size_t start, size_t *end)
+{
+	int version;
+	bool found = false;
+
+	int n = FrameBufferEntries(in + start, len - start, &version, NULL, 0);
+	if (n == 0)
+	{
+		*end = start;
+		return true;
+	}
+	if (n < 0)
+	{
+		return false;
+	}
+
+	CalEntryFrame *frames = (CalEntryFrame *)malloc(n * sizeof(CalEntryFrame));
+	if (frames)
+	{
+		FrameBufferEntries(in + start, len - start, &version, frames, (unsigned int)n);
+		*end = start + frames[n - 1].Offset + frames[n - 1].Length;
+		found = frames[0].Offset == 0;
+		free(frames);
+	}
+	return found;
+}
+
+static bool SameFrameBytes(const CalEntryFrame *a, const CalEntryFrame *b)
+{
+	return a->Length == b->Length && a->Hash[0] == b->Hash[0] && a->Hash[1] == b->Hash[1];
+}
+
+/// <summary>
+/// Updates a calendar tracked with CALPARSE_TRACK_ENTRIES after an edit to
+/// its buffer: removed bytes at offset were replaced by inserted bytes, and
+/// in holds the result.  The entries the edit touches are framed again;
+/// those whose bytes are unchanged keep their CalendarEntry and the rest
+/// are parsed with pOptions, which must be the options the calendar was
+/// parsed with.  VERSION, ENTRYCOUNT and the END element are checked as a
+/// parse would; of the budgets only MaxEntries covers the whole calendar,
+/// the rest the entries parsed.  Only EntryTable and EntryFrames are
+/// updated; the caller refreshes any other index.  Returns S_OK, S_FALSE
+/// if the edited buffer does not parse or memory ran out, leaving the
+/// calendar as it was, or -1 if the calendar is not tracked or the edit
+/// does not fit it
+/// </summary>
+HRESULT ReparseCalendarEdit(Calendar *pCalendar, unsigned char *in, size_t len, size_t offset, size_t removed, size_t inserted, const CalParseOptions *pOptions)
+{
+	HRESULT hr = S_FALSE;
+	unsigned int n = pCalendar->EntryTableCount;
+	CalEntryFrame *frames = pCalendar->EntryFrames;
+	CalParseOptions options;
+
+	if (!frames || !n || !pCalendar->EntryTable) return -1;
+	if (offset > pCalendar->SourceLength || removed > pCalendar->SourceLength - offset) return -1;
+	if (len != pCalendar->SourceLength - removed + inserted) return -1;
+	if (pOptions && (pOptions->Flags & (CALPARSE_FILTER_TYPE | CALPARSE_FILTER_WINDOW))) return -1;
+
+	memset(&options, 0, sizeof(options));
+	if (pOptions)
+	{
+		options = *pOptions;
+		options.Flags &= REPARSE_ENTRY_FLAGS;
+	}
+
+	int version, entryCount;
+	if (!ReadHeaderInt(in, len, 0, VERSION, &version) || !ReadHeaderInt(in, len, REPARSE_INT_ELEMENT, ENTRYCOUNT, &entryCount))
+	{
+		printf("-> ERROR: E#1 and E#2 must be VERSION and ENTRYCOUNT\n");
+		return S_FALSE;
+	}
+	if (version != pCalendar->Version || entryCount <= 0)
+	{
+		printf("-> ERROR: Version must be 1\n");
+		return S_FALSE;
+	}
+
+	// The entries the edit touches, [first, end): a byte inserted where one
+	// entry ends and the next begins may belong to either
+	size_t oldEnd = frames[n - 1].Offset + frames[n - 1].Length;
+	unsigned int first = 0, end = n;
+	{
+		unsigned int low = 0, high = n;
+		while (low < high)
+		{
+			unsigned int mid = low + (high - low) / 2;
+			if (frames[mid].Offset + frames[mid].Length < offset) low = mid + 1;
+			else high = mid;
+		}
+		first = low;
+
+		high = n;
+		while (low < high)
+		{
+			unsigned int mid = low + (high - low) / 2;
+			if (frames[mid].Offset <= offset + removed) low = mid + 1;
+			else high = mid;
+		}
+		end = low;
+	}
+
+	// The same bytes in the edited buffer: the entries after the edit moved
+	// by the change in length, and END is found again if it may have moved
+	int64_t delta = (int64_t)inserted - (int64_t)removed;
+	size_t regionStart = first < n ? frames[first].Offset : oldEnd;
+	size_t regionEnd;
+	if (end < n)
+	{
+		regionEnd = (size_t)((int64_t)frames[end].Offset + delta);
+	}
+	else if (!FindEndElement(in, len, regionStart, &regionEnd))
+	{
+		printf("-> ERROR: file must terminate with a unique END element\n");
+		return S_FALSE;
+	}
+	if (regionEnd < regionStart || regionEnd > len)
+	{
+		return S_FALSE;
+	}
+
+	CalEntryFrame *region = NULL;
+	CalendarEntry **fresh = NULL, **table = NULL;
+	CalEntryFrame *tableFrames = NULL;
+	Calendar *pParsed = NULL;
+	unsigned int prefix = 0, suffix = 0, count = 0, total = 0, low, high;
+	unsigned int k = end - first;
+
+	int m = FrameEntryRegion(in, regionStart, regionEnd, &region);
+	if (m < 0)
+	{
+		printf("-> ERROR: Could not frame the edited entries\n");
+		goto EXIT;
+	}
+
+	// Entries whose bytes did not change are kept
+	while (prefix < (unsigned int)m && prefix < k && SameFrameBytes(&region[prefix], &frames[first + prefix]))
+	{
+		prefix++;
+	}
+	while (suffix < (unsigned int)m - prefix && suffix < k - prefix &&
+		SameFrameBytes(&region[m - 1 - suffix], &frames[end - 1 - suffix]))
+	{
+		suffix++;
+	}
+	count = (unsigned int)m - prefix - suffix;
+
+	total = n - k + (unsigned int)m;
+	if (!total)
+	{
+		printf("-> ERROR: Version must be 1\n");
+		goto EXIT;
+	}
+	if (IsBugDisabled(BUG_5) && (unsigned int)entryCount != total)
+	{
+		printf("-> ERROR: ENTRYCOUNT value does match file contents\n");
+		goto EXIT;
+	}
+	if (options.Limits.MaxEntries && total > options.Limits.MaxEntries)
+	{
+		printf("-> ERROR: entry budget of %u exceeded\n", options.Limits.MaxEntries);
+		goto EXIT;
+	}
+
+	fresh = (CalendarEntry **)calloc(count ? count : 1, sizeof(CalendarEntry *));
+	if (!fresh)
+	{
+		goto EXIT;
+	}
+
+	if (count)
+	{
+		pParsed = ParseEntryFrames(version, in, region + prefix, count, &options);
+		if (!pParsed || !TakeParsedEntries(pCalendar, pParsed, fresh))
+		{
+			printf("-> ERROR: Could not parse the edited entries\n");
+			goto EXIT;
+		}
+	}
+
+	if ((unsigned int)m != k)
+	{
+		table = (CalendarEntry **)CalMalloc(total * sizeof(CalendarEntry *));
+		tableFrames = (CalEntryFrame *)CalMalloc(total * sizeof(CalEntryFrame));
+		if (!table || !tableFrames)
+		{
+			goto EXIT;
+		}
+
+		memcpy(table, pCalendar->EntryTable, first * sizeof(CalendarEntry *));
+		memcpy(tableFrames, frames, first * sizeof(CalEntryFrame));
+		memcpy(table + first, pCalendar->EntryTable + first, prefix * sizeof(CalendarEntry *));
+		memcpy(table + first + m - suffix, pCalendar->EntryTable + end - suffix, (n - end + suffix) * sizeof(CalendarEntry *));
+		memcpy(tableFrames + first + m, frames + end, (n - end) * sizeof(CalEntryFrame));
+	}
+	else
+	{
+		table = pCalendar->EntryTable;
+		tableFrames = frames;
+	}
+
+	// Nothing can fail from here.  The entries replaced are released
+	for (unsigned int i = first + prefix; i < end - suffix; i++)
+	{
+		pCalendar->EntryTable[i]->NextEntry = NULL;
+		DestroyCalendarEntry(pCalendar->EntryTable[i]);
+	}
+	memcpy(table + first + prefix, fresh, count * sizeof(CalendarEntry *));
+	memcpy(tableFrames + first, region, m * sizeof(CalEntryFrame));
+	if (delta)
+	{
+		for (unsigned int i = first + m; i < total; i++)
+		{
+			tableFrames[i].Offset = (size_t)((int64_t)tableFrames[i].Offset + delta);
+		}
+	}
+
+	// Relink the entries around the region
+	low = first ? first - 1 : 0;
+	high = first + m < total ? first + m : total - 1;
+	for (unsigned int i = low; i <= high; i++)
+	{
+		table[i]->PreviousEntry = i ? table[i - 1] : NULL;
+		table[i]->NextEntry = i + 1 < total ? table[i + 1] : NULL;
+	}
+	pCalendar->Entry = table[0];
+
+	if (table != pCalendar->EntryTable)
+	{
+		CalFree(pCalendar->EntryTable);
+		CalFree(pCalendar->EntryFrames);
+		pCalendar->EntryTable = table;
+		pCalendar->EntryFrames = tableFrames;
+	}
+	table = NULL;
+	tableFrames = NULL;
+
+	pCalendar->EntryTableCount = total;
+	pCalendar->EntryCount = (options.Flags & CALPARSE_PROJECT_FIELDS) ? (int)total : entryCount;
+	pCalendar->SourceLength = len;
+	hr = S_OK;
+
+EXIT:
+	if (hr != S_OK && fresh)
+	{
+		for (unsigned int i = 0; i < count; i++)
+		{
+			DestroyCalendarEntry(fresh[i]);
+		}
+	}
+	if (table != pCalendar->EntryTable)
+	{
+		CalFree(table);
+		CalFree(tableFrames);
+	}
+	DestroyCalendar(pParsed);
+	free(fresh);
+	free(region);
+	return hr;
+}
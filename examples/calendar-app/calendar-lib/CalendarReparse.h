@@ -0,0 +1,34 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarReparse.h:  contains the incremental re-parse of a calendar
+* after an edit to the buffer it was parsed from
+*
+*********************************************************************/
+
+#pragma once
+
+#include <stddef.h>
+#include "CalendarStructures.h"
+#include "CalendarParser.h"
+#include "CalendarFraming.h"
+
+#define REPARSE_INT_ELEMENT		9		// Type, length and value
+#define REPARSE_HEADER			(2 * REPARSE_INT_ELEMENT)
+#define REPARSE_END_ELEMENT		5		// Type and a length the parser does not read
+
+// Parse flags that carry over to entries parsed on their own, so they come
+// out as a full parse would make them.  Of the rest, the string table is
+// the calendar's own, the entry filters are refused and the others build
+// indexes, which are refreshed over the whole calendar afterwards
+#define REPARSE_ENTRY_FLAGS		(CALPARSE_PROJECT_FIELDS | CALPARSE_SKIP_TIME_ZONES)
+
+bool ReadHeaderInt(unsigned char *in, size_t len, size_t at, unsigned char type, int *value);
+void PutHeaderInt(unsigned char *p, unsigned char type, int value);
+int FrameEntryRegion(unsigned char *in, size_t start, size_t end, CalEntryFrame **frames);
+Calendar *ParseEntryFrames(int version, unsigned char *in, const CalEntryFrame *frames, unsigned int count, const CalParseOptions *pOptions);
+bool TakeParsedEntries(Calendar *pCalendar, Calendar *pParsed, CalendarEntry **fresh);
+bool TrackCalendarEntries(Calendar *pCalendar, unsigned char *in, size_t len);
+HRESULT ReparseCalendarEdit(Calendar *pCalendar, unsigned char *in, size_t len, size_t offset, size_t removed, size_t inserted, const CalParseOptions *pOptions);
@@ -0,0 +1,232 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarScan.cpp:  contains the vector substring search used to scan
+* entry strings for a set of needles when there is no index
+*
+*********************************************************************/
+
+#include "stdafx.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "CalendarScan.h"
+
+// The candidate filter is picked when the library is compiled; build with
+// /arch:AVX2 (or -mavx2) to get the 32-byte version on x64
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SCAN_AVX2
+#define SCAN_VECTOR		32
+#define SCAN_MASK_BITS	1		// Mask bits per byte position
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define SCAN_NEON
+#define SCAN_VECTOR		16
+#define SCAN_MASK_BITS	4
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SCAN_SSE2
+#define SCAN_VECTOR		16
+#define SCAN_MASK_BITS	1
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+/// <summary>
+/// Returns the index of the lowest set bit of a nonzero word
+/// </summary>
+static unsigned int LowestSetBit(uint64_t x)
+{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+	unsigned long i;
+	_BitScanForward64(&i, x);
+	return (unsigned int)i;
+#elif defined(__GNUC__) || defined(__clang__)
+	return (unsigned int)__builtin_ctzll(x);
+#else
+	unsigned int i = 0;
+	while (!(x & 1))
+	{
+		x >>= 1;
+		i++;
+	}
+	return i;
+#endif
+}
+
+#if defined(SCAN_VECTOR)
+/// <summary>
+/// Returns SCAN_MASK_BITS bits for each of the SCAN_VECTOR positions i
+/// where head[i] is the first byte of the needle and tail[i] its last
+/// </summary>
+static uint64_t CandidateMask(const unsigned char *head, const unsigned char *tail, unsigned char first, unsigned char last)
+{
+#if defined(SCAN_AVX2)
+	__m256i h = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)head), _mm256_set1_epi8((char)first));
+	__m256i t = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)tail), _mm256_set1_epi8((char)last));
+	return (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(h, t));
+#elif defined(SCAN_NEON)
+	uint8x16_t h = vceqq_u8(vld1q_u8(head), vdupq_n_u8(first));
+	uint8x16_t t = vceqq_u8(vld1q_u8(tail), vdupq_n_u8(last));
+	uint8x8_t m = vshrn_n_u16(vreinterpretq_u16_u8(vandq_u8(h, t)), 4);
+	return vget_lane_u64(vreinterpret_u64_u8(m), 0);
+#else
+	__m128i h = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)head), _mm_set1_epi8((char)first));
+	__m128i t = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)tail), _mm_set1_epi8((char)last));
+	return (uint32_t)_mm_movemask_epi8(_mm_and_si128(h, t));
+#endif
+}
+#endif
+
+/// <summary>
+/// Returns true if needle (k bytes, k > 0) occurs in s.  Positions whose
+/// first and last bytes both match the needle are found a vector at a
+/// time, and only those are compared in full
+/// </summary>
+static bool FindNeedle(const unsigned char *s, size_t n, const unsigned char *needle, size_t k)
+{
+	unsigned char first = needle[0];
+	unsigned char last = needle[k - 1];
+	size_t middle = k > 2 ? k - 2 : 0;
+	size_t i = 0;
+
+	if (k > n)
+	{
+		return false;
+	}
+
+#if defined(SCAN_VECTOR)
+	for (; i + k - 1 + SCAN_VECTOR <= n; i += SCAN_VECTOR)
+	{
+		uint64_t m = CandidateMask(s + i, s + i + k - 1, first, last);
+
+		while (m)
+		{
+			unsigned int bit = LowestSetBit(m);
+			if (!memcmp(s + i + bit / SCAN_MASK_BITS + 1, needle + 1, middle))
+			{
+				return true;
+			}
+			m &= ~(((1ULL << SCAN_MASK_BITS) - 1) << bit);
+		}
+	}
+#endif
+
+	// The tail, and strings too short for a vector
+	while (i + k <= n)
+	{
+		const unsigned char *p = (const unsigned char *)memchr(s + i, first, n - k + 1 - i);
+		if (!p)
+		{
+			return false;
+		}
+
+		i = p - s;
+		if (s[i + k - 1] == last && !memcmp(s + i + 1, needle + 1, middle))
+		{
+			return true;
+		}
+		i++;
+	}
+	return false;
+}
+
+/// <summary>
+/// Prepares needles for scanning.  Prints the reason and returns false if
+/// there are none, too many, or an empty one
+/// </summary>
+bool InitNeedleSet(CalNeedleSet *pSet, const char **needles, unsigned int count)
+{
+	if (!count || count > CALSCAN_MAX_NEEDLES)
+	{
+		printf("-> ERROR: scan needs between 1 and %d needles\n", CALSCAN_MAX_NEEDLES);
+		return false;
+	}
+
+	pSet->Count = count;
+	pSet->Shortest = SIZE_MAX;
+	for (unsigned int i = 0; i < count; i++)
+	{
+		size_t len = needles[i] ? strlen(needles[i]) : 0;
+		if (!len)
+		{
+			printf("-> ERROR: scan needle %u is empty\n", i);
+			return false;
+		}
+
+		pSet->Needles[i] = (const unsigned char *)needles[i];
+		pSet->Lengths[i] = len;
+		pSet->Shortest = min(pSet->Shortest, len);
+	}
+	return true;
+}
+
+bool ContainsAnyNeedle(const CalNeedleSet *pSet, const unsigned char *s, size_t len)
+{
+	if (!s || len < pSet->Shortest)
+	{
+		return false;
+	}
+
+	for (unsigned int i = 0; i < pSet->Count; i++)
+	{
+		if (FindNeedle(s, len, pSet->Needles[i], pSet->Lengths[i]))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+static CalString *GetEntryString(CalendarEntry *e, int type)
+{
+	switch (type)
+	{
+	case LOCATION:		return e->Location;
+	case TIMEZONE:		return e->TimeZone;
+	case SUBJECT:		return e->Subject;
+	case CONTENT:		return e->Content;
+	case CONTENTTYPE:	return e->ContentType;
+	default:			return NULL;
+	}
+}
+
+/// <summary>
+/// Finds the entries of a calendar with a needle in any of the string
+/// elements in fields.  Writes up to n ascending entry indices to out and
+/// returns how many entries match
+/// </summary>
+int ScanEntriesForNeedles(Calendar *pCalendar, const CalNeedleSet *pSet, unsigned int fields, unsigned int *out, unsigned int n)
+{
+	static const int types[] = { SUBJECT, CONTENT, LOCATION, TIMEZONE, CONTENTTYPE };
+	unsigned int entry = 0;
+	int found = 0;
+
+	for (CalendarEntry *e = pCalendar->Entry; e; e = e->NextEntry, entry++)
+	{
+		for (int i = 0; i < (int)(sizeof(types) / sizeof(types[0])); i++)
+		{
+			CalString *s = (fields & CALFIELD(types[i])) ? GetEntryString(e, types[i]) : NULL;
+			if (!s)
+			{
+				continue;
+			}
+
+			bool hit = (s->StringType == LONGSTRING)
+				? ContainsAnyNeedle(pSet, s->Long.Value, s->Long.Length)
+				: ContainsAnyNeedle(pSet, s->Short.Value, s->Short.Length);
+			if (hit)
+			{
+				if ((unsigned int)found < n) out[found] = entry;
+				if (found < INT_MAX) found++;
+				break;
+			}
+		}
+	}
+	return found;
+}
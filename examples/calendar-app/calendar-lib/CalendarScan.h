@@ -0,0 +1,31 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarScan.h:  contains the vector substring search used to scan
+* entry strings for a set of needles when there is no index
+*
+*********************************************************************/
+
+#pragma once
+
+#include <stddef.h>
+#include "CalendarStructures.h"
+
+#define CALSCAN_MAX_NEEDLES		32
+
+// The string elements that can be scanned, as CALFIELD bits
+#define CALSCAN_FIELDS			(CALFIELD(LOCATION) | CALFIELD(TIMEZONE) | CALFIELD(SUBJECT) | CALFIELD(CONTENT) | CALFIELD(CONTENTTYPE))
+
+typedef struct _CalNeedleSet
+{
+	unsigned int Count;
+	size_t Shortest;			// Strings shorter than this cannot match
+	const unsigned char *Needles[CALSCAN_MAX_NEEDLES];
+	size_t Lengths[CALSCAN_MAX_NEEDLES];
+} CalNeedleSet;
+
+bool InitNeedleSet(CalNeedleSet *pSet, const char **needles, unsigned int count);
+bool ContainsAnyNeedle(const CalNeedleSet *pSet, const unsigned char *s, size_t len);
+int ScanEntriesForNeedles(Calendar *pCalendar, const CalNeedleSet *pSet, unsigned int fields, unsigned int *out, unsigned int n);
@@ -0,0 +1,899 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarSnapshot.cpp:  contains the relocatable calendar image, so a
+* service can map the calendars it parsed on a previous run instead of
+* parsing them again
+*
+*********************************************************************/
+
+#include "stdafx.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "CalendarHash.h"
+#include "CalendarContactIndex.h"
+#include "CalendarIntervalIndex.h"
+#include "CalendarStartOrder.h"
+#include "CalendarTextIndex.h"
+#include "CalendarBloom.h"
+#include "CalendarSnapshot.h"
+
+#pragma warning (disable: 4996) // Suppress compiler warning re: use of fopen
+
+#define SNAPSHOT_AT(p, off)		((unsigned char *)(p) + (off))
+
+typedef struct _CalSnapshotWriter
+{
+	unsigned char *Image;
+	size_t Length;
+	size_t Capacity;
+	uint64_t *Relocations;
+	size_t RelocationCount;
+	size_t RelocationCapacity;
+	const CalString **Strings;	// Strings already written, so shared ones stay shared
+	size_t *StringOffsets;
+	size_t StringCount;
+	size_t StringCapacity;		// A power of two
+	bool Failed;
+} CalSnapshotWriter;
+
+/// <summary>
+/// Appends that many zeroed bytes to the image at the given alignment and
+/// returns their offset, or 0 once the writer has failed.  The image moves
+/// as it grows, so structures in it are only ever addressed by offset
+/// </summary>
+static size_t ReserveSnapshot(CalSnapshotWriter *w, size_t bytes, size_t align)
+{
+	if (w->Failed)
+	{
+		return 0;
+	}
+
+	size_t offset = (w->Length + align - 1) & ~(align - 1);
+	if (offset + bytes < offset)
+	{
+		w->Failed = true;
+		return 0;
+	}
+
+	if (offset + bytes > w->Capacity)
+	{
+		size_t capacity = w->Capacity ? w->Capacity : 64 * 1024;
+		while (capacity < offset + bytes)
+		{
+			capacity *= 2;
+		}
+
+		unsigned char *grown = (unsigned char *)realloc(w->Image, capacity);
+		if (!grown)
+		{
+			w->Failed = true;
+			return 0;
+		}
+		memset(grown + w->Capacity, 0, capacity - w->Capacity);
+		w->Image = grown;
+		w->Capacity = capacity;
+	}
+
+	w->Length = offset + bytes;
+	return offset;
+}
+
+static size_t CopyToSnapshot(CalSnapshotWriter *w, const void *p, size_t bytes, size_t align)
+{
+	if (!p)
+	{
+		return 0;
+	}
+
+	size_t offset = ReserveSnapshot(w, bytes, align);
+	if (offset)
+	{
+		memcpy(SNAPSHOT_AT(w->Image, offset), p, bytes);
+	}
+	return offset;
+}
+
+/// <summary>
+/// Points the pointer at offset field to the structure at offset target,
+/// or sets it to NULL when target is 0, and records it for relocation
+/// </summary>
+static void SetSnapshotPointer(CalSnapshotWriter *w, size_t field, size_t target)
+{
+	if (w->Failed)
+	{
+		return;
+	}
+
+	void *value = target ? (void *)(uintptr_t)(CALSNAP_PREFERRED_BASE + target) : NULL;
+	memcpy(SNAPSHOT_AT(w->Image, field), &value, sizeof(value));
+	if (!target)
+	{
+		return;
+	}
+
+	if (w->RelocationCount == w->RelocationCapacity)
+	{
+		size_t capacity = w->RelocationCapacity ? w->RelocationCapacity * 2 : 1024;
+		uint64_t *grown = (uint64_t *)realloc(w->Relocations, capacity * sizeof(uint64_t));
+		if (!grown)
+		{
+			w->Failed = true;
+			return;
+		}
+		w->Relocations = grown;
+		w->RelocationCapacity = capacity;
+	}
+	w->Relocations[w->RelocationCount++] = field;
+}
+
+static size_t HashSnapshotPointer(const void *p, size_t capacity)
+{
+	uint64_t x = (uint64_t)(uintptr_t)p * 0x9e3779b97f4a7c15ULL;
+	return (size_t)(x >> 32) & (capacity - 1);
+}
+
+static bool GrowSnapshotStrings(CalSnapshotWriter *w)
+{
+	size_t capacity = w->StringCapacity ? w->StringCapacity * 2 : 1024;
+	const CalString **strings = (const CalString **)calloc(capacity, sizeof(CalString *));
+	size_t *offsets = (size_t *)malloc(capacity * sizeof(size_t));
+	if (!strings || !offsets)
+	{
+		free(strings);
+		free(offsets);
+		return false;
+	}
+
+	for (size_t i = 0; i < w->StringCapacity; i++)
+	{
+		if (w->Strings[i])
+		{
+			size_t slot = HashSnapshotPointer(w->Strings[i], capacity);
+			while (strings[slot])
+			{
+				slot = (slot + 1) & (capacity - 1);
+			}
+			strings[slot] = w->Strings[i];
+			offsets[slot] = w->StringOffsets[i];
+		}
+	}
+
+	free(w->Strings);
+	free(w->StringOffsets);
+	w->Strings = strings;
+	w->StringOffsets = offsets;
+	w->StringCapacity = capacity;
+	return true;
+}
+
+/// <summary>
+/// Writes a CalString and its value, once per distinct CalString, so the
+/// strings interned by CALPARSE_INTERN_STRINGS are still shared in the image
+/// </summary>
+static size_t WriteSnapshotString(CalSnapshotWriter *w, const CalString *s)
+{
+	if (!s || w->Failed)
+	{
+		return 0;
+	}
+
+	if (w->StringCount * 2 >= w->StringCapacity && !GrowSnapshotStrings(w))
+	{
+		w->Failed = true;
+		return 0;
+	}
+
+	size_t slot = HashSnapshotPointer(s, w->StringCapacity);
+	while (w->Strings[slot])
+	{
+		if (w->Strings[slot] == s)
+		{
+			return w->StringOffsets[slot];
+		}
+		slot = (slot + 1) & (w->StringCapacity - 1);
+	}
+
+	bool isLong = s->StringType == LONGSTRING;
+	const unsigned char *value = isLong ? s->Long.Value : s->Short.Value;
+	size_t length = isLong ? s->Long.Length : s->Short.Length;
+	size_t field = isLong ? offsetof(CalString, Long.Value) : offsetof(CalString, Short.Value);
+
+	size_t offset = CopyToSnapshot(w, s, sizeof(CalString), 8);
+	if (!offset)
+	{
+		return 0;
+	}
+
+	// Mapped values are owned by the image, never by a reference count
+	SetSnapshotPointer(w, offset + offsetof(CalString, Shared), 0);
+
+	if (value == s->Inline)
+	{
+		SetSnapshotPointer(w, offset + field, offset + offsetof(CalString, Inline));
+	}
+	else if (value)
+	{
+		// Reserved zeroed, so the copy is NUL-terminated
+		size_t valueOffset = ReserveSnapshot(w, length + 1, 1);
+		if (valueOffset)
+		{
+			memcpy(SNAPSHOT_AT(w->Image, valueOffset), value, length);
+		}
+		SetSnapshotPointer(w, offset + field, valueOffset);
+	}
+
+	w->Strings[slot] = s;
+	w->StringOffsets[slot] = offset;
+	w->StringCount++;
+	return offset;
+}
+
+static size_t WriteSnapshotContacts(CalSnapshotWriter *w, const Contact *c)
+{
+	size_t first = 0, previous = 0;
+
+	for (; c && !w->Failed; c = c->NextContact)
+	{
+		size_t offset = ReserveSnapshot(w, sizeof(Contact), 8);
+		SetSnapshotPointer(w, offset + offsetof(Contact, Name), WriteSnapshotString(w, c->Name));
+		SetSnapshotPointer(w, offset + offsetof(Contact, Email), WriteSnapshotString(w, c->Email));
+
+		if (previous)
+		{
+			SetSnapshotPointer(w, previous + offsetof(Contact, NextContact), offset);
+		}
+		else
+		{
+			first = offset;
+		}
+		previous = offset;
+	}
+	return first;
+}
+
+static size_t WriteSnapshotAttachments(CalSnapshotWriter *w, const Attachments *a)
+{
+	size_t offset = CopyToSnapshot(w, a, sizeof(Attachments), 8);
+	if (!offset)
+	{
+		return 0;
+	}
+
+	size_t array = 0;
+	if (a->Count > 0 && a->Attachment)
+	{
+		array = ReserveSnapshot(w, a->Count * sizeof(Attachment), 8);
+		for (int i = 0; i < a->Count && !w->Failed; i++)
+		{
+			size_t item = array + i * sizeof(Attachment);
+			const Blob *b = a->Attachment[i].Blob;
+
+			SetSnapshotPointer(w, item + offsetof(Attachment, Name), WriteSnapshotString(w, a->Attachment[i].Name));
+
+			size_t blob = CopyToSnapshot(w, b, sizeof(Blob), 8);
+			if (blob)
+			{
+				SetSnapshotPointer(w, blob + offsetof(Blob, Data), CopyToSnapshot(w, b->Data, b->Length, 16));
+				SetSnapshotPointer(w, blob + offsetof(Blob, Shared), 0);
+			}
+			SetSnapshotPointer(w, item + offsetof(Attachment, Blob), blob);
+		}
+	}
+	SetSnapshotPointer(w, offset + offsetof(Attachments, Attachment), array);
+	return offset;
+}
+
+static size_t WriteSnapshotEntry(CalSnapshotWriter *w, size_t offset, const CalendarEntry *e)
+{
+	const StructuredBlob *sb = e->StructuredBlob;
+
+	memcpy(SNAPSHOT_AT(w->Image, offset), e, sizeof(CalendarEntry));
+
+	SetSnapshotPointer(w, offset + offsetof(CalendarEntry, Sender), WriteSnapshotContacts(w, e->Sender));
+	SetSnapshotPointer(w, offset + offsetof(CalendarEntry, Recipient), WriteSnapshotContacts(w, e->Recipient));
+	SetSnapshotPointer(w, offset + offsetof(CalendarEntry, Location), WriteSnapshotString(w, e->Location));
+	SetSnapshotPointer(w, offset + offsetof(CalendarEntry, TimeZone), WriteSnapshotString(w, e->TimeZone));
+	SetSnapshotPointer(w, offset + offsetof(CalendarEntry, StartTime), CopyToSnapshot(w, e->StartTime, sizeof(CalTime), 8));
+	SetSnapshotPointer(w, offset + offsetof(CalendarEntry, StartDate), CopyToSnapshot(w, e->StartDate, sizeof(CalDate), 8));
+	SetSnapshotPointer(w, offset + offsetof(CalendarEntry, Duration), CopyToSnapshot(w, e->Duration, sizeof(CalTime), 8));
+	SetSnapshotPointer(w, offset + offsetof(CalendarEntry, Subject), WriteSnapshotString(w, e->Subject));
+	SetSnapshotPointer(w, offset + offsetof(CalendarEntry, Content), WriteSnapshotString(w, e->Content));
+	SetSnapshotPointer(w, offset + offsetof(CalendarEntry, ContentType), WriteSnapshotString(w, e->ContentType));
+	SetSnapshotPointer(w, offset + offsetof(CalendarEntry, Attachments), WriteSnapshotAttachments(w, e->Attachments));
+
+	size_t blob = CopyToSnapshot(w, sb, sizeof(StructuredBlob), 8);
+	if (blob)
+	{
+		SetSnapshotPointer(w, blob + offsetof(StructuredBlob, Data), CopyToSnapshot(w, sb->Data, sb->TotalLength, 16));
+	}
+	SetSnapshotPointer(w, offset + offsetof(CalendarEntry, StructuredBlob), blob);
+	return offset;
+}
+
+/// <summary>
+/// Hashes the header, less its checksum, and the bytes after it, so a
+/// damaged field in either is caught before the image is used
+/// </summary>
+static uint64_t SnapshotChecksum(const unsigned char *image, const CalSnapshotHeader *h)
+{
+	CalSnapshotHeader header = *h;
+
+	header.Checksum = 0;
+	uint64_t seed = CalHash64(&header, sizeof(header), CALSNAP_MAGIC);
+	return CalHash64(image + CALSNAP_HEADER, (size_t)h->Size - CALSNAP_HEADER, seed);
+}
+
+/// <summary>
+/// Lays out a calendar, its entries and the indexes it carries as one
+/// image.  The entries are stored together in list order; the flat indexes
+/// are copied byte for byte
+/// </summary>
+static bool WriteSnapshot(CalSnapshotWriter *w, Calendar *pCalendar)
+{
+	unsigned int count = 0;
+	for (CalendarEntry *e = pCalendar->Entry; e; e = e->NextEntry)
+	{
+		count++;
+	}
+
+	size_t header = ReserveSnapshot(w, CALSNAP_HEADER, 64);
+	size_t calendar = CopyToSnapshot(w, pCalendar, sizeof(Calendar), 64);
+	size_t entries = count ? ReserveSnapshot(w, count * sizeof(CalendarEntry), 64) : 0;
+	size_t table = count ? ReserveSnapshot(w, count * sizeof(CalendarEntry *), 8) : 0;
+	if (w->Failed || header != 0 || calendar != CALSNAP_HEADER)
+	{
+		return false;
+	}
+
+	unsigned int i = 0;
+	for (CalendarEntry *e = pCalendar->Entry; e && !w->Failed; e = e->NextEntry, i++)
+	{
+		size_t offset = WriteSnapshotEntry(w, entries + i * sizeof(CalendarEntry), e);
+
+		SetSnapshotPointer(w, offset + offsetof(CalendarEntry, PreviousEntry), i ? offset - sizeof(CalendarEntry) : 0);
+		SetSnapshotPointer(w, offset + offsetof(CalendarEntry, NextEntry), i + 1 < count ? offset + sizeof(CalendarEntry) : 0);
+		SetSnapshotPointer(w, table + i * sizeof(CalendarEntry *), offset);
+	}
+
+	Calendar *c = (Calendar *)SNAPSHOT_AT(w->Image, calendar);
+	c->Storage = SNAPSHOTSTORAGE;
+	c->EntryTableCount = count;
+	c->Flags = 0;
+	SetSnapshotPointer(w, calendar + offsetof(Calendar, Entry), entries);
+	SetSnapshotPointer(w, calendar + offsetof(Calendar, Arena), 0);
+	SetSnapshotPointer(w, calendar + offsetof(Calendar, Strings), 0);
+	SetSnapshotPointer(w, calendar + offsetof(Calendar, EntryTable), table);
+	SetSnapshotPointer(w, calendar + offsetof(Calendar, EntryFrames), 0);
+
+	CalContactIndex *pContacts = pCalendar->ContactIndex;
+	CalIntervalIndex *pIntervals = pCalendar->IntervalIndex;
+	CalStartOrder *pOrder = pCalendar->StartOrder;
+	CalTextIndex *pText = pCalendar->TextIndex;
+	CalBloom *pBloom = pCalendar->Bloom;
+
+	SetSnapshotPointer(w, calendar + offsetof(Calendar, ContactIndex), pContacts ? CopyToSnapshot(w, pContacts, pContacts->Size, 64) : 0);
+	SetSnapshotPointer(w, calendar + offsetof(Calendar, IntervalIndex), pIntervals ? CopyToSnapshot(w, pIntervals, pIntervals->Size, 64) : 0);
+	SetSnapshotPointer(w, calendar + offsetof(Calendar, StartOrder), pOrder ? CopyToSnapshot(w, pOrder, pOrder->Size, 64) : 0);
+	SetSnapshotPointer(w, calendar + offsetof(Calendar, TextIndex), pText ? CopyToSnapshot(w, pText, (size_t)pText->Size, 64) : 0);
+	SetSnapshotPointer(w, calendar + offsetof(Calendar, Bloom), pBloom ? CopyToSnapshot(w, pBloom, pBloom->Size, 64) : 0);
+
+	if (w->Failed || w->RelocationCount > UINT32_MAX)
+	{
+		return false;
+	}
+
+	size_t relocations = CopyToSnapshot(w, w->Relocations, w->RelocationCount * sizeof(uint64_t), 8);
+	if (w->Failed)
+	{
+		return false;
+	}
+
+	CalSnapshotHeader *h = (CalSnapshotHeader *)w->Image;
+	h->Magic = CALSNAP_MAGIC;
+	h->Version = CALSNAP_VERSION;
+	h->PointerSize = sizeof(void *);
+	h->RelocationCount = (uint32_t)w->RelocationCount;
+	h->Size = w->Length;
+	h->PreferredBase = CALSNAP_PREFERRED_BASE;
+	h->Calendar = calendar;
+	h->Relocations = w->RelocationCount ? relocations : w->Length;
+	h->Checksum = SnapshotChecksum(w->Image, h);
+	return true;
+}
+
+/// <summary>
+/// Writes a calendar and its indexes to a snapshot file that MapSnapshot
+/// maps back, and the size of the file to bytes if it is not NULL.  The
+/// calendar is only read
+/// </summary>
+bool SaveSnapshot(Calendar *pCalendar, const char *path, uint64_t *bytes)
+{
+	CalSnapshotWriter w;
+	bool ok = false;
+	FILE *f = NULL;
+
+	memset(&w, 0, sizeof(w));
+	if (!WriteSnapshot(&w, pCalendar))
+	{
+		printf("-> ERROR: cannot build the snapshot\n");
+		goto ERROR_EXIT;
+	}
+
+	f = fopen(path, "wb");
+	if (!f)
+	{
+		printf("-> ERROR: cannot create %s\n", path);
+		goto ERROR_EXIT;
+	}
+
+	ok = fwrite(w.Image, 1, w.Length, f) == w.Length;
+	ok = (fclose(f) == 0) && ok;
+	if (!ok)
+	{
+		printf("-> ERROR: cannot write %s\n", path);
+	}
+	else if (bytes)
+	{
+		*bytes = w.Length;
+	}
+
+ERROR_EXIT:
+	free(w.Image);
+	free(w.Relocations);
+	free(w.Strings);
+	free(w.StringOffsets);
+	return ok;
+}
+
+static bool ValidateSnapshotHeader(const CalSnapshotHeader *h, uint64_t fileSize)
+{
+	return h->Magic == CALSNAP_MAGIC && h->Version == CALSNAP_VERSION &&
+		h->PointerSize == sizeof(void *) &&
+		h->Size == fileSize && h->Size >= CALSNAP_HEADER + sizeof(Calendar) &&
+		h->Calendar == CALSNAP_HEADER &&
+		h->PreferredBase + h->Size > h->PreferredBase &&
+		h->Relocations % sizeof(uint64_t) == 0 && h->Relocations <= h->Size &&
+		h->RelocationCount <= (h->Size - h->Relocations) / sizeof(uint64_t);
+}
+
+// What MapSnapshot knows about an image while it checks it.  Both bitmaps
+// hold one bit per pointer-sized word
+typedef struct _CalSnapshotCheck
+{
+	unsigned char *View;
+	uint64_t Size;
+	uint64_t *Relocated;		// Words the relocation table lists
+	uint64_t *Claimed;			// Words an object reached from the Calendar starts at
+} CalSnapshotCheck;
+
+static bool TestSnapshotBit(const uint64_t *bits, uint64_t offset)
+{
+	uint64_t word = offset / sizeof(void *);
+	return (bits[word / 64] >> (word % 64)) & 1;
+}
+
+static void SetSnapshotBit(uint64_t *bits, uint64_t offset)
+{
+	uint64_t word = offset / sizeof(void *);
+	bits[word / 64] |= 1ULL << (word % 64);
+}
+
+/// <summary>
+/// Checks that every relocated pointer lies in the image, is listed once
+/// and points into it, then moves each by the difference between where
+/// the image was mapped and its preferred base.  A view at the preferred
+/// base is only checked
+/// </summary>
+static bool RelocateSnapshot(CalSnapshotCheck *c, const CalSnapshotHeader *h)
+{
+	unsigned char *view = c->View;
+	const uint64_t *relocations = (const uint64_t *)SNAPSHOT_AT(view, h->Relocations);
+	uintptr_t delta = (uintptr_t)view - (uintptr_t)h->PreferredBase;
+
+	for (uint32_t i = 0; i < h->RelocationCount; i++)
+	{
+		uint64_t field = relocations[i];
+		uintptr_t value;
+
+		if (field % sizeof(void *) || field < CALSNAP_HEADER || field > h->Size - sizeof(void *) ||
+			TestSnapshotBit(c->Relocated, field))
+		{
+			return false;
+		}
+		SetSnapshotBit(c->Relocated, field);
+
+		memcpy(&value, view + field, sizeof(value));
+		if ((uint64_t)value - h->PreferredBase >= h->Size)
+		{
+			return false;
+		}
+
+		if (delta)
+		{
+			value += delta;
+			memcpy(view + field, &value, sizeof(value));
+		}
+	}
+	return true;
+}
+
+/// <summary>
+/// Reads the pointer in a field of an object in the image.  It must be
+/// NULL, or listed in the relocation table and point at bytes bytes of the
+/// image aligned to align
+/// </summary>
+static bool GetSnapshotTarget(const CalSnapshotCheck *c, const void *field, uint64_t bytes, uint64_t align, const void **target)
+{
+	const unsigned char *p;
+	memcpy(&p, field, sizeof(p));
+	*target = p;
+	if (!p)
+	{
+		return true;
+	}
+
+	// Relocated pointers are known to point into the image
+	uint64_t offset = (uint64_t)(p - c->View);
+	return TestSnapshotBit(c->Relocated, (uint64_t)((const unsigned char *)field - c->View)) &&
+		offset % align == 0 && bytes <= c->Size - offset;
+}
+
+/// <summary>
+/// Marks an object as reached, failing if it was reached before, so no
+/// list can loop or be shared
+/// </summary>
+static bool ClaimSnapshotObject(CalSnapshotCheck *c, const void *p)
+{
+	uint64_t offset = (uint64_t)((const unsigned char *)p - c->View);
+	if (TestSnapshotBit(c->Claimed, offset))
+	{
+		return false;
+	}
+	SetSnapshotBit(c->Claimed, offset);
+	return true;
+}
+
+/// <summary>
+/// Checks an object reached through a field: in the image, and not reached
+/// before.  *target is NULL if the field is
+/// </summary>
+static bool CheckSnapshotObject(CalSnapshotCheck *c, const void *field, uint64_t bytes, const void **target)
+{
+	return GetSnapshotTarget(c, field, bytes, 8, target) && (!*target || ClaimSnapshotObject(c, *target));
+}
+
+/// <summary>
+/// Checks a CalString and its NUL-terminated value.  Interned strings are
+/// shared by their referrers, so they are not claimed
+/// </summary>
+static bool CheckSnapshotString(CalSnapshotCheck *c, CalString *const *field)
+{
+	const CalString *s;
+	const unsigned char *value;
+	uint64_t length;
+
+	if (!GetSnapshotTarget(c, field, sizeof(CalString), 8, (const void **)&s))
+	{
+		return false;
+	}
+	if (!s)
+	{
+		return true;
+	}
+
+	if (s->StringType == SHORTSTRING)
+	{
+		length = s->Short.Length;
+		if (!GetSnapshotTarget(c, &s->Short.Value, length + 1, 1, (const void **)&value))
+		{
+			return false;
+		}
+	}
+	else if (s->StringType == LONGSTRING)
+	{
+		length = s->Long.Length;
+		if (!GetSnapshotTarget(c, &s->Long.Value, length + 1, 1, (const void **)&value))
+		{
+			return false;
+		}
+	}
+	else
+	{
+		return false;
+	}
+
+	return !s->Shared && (value ? value[length] == '\0' : length == 0);
+}
+
+static bool CheckSnapshotContacts(CalSnapshotCheck *c, Contact *const *field)
+{
+	const Contact *k;
+
+	for (;;)
+	{
+		if (!CheckSnapshotObject(c, field, sizeof(Contact), (const void **)&k))
+		{
+			return false;
+		}
+		if (!k)
+		{
+			return true;
+		}
+
+		if (!CheckSnapshotString(c, &k->Name) || !CheckSnapshotString(c, &k->Email))
+		{
+			return false;
+		}
+		field = &k->NextContact;
+	}
+}
+
+static bool CheckSnapshotBlob(CalSnapshotCheck *c, Blob *const *field)
+{
+	const Blob *b;
+	const void *data;
+
+	if (!CheckSnapshotObject(c, field, sizeof(Blob), (const void **)&b))
+	{
+		return false;
+	}
+	return !b || (!b->Shared && GetSnapshotTarget(c, &b->Data, b->Length, 1, &data) && (data || !b->Length));
+}
+
+static bool CheckSnapshotAttachments(CalSnapshotCheck *c, Attachments *const *field)
+{
+	const Attachments *a;
+	const Attachment *items;
+
+	if (!CheckSnapshotObject(c, field, sizeof(Attachments), (const void **)&a))
+	{
+		return false;
+	}
+	if (!a)
+	{
+		return true;
+	}
+
+	if (a->Count < 0 || !CheckSnapshotObject(c, &a->Attachment, (uint64_t)a->Count * sizeof(Attachment), (const void **)&items) ||
+		(!items && a->Count))
+	{
+		return false;
+	}
+
+	for (int i = 0; i < a->Count; i++)
+	{
+		if (!CheckSnapshotString(c, &items[i].Name) || !CheckSnapshotBlob(c, &items[i].Blob))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool CheckSnapshotEntry(CalSnapshotCheck *c, const CalendarEntry *e)
+{
+	const StructuredBlob *sb;
+	const void *p;
+
+	if (!CheckSnapshotContacts(c, &e->Sender) || !CheckSnapshotContacts(c, &e->Recipient) ||
+		!CheckSnapshotString(c, &e->Location) || !CheckSnapshotString(c, &e->TimeZone) ||
+		!CheckSnapshotObject(c, &e->StartTime, sizeof(CalTime), &p) ||
+		!CheckSnapshotObject(c, &e->StartDate, sizeof(CalDate), &p) ||
+		!CheckSnapshotObject(c, &e->Duration, sizeof(CalTime), &p) ||
+		!CheckSnapshotString(c, &e->Subject) || !CheckSnapshotString(c, &e->Content) ||
+		!CheckSnapshotString(c, &e->ContentType) || !CheckSnapshotAttachments(c, &e->Attachments) ||
+		!CheckSnapshotObject(c, &e->StructuredBlob, sizeof(StructuredBlob), (const void **)&sb))
+	{
+		return false;
+	}
+
+	return !sb || (GetSnapshotTarget(c, &sb->Data, sb->TotalLength, 1, &p) && (p || !sb->TotalLength));
+}
+
+/// <summary>
+/// Reaches the index in a field of the Calendar and returns how many bytes
+/// of the image it may take, for its validator to bound its Size by
+/// </summary>
+static bool GetSnapshotIndex(CalSnapshotCheck *c, const void *field, uint64_t header, const void **target, uint64_t *bytes)
+{
+	if (!GetSnapshotTarget(c, field, header, 64, target))
+	{
+		return false;
+	}
+	*bytes = *target ? c->Size - (uint64_t)((const unsigned char *)*target - c->View) : 0;
+	return true;
+}
+
+/// <summary>
+/// Walks everything reachable from the Calendar of a relocated image and
+/// checks it as the accessors will use it: every pointer listed in the
+/// relocation table and aimed at a whole object of the right size, every
+/// length within the image, entries listed in order in the entry table,
+/// and the indexes consistent with them.  Snapshots are not only read
+/// back by the process that saved them, so nothing in the file is trusted
+/// </summary>
+static bool CheckSnapshotCalendar(CalSnapshotCheck *c, const Calendar *pCalendar)
+{
+	CalendarEntry *const *table;
+	const CalendarEntry *const *field = (const CalendarEntry *const *)&pCalendar->Entry;
+	const CalendarEntry *previous = NULL;
+	unsigned int count = pCalendar->EntryTableCount;
+
+	if (pCalendar->Storage != SNAPSHOTSTORAGE || pCalendar->Arena || pCalendar->Strings || pCalendar->EntryFrames || pCalendar->Flags ||
+		(pCalendar->Fields & ~CALFIELD_ENTRY_ELEMENTS) ||
+		!ClaimSnapshotObject(c, pCalendar) ||
+		!CheckSnapshotObject(c, &pCalendar->EntryTable, (uint64_t)count * sizeof(CalendarEntry *), (const void **)&table) ||
+		(!table && count))
+	{
+		return false;
+	}
+
+	for (unsigned int i = 0; ; i++)
+	{
+		const CalendarEntry *e, *listed, *back;
+
+		if (!CheckSnapshotObject(c, field, sizeof(CalendarEntry), (const void **)&e) || (i == count) != !e)
+		{
+			return false;
+		}
+		if (!e)
+		{
+			break;
+		}
+
+		if (!GetSnapshotTarget(c, &table[i], sizeof(CalendarEntry), 8, (const void **)&listed) || listed != e ||
+			!GetSnapshotTarget(c, &e->PreviousEntry, sizeof(CalendarEntry), 8, (const void **)&back) || back != previous ||
+			!CheckSnapshotEntry(c, e))
+		{
+			return false;
+		}
+
+		previous = e;
+		field = (const CalendarEntry *const *)&e->NextEntry;
+	}
+
+	const CalContactIndex *pContacts;
+	const CalIntervalIndex *pIntervals;
+	const CalStartOrder *pOrder;
+	const CalTextIndex *pText;
+	const CalBloom *pBloom;
+	uint64_t bytes;
+
+	return GetSnapshotIndex(c, &pCalendar->ContactIndex, sizeof(CalContactIndex), (const void **)&pContacts, &bytes) &&
+		(!pContacts || ValidateContactIndex(pContacts, bytes, count)) &&
+		GetSnapshotIndex(c, &pCalendar->IntervalIndex, sizeof(CalIntervalIndex), (const void **)&pIntervals, &bytes) &&
+		(!pIntervals || ValidateIntervalIndex(pIntervals, bytes, count)) &&
+		GetSnapshotIndex(c, &pCalendar->StartOrder, sizeof(CalStartOrder), (const void **)&pOrder, &bytes) &&
+		(!pOrder || ValidateStartOrder(pOrder, bytes, count)) &&
+		GetSnapshotIndex(c, &pCalendar->TextIndex, sizeof(CalTextIndex), (const void **)&pText, &bytes) &&
+		(!pText || (pText->Size <= bytes && ValidateTextIndex(pText, pText->Size) && pText->CalendarCount == 1 && pText->DocCount == count)) &&
+		GetSnapshotIndex(c, &pCalendar->Bloom, sizeof(CalBloom), (const void **)&pBloom, &bytes) &&
+		(!pBloom || ValidateBloom(pBloom, bytes));
+}
+
+/// <summary>
+/// Relocates a mapped image and checks everything reachable from its
+/// Calendar
+/// </summary>
+static bool CheckSnapshot(unsigned char *view, const CalSnapshotHeader *h)
+{
+	CalSnapshotCheck c;
+	size_t words = (size_t)((h->Size / sizeof(void *) + 63) / 64);
+	bool ok;
+
+	c.View = view;
+	c.Size = h->Size;
+	c.Relocated = (uint64_t *)calloc(words, sizeof(uint64_t));
+	c.Claimed = (uint64_t *)calloc(words, sizeof(uint64_t));
+
+	ok = c.Relocated && c.Claimed && RelocateSnapshot(&c, h) &&
+		CheckSnapshotCalendar(&c, (const Calendar *)(view + h->Calendar));
+
+	free(c.Relocated);
+	free(c.Claimed);
+	return ok;
+}
+
+/// <summary>
+/// Maps a snapshot file as a read-only calendar that the accessors use in
+/// place.  The image is mapped shared at its preferred base when that
+/// address is free and needs no fixups there; otherwise it is mapped
+/// copy-on-write, relocated and made read-only.  Either way its checksum
+/// is verified first and everything the Calendar reaches is checked before
+/// it is returned.  Calendar flags other than zero are set on the mapped
+/// Calendar, which takes a copy-on-write view even at the preferred base.
+/// Release it with UnmapSnapshot
+/// </summary>
+Calendar *MapSnapshot(const char *path, unsigned int flags)
+{
+	CalSnapshotHeader header;
+	LARGE_INTEGER fileSize;
+	DWORD read = 0;
+	unsigned char *view = NULL;
+	bool relocated = false;
+	Calendar *pCalendar;
+	DWORD protection;
+
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		printf("-> ERROR: cannot open %s\n", path);
+		return NULL;
+	}
+
+	if (!GetFileSizeEx(file, &fileSize) ||
+		!ReadFile(file, &header, sizeof(header), &read, NULL) || read != sizeof(header) ||
+		!ValidateSnapshotHeader(&header, (uint64_t)fileSize.QuadPart))
+	{
+		printf("-> ERROR: %s is not a valid snapshot\n", path);
+		CloseHandle(file);
+		return NULL;
+	}
+
+	// The view stays valid after both handles are closed
+	HANDLE mapping = CreateFileMapping(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	if (mapping)
+	{
+		view = (unsigned char *)MapViewOfFileEx(mapping, flags ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0, (void *)(uintptr_t)header.PreferredBase);
+		if (!view)
+		{
+			view = (unsigned char *)MapViewOfFileEx(mapping, FILE_MAP_COPY, 0, 0, 0, NULL);
+			relocated = true;
+		}
+		CloseHandle(mapping);
+	}
+	CloseHandle(file);
+
+	if (!view)
+	{
+		printf("-> ERROR: cannot map %s\n", path);
+		return NULL;
+	}
+
+	if (memcmp(view, &header, sizeof(header)) ||
+		SnapshotChecksum(view, &header) != header.Checksum ||
+		!CheckSnapshot(view, &header))
+	{
+		printf("-> ERROR: %s is corrupt\n", path);
+		goto ERROR_EXIT;
+	}
+
+	pCalendar = (Calendar *)(view + header.Calendar);
+	if (flags)
+	{
+		pCalendar->Flags = flags;
+	}
+
+	if ((relocated || flags) && !VirtualProtect(view, (size_t)header.Size, PAGE_READONLY, &protection))
+	{
+		goto ERROR_EXIT;
+	}
+
+	return pCalendar;
+
+ERROR_EXIT:
+	UnmapViewOfFile(view);
+	return NULL;
+}
+
+/// <summary>
+/// Returns the bytes mapped for a snapshot calendar
+/// </summary>
+uint64_t GetSnapshotSize(const Calendar *pCalendar)
+{
+	const CalSnapshotHeader *h = (const CalSnapshotHeader *)((const unsigned char *)pCalendar - CALSNAP_HEADER);
+	return h->Size;
+}
+
+void UnmapSnapshot(Calendar *pCalendar)
+{
+	if (pCalendar && pCalendar->Storage == SNAPSHOTSTORAGE)
+	{
+		UnmapViewOfFile((unsigned char *)pCalendar - CALSNAP_HEADER);
+	}
+}
@@ -0,0 +1,52 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarSnapshot.h:  contains the relocatable image of a parsed
+* calendar that is saved to disk and mapped back without parsing
+*
+*********************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include "CalendarStructures.h"
+
+#define CALSNAP_MAGIC		0x504e5343	// "CSNP"
+#define CALSNAP_VERSION		7
+
+// Address the image is laid out for.  Mapped there, it is used as is;
+// anywhere else, every pointer listed in the relocation table is moved
+// by the difference first
+#ifdef _WIN64
+#define CALSNAP_PREFERRED_BASE	0x00000B0000000000ULL
+#else
+#define CALSNAP_PREFERRED_BASE	0x50000000ULL
+#endif
+
+// The image holds the structures of calendar-lib itself, pointers
+// included, so the accessors read it in place.  The Calendar follows the
+// header; the other structures follow it in no fixed order.  The
+// relocation table lists the offset of every non-NULL pointer in the
+// image, each of which holds PreferredBase plus the offset of its target
+typedef struct _CalSnapshotHeader
+{
+	uint32_t Magic;
+	uint32_t Version;
+	uint32_t PointerSize;		// sizeof(void *) of the build that saved it
+	uint32_t RelocationCount;
+	uint64_t Size;				// Bytes in the image, header included
+	uint64_t Checksum;			// CalHash64 of the rest of the header and the bytes after it
+	uint64_t PreferredBase;
+	uint64_t Calendar;			// Offset of the Calendar
+	uint64_t Relocations;		// Offset of the RelocationCount pointer offsets
+} CalSnapshotHeader;
+
+// Bytes the header takes; the Calendar starts here
+#define CALSNAP_HEADER		64
+
+bool SaveSnapshot(Calendar *pCalendar, const char *path, uint64_t *bytes);
+Calendar *MapSnapshot(const char *path, unsigned int flags);
+uint64_t GetSnapshotSize(const Calendar *pCalendar);
+void UnmapSnapshot(Calendar *pCalendar);
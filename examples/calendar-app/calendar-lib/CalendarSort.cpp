@@ -0,0 +1,100 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarSort.cpp:  contains the radix sort used to order entries by
+* timestamp
+*
+*********************************************************************/
+
+#include "stdafx.h"
+#include <string.h>
+#include "CalendarArena.h"
+#include "CalendarSort.h"
+
+#define RADIX_BITS		8
+#define RADIX_BUCKETS	(1 << RADIX_BITS)
+#define RADIX_PASSES	(64 / RADIX_BITS)
+
+// Flipping the sign bit makes signed keys order correctly as unsigned
+static uint64_t RadixKey(const unsigned char *record)
+{
+	int64_t key;
+	memcpy(&key, record, sizeof(key));
+	return (uint64_t)key ^ 0x8000000000000000ULL;
+}
+
+/// <summary>
+/// Sorts count records of size bytes, each starting with an int64_t key,
+/// into ascending key order.  The sort is stable, so records with equal
+/// keys keep their relative order.  Fails only if scratch space cannot be
+/// allocated
+/// </summary>
+bool CalRadixSort64(void *records, size_t count, size_t size)
+{
+	size_t histogram[RADIX_PASSES][RADIX_BUCKETS];
+	unsigned char *src = (unsigned char *)records;
+
+	if (count < 2)
+	{
+		return true;
+	}
+
+	unsigned char *dst = (unsigned char *)CalMalloc(count * size);
+	if (!dst)
+	{
+		return false;
+	}
+	unsigned char *scratch = dst;
+
+	// Count every digit of every key in one pass
+	memset(histogram, 0, sizeof(histogram));
+	for (size_t i = 0; i < count; i++)
+	{
+		uint64_t key = RadixKey(src + i * size);
+		for (int pass = 0; pass < RADIX_PASSES; pass++)
+		{
+			histogram[pass][(key >> (pass * RADIX_BITS)) & (RADIX_BUCKETS - 1)]++;
+		}
+	}
+
+	for (int pass = 0; pass < RADIX_PASSES; pass++)
+	{
+		size_t *buckets = histogram[pass];
+		unsigned int shift = pass * RADIX_BITS;
+
+		// Timestamps share their high digits; skip passes that would not move anything
+		if (buckets[(RadixKey(src) >> shift) & (RADIX_BUCKETS - 1)] == count)
+		{
+			continue;
+		}
+
+		size_t offset = 0;
+		for (int b = 0; b < RADIX_BUCKETS; b++)
+		{
+			size_t n = buckets[b];
+			buckets[b] = offset;
+			offset += n;
+		}
+
+		for (size_t i = 0; i < count; i++)
+		{
+			unsigned char *record = src + i * size;
+			size_t b = (RadixKey(record) >> shift) & (RADIX_BUCKETS - 1);
+			memcpy(dst + buckets[b]++ * size, record, size);
+		}
+
+		unsigned char *swap = src;
+		src = dst;
+		dst = swap;
+	}
+
+	if (src != records)
+	{
+		memcpy(records, src, count * size);
+	}
+
+	CalFree(scratch);
+	return true;
+}
@@ -0,0 +1,16 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarSort.h:  contains the radix sort used to order entries by
+* timestamp
+*
+*********************************************************************/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+bool CalRadixSort64(void *records, size_t count, size_t size);
@@ -0,0 +1,133 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarStartOrder.cpp:  contains the view of a calendar's entries
+* ordered by start timestamp, for paging and time-window queries
+*
+*********************************************************************/
+
+#include "stdafx.h"
+#include <stdio.h>
+#include "CalendarArena.h"
+#include "CalendarSort.h"
+#include "CalendarTime.h"
+#include "CalendarStartOrder.h"
+
+#define STARTORDER_ALIGN(x)	(((x) + 7) & ~(size_t)7)
+
+/// <summary>
+/// Builds the start order of a calendar.  Entries are numbered in list
+/// order from zero; those with equal starts keep that order, and those
+/// without a valid start are left out
+/// </summary>
+CalStartOrder *BuildStartOrder(Calendar *pCalendar)
+{
+	unsigned int entryCount = 0;
+	unsigned int count = 0;
+	int64_t start;
+
+	for (CalendarEntry *e = pCalendar->Entry; e; e = e->NextEntry)
+	{
+		if (GetEntryStart(e, &start))
+		{
+			count++;
+		}
+		entryCount++;
+	}
+
+	size_t itemsOffset = STARTORDER_ALIGN(sizeof(CalStartOrder));
+	size_t size = itemsOffset + (size_t)count * sizeof(CalStartItem);
+
+	CalStartOrder *pOrder = (CalStartOrder *)CalCalloc(1, size);
+	if (!pOrder)
+	{
+		return NULL;
+	}
+
+	pOrder->Size = size;
+	pOrder->EntryCount = entryCount;
+	pOrder->Count = count;
+	pOrder->Items = (unsigned int)itemsOffset;
+
+	CalStartItem *items = GetStartOrderItems(pOrder);
+	unsigned int i = 0, entry = 0;
+
+	for (CalendarEntry *e = pCalendar->Entry; e; e = e->NextEntry, entry++)
+	{
+		if (GetEntryStart(e, &start))
+		{
+			items[i].Start = start;
+			items[i].Entry = entry;
+			i++;
+		}
+	}
+
+	if (!CalRadixSort64(items, count, sizeof(CalStartItem)))
+	{
+		CalFree(pOrder);
+		return NULL;
+	}
+
+	return pOrder;
+}
+
+void DestroyStartOrder(CalStartOrder *pOrder)
+{
+	CalFree(pOrder);
+}
+
+/// <summary>
+/// Checks that a view of at most bytes bytes, such as one mapped from a
+/// snapshot, stays inside itself and names only entries below entryCount
+/// </summary>
+bool ValidateStartOrder(const CalStartOrder *pOrder, uint64_t bytes, unsigned int entryCount)
+{
+	if (bytes < sizeof(CalStartOrder) || pOrder->Size > bytes || pOrder->EntryCount != entryCount ||
+		pOrder->Count > entryCount || (pOrder->Items & 7) || pOrder->Items > pOrder->Size ||
+		(uint64_t)pOrder->Count * sizeof(CalStartItem) > pOrder->Size - pOrder->Items)
+	{
+		return false;
+	}
+
+	const CalStartItem *items = (const CalStartItem *)((const unsigned char *)pOrder + pOrder->Items);
+	for (unsigned int i = 0; i < pOrder->Count; i++)
+	{
+		if (items[i].Entry >= entryCount)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+CalStartItem *GetStartOrderItems(CalStartOrder *pOrder)
+{
+	return (CalStartItem *)((unsigned char *)pOrder + pOrder->Items);
+}
+
+/// <summary>
+/// Returns the position of the first item starting at or after t, or
+/// Count if there is none
+/// </summary>
+unsigned int FindFirstStartAtOrAfter(CalStartOrder *pOrder, int64_t t)
+{
+	CalStartItem *items = GetStartOrderItems(pOrder);
+	unsigned int low = 0, high = pOrder->Count;
+
+	while (low < high)
+	{
+		unsigned int mid = low + (high - low) / 2;
+		if (items[mid].Start < t)
+		{
+			low = mid + 1;
+		}
+		else
+		{
+			high = mid;
+		}
+	}
+
+	return low;
+}
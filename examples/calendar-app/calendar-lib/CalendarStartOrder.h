@@ -0,0 +1,37 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarStartOrder.h:  contains the view of a calendar's entries
+* ordered by start timestamp
+*
+*********************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include "CalendarStructures.h"
+
+typedef struct _CalStartItem
+{
+	int64_t Start;
+	unsigned int Entry;
+	unsigned int Reserved;
+} CalStartItem;
+
+// The view is a single allocation; the items that follow the header are
+// addressed by an offset from its start
+typedef struct _CalStartOrder
+{
+	size_t Size;				// Bytes in the allocation, header included
+	unsigned int EntryCount;	// Entries in the calendar when it was built
+	unsigned int Count;			// Entries with a valid start
+	unsigned int Items;			// Offset of the Count items, ascending by start
+} CalStartOrder;
+
+CalStartOrder *BuildStartOrder(Calendar *pCalendar);
+void DestroyStartOrder(CalStartOrder *pOrder);
+bool ValidateStartOrder(const CalStartOrder *pOrder, uint64_t bytes, unsigned int entryCount);
+CalStartItem *GetStartOrderItems(CalStartOrder *pOrder);
+unsigned int FindFirstStartAtOrAfter(CalStartOrder *pOrder, int64_t t);
@@ -0,0 +1,150 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarStringTable.cpp:  contains the table used to intern the
+* SHORTSTRING values of a calendar, so that repeated time zones, names
+* and emails share one CalString
+*
+*********************************************************************/
+
+#include "stdafx.h"
+#include <stdlib.h>
+#include "CalendarArena.h"
+#include "CalendarHash.h"
+#include "CalendarStringTable.h"
+
+#define STRINGTABLE_INITIAL_CAPACITY 64
+
+static __declspec(thread) CalStringTable *ThreadStringTable = NULL;
+
+CalStringTable *CreateStringTable()
+{
+	CalStringTable *t = (CalStringTable *)CalCalloc(1, sizeof(CalStringTable));
+	if (!t)
+	{
+		return NULL;
+	}
+
+	t->Slots = (CalStringSlot *)CalCalloc(STRINGTABLE_INITIAL_CAPACITY, sizeof(CalStringSlot));
+	if (!t->Slots)
+	{
+		CalFree(t);
+		return NULL;
+	}
+
+	t->Capacity = STRINGTABLE_INITIAL_CAPACITY;
+	return t;
+}
+
+/// <summary>
+/// Doubles the capacity of the table, rehashing its strings
+/// </summary>
+static bool GrowStringTable(CalStringTable *t)
+{
+	if (t->Capacity > UINT_MAX / 2)
+	{
+		return false;
+	}
+
+	unsigned int capacity = t->Capacity * 2;
+	CalStringSlot *slots = (CalStringSlot *)CalCalloc(capacity, sizeof(CalStringSlot));
+	if (!slots)
+	{
+		return false;
+	}
+
+	for (unsigned int i = 0; i < t->Capacity; i++)
+	{
+		if (!t->Slots[i].String)
+		{
+			continue;
+		}
+
+		unsigned int j = (unsigned int)t->Slots[i].Hash & (capacity - 1);
+		while (slots[j].String)
+		{
+			j = (j + 1) & (capacity - 1);
+		}
+		slots[j] = t->Slots[i];
+	}
+
+	CalFree(t->Slots);
+	t->Slots = slots;
+	t->Capacity = capacity;
+	return true;
+}
+
+/// <summary>
+/// Returns the table's SHORTSTRING CalString holding the len bytes at p,
+/// adding one if this is the first occurrence.  The CalString returned is
+/// owned by the table; DestroyCalString ignores it
+/// </summary>
+CalString *InternCalString(CalStringTable *t, const unsigned char *p, size_t len)
+{
+	uint64_t hash = CalHash64(p, len, 0);
+	unsigned int i = (unsigned int)hash & (t->Capacity - 1);
+
+	while (t->Slots[i].String)
+	{
+		CalString *s = t->Slots[i].String;
+		if (t->Slots[i].Hash == hash && s->Short.Length == len && !memcmp(s->Short.Value, p, len))
+		{
+			return s;
+		}
+		i = (i + 1) & (t->Capacity - 1);
+	}
+
+	// Keep the load factor at or below one half
+	if ((t->Count + 1) * 2 > t->Capacity)
+	{
+		if (!GrowStringTable(t))
+		{
+			return NULL;
+		}
+		return InternCalString(t, p, len);
+	}
+
+	CalString *s = CreateCalStringFromBytes(SHORTSTRING, p, len);
+	if (!s)
+	{
+		return NULL;
+	}
+
+	s->Interned = true;
+	t->Slots[i].Hash = hash;
+	t->Slots[i].String = s;
+	t->Count++;
+	return s;
+}
+
+void DestroyStringTable(CalStringTable *t)
+{
+	if (!t) return;
+
+	for (unsigned int i = 0; i < t->Capacity; i++)
+	{
+		CalString *s = t->Slots[i].String;
+		if (s)
+		{
+			s->Interned = false;
+			DestroyCalString(s);
+		}
+	}
+
+	CalFree(t->Slots);
+	CalFree(t);
+}
+
+CalStringTable *SetThreadStringTable(CalStringTable *t)
+{
+	CalStringTable *previous = ThreadStringTable;
+	ThreadStringTable = t;
+	return previous;
+}
+
+CalStringTable *GetThreadStringTable()
+{
+	return ThreadStringTable;
+}
@@ -0,0 +1,35 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarStringTable.h:  contains the table used to intern the
+* SHORTSTRING values of a calendar
+*
+*********************************************************************/
+
+#pragma once
+
+#include "CalendarStructures.h"
+
+typedef struct _CalStringSlot
+{
+	uint64_t Hash;
+	CalString *String;
+} CalStringSlot;
+
+typedef struct _CalStringTable
+{
+	unsigned int Capacity;	// Power of two
+	unsigned int Count;
+	CalStringSlot *Slots;
+} CalStringTable;
+
+CalStringTable *CreateStringTable();
+CalString *InternCalString(CalStringTable *t, const unsigned char *p, size_t len);
+void DestroyStringTable(CalStringTable *t);
+
+// SHORTSTRING values parsed or copied on the calling thread are interned
+// into this table while it is installed (NULL to stop interning)
+CalStringTable *SetThreadStringTable(CalStringTable *t);
+CalStringTable *GetThreadStringTable();
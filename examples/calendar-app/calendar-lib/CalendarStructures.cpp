@@ -11,16 +11,78 @@
 #include "stdafx.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include "CalendarArena.h"
 #include "CalendarStructures.h"
+#include "CalendarStringTable.h"
+#include "CalendarContactIndex.h"
+#include "CalendarIntervalIndex.h"
+#include "CalendarStartOrder.h"
+#include "CalendarTextIndex.h"
+#include "CalendarBloom.h"
+#include "CalendarSnapshot.h"
 
 extern "C"
 {
 	extern unsigned int BugBitmask;
 }
 
+/// <summary>
+/// Takes a reference to the value whose count is at *pShared for a new
+/// copy, creating the count on first use with a reference for the holder
+/// it belongs to.  Returns NULL if the count could not be allocated
+/// </summary>
+static CalShared *ShareValue(CalShared **pShared)
+{
+	CalShared *shared = *pShared;
+	if (!shared)
+	{
+		CalShared *created = (CalShared *)CalMalloc(sizeof(CalShared));
+		if (!created)
+		{
+			return NULL;
+		}
+		created->References = 1;
+
+		// Calendars may be copied from on several threads at once; the first
+		// count installed is the one used
+		shared = (CalShared *)InterlockedCompareExchangePointer((PVOID volatile *)pShared, created, NULL);
+		if (shared)
+		{
+			CalFree(created);
+		}
+		else
+		{
+			shared = created;
+		}
+	}
+
+	InterlockedIncrement(&shared->References);
+	return shared;
+}
+
+/// <summary>
+/// Drops a holder's reference to its value.  Returns true if the holder was
+/// the last, and must free the value
+/// </summary>
+static bool ReleaseValue(CalShared *shared)
+{
+	if (!shared)
+	{
+		return true;
+	}
+
+	if (InterlockedDecrement(&shared->References) != 0)
+	{
+		return false;
+	}
+
+	CalFree(shared);
+	return true;
+}
+
 CalString *CreateCalString(enum CalStringType stringType)
 {
-	CalString *r = (CalString *)calloc(1, sizeof(CalString));
+	CalString *r = (CalString *)CalCalloc(1, sizeof(CalString));
 	if (!r) return r;
 	r->StringType = stringType;
 	return r;
@@ -28,45 +90,55 @@ CalString *CreateCalString(enum CalStringType stringType)
 
 CalString *CreateCalStringAndInit(enum CalStringType stringType, const char *p)
 {
+	size_t len = strlen(p);
+	if (stringType == SHORTSTRING && len > 0xfffe)
+	{
+		return NULL;
+	}
+
+	return CreateCalStringFromBytes(stringType, (const unsigned char *)p, len);
+}
+
+/// <summary>
+/// Creates a CalString holding a NUL-terminated copy of the len bytes at p.
+/// Values up to CALSTRING_INLINE_LENGTH bytes are stored inline
+/// </summary>
+CalString *CreateCalStringFromBytes(enum CalStringType stringType, const unsigned char *p, size_t len)
+{
+	if (stringType != SHORTSTRING && stringType != LONGSTRING)
+	{
+		printf("Invalid CalStringType");
+		return NULL;
+	}
+
 	CalString *s = CreateCalString(stringType);
 	if (!s)
 	{
 		return NULL;
 	}
 
-	if (stringType == SHORTSTRING)
+	unsigned char *value = s->Inline;
+	if (len > CALSTRING_INLINE_LENGTH)
 	{
-		if (strlen(p) > 0xfffe)
+		value = (unsigned char *)CalMalloc(len + 1);
+		if (!value)
 		{
 			goto ERROR_EXIT;
 		}
+	}
 
-		unsigned int len = strlen(p);
-		s->Short.Value = (unsigned char *)calloc(1, len + 1);
-		if (!s->Short.Value)
-		{
-			goto ERROR_EXIT;
-		}
+	memcpy(value, p, len);
+	value[len] = '\0';
 
-		s->Short.Length = len;
-		memcpy(s->Short.Value, p, len);
-	}
-	else if (stringType == LONGSTRING)
+	if (stringType == SHORTSTRING)
 	{
-		unsigned int len = strlen(p);
-		s->Long.Value = (unsigned char *)calloc(1, len + 1);
-		if (!s->Long.Value)
-		{
-			goto ERROR_EXIT;
-		}
-
-		s->Long.Length = len;
-		memcpy(s->Long.Value, p, s->Long.Length);
+		s->Short.Length = (unsigned short)len;
+		s->Short.Value = value;
 	}
 	else
 	{
-		printf("Invalid CalStringType");
-		goto ERROR_EXIT;
+		s->Long.Length = (unsigned long)len;
+		s->Long.Value = value;
 	}
 
 	return s;
@@ -77,69 +149,95 @@ ERROR_EXIT:
 }
 
 /// <summary>
-/// Copies the content of an existing CalString object to a new one that's returned
+/// Returns true if the value of the CalString is stored in its Inline buffer
 /// </summary>
-CalString *CopyCalString(CalString *src)
+bool IsInlineCalString(CalString *s)
 {
-	CalString *dst = CreateCalString(src->StringType);
-	if (!dst)
+	if (s->StringType == SHORTSTRING)
 	{
-		return NULL;
+		return s->Short.Value == s->Inline;
 	}
+	else if (s->StringType == LONGSTRING)
+	{
+		return s->Long.Value == s->Inline;
+	}
+	return false;
+}
 
-	dst->StringType = src->StringType;
+/// <summary>
+/// Copies the content of an existing CalString object to a new one that's returned.
+/// SHORTSTRING values are interned instead while a string table is installed.
+/// With share, a value not stored inline is shared with the copy rather than
+/// duplicated; src must then be heap-allocated
+/// </summary>
+CalString *CopyCalString(CalString *src, bool share)
+{
+	CalStringTable *pStrings = GetThreadStringTable();
+	if (pStrings && src->StringType == SHORTSTRING)
+	{
+		return InternCalString(pStrings, src->Short.Value, src->Short.Length);
+	}
 
-	if (src->StringType == SHORTSTRING)
+	if (share && !IsInlineCalString(src) && (src->StringType == SHORTSTRING || src->StringType == LONGSTRING))
 	{
-		dst->Short.Length = src->Short.Length;
-		dst->Short.Value = (unsigned char *)malloc(dst->Short.Length + 1);
-		if (!dst->Short.Value)
+		CalString *dst = CreateCalString(src->StringType);
+		if (!dst)
 		{
-			goto ERROR_EXIT;
+			return NULL;
 		}
-		memcpy(dst->Short.Value, src->Short.Value, dst->Short.Length + 1);
-	}
 
-	else if (src->StringType == LONGSTRING)
-	{
-		dst->Long.Length = src->Long.Length;
-		dst->Long.Value = (unsigned char *)malloc(dst->Long.Length + 1);
-		if (!dst->Long.Value)
+		dst->Shared = ShareValue(&src->Shared);
+		if (!dst->Shared)
 		{
-			goto ERROR_EXIT;
+			CalFree(dst);
+			return NULL;
 		}
-		memcpy(dst->Long.Value, src->Long.Value, dst->Long.Length + 1);
+
+		if (src->StringType == SHORTSTRING)
+		{
+			dst->Short = src->Short;
+		}
+		else
+		{
+			dst->Long = src->Long;
+		}
+		return dst;
 	}
-	else
+
+	if (src->StringType == SHORTSTRING)
 	{
-		printf("Invalid StringType");
-		goto ERROR_EXIT;
+		return CreateCalStringFromBytes(SHORTSTRING, src->Short.Value, src->Short.Length);
+	}
+	else if (src->StringType == LONGSTRING)
+	{
+		return CreateCalStringFromBytes(LONGSTRING, src->Long.Value, src->Long.Length);
 	}
 
-	return dst;
-
-ERROR_EXIT:
-	DestroyCalString(dst);
+	printf("Invalid StringType");
 	return NULL;
 }
 
 void DestroyCalString(CalString *s)
 {
 	if (!s) return;
-	if (s->StringType == SHORTSTRING)
-	{
-		free(s->Short.Value);
-	}
-	else if (s->StringType == LONGSTRING)
+	if (s->Interned) return; // Released with its CalStringTable
+	if (!IsInlineCalString(s) && ReleaseValue(s->Shared))
 	{
-		free(s->Long.Value);
+		if (s->StringType == SHORTSTRING)
+		{
+			CalFree(s->Short.Value);
+		}
+		else if (s->StringType == LONGSTRING)
+		{
+			CalFree(s->Long.Value);
+		}
 	}
-	free(s);
+	CalFree(s);
 }
 
 CalDate *CreateCalDate()
 {
-	CalDate *r = (CalDate *)calloc(1, sizeof(CalDate));
+	CalDate *r = (CalDate *)CalCalloc(1, sizeof(CalDate));
 	return r;
 }
 
@@ -161,13 +259,13 @@ CalDate *CopyCalDate(CalDate *src)
 
 void DestroyCalDate(CalDate *d)
 {
-	free(d);
+	CalFree(d);
 	return;
 }
 
 CalTime *CreateCalTime()
 {
-	CalTime *r = (CalTime *)calloc(1, sizeof(CalTime));
+	CalTime *r = (CalTime *)CalCalloc(1, sizeof(CalTime));
 	return r;
 }
 
@@ -190,19 +288,21 @@ CalTime *CopyCalTime(CalTime *pTime)
 
 void DestroyCalTime(CalTime *t)
 {
-	free(t);
+	CalFree(t);
 }
 
 Blob *CreateBlob()
 {
-	Blob *r = (Blob *)calloc(1, sizeof(Blob));
+	Blob *r = (Blob *)CalCalloc(1, sizeof(Blob));
 	return r;
 }
 
 /// <summary>
-/// Copies the content of an existing Blob object to a new one that's returned
+/// Copies the content of an existing Blob object to a new one that's returned.
+/// With share, the data is shared with the copy rather than duplicated; src
+/// must then be heap-allocated
 /// </summary>
-Blob *CopyBlob(Blob *src)
+Blob *CopyBlob(Blob *src, bool share)
 {
 	Blob *dst = CreateBlob();
 	if (!dst)
@@ -210,8 +310,22 @@ Blob *CopyBlob(Blob *src)
 		return NULL;
 	}
 
+	if (share && src->Data)
+	{
+		CalShared *shared = ShareValue(&src->Shared);
+		if (!shared)
+		{
+			goto ERROR_EXIT;
+		}
+
+		dst->Length = src->Length;
+		dst->Data = src->Data;
+		dst->Shared = shared;
+		return dst;
+	}
+
 	dst->Length = src->Length;
-	dst->Data = malloc(dst->Length);
+	dst->Data = CalMalloc(dst->Length);
 	if (!dst->Data)
 	{
 		goto ERROR_EXIT;
@@ -227,12 +341,16 @@ ERROR_EXIT:
 void DestroyBlob(Blob *b)
 {
 	if (!b) return;
-	free(b->Data);
+	if (ReleaseValue(b->Shared))
+	{
+		CalFree(b->Data);
+	}
+	CalFree(b);
 }
 
 StructuredBlob *CreateStructuredBlob()
 {
-	StructuredBlob *u = (StructuredBlob *)calloc(1, sizeof(StructuredBlob));
+	StructuredBlob *u = (StructuredBlob *)CalCalloc(1, sizeof(StructuredBlob));
 	return u;
 }
 
@@ -241,21 +359,21 @@ void DestroyStructuredBlob(StructuredBlob *pUnknown)
 	if (!pUnknown) return;
 	if (pUnknown->Data)
 	{
-		free(pUnknown->Data);
+		CalFree(pUnknown->Data);
 	}
-	free(pUnknown);
+	CalFree(pUnknown);
 }
 
 Contact *CreateContact()
 {
-	Contact *r = (Contact *)calloc(1, sizeof(Contact));
+	Contact *r = (Contact *)CalCalloc(1, sizeof(Contact));
 	return r;
 }
 
 /// <summary>
 /// Copies the content of an existing Contact object to a new one that's returned
 /// </summary>
-Contact *CopyContact(Contact *pContact)
+Contact *CopyContact(Contact *pContact, bool share)
 {
 #define MAX_RECURSION 1000
 	static int count;
@@ -266,13 +384,13 @@ Contact *CopyContact(Contact *pContact)
 		return NULL;
 	}
 
-	dst->Email = CopyCalString(pContact->Email);
-	if (!dst)
+	dst->Email = CopyCalString(pContact->Email, share);
+	if (!dst->Email)
 	{
 		goto ERROR_EXIT;
 	}
 
-	dst->Name = CopyCalString(pContact->Name);
+	dst->Name = CopyCalString(pContact->Name, share);
 	if (!dst->Name)
 	{
 		goto ERROR_EXIT;
@@ -280,7 +398,7 @@ Contact *CopyContact(Contact *pContact)
 
 	if (pContact->NextContact)
 	{
-		dst->NextContact = CopyContact(pContact->NextContact); // <-- Recursive Call
+		dst->NextContact = CopyContact(pContact->NextContact, share); // <-- Recursive Call
 		if (!dst->NextContact)
 		{
 			goto ERROR_EXIT;
@@ -312,7 +430,7 @@ void DestroyContact(Contact *pContact)
 		}
 
 		Contact *next = pContact->NextContact;
-		free(pContact);
+		CalFree(pContact);
 		pContact = next;
 	} while (pContact);
 
@@ -321,30 +439,31 @@ void DestroyContact(Contact *pContact)
 
 Attachment *CreateAttachment()
 {
-	Attachment *pAttachment = (Attachment *)calloc(1, sizeof(Attachment));
+	Attachment *pAttachment = (Attachment *)CalCalloc(1, sizeof(Attachment));
 	return pAttachment;
 }
 
 Attachments *CreateAttachments()
 {
-	Attachments *r = (Attachments *)calloc(1, sizeof(Attachments));
+	Attachments *r = (Attachments *)CalCalloc(1, sizeof(Attachments));
 	return r;
 }
 
 Attachment *CreateMultipleAttachment(int attachmentCount)
 {
-	Attachment *pAttachment = (Attachment *)calloc(attachmentCount, sizeof(Attachment));
+	Attachment *pAttachment = (Attachment *)CalCalloc(attachmentCount, sizeof(Attachment));
 	return pAttachment;
 }
 
 /// <summary>
-/// Copies the content of an existing Attachment object to a new one that's returned
+/// Copies the content of an existing Attachment object to a new one that's
+/// returned; both members are NULL if the copy failed
 /// </summary>
-Attachment CopyAttachment(Attachment dst)
+Attachment CopyAttachment(Attachment dst, bool share)
 {
 	Attachment src;
-	src.Name = CopyCalString(dst.Name);
-	src.Blob = CopyBlob(dst.Blob);
+	src.Name = CopyCalString(dst.Name, share);
+	src.Blob = CopyBlob(dst.Blob, share);
 	if (!src.Blob || !src.Name)
 	{
 		DestroyAttachment(&src);
@@ -356,7 +475,7 @@ Attachment CopyAttachment(Attachment dst)
 /// <summary>
 /// Copies the content of an existing Attachments object to a new one that's returned
 /// </summary>
-Attachments *CopyAttachments(Attachments *src)
+Attachments *CopyAttachments(Attachments *src, bool share)
 {
 	Attachments *pDest = CreateAttachments();
 	if (!pDest)
@@ -364,7 +483,12 @@ Attachments *CopyAttachments(Attachments *src)
 		return NULL;
 	}
 
-	pDest->Attachment = (Attachment *)calloc(1, pDest->Count * sizeof(Attachment));
+	if (src->Count <= 0)
+	{
+		return pDest;
+	}
+
+	pDest->Attachment = (Attachment *)CalCalloc(src->Count, sizeof(Attachment));
 	if (!pDest->Attachment)
 	{
 		goto ERROR_EXIT;
@@ -374,7 +498,11 @@ Attachments *CopyAttachments(Attachments *src)
 
 	for (int i = 0; i < src->Count; i++)
 	{
-		pDest->Attachment[i] = CopyAttachment(src->Attachment[i]);
+		pDest->Attachment[i] = CopyAttachment(src->Attachment[i], share);
+		if (!pDest->Attachment[i].Blob)
+		{
+			goto ERROR_EXIT;
+		}
 	}
 
 	return pDest;
@@ -411,19 +539,23 @@ void DestroyAttachments(Attachments *pAttachments)
 		DestroyAttachment(&(pAttachments->Attachment[i])); // Bug #4: pAttachments has already been freed
 	}
 
-	free(pAttachments);
+	CalFree(pAttachments->Attachment);
+	CalFree(pAttachments);
 };
 
 CalendarEntry *CreateCalendarEntry()
 {
-	CalendarEntry *r = (CalendarEntry *)calloc(1, sizeof(CalendarEntry));
+	CalendarEntry *r = (CalendarEntry *)CalCalloc(1, sizeof(CalendarEntry));
 	return r;
 }
 
 /// <summary>
-/// Copies the content of an existing CalendarEntry object to a new one that's returned
+/// Copies the content of an existing CalendarEntry object to a new one that's returned.
+/// With share, which requires pEntry to be part of a heap calendar, string and
+/// blob values are shared with the copy, so only the structures holding them
+/// are allocated
 /// </summary>
-CalendarEntry *CopyCalendarEntry(CalendarEntry *pEntry)
+CalendarEntry *CopyCalendarEntry(CalendarEntry *pEntry, bool share)
 {
 	CalendarEntry *pEntryCopy = CreateCalendarEntry();
 	if (!pEntryCopy)
@@ -432,16 +564,24 @@ CalendarEntry *CopyCalendarEntry(CalendarEntry *pEntry)
 	}
 
 	pEntryCopy->EntryType = pEntry->EntryType;
+	pEntryCopy->UtcStart = pEntry->UtcStart;
+	pEntryCopy->UtcEnd = pEntry->UtcEnd;
+	pEntryCopy->TimeFlags = pEntry->TimeFlags;
+	pEntryCopy->Fingerprint[0] = pEntry->Fingerprint[0];
+	pEntryCopy->Fingerprint[1] = pEntry->Fingerprint[1];
 
-	pEntryCopy->Sender = CopyContact(pEntry->Sender);
-	if (!pEntryCopy->Sender)
+	if (pEntry->Sender)
 	{
-		goto ERROR_EXIT;
+		pEntryCopy->Sender = CopyContact(pEntry->Sender, share);
+		if (!pEntryCopy->Sender)
+		{
+			goto ERROR_EXIT;
+		}
 	}
 
 	if (pEntry->Recipient)
 	{
-		pEntryCopy->Recipient = CopyContact(pEntry->Recipient);
+		pEntryCopy->Recipient = CopyContact(pEntry->Recipient, share);
 		if (!pEntryCopy->Recipient)
 		{
 			goto ERROR_EXIT;
@@ -450,40 +590,52 @@ CalendarEntry *CopyCalendarEntry(CalendarEntry *pEntry)
 
 	if (pEntry->Location)
 	{
-		pEntryCopy->Location = CopyCalString(pEntry->Location);
+		pEntryCopy->Location = CopyCalString(pEntry->Location, share);
 		if (!pEntryCopy->Location)
 		{
 			goto ERROR_EXIT;
 		}
 	}
 
-	pEntryCopy->TimeZone = CopyCalString(pEntry->TimeZone);
-	if (!pEntryCopy->TimeZone)
+	if (pEntry->TimeZone)
 	{
-		goto ERROR_EXIT;
+		pEntryCopy->TimeZone = CopyCalString(pEntry->TimeZone, share);
+		if (!pEntryCopy->TimeZone)
+		{
+			goto ERROR_EXIT;
+		}
 	}
 
-	pEntryCopy->StartTime = CopyCalTime(pEntry->StartTime);
-	if (!pEntryCopy->StartTime)
+	if (pEntry->StartTime)
 	{
-		goto ERROR_EXIT;
+		pEntryCopy->StartTime = CopyCalTime(pEntry->StartTime);
+		if (!pEntryCopy->StartTime)
+		{
+			goto ERROR_EXIT;
+		}
 	}
 
-	pEntryCopy->StartDate = CopyCalDate(pEntry->StartDate);
-	if (!pEntryCopy->StartDate)
+	if (pEntry->StartDate)
 	{
-		goto ERROR_EXIT;
+		pEntryCopy->StartDate = CopyCalDate(pEntry->StartDate);
+		if (!pEntryCopy->StartDate)
+		{
+			goto ERROR_EXIT;
+		}
 	}
 
-	pEntryCopy->Duration = CopyCalTime(pEntry->Duration);
-	if (!pEntryCopy->Duration)
+	if (pEntry->Duration)
 	{
-		goto ERROR_EXIT;
+		pEntryCopy->Duration = CopyCalTime(pEntry->Duration);
+		if (!pEntryCopy->Duration)
+		{
+			goto ERROR_EXIT;
+		}
 	}
 
 	if (pEntry->Subject)
 	{
-		pEntryCopy->Subject = CopyCalString(pEntry->Subject);
+		pEntryCopy->Subject = CopyCalString(pEntry->Subject, share);
 		if (!pEntryCopy->Subject)
 		{
 			goto ERROR_EXIT;
@@ -492,16 +644,25 @@ CalendarEntry *CopyCalendarEntry(CalendarEntry *pEntry)
 
 	if (pEntry->Content)
 	{
-		pEntryCopy->Content = CopyCalString(pEntry->Subject);
+		pEntryCopy->Content = CopyCalString(pEntry->Content, share);
 		if (!pEntryCopy->Content)
 		{
 			goto ERROR_EXIT;
 		}
 	}
 
+	if (pEntry->ContentType)
+	{
+		pEntryCopy->ContentType = CopyCalString(pEntry->ContentType, share);
+		if (!pEntryCopy->ContentType)
+		{
+			goto ERROR_EXIT;
+		}
+	}
+
 	if (pEntry->Attachments)
 	{
-		pEntryCopy->Attachments = CopyAttachments(pEntry->Attachments);
+		pEntryCopy->Attachments = CopyAttachments(pEntry->Attachments, share);
 		if (!pEntryCopy->Attachments)
 		{
 			goto ERROR_EXIT;
@@ -532,29 +693,87 @@ void DestroyCalendarEntry(CalendarEntry *pEntry)
 		DestroyCalString(pEntry->ContentType);
 		DestroyAttachments(pEntry->Attachments);
 		CalendarEntry *next = pEntry->NextEntry;
-		free(pEntry);
+		CalFree(pEntry);
 		pEntry = next;
 	} while (pEntry);
 }
 
 Calendar *CreateCalendar(int version, int entryCount)
 {
-	Calendar *r = (Calendar *)calloc(1, sizeof(Calendar));
+	Calendar *r = (Calendar *)CalCalloc(1, sizeof(Calendar));
 	if (!r) return r;
 
 	r->Version = version;
 	r->EntryCount = entryCount;
+	r->Fields = CALFIELD_ENTRY_ELEMENTS;
+
+	// Everything allocated for the calendar comes from the same place
+	r->Arena = GetThreadArena();
 
 	return r;
 }
 
+/// <summary>
+/// (Re)builds the array of entry pointers that gives access to entries by
+/// index
+/// </summary>
+bool BuildEntryTable(Calendar *pCalendar)
+{
+	unsigned int count = 0;
+	for (CalendarEntry *e = pCalendar->Entry; e; e = e->NextEntry)
+	{
+		count++;
+	}
+
+	CalFree(pCalendar->EntryTable);
+	pCalendar->EntryTableCount = 0;
+
+	pCalendar->EntryTable = (CalendarEntry **)CalMalloc((count ? count : 1) * sizeof(CalendarEntry *));
+	if (!pCalendar->EntryTable)
+	{
+		return false;
+	}
+
+	unsigned int i = 0;
+	for (CalendarEntry *e = pCalendar->Entry; e; e = e->NextEntry)
+	{
+		pCalendar->EntryTable[i++] = e;
+	}
+
+	pCalendar->EntryTableCount = count;
+	return true;
+}
+
 void DestroyCalendar(void *pCalendar)
 {
 	Calendar *c = (Calendar *)pCalendar;
 	if (!pCalendar) return;
 
+	// A flagged calendar is destroyed by its owner, which clears the flags first
+	if (c->Flags) return;
+
+	if (c->Storage == SNAPSHOTSTORAGE)
+	{
+		UnmapSnapshot(c);
+		return;
+	}
+
+	// Calendars returned by a CalParser are released when it is reset, and
+	// those parsed into caller memory are released by the caller
+	if (c->Storage != HEAPSTORAGE) return;
+
+	CalArena *previous = SetCalendarArena(c);
 	CalendarEntry *e = c->Entry;
 	DestroyCalendarEntry(e);
-	free(pCalendar);
+	DestroyStringTable(c->Strings);
+	DestroyContactIndex(c->ContactIndex);
+	DestroyIntervalIndex(c->IntervalIndex);
+	DestroyStartOrder(c->StartOrder);
+	DestroyTextIndex(c->TextIndex);
+	DestroyBloom(c->Bloom);
+	CalFree(c->EntryTable);
+	CalFree(c->EntryFrames);
+	CalFree(pCalendar);
+	SetThreadArena(previous);
 	return;
 }
\ No newline at end of file
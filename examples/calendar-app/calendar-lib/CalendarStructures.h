@@ -8,7 +8,11 @@
 *
 *********************************************************************/
 
+#pragma once
+
 #include <windows.h>
+#include <stdint.h>
+#include "CalendarParser.h"
 
 enum CalStringType
 {
@@ -28,14 +32,30 @@ typedef struct _ShortCalString
 	unsigned char *Value;
 } ShortCalString;
 
+// Values up to this many bytes are stored in the CalString itself rather
+// than in a separate allocation; Value then points at Inline
+#define CALSTRING_INLINE_LENGTH 23
+
+// Reference count of a string or blob value shared by copies of the
+// CalString or Blob that holds it.  Shared values are never modified; the
+// last copy destroyed frees the value.  Without one, the holder owns its
+// value outright
+typedef struct _CalShared
+{
+	volatile LONG References;
+} CalShared;
+
 typedef struct _CalString
 {
 	CalStringType StringType;
+	bool Interned;		// Owned by a CalStringTable rather than by its referrers
+	CalShared *Shared;	// Set once the value is shared with a copy
 	union
 	{
 		LongCalString  Long;
 		ShortCalString Short;
 	};
+	unsigned char Inline[CALSTRING_INLINE_LENGTH + 1];
 } CalString;
 
 typedef struct _CalDate
@@ -64,6 +84,7 @@ typedef struct _Blob
 {
 	unsigned int Length;
 	PVOID Data;
+	CalShared *Shared;	// Set once Data is shared with a copy
 } Blob;
 
 typedef struct _StructuredBlob
@@ -103,13 +124,44 @@ typedef struct _CalendarEntry
 	StructuredBlob			*StructuredBlob;
 	struct _CalendarEntry	*PreviousEntry;
 	struct _CalendarEntry	*NextEntry;
+	int64_t					UtcStart;		// Resolved from the fields above after parsing
+	int64_t					UtcEnd;
+	unsigned int			TimeFlags;		// CALTIME_* flags saying which are valid
+	uint64_t				Fingerprint[2];	// Hash of the content, set with the times
 } CalendarEntry;
 
+enum CalendarStorage
+{
+	HEAPSTORAGE,		// Owned by the caller; released with DestroyCalendar
+	PARSERSTORAGE,		// Owned by a CalParser; released when the parser is reset
+	CALLERSTORAGE,		// Laid out in a caller-provided block by ParseCalendarInto
+	SNAPSHOTSTORAGE		// Mapped read-only from a snapshot file; released with UnmapSnapshot
+};
+
+// Calendar Flags.  A calendar with a flag set belongs to the object that
+// set it; the calls that change or destroy calendars reject it
+#define CALENDAR_SHARED		0x1		// Handed out by a parse cache to any number of callers
+#define CALENDAR_JOURNALED	0x2		// Grown by the journal that opened it; its EntryTable has spare room
+
 typedef struct _Calendar
 {
 	int Version;
 	int EntryCount;
 	CalendarEntry *Entry;
+	enum CalendarStorage Storage;
+	struct _CalArena *Arena;			// Holds its structures, or NULL for the heap
+	struct _CalStringTable *Strings;	// Interned SHORTSTRING values, if enabled
+	struct _CalContactIndex *ContactIndex;	// Email to entry index, if built
+	struct _CalIntervalIndex *IntervalIndex;	// Time interval index, if built
+	struct _CalStartOrder *StartOrder;		// Entries ordered by start, if built
+	struct _CalTextIndex *TextIndex;		// Subject, Location and Content words, if built
+	struct _CalBloom *Bloom;				// Bloom filter over contacts and places, if built
+	CalendarEntry **EntryTable;				// Entries in list order, for access by index
+	unsigned int EntryTableCount;
+	struct _CalEntryFrame *EntryFrames;		// Bytes of each EntryTable entry in the buffer parsed, if tracked
+	size_t SourceLength;					// Length of that buffer
+	unsigned int Flags;						// CALENDAR_ flags
+	unsigned int Fields;					// CALFIELD bits of the entry elements parsed; the rest were projected out
 } Calendar;
 
 //////////////////////////////////////////
@@ -120,6 +172,8 @@ typedef struct _Calendar
 
 CalString *CreateCalString(enum CalStringType type);
 CalString *CreateCalStringAndInit(enum CalStringType type, const char *p);
+CalString *CreateCalStringFromBytes(enum CalStringType type, const unsigned char *p, size_t len);
+bool IsInlineCalString(CalString *s);
 void DestroyCalString(CalString *s);
 
 CalDate *CreateCalDate();
@@ -150,4 +204,5 @@ CalendarEntry *CreateCalendarEntry();
 void DestroyCalendarEntry(CalendarEntry *pCalendar);
 
 Calendar *CreateCalendar(int version, int entryCount);
+bool BuildEntryTable(Calendar *pCalendar);
 void DestroyCalendar(void *pCalendar);
\ No newline at end of file
@@ -0,0 +1,1172 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarTextIndex.cpp:  contains the inverted word index over entry
+* Subject, Location and Content, so keyword searches read the postings
+* of the query words instead of scanning every entry
+*
+*********************************************************************/
+
+#include "stdafx.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "CalendarArena.h"
+#include "CalendarHash.h"
+#include "CalendarTextIndex.h"
+
+#pragma warning (disable: 4996) // Suppress compiler warning re: use of fopen
+
+#define TEXTINDEX_ALIGN(x)		(((x) + 7) & ~(size_t)7)
+#define TEXTINDEX_AT(p, off)	((unsigned char *)(p) + (off))
+#define TEXTINDEX_SLOTS(p)		((const CalTextSlot *)TEXTINDEX_AT(p, (p)->Slots))
+#define TEXTINDEX_BASES(p)		((const uint32_t *)TEXTINDEX_AT(p, (p)->Bases))
+
+// The fields that are indexed, in position order
+#define TEXTINDEX_FIELDS		3
+
+// Longest varint encoding of a 32 bit value
+#define TEXTINDEX_MAX_VARINT	5
+
+typedef struct _CalTextWord
+{
+	uint64_t Hash;
+	uint32_t Key;				// Offset in the builder key buffer
+	uint32_t Length;
+	uint32_t Items;				// Occurrences of the word
+	uint32_t First;				// First of its occurrences once they are sorted
+	uint32_t DocCount;
+	uint32_t LastDoc;
+	uint32_t PostingBytes;
+	uint32_t BlockCount;
+} CalTextWord;
+
+// One occurrence of a word
+typedef struct _CalTextItem
+{
+	uint32_t Word;
+	uint32_t Doc;
+	uint32_t Position;
+} CalTextItem;
+
+// Scratch state of BuildTextIndex.  It can grow large, so it comes from
+// the heap rather than from the arena of the calendar being indexed
+typedef struct _CalTextBuilder
+{
+	CalTextWord *Words;
+	size_t WordCapacity;
+	uint32_t WordCount;
+	uint32_t *Table;			// Word number + 1, or zero for an empty slot
+	uint32_t TableCapacity;
+	unsigned char *Keys;
+	size_t KeyLength;
+	size_t KeyCapacity;
+	CalTextItem *Items;
+	size_t ItemCount;
+	size_t ItemCapacity;
+} CalTextBuilder;
+
+typedef struct _CalTextCursor
+{
+	const unsigned char *Data;	// Start of the postings
+	const unsigned char *Next;	// Next posting to decode
+	const unsigned char *BlockEnd;
+	const CalTextSkip *Skips;
+	uint32_t BlockCount;
+	uint32_t Block;
+	uint32_t DocLimit;			// Entries in the index; larger numbers are corrupt
+	uint32_t DocCount;			// Entries containing the word
+	int64_t Doc;				// Current entry, or -1 before the first
+	uint32_t Frequency;
+	const unsigned char *Positions;
+	bool Done;
+} CalTextCursor;
+
+typedef struct _CalTextQuery
+{
+	unsigned char Words[CALTEXT_MAX_QUERY_WORDS][CALTEXT_MAX_WORD];
+	unsigned int Lengths[CALTEXT_MAX_QUERY_WORDS];
+	unsigned int Count;
+} CalTextQuery;
+
+// Collects search results either as entry numbers of a single calendar
+// or as (calendar, entry) pairs
+typedef struct _CalTextResults
+{
+	const uint32_t *Bases;
+	unsigned int *Entries;
+	CalQueryMatch *Matches;
+	unsigned int Capacity;
+	unsigned int Calendar;
+	int Found;
+} CalTextResults;
+
+static bool IsWordByte(unsigned char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+static unsigned char LowerAscii(unsigned char c)
+{
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+/// <summary>
+/// Finds the next word at or after *p, writes it folded and truncated to
+/// word and advances *p past it.  Returns false at the end of the text
+/// </summary>
+static bool NextWord(const unsigned char **p, const unsigned char *end, unsigned char *word, unsigned int *length)
+{
+	const unsigned char *s = *p;
+	unsigned int n = 0;
+
+	while (s < end && !IsWordByte(*s))
+	{
+		s++;
+	}
+	if (s == end)
+	{
+		*p = s;
+		return false;
+	}
+
+	for (; s < end && IsWordByte(*s); s++)
+	{
+		if (n < CALTEXT_MAX_WORD)
+		{
+			word[n++] = LowerAscii(*s);
+		}
+	}
+
+	*p = s;
+	*length = n;
+	return true;
+}
+
+/// <summary>
+/// Returns the bytes of indexed field i of an entry, or NULL if the entry
+/// does not have it
+/// </summary>
+static const unsigned char *GetEntryText(CalendarEntry *e, int i, size_t *len)
+{
+	CalString *s = (i == 0) ? e->Subject : (i == 1) ? e->Location : e->Content;
+
+	if (!s)
+	{
+		return NULL;
+	}
+
+	if (s->StringType == LONGSTRING)
+	{
+		*len = s->Long.Length;
+		return s->Long.Value;
+	}
+	*len = s->Short.Length;
+	return s->Short.Value;
+}
+
+static unsigned int PutVarint(unsigned char *out, size_t offset, uint32_t v)
+{
+	unsigned int n = 0;
+
+	while (v >= 0x80)
+	{
+		if (out) out[offset + n] = (unsigned char)(v | 0x80);
+		v >>= 7;
+		n++;
+	}
+	if (out) out[offset + n] = (unsigned char)v;
+	return n + 1;
+}
+
+static bool ReadVarint(const unsigned char **p, const unsigned char *end, uint32_t *v)
+{
+	const unsigned char *s = *p;
+	uint32_t value = 0;
+
+	for (unsigned int shift = 0; shift < 7 * TEXTINDEX_MAX_VARINT; shift += 7)
+	{
+		if (s == end)
+		{
+			return false;
+		}
+
+		unsigned char b = *s++;
+		if (shift == 28 && b > 0x0f)
+		{
+			return false;
+		}
+
+		value |= (uint32_t)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+		{
+			*p = s;
+			*v = value;
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool GrowArray(void **p, size_t *capacity, size_t needed, size_t size)
+{
+	if (needed <= *capacity)
+	{
+		return true;
+	}
+
+	size_t grown = *capacity ? *capacity : 256;
+	while (grown < needed)
+	{
+		grown *= 2;
+	}
+
+	void *q = realloc(*p, grown * size);
+	if (!q)
+	{
+		return false;
+	}
+
+	*p = q;
+	*capacity = grown;
+	return true;
+}
+
+static bool GrowWordTable(CalTextBuilder *b)
+{
+	uint32_t capacity = b->TableCapacity ? b->TableCapacity * 2 : 1024;
+	uint32_t *table = (uint32_t *)calloc(capacity, sizeof(uint32_t));
+
+	if (!table)
+	{
+		return false;
+	}
+
+	for (uint32_t w = 0; w < b->WordCount; w++)
+	{
+		uint32_t i = (uint32_t)b->Words[w].Hash & (capacity - 1);
+		while (table[i])
+		{
+			i = (i + 1) & (capacity - 1);
+		}
+		table[i] = w + 1;
+	}
+
+	free(b->Table);
+	b->Table = table;
+	b->TableCapacity = capacity;
+	return true;
+}
+
+/// <summary>
+/// Records one occurrence of a word, adding the word to the dictionary the
+/// first time it is seen
+/// </summary>
+static bool AddWord(CalTextBuilder *b, const unsigned char *word, unsigned int length, uint32_t doc, uint32_t position)
+{
+	uint64_t hash = CalHash64(word, length, 0);
+	CalTextWord *w = NULL;
+
+	// Keep the load factor at or below one half
+	if ((b->WordCount + 1) * 2 > b->TableCapacity && !GrowWordTable(b))
+	{
+		return false;
+	}
+
+	uint32_t i = (uint32_t)hash & (b->TableCapacity - 1);
+	while (b->Table[i])
+	{
+		CalTextWord *candidate = &b->Words[b->Table[i] - 1];
+		if (candidate->Hash == hash && candidate->Length == length && !memcmp(b->Keys + candidate->Key, word, length))
+		{
+			w = candidate;
+			break;
+		}
+		i = (i + 1) & (b->TableCapacity - 1);
+	}
+
+	if (!w)
+	{
+		if (!GrowArray((void **)&b->Words, &b->WordCapacity, (size_t)b->WordCount + 1, sizeof(CalTextWord)) ||
+			!GrowArray((void **)&b->Keys, &b->KeyCapacity, b->KeyLength + length, 1))
+		{
+			return false;
+		}
+
+		w = &b->Words[b->WordCount];
+		memset(w, 0, sizeof(CalTextWord));
+		w->Hash = hash;
+		w->Key = (uint32_t)b->KeyLength;
+		w->Length = length;
+		memcpy(b->Keys + b->KeyLength, word, length);
+		b->KeyLength += length;
+		b->Table[i] = ++b->WordCount;
+	}
+
+	if (!GrowArray((void **)&b->Items, &b->ItemCapacity, b->ItemCount + 1, sizeof(CalTextItem)))
+	{
+		return false;
+	}
+
+	CalTextItem *item = &b->Items[b->ItemCount++];
+	item->Word = (uint32_t)(w - b->Words);
+	item->Doc = doc;
+	item->Position = position;
+
+	w->Items++;
+	if (!w->DocCount || w->LastDoc != doc)
+	{
+		w->DocCount++;
+		w->LastDoc = doc;
+	}
+	return true;
+}
+
+/// <summary>
+/// Encodes the occurrences of one word, which are ordered by entry and
+/// position.  With out and skips NULL it only measures; returns the bytes
+/// of postings and sets the number of blocks
+/// </summary>
+static size_t EncodePostings(const CalTextItem *items, uint32_t count, unsigned char *out, CalTextSkip *skips, uint32_t *blockCount)
+{
+	size_t bytes = 0;
+	uint32_t blocks = 0;
+	uint32_t inBlock = 0;
+	int64_t previous = -1;
+
+	for (uint32_t i = 0; i < count; )
+	{
+		uint32_t doc = items[i].Doc;
+		uint32_t j = i;
+
+		while (j < count && items[j].Doc == doc)
+		{
+			j++;
+		}
+
+		if (inBlock == CALTEXT_BLOCK)
+		{
+			if (skips)
+			{
+				skips[blocks].LastDoc = (uint32_t)previous;
+				skips[blocks].End = (uint32_t)bytes;
+			}
+			blocks++;
+			inBlock = 0;
+		}
+
+		bytes += PutVarint(out, bytes, (uint32_t)(doc - previous - 1));
+		bytes += PutVarint(out, bytes, j - i);
+
+		int64_t position = -1;
+		for (uint32_t k = i; k < j; k++)
+		{
+			bytes += PutVarint(out, bytes, (uint32_t)(items[k].Position - position - 1));
+			position = items[k].Position;
+		}
+
+		previous = doc;
+		inBlock++;
+		i = j;
+	}
+
+	if (inBlock)
+	{
+		if (skips)
+		{
+			skips[blocks].LastDoc = (uint32_t)previous;
+			skips[blocks].End = (uint32_t)bytes;
+		}
+		blocks++;
+	}
+
+	*blockCount = blocks;
+	return bytes;
+}
+
+static void DestroyTextBuilder(CalTextBuilder *b)
+{
+	free(b->Words);
+	free(b->Table);
+	free(b->Keys);
+	free(b->Items);
+}
+
+/// <summary>
+/// Builds one index over the Subject, Location and Content words of every
+/// entry of the calendars.  Entries are numbered in list order from zero,
+/// continuing from one calendar to the next.  Fields are separated by an
+/// unused position so a phrase never spans two of them
+/// </summary>
+CalTextIndex *BuildTextIndex(Calendar **calendars, unsigned int count)
+{
+	CalTextBuilder b;
+	CalTextItem *sorted = NULL;
+	CalTextIndex *pIndex = NULL;
+	uint32_t *bases = NULL;
+	uint64_t docCount = 0;
+	unsigned char word[CALTEXT_MAX_WORD];
+
+	memset(&b, 0, sizeof(b));
+
+	bases = (uint32_t *)malloc(((size_t)count + 1) * sizeof(uint32_t));
+	if (!bases || !GrowWordTable(&b))
+	{
+		goto ERROR_EXIT;
+	}
+
+	// First pass: gather every word occurrence
+	for (unsigned int c = 0; c < count; c++)
+	{
+		bases[c] = (uint32_t)docCount;
+
+		for (CalendarEntry *e = calendars[c]->Entry; e; e = e->NextEntry, docCount++)
+		{
+			uint32_t position = 0;
+
+			if (docCount >= UINT_MAX)
+			{
+				printf("-> ERROR: too many entries to index\n");
+				goto ERROR_EXIT;
+			}
+
+			for (int field = 0; field < TEXTINDEX_FIELDS; field++, position++)
+			{
+				size_t len = 0;
+				const unsigned char *p = GetEntryText(e, field, &len);
+				const unsigned char *end = p ? p + len : NULL;
+				unsigned int length;
+
+				while (p && NextWord(&p, end, word, &length))
+				{
+					if (!AddWord(&b, word, length, (uint32_t)docCount, position++))
+					{
+						goto ERROR_EXIT;
+					}
+				}
+			}
+		}
+	}
+	bases[count] = (uint32_t)docCount;
+
+	if (b.ItemCount >= UINT_MAX)
+	{
+		printf("-> ERROR: text index too large\n");
+		goto ERROR_EXIT;
+	}
+
+	sorted = (CalTextItem *)malloc((b.ItemCount ? b.ItemCount : 1) * sizeof(CalTextItem));
+	if (!sorted)
+	{
+		goto ERROR_EXIT;
+	}
+
+	{
+		// Second pass: group the occurrences by word.  They were gathered
+		// in entry and position order, which the counting sort preserves
+		uint32_t first = 0;
+		for (uint32_t w = 0; w < b.WordCount; w++)
+		{
+			b.Words[w].First = first;
+			first += b.Words[w].Items;
+		}
+
+		uint32_t *next = b.Table;	// Reused; the dictionary lookups are done
+		for (uint32_t w = 0; w < b.WordCount; w++)
+		{
+			next[w] = b.Words[w].First;
+		}
+		for (size_t i = 0; i < b.ItemCount; i++)
+		{
+			sorted[next[b.Items[i].Word]++] = b.Items[i];
+		}
+
+		// Size the image
+		uint64_t postingBytes = 0;
+		uint64_t blockCount = 0;
+		for (uint32_t w = 0; w < b.WordCount; w++)
+		{
+			CalTextWord *pWord = &b.Words[w];
+			size_t bytes = EncodePostings(sorted + pWord->First, pWord->Items, NULL, NULL, &pWord->BlockCount);
+
+			pWord->PostingBytes = (uint32_t)min(bytes, (size_t)UINT_MAX);
+			postingBytes += bytes;
+			blockCount += pWord->BlockCount;
+		}
+
+		uint32_t capacity = 1;
+		while (capacity < (uint64_t)b.WordCount * 2)
+		{
+			capacity *= 2;
+		}
+
+		uint64_t basesOffset = TEXTINDEX_ALIGN(sizeof(CalTextIndex));
+		uint64_t slotsOffset = TEXTINDEX_ALIGN(basesOffset + ((uint64_t)count + 1) * sizeof(uint32_t));
+		uint64_t skipsOffset = slotsOffset + (uint64_t)capacity * sizeof(CalTextSlot);
+		uint64_t keysOffset = skipsOffset + blockCount * sizeof(CalTextSkip);
+		uint64_t postingsOffset = keysOffset + b.KeyLength;
+		uint64_t size = TEXTINDEX_ALIGN(postingsOffset + postingBytes);
+
+		if (size > UINT_MAX)
+		{
+			printf("-> ERROR: text index too large\n");
+			goto ERROR_EXIT;
+		}
+
+		pIndex = (CalTextIndex *)CalCalloc(1, (size_t)size);
+		if (!pIndex)
+		{
+			goto ERROR_EXIT;
+		}
+
+		pIndex->Magic = CALTEXT_MAGIC;
+		pIndex->Version = CALTEXT_VERSION;
+		pIndex->Size = size;
+		pIndex->CalendarCount = count;
+		pIndex->DocCount = (uint32_t)docCount;
+		pIndex->WordCount = b.WordCount;
+		pIndex->Capacity = capacity;
+		pIndex->Bases = (uint32_t)basesOffset;
+		pIndex->Slots = (uint32_t)slotsOffset;
+		memcpy(TEXTINDEX_AT(pIndex, basesOffset), bases, ((size_t)count + 1) * sizeof(uint32_t));
+
+		CalTextSlot *slots = (CalTextSlot *)TEXTINDEX_AT(pIndex, slotsOffset);
+		uint32_t skipOffset = (uint32_t)skipsOffset;
+		uint32_t keyOffset = (uint32_t)keysOffset;
+		uint32_t postingOffset = (uint32_t)postingsOffset;
+
+		for (uint32_t w = 0; w < b.WordCount; w++)
+		{
+			CalTextWord *pWord = &b.Words[w];
+			uint32_t i = (uint32_t)pWord->Hash & (capacity - 1);
+
+			while (slots[i].DocCount)
+			{
+				i = (i + 1) & (capacity - 1);
+			}
+
+			CalTextSlot *slot = &slots[i];
+			slot->Hash = pWord->Hash;
+			slot->Word = keyOffset;
+			slot->WordLength = pWord->Length;
+			slot->Postings = postingOffset;
+			slot->PostingBytes = pWord->PostingBytes;
+			slot->DocCount = pWord->DocCount;
+			slot->Skips = skipOffset;
+			slot->BlockCount = pWord->BlockCount;
+
+			memcpy(TEXTINDEX_AT(pIndex, keyOffset), b.Keys + pWord->Key, pWord->Length);
+			EncodePostings(sorted + pWord->First, pWord->Items, TEXTINDEX_AT(pIndex, postingOffset),
+				(CalTextSkip *)TEXTINDEX_AT(pIndex, skipOffset), &pWord->BlockCount);
+
+			keyOffset += pWord->Length;
+			postingOffset += pWord->PostingBytes;
+			skipOffset += pWord->BlockCount * sizeof(CalTextSkip);
+		}
+	}
+
+ERROR_EXIT:
+	free(sorted);
+	free(bases);
+	DestroyTextBuilder(&b);
+	return pIndex;
+}
+
+void DestroyTextIndex(CalTextIndex *pIndex)
+{
+	CalFree(pIndex);
+}
+
+/// <summary>
+/// Splits a query into folded words.  Prints the reason and returns false
+/// if it has too many
+/// </summary>
+static bool ParseTextQuery(const char *text, CalTextQuery *q)
+{
+	const unsigned char *p = (const unsigned char *)text;
+	const unsigned char *end = p + strlen(text);
+	unsigned char word[CALTEXT_MAX_WORD];
+	unsigned int length;
+
+	q->Count = 0;
+	while (NextWord(&p, end, word, &length))
+	{
+		if (q->Count == CALTEXT_MAX_QUERY_WORDS)
+		{
+			printf("-> ERROR: text query has more than %d words\n", CALTEXT_MAX_QUERY_WORDS);
+			return false;
+		}
+
+		memcpy(q->Words[q->Count], word, length);
+		q->Lengths[q->Count++] = length;
+	}
+	return true;
+}
+
+static const CalTextSlot *FindTextSlot(const CalTextIndex *pIndex, const unsigned char *word, unsigned int length)
+{
+	uint64_t hash = CalHash64(word, length, 0);
+	const CalTextSlot *slots = TEXTINDEX_SLOTS(pIndex);
+	uint32_t i = (uint32_t)hash & (pIndex->Capacity - 1);
+
+	for (uint32_t probes = 0; probes < pIndex->Capacity && slots[i].DocCount; probes++)
+	{
+		if (slots[i].Hash == hash && slots[i].WordLength == length && !memcmp(TEXTINDEX_AT(pIndex, slots[i].Word), word, length))
+		{
+			return &slots[i];
+		}
+		i = (i + 1) & (pIndex->Capacity - 1);
+	}
+	return NULL;
+}
+
+/// <summary>
+/// Decodes the next posting of a cursor, moving into the following block
+/// when the current one is used up.  Malformed postings end the cursor
+/// </summary>
+static void NextPosting(CalTextCursor *c)
+{
+	uint32_t gap, gaps;
+
+	if (c->Next == c->BlockEnd)
+	{
+		if (++c->Block >= c->BlockCount)
+		{
+			c->Done = true;
+			return;
+		}
+		c->BlockEnd = c->Data + c->Skips[c->Block].End;
+	}
+
+	if (!ReadVarint(&c->Next, c->BlockEnd, &gap) || !ReadVarint(&c->Next, c->BlockEnd, &c->Frequency))
+	{
+		c->Done = true;
+		return;
+	}
+
+	c->Doc += (int64_t)gap + 1;
+	c->Positions = c->Next;
+
+	// Every position takes at least one byte
+	if (c->Doc >= c->DocLimit || c->Doc > c->Skips[c->Block].LastDoc || c->Frequency > (uint32_t)(c->BlockEnd - c->Next))
+	{
+		c->Done = true;
+		return;
+	}
+
+	for (uint32_t i = 0; i < c->Frequency; i++)
+	{
+		if (!ReadVarint(&c->Next, c->BlockEnd, &gaps))
+		{
+			c->Done = true;
+			return;
+		}
+	}
+}
+
+/// <summary>
+/// Moves a cursor to the first entry at or after target, skipping whole
+/// blocks that end before it
+/// </summary>
+static void SeekPosting(CalTextCursor *c, int64_t target)
+{
+	if (c->Done || c->Doc >= target)
+	{
+		return;
+	}
+
+	if (c->Skips[c->Block].LastDoc < target)
+	{
+		uint32_t lo = c->Block + 1, hi = c->BlockCount;
+
+		while (lo < hi)
+		{
+			uint32_t mid = lo + (hi - lo) / 2;
+			if (c->Skips[mid].LastDoc < target) lo = mid + 1;
+			else hi = mid;
+		}
+		if (lo == c->BlockCount)
+		{
+			c->Done = true;
+			return;
+		}
+
+		c->Block = lo;
+		c->Next = c->Data + c->Skips[lo - 1].End;
+		c->BlockEnd = c->Data + c->Skips[lo].End;
+		c->Doc = c->Skips[lo - 1].LastDoc;
+	}
+
+	while (!c->Done && c->Doc < target)
+	{
+		NextPosting(c);
+	}
+}
+
+static void OpenCursor(CalTextCursor *c, const CalTextIndex *pIndex, const CalTextSlot *slot)
+{
+	memset(c, 0, sizeof(CalTextCursor));
+	c->Data = TEXTINDEX_AT(pIndex, slot->Postings);
+	c->Skips = (const CalTextSkip *)TEXTINDEX_AT(pIndex, slot->Skips);
+	c->BlockCount = slot->BlockCount;
+	c->DocLimit = pIndex->DocCount;
+	c->DocCount = slot->DocCount;
+	c->Doc = -1;
+	c->Next = c->Data;
+	c->BlockEnd = c->BlockCount ? c->Data + c->Skips[0].End : c->Data;
+	c->Done = !c->BlockCount;
+	NextPosting(c);
+}
+
+/// <summary>
+/// Returns true if the words of the cursors, given in query order and all
+/// on the same entry, occur there at consecutive positions
+/// </summary>
+static bool MatchesPhrase(CalTextCursor **cursors, unsigned int count)
+{
+	const unsigned char *next[CALTEXT_MAX_QUERY_WORDS];
+	uint32_t left[CALTEXT_MAX_QUERY_WORDS];
+	int64_t position[CALTEXT_MAX_QUERY_WORDS];
+	uint32_t gap;
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		next[i] = cursors[i]->Positions;
+		left[i] = cursors[i]->Frequency;
+		position[i] = -1;
+	}
+
+	// The postings were decoded once already, so these reads stay in bounds
+	while (left[0]--)
+	{
+		ReadVarint(&next[0], cursors[0]->Next, &gap);
+		position[0] += (int64_t)gap + 1;
+
+		unsigned int i;
+		for (i = 1; i < count; i++)
+		{
+			int64_t want = position[0] + i;
+
+			while (position[i] < want && left[i])
+			{
+				ReadVarint(&next[i], cursors[i]->Next, &gap);
+				position[i] += (int64_t)gap + 1;
+				left[i]--;
+			}
+			if (position[i] < want)
+			{
+				return false;		// Word i has no later position
+			}
+			if (position[i] != want)
+			{
+				break;
+			}
+		}
+
+		if (i == count)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+static void AddTextResult(CalTextResults *r, uint32_t doc)
+{
+	if ((unsigned int)r->Found < r->Capacity)
+	{
+		if (r->Entries)
+		{
+			r->Entries[r->Found] = doc;
+		}
+		else
+		{
+			// Results arrive in entry order, so the calendar only moves forward
+			while (doc >= r->Bases[r->Calendar + 1])
+			{
+				r->Calendar++;
+			}
+			r->Matches[r->Found].Calendar = r->Calendar;
+			r->Matches[r->Found].Entry = doc - r->Bases[r->Calendar];
+		}
+	}
+	if (r->Found < INT_MAX) r->Found++;
+}
+
+static int CompareCursorDocCounts(const void *a, const void *b)
+{
+	const CalTextCursor *x = *(const CalTextCursor **)a;
+	const CalTextCursor *y = *(const CalTextCursor **)b;
+
+	return x->DocCount < y->DocCount ? -1 : x->DocCount > y->DocCount ? 1 : 0;
+}
+
+/// <summary>
+/// Runs a parsed query against an index image
+/// </summary>
+static void SearchTextImage(const CalTextIndex *pIndex, const CalTextQuery *q, int mode, CalTextResults *r)
+{
+	CalTextCursor cursors[CALTEXT_MAX_QUERY_WORDS];
+	CalTextCursor *ordered[CALTEXT_MAX_QUERY_WORDS];
+	CalTextCursor *phrase[CALTEXT_MAX_QUERY_WORDS];
+	unsigned int count = 0;
+
+	for (unsigned int i = 0; i < q->Count; i++)
+	{
+		const CalTextSlot *slot = FindTextSlot(pIndex, q->Words[i], q->Lengths[i]);
+		if (!slot)
+		{
+			if (mode == CALTEXT_ANY)
+			{
+				continue;
+			}
+			return;			// Some word occurs nowhere
+		}
+
+		OpenCursor(&cursors[count], pIndex, slot);
+		phrase[count] = ordered[count] = &cursors[count];
+		count++;
+	}
+
+	if (!count)
+	{
+		return;
+	}
+
+	if (mode == CALTEXT_ANY)
+	{
+		// Union: emit the lowest current entry and step every cursor on it
+		for (;;)
+		{
+			int64_t low = -1;
+			for (unsigned int i = 0; i < count; i++)
+			{
+				if (!cursors[i].Done && (low < 0 || cursors[i].Doc < low))
+				{
+					low = cursors[i].Doc;
+				}
+			}
+			if (low < 0)
+			{
+				return;
+			}
+
+			AddTextResult(r, (uint32_t)low);
+			for (unsigned int i = 0; i < count; i++)
+			{
+				if (!cursors[i].Done && cursors[i].Doc == low)
+				{
+					NextPosting(&cursors[i]);
+				}
+			}
+		}
+	}
+
+	// Intersection: the rarest word proposes an entry and the others seek
+	// to it, proposing a later one when they do not have it
+	qsort(ordered, count, sizeof(CalTextCursor *), CompareCursorDocCounts);
+
+	int64_t target = ordered[0]->Doc;
+	while (!ordered[0]->Done)
+	{
+		unsigned int i;
+		for (i = 0; i < count; i++)
+		{
+			SeekPosting(ordered[i], target);
+			if (ordered[i]->Done)
+			{
+				return;
+			}
+			if (ordered[i]->Doc != target)
+			{
+				target = ordered[i]->Doc;
+				break;
+			}
+		}
+
+		if (i == count)
+		{
+			if (mode != CALTEXT_PHRASE || MatchesPhrase(phrase, count))
+			{
+				AddTextResult(r, (uint32_t)target);
+			}
+			NextPosting(ordered[0]);
+			target = ordered[0]->Doc;
+		}
+	}
+}
+
+/// <summary>
+/// Checks every entry of a calendar for the query words; used when the
+/// calendar has no text index.  The phrase state has bit i set while the
+/// last words read match the first i + 1 query words
+/// </summary>
+static void ScanTextEntries(Calendar *pCalendar, const CalTextQuery *q, int mode, CalTextResults *r)
+{
+	unsigned char word[CALTEXT_MAX_WORD];
+	unsigned int length;
+	uint32_t doc = 0;
+	uint32_t all = (1U << q->Count) - 1;
+
+	if (!q->Count)
+	{
+		return;
+	}
+
+	for (CalendarEntry *e = pCalendar->Entry; e; e = e->NextEntry, doc++)
+	{
+		uint32_t seen = 0;
+		bool matched = false;
+
+		for (int field = 0; field < TEXTINDEX_FIELDS && !matched; field++)
+		{
+			size_t len = 0;
+			const unsigned char *p = GetEntryText(e, field, &len);
+			const unsigned char *end = p ? p + len : NULL;
+			uint32_t state = 0;
+
+			while (p && !matched && NextWord(&p, end, word, &length))
+			{
+				uint32_t hits = 0;
+				for (unsigned int i = 0; i < q->Count; i++)
+				{
+					if (q->Lengths[i] == length && !memcmp(q->Words[i], word, length))
+					{
+						hits |= 1U << i;
+					}
+				}
+
+				seen |= hits;
+				state = ((state << 1) | 1) & hits;
+
+				if (mode == CALTEXT_ANY) matched = seen != 0;
+				else if (mode == CALTEXT_ALL) matched = seen == all;
+				else matched = (state >> (q->Count - 1)) & 1;
+			}
+		}
+
+		if (matched)
+		{
+			AddTextResult(r, doc);
+		}
+	}
+}
+
+/// <summary>
+/// Finds the entries of a calendar whose Subject, Location or Content
+/// contain the words of text as the mode asks.  Writes up to n ascending
+/// entry indices to out and returns how many entries match, or -1 if the
+/// query has too many words.  Calendars without a text index are scanned
+/// </summary>
+int FindTextEntries(Calendar *pCalendar, const char *text, int mode, unsigned int *out, unsigned int n)
+{
+	CalTextQuery q;
+	CalTextResults r;
+
+	if (!ParseTextQuery(text, &q))
+	{
+		return -1;
+	}
+
+	memset(&r, 0, sizeof(r));
+	r.Entries = out;
+	r.Capacity = out ? n : 0;
+
+	if (pCalendar->TextIndex)
+	{
+		SearchTextImage(pCalendar->TextIndex, &q, mode, &r);
+	}
+	else
+	{
+		ScanTextEntries(pCalendar, &q, mode, &r);
+	}
+	return r.Found;
+}
+
+/// <summary>
+/// Searches an index over many calendars.  Writes up to n matches to out
+/// in calendar and entry order and returns how many there are, or -1 if
+/// the query has too many words
+/// </summary>
+int SearchTextIndex(const CalTextIndex *pIndex, const char *text, int mode, CalQueryMatch *out, unsigned int n)
+{
+	CalTextQuery q;
+	CalTextResults r;
+
+	if (!ParseTextQuery(text, &q))
+	{
+		return -1;
+	}
+
+	memset(&r, 0, sizeof(r));
+	r.Bases = TEXTINDEX_BASES(pIndex);
+	r.Matches = out;
+	r.Capacity = out ? n : 0;
+
+	SearchTextImage(pIndex, &q, mode, &r);
+	return r.Found;
+}
+
+bool SaveTextIndex(const CalTextIndex *pIndex, const char *path)
+{
+	FILE *f = fopen(path, "wb");
+	bool ok;
+
+	if (!f)
+	{
+		printf("-> ERROR: cannot create %s\n", path);
+		return false;
+	}
+
+	ok = fwrite(pIndex, 1, (size_t)pIndex->Size, f) == pIndex->Size;
+	ok = (fclose(f) == 0) && ok;
+	if (!ok)
+	{
+		printf("-> ERROR: cannot write %s\n", path);
+	}
+	return ok;
+}
+
+static bool InImage(uint64_t size, uint64_t offset, uint64_t length)
+{
+	return offset <= size && length <= size - offset;
+}
+
+/// <summary>
+/// Checks that every offset in an image of fileSize bytes, mapped from a
+/// file or a snapshot, stays inside it, so searches can trust them.  The
+/// postings themselves are checked as they are read
+/// </summary>
+bool ValidateTextIndex(const CalTextIndex *pIndex, uint64_t fileSize)
+{
+	if (fileSize < sizeof(CalTextIndex) || pIndex->Magic != CALTEXT_MAGIC || pIndex->Version != CALTEXT_VERSION || pIndex->Size != fileSize)
+	{
+		return false;
+	}
+
+	uint64_t size = pIndex->Size;
+	if (!pIndex->Capacity || (pIndex->Capacity & (pIndex->Capacity - 1)) || pIndex->WordCount >= pIndex->Capacity ||
+		(pIndex->Bases & 3) || (pIndex->Slots & 7) ||
+		!InImage(size, pIndex->Bases, ((uint64_t)pIndex->CalendarCount + 1) * sizeof(uint32_t)) ||
+		!InImage(size, pIndex->Slots, (uint64_t)pIndex->Capacity * sizeof(CalTextSlot)))
+	{
+		return false;
+	}
+
+	const uint32_t *bases = TEXTINDEX_BASES(pIndex);
+	for (uint32_t c = 0; c < pIndex->CalendarCount; c++)
+	{
+		if (bases[c] > bases[c + 1])
+		{
+			return false;
+		}
+	}
+	if (bases[0] != 0 || bases[pIndex->CalendarCount] != pIndex->DocCount)
+	{
+		return false;
+	}
+
+	const CalTextSlot *slots = TEXTINDEX_SLOTS(pIndex);
+	for (uint32_t i = 0; i < pIndex->Capacity; i++)
+	{
+		const CalTextSlot *slot = &slots[i];
+		if (!slot->DocCount)
+		{
+			continue;
+		}
+
+		if (slot->WordLength > CALTEXT_MAX_WORD || (slot->Skips & 3) || !slot->BlockCount ||
+			!InImage(size, slot->Word, slot->WordLength) ||
+			!InImage(size, slot->Postings, slot->PostingBytes) ||
+			!InImage(size, slot->Skips, (uint64_t)slot->BlockCount * sizeof(CalTextSkip)))
+		{
+			return false;
+		}
+
+		const CalTextSkip *skips = (const CalTextSkip *)TEXTINDEX_AT(pIndex, slot->Skips);
+		for (uint32_t k = 0; k < slot->BlockCount; k++)
+		{
+			if (skips[k].End > slot->PostingBytes || (k && (skips[k].End < skips[k - 1].End || skips[k].LastDoc <= skips[k - 1].LastDoc)))
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+/// <summary>
+/// Maps a saved index read-only and checks it.  Returns NULL if the file
+/// cannot be mapped or is not a valid index
+/// </summary>
+CalTextCorpus *MapTextIndex(const char *path)
+{
+	CalTextCorpus *pCorpus = NULL;
+	LARGE_INTEGER fileSize;
+	void *view = NULL;
+
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		printf("-> ERROR: cannot open %s\n", path);
+		return NULL;
+	}
+
+	if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart >= (LONGLONG)sizeof(CalTextIndex))
+	{
+		// The view stays valid after both handles are closed
+		HANDLE mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping)
+		{
+			view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(mapping);
+		}
+	}
+	CloseHandle(file);
+
+	if (!view)
+	{
+		printf("-> ERROR: cannot map %s\n", path);
+		return NULL;
+	}
+
+	if (!ValidateTextIndex((const CalTextIndex *)view, (uint64_t)fileSize.QuadPart))
+	{
+		printf("-> ERROR: %s is not a valid text index\n", path);
+		goto ERROR_EXIT;
+	}
+
+	pCorpus = (CalTextCorpus *)CalCalloc(1, sizeof(CalTextCorpus));
+	if (!pCorpus)
+	{
+		goto ERROR_EXIT;
+	}
+
+	pCorpus->Index = (CalTextIndex *)view;
+	pCorpus->Mapped = true;
+	return pCorpus;
+
+ERROR_EXIT:
+	UnmapViewOfFile(view);
+	return NULL;
+}
+
+void DestroyTextCorpus(CalTextCorpus *pCorpus)
+{
+	if (!pCorpus)
+	{
+		return;
+	}
+
+	if (pCorpus->Mapped)
+	{
+		UnmapViewOfFile(pCorpus->Index);
+	}
+	else
+	{
+		DestroyTextIndex(pCorpus->Index);
+	}
+	CalFree(pCorpus);
+}
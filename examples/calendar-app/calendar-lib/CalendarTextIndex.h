@@ -0,0 +1,89 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarTextIndex.h:  contains the inverted word index over entry
+* Subject, Location and Content
+*
+*********************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include "CalendarStructures.h"
+#include "CalendarQuery.h"
+
+// Search modes
+#define CALTEXT_ALL			0	// Entries containing every query word
+#define CALTEXT_ANY			1	// Entries containing any query word
+#define CALTEXT_PHRASE		2	// Entries containing the query words adjacent and in order
+
+// Words are runs of ASCII letters and digits and of non-ASCII bytes,
+// compared with ASCII case folded.  Longer words are indexed and
+// searched by their first CALTEXT_MAX_WORD bytes
+#define CALTEXT_MAX_WORD			64
+#define CALTEXT_MAX_QUERY_WORDS		16
+
+#define CALTEXT_MAGIC		0x58495443	// "CTIX"
+#define CALTEXT_VERSION		1
+
+// Postings are kept in blocks of this many entries.  The skip table
+// records where each block ends, so an AND search can jump over blocks
+// instead of decoding them
+#define CALTEXT_BLOCK		64
+
+typedef struct _CalTextSlot
+{
+	uint64_t Hash;
+	uint32_t Word;				// Offset of the word bytes
+	uint32_t WordLength;
+	uint32_t Postings;			// Offset of the encoded postings
+	uint32_t PostingBytes;
+	uint32_t DocCount;			// Entries containing the word; zero for an empty slot
+	uint32_t Skips;				// Offset of the CalTextSkip array
+	uint32_t BlockCount;
+	uint32_t Reserved;
+} CalTextSlot;
+
+typedef struct _CalTextSkip
+{
+	uint32_t LastDoc;			// Last entry in the block
+	uint32_t End;				// Offset of the end of the block within the postings
+} CalTextSkip;
+
+// The index is one allocation addressed by offsets from its start, so
+// it is saved to disk byte for byte and searched in place once mapped
+// back.  Entries of all the indexed calendars are numbered together in
+// order; Bases holds the first number of each calendar.  Each posting
+// is the varint gap from the previous entry, the number of positions
+// and the varint gaps between the positions of the word in the entry
+typedef struct _CalTextIndex
+{
+	uint32_t Magic;
+	uint32_t Version;
+	uint64_t Size;				// Bytes in the image, header included
+	uint32_t CalendarCount;
+	uint32_t DocCount;			// Entries across all the calendars
+	uint32_t WordCount;			// Distinct words
+	uint32_t Capacity;			// Slots; a power of two
+	uint32_t Bases;				// Offset of CalendarCount + 1 entry numbers
+	uint32_t Slots;				// Offset of the slot array
+} CalTextIndex;
+
+// An index over many calendars that is kept apart from them; either
+// built in memory or a read-only view of a saved index
+typedef struct _CalTextCorpus
+{
+	CalTextIndex *Index;
+	bool Mapped;
+} CalTextCorpus;
+
+CalTextIndex *BuildTextIndex(Calendar **calendars, unsigned int count);
+void DestroyTextIndex(CalTextIndex *pIndex);
+int FindTextEntries(Calendar *pCalendar, const char *text, int mode, unsigned int *out, unsigned int n);
+int SearchTextIndex(const CalTextIndex *pIndex, const char *text, int mode, CalQueryMatch *out, unsigned int n);
+bool SaveTextIndex(const CalTextIndex *pIndex, const char *path);
+CalTextCorpus *MapTextIndex(const char *path);
+bool ValidateTextIndex(const CalTextIndex *pIndex, uint64_t fileSize);
+void DestroyTextCorpus(CalTextCorpus *pCorpus);
@@ -0,0 +1,165 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarTime.cpp:  contains the conversion of entry dates, times,
+* durations and time zones to UTC timestamps
+*
+*********************************************************************/
+
+#include "stdafx.h"
+#include <string.h>
+#include "CalendarTime.h"
+#include "CalendarTimeZone.h"
+
+/// <summary>
+/// Returns the number of days from 1970-01-01 to a date in the proleptic
+/// Gregorian calendar
+/// </summary>
+int64_t CalDaysFromCivil(int year, int month, int day)
+{
+	int64_t y = (int64_t)year - (month <= 2);
+	int64_t era = (y >= 0 ? y : y - 399) / 400;
+	int64_t yoe = y - era * 400;
+	int64_t doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+	int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+	return era * 146097 + doe - 719468;
+}
+
+/// <summary>
+/// Computes the wall-clock timestamp at which an entry starts from its
+/// StartDate and StartTime.  Fails for entries missing either or holding
+/// out-of-range values
+/// </summary>
+static bool GetEntryLocalStart(CalendarEntry *pEntry, int64_t *start)
+{
+	CalDate *d = pEntry->StartDate;
+	CalTime *t = pEntry->StartTime;
+
+	if (!d || !t)
+	{
+		return false;
+	}
+
+	if (d->Month < 1 || d->Month > 12 || d->Day < 1 || d->Day > 31 ||
+		t->Hour < 0 || t->Hour > 23 || t->Minute < 0 || t->Minute > 59 || t->Second < 0 || t->Second > 59)
+	{
+		return false;
+	}
+
+	*start = CalDaysFromCivil(d->Year, d->Month, d->Day) * 86400 + t->Hour * 3600 + t->Minute * 60 + t->Second;
+	return true;
+}
+
+/// <summary>
+/// Stores the UTC start of an entry from its wall-clock start and zone (UTC
+/// when NULL), and its UTC end if it has a usable Duration
+/// </summary>
+static void SetEntryTimes(CalendarEntry *e, int64_t local, const CalTimeZone *zone)
+{
+	CalTime *l = e->Duration;
+
+	e->UtcStart = zone ? LocalToUtc(zone, local) : local;
+	e->TimeFlags = CALTIME_HAS_START | (zone ? CALTIME_ZONE_KNOWN : 0);
+
+	if (l && l->Hour >= 0 && l->Minute >= 0 && l->Second >= 0)
+	{
+		e->UtcEnd = e->UtcStart + (int64_t)l->Hour * 3600 + (int64_t)l->Minute * 60 + l->Second;
+		e->TimeFlags |= CALTIME_HAS_END;
+	}
+}
+
+/// <summary>
+/// Resolves the TIMEZONE of every entry and stores its UTC start and end.
+/// Entries whose zone cannot be resolved are taken to be in UTC
+/// </summary>
+void ResolveCalendarTimes(Calendar *pCalendar)
+{
+	// Consecutive entries usually share a zone (and, when interned, a CalString)
+	CalString *lastName = NULL;
+	const CalTimeZone *lastZone = NULL;
+
+	for (CalendarEntry *e = pCalendar->Entry; e; e = e->NextEntry)
+	{
+		int64_t local;
+		CalString *name = e->TimeZone;
+		const CalTimeZone *zone = NULL;
+
+		e->TimeFlags = 0;
+		if (!GetEntryLocalStart(e, &local))
+		{
+			continue;
+		}
+
+		if (name && name->Short.Value)
+		{
+			if (lastName && (name == lastName || (name->Short.Length == lastName->Short.Length &&
+				!memcmp(name->Short.Value, lastName->Short.Value, name->Short.Length))))
+			{
+				zone = lastZone;
+			}
+			else
+			{
+				ReleaseTimeZone(lastZone);
+				zone = ResolveTimeZone(name->Short.Value, name->Short.Length);
+				lastName = name;
+				lastZone = zone;
+			}
+		}
+
+		SetEntryTimes(e, local, zone);
+	}
+
+	ReleaseTimeZone(lastZone);
+}
+
+/// <summary>
+/// Resolves the TIMEZONE of a single entry and stores its UTC start and
+/// end, as ResolveCalendarTimes does for a whole calendar
+/// </summary>
+void ResolveEntryTimes(CalendarEntry *pEntry)
+{
+	int64_t local;
+	CalString *name = pEntry->TimeZone;
+
+	pEntry->TimeFlags = 0;
+	if (!GetEntryLocalStart(pEntry, &local))
+	{
+		return;
+	}
+
+	const CalTimeZone *zone = (name && name->Short.Value) ? ResolveTimeZone(name->Short.Value, name->Short.Length) : NULL;
+	SetEntryTimes(pEntry, local, zone);
+	ReleaseTimeZone(zone);
+}
+
+/// <summary>
+/// Returns the UTC timestamp at which an entry starts, if it has one
+/// </summary>
+bool GetEntryStart(CalendarEntry *pEntry, int64_t *start)
+{
+	if (!(pEntry->TimeFlags & CALTIME_HAS_START))
+	{
+		return false;
+	}
+
+	*start = pEntry->UtcStart;
+	return true;
+}
+
+/// <summary>
+/// Returns the UTC interval [start, end) an entry occupies, if it has one
+/// </summary>
+bool GetEntryInterval(CalendarEntry *pEntry, int64_t *start, int64_t *end)
+{
+	if (!(pEntry->TimeFlags & CALTIME_HAS_END))
+	{
+		return false;
+	}
+
+	*start = pEntry->UtcStart;
+	*end = pEntry->UtcEnd;
+	return true;
+}
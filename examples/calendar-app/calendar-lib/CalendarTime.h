@@ -0,0 +1,26 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarTime.h:  contains the conversion of entry dates, times,
+* durations and time zones to UTC timestamps
+*
+*********************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include "CalendarStructures.h"
+
+// CalendarEntry TimeFlags
+#define CALTIME_HAS_START	0x00000001	// UtcStart is valid
+#define CALTIME_HAS_END		0x00000002	// UtcEnd is valid
+#define CALTIME_ZONE_KNOWN	0x00000004	// TIMEZONE was resolved; otherwise taken as UTC
+
+// Timestamps are seconds since 1970-01-01 00:00:00 UTC
+int64_t CalDaysFromCivil(int year, int month, int day);
+void ResolveCalendarTimes(Calendar *pCalendar);
+void ResolveEntryTimes(CalendarEntry *pEntry);
+bool GetEntryStart(CalendarEntry *pEntry, int64_t *start);
+bool GetEntryInterval(CalendarEntry *pEntry, int64_t *start, int64_t *end);
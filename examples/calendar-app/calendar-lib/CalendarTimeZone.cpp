@@ -0,0 +1,932 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarTimeZone.cpp:  contains the resolver that maps TIMEZONE
+* strings to UTC offset rules.  Names are looked up in a table of
+* common abbreviations, parsed as numeric offsets, or loaded from the
+* TZif files of a tzdata directory, and a bounded number of results
+* are cached
+*
+*********************************************************************/
+
+#include "stdafx.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "CalendarHash.h"
+#include "CalendarTime.h"
+#include "CalendarTimeZone.h"
+
+#define CALTZ_MAX_PATH		260
+#define CALTZ_MAX_FILE		(64 * 1024)
+#define CALTZ_CACHE_SLOTS	512		// A power of two, at least twice CALTZ_CACHE_MAX
+#define CALTZ_CACHE_MAX		256		// Names cached, failures included
+
+#define CALTZ_DEFAULT_DIRECTORY "/usr/share/zoneinfo"
+
+// Zones are shared by every thread and every calendar, so they are
+// allocated with malloc rather than CalMalloc: they must not land in a
+// parser's arena or count against a parse budget
+
+typedef struct _CalTzAbbreviation
+{
+	const char *Name;
+	int Offset;
+} CalTzAbbreviation;
+
+// Where an abbreviation is ambiguous (IST, BST) the most common reading wins
+static const CalTzAbbreviation TimeZoneAbbreviations[] =
+{
+	{ "UTC", 0 }, { "UT", 0 }, { "GMT", 0 }, { "Z", 0 },
+	{ "WET", 0 }, { "WEST", 3600 }, { "BST", 3600 },
+	{ "CET", 3600 }, { "CEST", 7200 }, { "EET", 7200 }, { "EEST", 10800 },
+	{ "MSK", 10800 }, { "IST", 19800 }, { "HKT", 28800 }, { "AWST", 28800 },
+	{ "JST", 32400 }, { "KST", 32400 }, { "ACST", 34200 }, { "ACDT", 37800 },
+	{ "AEST", 36000 }, { "AEDT", 39600 }, { "NZST", 43200 }, { "NZDT", 46800 },
+	{ "AST", -14400 }, { "ADT", -10800 }, { "NST", -12600 }, { "NDT", -9000 },
+	{ "EST", -18000 }, { "EDT", -14400 }, { "CST", -21600 }, { "CDT", -18000 },
+	{ "MST", -25200 }, { "MDT", -21600 }, { "PST", -28800 }, { "PDT", -25200 },
+	{ "AKST", -32400 }, { "AKDT", -28800 }, { "HST", -36000 }
+};
+
+typedef struct _CalTzCacheSlot
+{
+	uint64_t Hash;
+	char *Name;					// Lowercased; NULL for an empty slot
+	CalTimeZone *Zone;			// NULL if the name could not be resolved
+	volatile LONG Used;			// Set by lookups, cleared as the eviction hand passes
+} CalTzCacheSlot;
+
+static SRWLOCK TimeZoneLock = SRWLOCK_INIT;
+static CalTzCacheSlot TimeZoneCache[CALTZ_CACHE_SLOTS];
+static unsigned int TimeZoneCacheCount = 0;
+static unsigned int TimeZoneCacheHand = 0;
+static char TimeZoneDirectory[CALTZ_MAX_PATH] = "";
+
+static __declspec(thread) unsigned int ThreadZoneLoadBudget = 0;
+static __declspec(thread) unsigned int ThreadZoneLoads = 0;
+static __declspec(thread) bool ThreadZoneLoadsExceeded = false;
+
+//////////////////////////////////////////
+//
+// Offset rules
+//
+//////////////////////////////////////////
+
+static CalTimeZone *CreateTimeZone(unsigned int transitionCount)
+{
+	size_t size = sizeof(CalTimeZone) + transitionCount * (sizeof(int64_t) + sizeof(int));
+	CalTimeZone *z = (CalTimeZone *)calloc(1, size);
+	if (!z)
+	{
+		return NULL;
+	}
+
+	z->References = 1;
+	z->TransitionCount = transitionCount;
+	z->Transitions = (int64_t *)(z + 1);
+	z->Offsets = (int *)(z->Transitions + transitionCount);
+	return z;
+}
+
+static CalTimeZone *CreateFixedTimeZone(int offset)
+{
+	CalTimeZone *z = CreateTimeZone(0);
+	if (z)
+	{
+		z->InitialOffset = offset;
+	}
+	return z;
+}
+
+static int64_t YearFromDays(int64_t days)
+{
+	days += 719468;
+	int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+	int64_t doe = days - era * 146097;
+	int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	int64_t mp = (5 * doy + 2) / 153;
+
+	return yoe + era * 400 + (mp >= 10 ? 1 : 0);
+}
+
+static int64_t FloorDiv(int64_t a, int64_t b)
+{
+	return a / b - ((a % b != 0) && ((a < 0) != (b < 0)));
+}
+
+/// <summary>
+/// Returns the local time, in seconds since 1970, at which a rule date
+/// falls in a year
+/// </summary>
+static int64_t RuleDateToLocal(const CalTzRuleDate *d, int year)
+{
+	int64_t jan1 = CalDaysFromCivil(year, 1, 1);
+	bool leap = CalDaysFromCivil(year, 3, 1) - jan1 == 60;
+	int64_t day;
+
+	if (d->Kind == TZDATE_JULIAN1)
+	{
+		day = jan1 + d->Day - 1 + ((leap && d->Day >= 60) ? 1 : 0);
+	}
+	else if (d->Kind == TZDATE_JULIAN0)
+	{
+		day = jan1 + d->Day;
+	}
+	else
+	{
+		int64_t first = CalDaysFromCivil(year, d->Month, 1);
+		int64_t next = (d->Month == 12) ? CalDaysFromCivil(year + 1, 1, 1) : CalDaysFromCivil(year, d->Month + 1, 1);
+		int64_t weekday = ((first % 7) + 7 + 4) % 7;	// 1970-01-01 was a Thursday
+
+		day = first + (d->Day - weekday + 7) % 7 + (int64_t)(d->Week - 1) * 7;
+		while (day >= next)
+		{
+			day -= 7;	// Week 5 means the last such day of the month
+		}
+	}
+
+	return day * 86400 + d->Time;
+}
+
+static int GetRuleOffset(const CalTzRule *r, int64_t utc)
+{
+	if (!r->HasDst)
+	{
+		return r->StdOffset;
+	}
+
+	int year = (int)YearFromDays(FloorDiv(utc + r->StdOffset, 86400));
+	int64_t start = RuleDateToLocal(&r->DstStart, year) - r->StdOffset;
+	int64_t end = RuleDateToLocal(&r->DstEnd, year) - r->DstOffset;
+	bool dst;
+
+	if (start < end)
+	{
+		dst = utc >= start && utc < end;
+	}
+	else
+	{
+		dst = !(utc >= end && utc < start);	// Southern hemisphere
+	}
+
+	return dst ? r->DstOffset : r->StdOffset;
+}
+
+/// <summary>
+/// Returns the offset from UTC, in seconds, in effect in a zone at a UTC
+/// instant
+/// </summary>
+int GetTimeZoneOffset(const CalTimeZone *pZone, int64_t utc)
+{
+	unsigned int n = pZone->TransitionCount;
+
+	if (n == 0 || utc < pZone->Transitions[0])
+	{
+		return (n == 0 && pZone->HasRule) ? GetRuleOffset(&pZone->Rule, utc) : pZone->InitialOffset;
+	}
+
+	if (utc >= pZone->Transitions[n - 1] && pZone->HasRule)
+	{
+		return GetRuleOffset(&pZone->Rule, utc);
+	}
+
+	unsigned int low = 0, high = n;
+	while (high - low > 1)
+	{
+		unsigned int mid = low + (high - low) / 2;
+		if (pZone->Transitions[mid] <= utc)
+		{
+			low = mid;
+		}
+		else
+		{
+			high = mid;
+		}
+	}
+
+	return pZone->Offsets[low];
+}
+
+/// <summary>
+/// Converts a local time in a zone to UTC.  Local times skipped by a
+/// forward change are moved forward by the size of the change, and those
+/// repeated by a backward change resolve to their first occurrence
+/// </summary>
+int64_t LocalToUtc(const CalTimeZone *pZone, int64_t local)
+{
+	// Try the offsets in effect either side of the local time
+	int first = GetTimeZoneOffset(pZone, local);
+	int64_t a = local - first;
+	int second = GetTimeZoneOffset(pZone, a);
+	int64_t b = local - second;
+
+	bool aValid = GetTimeZoneOffset(pZone, a) == first;
+	bool bValid = GetTimeZoneOffset(pZone, b) == second;
+
+	if (aValid && bValid)
+	{
+		return a < b ? a : b;	// Repeated
+	}
+	if (aValid || bValid)
+	{
+		return aValid ? a : b;
+	}
+	return a > b ? a : b;		// Skipped
+}
+
+//////////////////////////////////////////
+//
+// POSIX TZ strings
+//
+//////////////////////////////////////////
+
+static const char *ParseTzName(const char *p)
+{
+	const char *start = p;
+
+	if (*p == '<')
+	{
+		const char *close = strchr(p, '>');
+		return close ? close + 1 : NULL;
+	}
+
+	while (isalpha((unsigned char)*p))
+	{
+		p++;
+	}
+	return (p - start >= 3) ? p : NULL;
+}
+
+// [+-]hh[:mm[:ss]]
+static const char *ParseTzTime(const char *p, int *seconds)
+{
+	int sign = 1, h = 0, m = 0, s = 0;
+
+	if (*p == '+' || *p == '-')
+	{
+		sign = (*p++ == '-') ? -1 : 1;
+	}
+	if (!isdigit((unsigned char)*p))
+	{
+		return NULL;
+	}
+
+	while (isdigit((unsigned char)*p) && h < 1000)
+	{
+		h = h * 10 + (*p++ - '0');
+	}
+	if (*p == ':')
+	{
+		p++;
+		m = (int)strtol(p, (char **)&p, 10);
+		if (*p == ':')
+		{
+			p++;
+			s = (int)strtol(p, (char **)&p, 10);
+		}
+	}
+
+	if (h > 167 || m < 0 || m > 59 || s < 0 || s > 59)
+	{
+		return NULL;
+	}
+
+	*seconds = sign * (h * 3600 + m * 60 + s);
+	return p;
+}
+
+static const char *ParseTzRuleDate(const char *p, CalTzRuleDate *d)
+{
+	char *next;
+	memset(d, 0, sizeof(*d));
+	d->Time = 2 * 3600;
+
+	if (*p == 'J')
+	{
+		d->Kind = TZDATE_JULIAN1;
+		d->Day = (int)strtol(p + 1, &next, 10);
+		if (next == p + 1 || d->Day < 1 || d->Day > 365) return NULL;
+	}
+	else if (*p == 'M')
+	{
+		d->Kind = TZDATE_MONTHWEEK;
+		d->Month = (int)strtol(p + 1, &next, 10);
+		if (*next != '.') return NULL;
+		d->Week = (int)strtol(next + 1, &next, 10);
+		if (*next != '.') return NULL;
+		d->Day = (int)strtol(next + 1, &next, 10);
+		if (d->Month < 1 || d->Month > 12 || d->Week < 1 || d->Week > 5 || d->Day < 0 || d->Day > 6) return NULL;
+	}
+	else
+	{
+		d->Kind = TZDATE_JULIAN0;
+		d->Day = (int)strtol(p, &next, 10);
+		if (next == p || d->Day < 0 || d->Day > 365) return NULL;
+	}
+
+	p = next;
+	if (*p == '/')
+	{
+		p = ParseTzTime(p + 1, &d->Time);
+	}
+	return p;
+}
+
+/// <summary>
+/// Parses a POSIX TZ string such as "CET-1CEST,M3.5.0,M10.5.0/3".  Offsets
+/// in these strings count west of UTC, the opposite of CalTzRule
+/// </summary>
+static bool ParseTzRule(const char *p, CalTzRule *r)
+{
+	int offset;
+
+	memset(r, 0, sizeof(*r));
+
+	if (!(p = ParseTzName(p)) || !(p = ParseTzTime(p, &offset)))
+	{
+		return false;
+	}
+	r->StdOffset = -offset;
+
+	if (!*p)
+	{
+		return true;
+	}
+
+	if (!(p = ParseTzName(p)))
+	{
+		return false;
+	}
+
+	r->HasDst = true;
+	r->DstOffset = r->StdOffset + 3600;
+	if (*p && *p != ',')
+	{
+		if (!(p = ParseTzTime(p, &offset)))
+		{
+			return false;
+		}
+		r->DstOffset = -offset;
+	}
+
+	if (!*p)
+	{
+		// No rule given; use the current United States one
+		p = ",M3.2.0,M11.1.0";
+	}
+
+	if (*p != ',' || !(p = ParseTzRuleDate(p + 1, &r->DstStart)) ||
+		*p != ',' || !(p = ParseTzRuleDate(p + 1, &r->DstEnd)))
+	{
+		return false;
+	}
+
+	return *p == '\0';
+}
+
+//////////////////////////////////////////
+//
+// TZif files
+//
+//////////////////////////////////////////
+
+static uint32_t ReadBigEndian32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static int64_t ReadBigEndian64(const unsigned char *p)
+{
+	return (int64_t)(((uint64_t)ReadBigEndian32(p) << 32) | ReadBigEndian32(p + 4));
+}
+
+typedef struct _CalTzifHeader
+{
+	uint64_t UtCount, StdCount, LeapCount, TimeCount, TypeCount, CharCount;
+} CalTzifHeader;
+
+static bool ReadTzifHeader(const unsigned char *p, size_t left, CalTzifHeader *h)
+{
+	if (left < 44 || memcmp(p, "TZif", 4))
+	{
+		return false;
+	}
+
+	h->UtCount = ReadBigEndian32(p + 20);
+	h->StdCount = ReadBigEndian32(p + 24);
+	h->LeapCount = ReadBigEndian32(p + 28);
+	h->TimeCount = ReadBigEndian32(p + 32);
+	h->TypeCount = ReadBigEndian32(p + 36);
+	h->CharCount = ReadBigEndian32(p + 40);
+	return h->TypeCount > 0;
+}
+
+static uint64_t TzifBlockSize(const CalTzifHeader *h, unsigned int timeSize)
+{
+	return h->TimeCount * timeSize + h->TimeCount + h->TypeCount * 6 + h->CharCount +
+		h->LeapCount * (timeSize + 4) + h->StdCount + h->UtCount;
+}
+
+/// <summary>
+/// Builds a zone from the contents of a TZif file (RFC 8536), preferring
+/// the 64-bit data and footer rule of version 2 and later files
+/// </summary>
+static CalTimeZone *ParseTzif(const unsigned char *data, size_t len)
+{
+	CalTzifHeader h;
+	const unsigned char *p = data;
+	unsigned int timeSize = 4;
+
+	if (!ReadTzifHeader(p, len, &h))
+	{
+		return NULL;
+	}
+
+	if (data[4] >= '2')
+	{
+		uint64_t skip = 44 + TzifBlockSize(&h, 4);
+		if (skip > len || !ReadTzifHeader(p + skip, len - (size_t)skip, &h))
+		{
+			return NULL;
+		}
+		p += skip;
+		timeSize = 8;
+	}
+
+	size_t left = len - (size_t)(p - data);
+	uint64_t block = TzifBlockSize(&h, timeSize);
+	if (44 + block > left || h.TimeCount > CALTZ_MAX_FILE)
+	{
+		return NULL;
+	}
+
+	const unsigned char *times = p + 44;
+	const unsigned char *indices = times + h.TimeCount * timeSize;
+	const unsigned char *types = indices + h.TimeCount;
+
+	CalTimeZone *z = CreateTimeZone((unsigned int)h.TimeCount);
+	if (!z)
+	{
+		return NULL;
+	}
+
+	// Times before the first transition use the first type
+	z->InitialOffset = (int)ReadBigEndian32(types);
+
+	for (unsigned int i = 0; i < h.TimeCount; i++)
+	{
+		if (indices[i] >= h.TypeCount)
+		{
+			free(z);
+			return NULL;
+		}
+
+		z->Transitions[i] = (timeSize == 8) ? ReadBigEndian64(times + i * 8) : (int32_t)ReadBigEndian32(times + i * 4);
+		z->Offsets[i] = (int)ReadBigEndian32(types + indices[i] * 6);
+	}
+
+	// The footer holds the rule for times after the last transition
+	const unsigned char *footer = p + 44 + block;
+	const unsigned char *end = data + len;
+	if (timeSize == 8 && footer < end && *footer == '\n')
+	{
+		const unsigned char *close = (const unsigned char *)memchr(footer + 1, '\n', end - footer - 1);
+		if (close && close - footer - 1 < 128)
+		{
+			char rule[128];
+			memcpy(rule, footer + 1, close - footer - 1);
+			rule[close - footer - 1] = '\0';
+			z->HasRule = rule[0] && ParseTzRule(rule, &z->Rule);
+		}
+	}
+
+	return z;
+}
+
+/// <summary>
+/// Returns true for names safe to append to the tzdata directory: no
+/// absolute paths, parent references or unexpected characters
+/// </summary>
+static bool IsSafeZoneName(const char *name)
+{
+	if (!name[0] || name[0] == '/' || strstr(name, ".."))
+	{
+		return false;
+	}
+
+	for (const char *p = name; *p; p++)
+	{
+		if (!isalnum((unsigned char)*p) && !strchr("/_-+.", *p))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static CalTimeZone *LoadTzifFile(const char *directory, const char *name)
+{
+	char path[CALTZ_MAX_PATH + CALTZ_MAX_NAME + 2];
+	unsigned char *data = NULL;
+	CalTimeZone *z = NULL;
+	long size;
+
+	snprintf(path, sizeof(path), "%s/%s", directory, name);
+	FILE *f = fopen(path, "rb");
+	if (!f)
+	{
+		return NULL;
+	}
+
+	// The buffer is sized to the file; real ones are a few KB
+	if (fseek(f, 0, SEEK_END) || (size = ftell(f)) <= 0 || size > CALTZ_MAX_FILE || fseek(f, 0, SEEK_SET))
+	{
+		fclose(f);
+		return NULL;
+	}
+
+	data = (unsigned char *)malloc(size);
+	if (data)
+	{
+		size_t len = fread(data, 1, size, f);
+		z = ParseTzif(data, len);
+		free(data);
+	}
+
+	fclose(f);
+	return z;
+}
+
+/// <summary>
+/// Parses numeric zones: "+05:30", "-0800", "UTC+1", "GMT-03:00".  Offsets
+/// count east of UTC
+/// </summary>
+static bool ParseNumericOffset(const char *name, int *offset)
+{
+	const char *p = name;
+	int sign, value = 0, digits = 0, h, m = 0;
+
+	if (!_strnicmp(p, "UTC", 3) || !_strnicmp(p, "GMT", 3))
+	{
+		p += 3;
+	}
+
+	if (*p != '+' && *p != '-')
+	{
+		return false;
+	}
+	sign = (*p++ == '-') ? -1 : 1;
+
+	while (isdigit((unsigned char)*p) && digits < 4)
+	{
+		value = value * 10 + (*p++ - '0');
+		digits++;
+	}
+
+	// h, hh, hh:mm or hhmm
+	if (digits == 1 || digits == 2)
+	{
+		h = value;
+		if (*p == ':')
+		{
+			if (!isdigit((unsigned char)p[1]) || !isdigit((unsigned char)p[2]))
+			{
+				return false;
+			}
+			m = (p[1] - '0') * 10 + (p[2] - '0');
+			p += 3;
+		}
+	}
+	else if (digits == 4)
+	{
+		h = value / 100;
+		m = value % 100;
+	}
+	else
+	{
+		return false;
+	}
+
+	if (*p || h > 14 || m > 59)
+	{
+		return false;
+	}
+
+	*offset = sign * (h * 3600 + m * 60);
+	return true;
+}
+
+/// <summary>
+/// Returns the offset of a zone name that needs no tzdata file: a common
+/// abbreviation or a numeric offset
+/// </summary>
+static bool GetFixedOffset(const char *name, int *offset)
+{
+	for (size_t i = 0; i < sizeof(TimeZoneAbbreviations) / sizeof(TimeZoneAbbreviations[0]); i++)
+	{
+		if (!_stricmp(name, TimeZoneAbbreviations[i].Name))
+		{
+			*offset = TimeZoneAbbreviations[i].Offset;
+			return true;
+		}
+	}
+
+	return ParseNumericOffset(name, offset);
+}
+
+/// <summary>
+/// Loads a zone name from the tzdata directory
+/// </summary>
+static CalTimeZone *LoadNamedTimeZone(const char *name, const char *directory)
+{
+	if (!IsSafeZoneName(name))
+	{
+		return NULL;
+	}
+
+	CalTimeZone *z = LoadTzifFile(directory, name);
+	if (z)
+	{
+		return z;
+	}
+
+	// tzdata names are case sensitive; retry "europe/berlin" as "Europe/Berlin"
+	char canonical[CALTZ_MAX_NAME + 1];
+	bool wordStart = true;
+	size_t i;
+	for (i = 0; name[i]; i++)
+	{
+		canonical[i] = wordStart ? (char)toupper((unsigned char)name[i]) : (char)tolower((unsigned char)name[i]);
+		wordStart = !isalpha((unsigned char)name[i]);
+	}
+	canonical[i] = '\0';
+
+	return strcmp(canonical, name) ? LoadTzifFile(directory, canonical) : NULL;
+}
+
+unsigned int SetThreadZoneLoadBudget(unsigned int maxLoads)
+{
+	unsigned int previous = ThreadZoneLoadBudget;
+	ThreadZoneLoadBudget = maxLoads;
+	ThreadZoneLoads = 0;
+	ThreadZoneLoadsExceeded = false;
+	return previous;
+}
+
+bool IsThreadZoneLoadBudgetExceeded()
+{
+	return ThreadZoneLoadsExceeded;
+}
+
+/// <summary>
+/// Charges one tzdata lookup against the thread's zone-load budget,
+/// returning false if that would exceed it
+/// </summary>
+static bool ChargeZoneLoad()
+{
+	if (!ThreadZoneLoadBudget)
+	{
+		return true;
+	}
+
+	if (ThreadZoneLoads >= ThreadZoneLoadBudget)
+	{
+		if (!ThreadZoneLoadsExceeded)
+		{
+			printf("-> ERROR: time zone load budget of %u files exceeded\n", ThreadZoneLoadBudget);
+			ThreadZoneLoadsExceeded = true;
+		}
+		return false;
+	}
+
+	ThreadZoneLoads++;
+	return true;
+}
+
+/// <summary>
+/// Drops a reference ResolveTimeZone returned.  A zone is freed once
+/// neither the cache nor any caller holds it
+/// </summary>
+void ReleaseTimeZone(const CalTimeZone *pZone)
+{
+	CalTimeZone *z = (CalTimeZone *)pZone;
+	if (z && InterlockedDecrement(&z->References) == 0)
+	{
+		free(z);
+	}
+}
+
+//////////////////////////////////////////
+//
+// Cache
+//
+//////////////////////////////////////////
+
+static CalTzCacheSlot *FindCacheSlot(uint64_t hash, const char *key)
+{
+	unsigned int i = (unsigned int)hash & (CALTZ_CACHE_SLOTS - 1);
+	while (TimeZoneCache[i].Name && (TimeZoneCache[i].Hash != hash || strcmp(TimeZoneCache[i].Name, key)))
+	{
+		i = (i + 1) & (CALTZ_CACHE_SLOTS - 1);
+	}
+	return &TimeZoneCache[i];
+}
+
+/// <summary>
+/// Empties a slot, moving the names after it in its probe run back so
+/// they are still found.  Called with the lock held exclusively
+/// </summary>
+static void RemoveCacheSlot(unsigned int hole)
+{
+	free(TimeZoneCache[hole].Name);
+	ReleaseTimeZone(TimeZoneCache[hole].Zone);
+	TimeZoneCacheCount--;
+
+	for (unsigned int i = (hole + 1) & (CALTZ_CACHE_SLOTS - 1); TimeZoneCache[i].Name; i = (i + 1) & (CALTZ_CACHE_SLOTS - 1))
+	{
+		// A name may move back unless its home slot lies after the hole
+		unsigned int home = (unsigned int)TimeZoneCache[i].Hash & (CALTZ_CACHE_SLOTS - 1);
+		if (((i - home) & (CALTZ_CACHE_SLOTS - 1)) >= ((i - hole) & (CALTZ_CACHE_SLOTS - 1)))
+		{
+			TimeZoneCache[hole] = TimeZoneCache[i];
+			hole = i;
+		}
+	}
+
+	TimeZoneCache[hole].Hash = 0;
+	TimeZoneCache[hole].Name = NULL;
+	TimeZoneCache[hole].Zone = NULL;
+	TimeZoneCache[hole].Used = 0;
+}
+
+/// <summary>
+/// Evicts the first name past the clock hand that has not been looked up
+/// since the hand last passed it.  Called with the lock held exclusively
+/// and the cache not empty
+/// </summary>
+static void EvictTimeZone()
+{
+	for (;;)
+	{
+		unsigned int i = TimeZoneCacheHand;
+		TimeZoneCacheHand = (TimeZoneCacheHand + 1) & (CALTZ_CACHE_SLOTS - 1);
+
+		if (TimeZoneCache[i].Name && !InterlockedExchange(&TimeZoneCache[i].Used, 0))
+		{
+			RemoveCacheSlot(i);
+			return;
+		}
+	}
+}
+
+/// <summary>
+/// Returns the zone a TIMEZONE value names, or NULL if it cannot be
+/// resolved; the caller drops the zone with ReleaseTimeZone.  Results,
+/// including failures, are cached by lowercased name, up to
+/// CALTZ_CACHE_MAX names.  A name not cached that needs the tzdata
+/// directory is charged against the thread's zone-load budget first
+/// </summary>
+const CalTimeZone *ResolveTimeZone(const unsigned char *name, size_t len)
+{
+	char original[CALTZ_MAX_NAME + 1];
+	char key[CALTZ_MAX_NAME + 1];
+	char directory[CALTZ_MAX_PATH];
+	int offset;
+
+	if (len == 0 || len > CALTZ_MAX_NAME || memchr(name, '\0', len))
+	{
+		return NULL;
+	}
+
+	for (size_t i = 0; i < len; i++)
+	{
+		original[i] = (char)name[i];
+		key[i] = (char)tolower(name[i]);
+	}
+	original[len] = key[len] = '\0';
+
+	uint64_t hash = CalHash64(key, len, 0);
+	CalTimeZone *z = NULL;
+	bool cached = false;
+
+	// Hits take a reference under the shared lock, which keeps eviction out
+	AcquireSRWLockShared(&TimeZoneLock);
+	CalTzCacheSlot *slot = FindCacheSlot(hash, key);
+	if (slot->Name)
+	{
+		cached = true;
+		z = slot->Zone;
+		if (z)
+		{
+			InterlockedIncrement(&z->References);
+		}
+		if (!slot->Used)
+		{
+			InterlockedExchange(&slot->Used, 1);
+		}
+	}
+	strcpy(directory, TimeZoneDirectory);
+	ReleaseSRWLockShared(&TimeZoneLock);
+
+	if (cached)
+	{
+		return z;
+	}
+
+	if (GetFixedOffset(original, &offset))
+	{
+		z = CreateFixedTimeZone(offset);
+		if (!z)
+		{
+			return NULL;
+		}
+	}
+	else
+	{
+		// Over budget, the name is not cached: it was never looked up
+		if (!ChargeZoneLoad())
+		{
+			return NULL;
+		}
+
+		if (!directory[0])
+		{
+			const char *env = getenv("TZDIR");
+			snprintf(directory, sizeof(directory), "%s", (env && env[0]) ? env : CALTZ_DEFAULT_DIRECTORY);
+		}
+
+		// Files are read outside the lock; a racing thread's result wins
+		z = LoadNamedTimeZone(original, directory);
+	}
+
+	AcquireSRWLockExclusive(&TimeZoneLock);
+	slot = FindCacheSlot(hash, key);
+	if (slot->Name)
+	{
+		ReleaseTimeZone(z);
+		z = slot->Zone;
+		if (z)
+		{
+			InterlockedIncrement(&z->References);
+		}
+	}
+	else
+	{
+		if (TimeZoneCacheCount >= CALTZ_CACHE_MAX)
+		{
+			EvictTimeZone();
+			slot = FindCacheSlot(hash, key);
+		}
+
+		if ((slot->Name = _strdup(key)) != NULL)
+		{
+			slot->Hash = hash;
+			slot->Zone = z;
+			slot->Used = 0;
+			if (z)
+			{
+				InterlockedIncrement(&z->References);	// The cache's
+			}
+			TimeZoneCacheCount++;
+		}
+	}
+	ReleaseSRWLockExclusive(&TimeZoneLock);
+
+	return z;
+}
+
+/// <summary>
+/// Sets the tzdata directory zone names are looked up in (by default
+/// TZDIR, else /usr/share/zoneinfo) and empties the cache.  Zones already
+/// resolved stay valid until their callers release them
+/// </summary>
+bool SetTimeZoneDirectory(const char *path)
+{
+	if (strlen(path) >= CALTZ_MAX_PATH)
+	{
+		return false;
+	}
+
+	AcquireSRWLockExclusive(&TimeZoneLock);
+	strcpy(TimeZoneDirectory, path);
+
+	for (unsigned int i = 0; i < CALTZ_CACHE_SLOTS; i++)
+	{
+		free(TimeZoneCache[i].Name);
+		ReleaseTimeZone(TimeZoneCache[i].Zone);
+		TimeZoneCache[i].Hash = 0;
+		TimeZoneCache[i].Name = NULL;
+		TimeZoneCache[i].Zone = NULL;
+		TimeZoneCache[i].Used = 0;
+	}
+	TimeZoneCacheCount = 0;
+	TimeZoneCacheHand = 0;
+	ReleaseSRWLockExclusive(&TimeZoneLock);
+
+	return true;
+}
@@ -0,0 +1,66 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarTimeZone.h:  contains the resolver that maps TIMEZONE
+* strings to UTC offset rules
+*
+*********************************************************************/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Longest zone name looked up in the tzdata directory
+#define CALTZ_MAX_NAME 64
+
+enum CalTzDateKind
+{
+	TZDATE_JULIAN1,		// Jn: day 1..365, February 29 never counted
+	TZDATE_JULIAN0,		// n: day 0..365, February 29 counted in leap years
+	TZDATE_MONTHWEEK	// Mm.w.d: day d of week w of month m
+};
+
+typedef struct _CalTzRuleDate
+{
+	enum CalTzDateKind Kind;
+	int Day;
+	int Week;
+	int Month;
+	int Time;			// Seconds after local midnight the change happens
+} CalTzRuleDate;
+
+// The POSIX TZ rule that applies after the last explicit transition
+typedef struct _CalTzRule
+{
+	int StdOffset;		// Seconds east of UTC
+	int DstOffset;
+	bool HasDst;
+	CalTzRuleDate DstStart;
+	CalTzRuleDate DstEnd;
+} CalTzRule;
+
+typedef struct _CalTimeZone
+{
+	volatile LONG References;	// The cache's, and one per ResolveTimeZone not yet released
+	unsigned int TransitionCount;
+	int64_t *Transitions;	// UTC instants, ascending
+	int *Offsets;			// Offset in effect from each transition on
+	int InitialOffset;		// Offset before the first transition
+	bool HasRule;
+	CalTzRule Rule;
+} CalTimeZone;
+
+const CalTimeZone *ResolveTimeZone(const unsigned char *name, size_t len);
+void ReleaseTimeZone(const CalTimeZone *pZone);
+int GetTimeZoneOffset(const CalTimeZone *pZone, int64_t utc);
+int64_t LocalToUtc(const CalTimeZone *pZone, int64_t local);
+bool SetTimeZoneDirectory(const char *path);
+
+// Caps the zone names ResolveTimeZone looks up in the tzdata directory on
+// the calling thread (0 for no cap) and resets the running count; returns
+// the previous cap
+unsigned int SetThreadZoneLoadBudget(unsigned int maxLoads);
+bool IsThreadZoneLoadBudgetExceeded();
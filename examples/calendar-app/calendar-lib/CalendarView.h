@@ -0,0 +1,370 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalendarView.h:  contains a header-only C++17 layer over the calendar
+* API for code linked with the library.  Views wrap the structures the
+* parser fills and read their fields directly: strings come back as
+* std::string_view with the lengths the parser recorded, lists are
+* iterated with range-for, and CalendarPtr destroys its calendar.
+* Nothing here allocates or copies.  It calls only the three exports it
+* declares, so it links against CalendarLib.dll or the library's object
+* files alike, but it reads the structures in place: compile it against
+* the calendar-lib headers the library was built from
+*
+*********************************************************************/
+
+#pragma once
+
+#if !((defined(_MSVC_LANG) && _MSVC_LANG >= 201703L) || __cplusplus >= 201703L)
+#error CalendarView.h requires C++17
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <iterator>
+#include <string_view>
+#include "CalendarStructures.h"
+#include "CalendarTime.h"
+
+extern "C"
+{
+	Calendar *ParseCalendarFileBufferEx(unsigned char *in, size_t len, const CalParseOptions *pOptions);
+	Calendar *MapCalendarSnapshot(const char *path);
+	void DestroyCalendar(Calendar *pCalendar);	// The export, not the library's own DestroyCalendar(void *)
+}
+
+/// <summary>
+/// Returns the value of a string field, or an empty view if there is none
+/// </summary>
+inline std::string_view CalStringView(const CalString *s) noexcept
+{
+	if (!s)
+	{
+		return std::string_view();
+	}
+	if (s->StringType == SHORTSTRING)
+	{
+		return std::string_view((const char *)s->Short.Value, s->Short.Length);
+	}
+	return std::string_view((const char *)s->Long.Value, s->Long.Length);
+}
+
+// Bytes held by a calendar, such as an attachment blob.  C++17 has no
+// std::span; this has the same data, size, begin and end, so a C++20
+// caller can construct a std::span<const unsigned char> from it
+class CalBytes
+{
+public:
+	constexpr CalBytes() noexcept : m_data(nullptr), m_size(0) {}
+	constexpr CalBytes(const unsigned char *data, size_t size) noexcept : m_data(data), m_size(size) {}
+
+	constexpr const unsigned char *data() const noexcept { return m_data; }
+	constexpr size_t size() const noexcept { return m_size; }
+	constexpr bool empty() const noexcept { return !m_size; }
+	constexpr const unsigned char *begin() const noexcept { return m_data; }
+	constexpr const unsigned char *end() const noexcept { return m_data + m_size; }
+	constexpr unsigned char operator[](size_t i) const noexcept { return m_data[i]; }
+
+private:
+	const unsigned char *m_data;
+	size_t m_size;
+};
+
+// Forward iterator over a NULL-terminated list linked through Next, which
+// yields a View of each node
+template <typename Node, typename View, Node *Node::*Next>
+class CalListIterator
+{
+public:
+	using iterator_category = std::forward_iterator_tag;
+	using value_type = View;
+	using difference_type = ptrdiff_t;
+	using pointer = void;
+	using reference = View;
+
+	constexpr CalListIterator() noexcept : m_node(nullptr) {}
+	constexpr explicit CalListIterator(Node *node) noexcept : m_node(node) {}
+
+	View operator*() const noexcept { return View(m_node); }
+	CalListIterator &operator++() noexcept { m_node = m_node->*Next; return *this; }
+	CalListIterator operator++(int) noexcept { CalListIterator at = *this; m_node = m_node->*Next; return at; }
+	bool operator==(const CalListIterator &other) const noexcept { return m_node == other.m_node; }
+	bool operator!=(const CalListIterator &other) const noexcept { return m_node != other.m_node; }
+
+private:
+	Node *m_node;
+};
+
+// The nodes of a list from head, for range-for
+template <typename Iterator>
+class CalListRange
+{
+public:
+	constexpr explicit CalListRange(Iterator first) noexcept : m_first(first) {}
+
+	Iterator begin() const noexcept { return m_first; }
+	Iterator end() const noexcept { return Iterator(); }
+	bool empty() const noexcept { return m_first == Iterator(); }
+
+private:
+	Iterator m_first;
+};
+
+class CalContactView
+{
+public:
+	constexpr explicit CalContactView(Contact *pContact = nullptr) noexcept : m_contact(pContact) {}
+
+	explicit operator bool() const noexcept { return m_contact != nullptr; }
+	Contact *get() const noexcept { return m_contact; }
+
+	std::string_view Name() const noexcept { return m_contact ? CalStringView(m_contact->Name) : std::string_view(); }
+	std::string_view Email() const noexcept { return m_contact ? CalStringView(m_contact->Email) : std::string_view(); }
+
+private:
+	Contact *m_contact;
+};
+
+using CalContactRange = CalListRange<CalListIterator<Contact, CalContactView, &Contact::NextContact>>;
+
+class CalAttachmentView
+{
+public:
+	constexpr explicit CalAttachmentView(const Attachment *pAttachment = nullptr) noexcept : m_attachment(pAttachment) {}
+
+	const Attachment *get() const noexcept { return m_attachment; }
+
+	std::string_view Name() const noexcept { return CalStringView(m_attachment->Name); }
+
+	CalBytes Blob() const noexcept
+	{
+		const ::Blob *b = m_attachment->Blob;
+		return b ? CalBytes((const unsigned char *)b->Data, b->Length) : CalBytes();
+	}
+
+private:
+	const Attachment *m_attachment;
+};
+
+// The attachments of an entry, which lie in one array
+class CalAttachmentRange
+{
+public:
+	class iterator
+	{
+	public:
+		using iterator_category = std::random_access_iterator_tag;
+		using value_type = CalAttachmentView;
+		using difference_type = ptrdiff_t;
+		using pointer = void;
+		using reference = CalAttachmentView;
+
+		constexpr explicit iterator(const Attachment *at = nullptr) noexcept : m_at(at) {}
+
+		CalAttachmentView operator*() const noexcept { return CalAttachmentView(m_at); }
+		CalAttachmentView operator[](difference_type i) const noexcept { return CalAttachmentView(m_at + i); }
+		iterator &operator++() noexcept { ++m_at; return *this; }
+		iterator operator++(int) noexcept { return iterator(m_at++); }
+		iterator &operator--() noexcept { --m_at; return *this; }
+		iterator operator--(int) noexcept { return iterator(m_at--); }
+		iterator &operator+=(difference_type n) noexcept { m_at += n; return *this; }
+		iterator &operator-=(difference_type n) noexcept { m_at -= n; return *this; }
+		iterator operator+(difference_type n) const noexcept { return iterator(m_at + n); }
+		iterator operator-(difference_type n) const noexcept { return iterator(m_at - n); }
+		difference_type operator-(const iterator &other) const noexcept { return m_at - other.m_at; }
+		bool operator==(const iterator &other) const noexcept { return m_at == other.m_at; }
+		bool operator!=(const iterator &other) const noexcept { return m_at != other.m_at; }
+		bool operator<(const iterator &other) const noexcept { return m_at < other.m_at; }
+		bool operator>(const iterator &other) const noexcept { return m_at > other.m_at; }
+		bool operator<=(const iterator &other) const noexcept { return m_at <= other.m_at; }
+		bool operator>=(const iterator &other) const noexcept { return m_at >= other.m_at; }
+
+	private:
+		const Attachment *m_at;
+	};
+
+	constexpr explicit CalAttachmentRange(const Attachments *pAttachments = nullptr) noexcept
+		: m_first(pAttachments && pAttachments->Count > 0 ? pAttachments->Attachment : nullptr),
+		m_count(pAttachments && pAttachments->Count > 0 ? (size_t)pAttachments->Count : 0) {}
+
+	iterator begin() const noexcept { return iterator(m_first); }
+	iterator end() const noexcept { return iterator(m_first + m_count); }
+	size_t size() const noexcept { return m_count; }
+	bool empty() const noexcept { return !m_count; }
+	CalAttachmentView operator[](size_t i) const noexcept { return CalAttachmentView(m_first + i); }
+
+private:
+	const Attachment *m_first;
+	size_t m_count;
+};
+
+class CalEntryView
+{
+public:
+	constexpr explicit CalEntryView(CalendarEntry *pEntry = nullptr) noexcept : m_entry(pEntry) {}
+
+	explicit operator bool() const noexcept { return m_entry != nullptr; }
+	CalendarEntry *get() const noexcept { return m_entry; }
+
+	enum EntryType Type() const noexcept { return m_entry->EntryType; }
+	CalContactView Sender() const noexcept { return CalContactView(m_entry->Sender); }
+	CalContactRange Recipients() const noexcept { return CalContactRange(CalListIterator<Contact, CalContactView, &Contact::NextContact>(m_entry->Recipient)); }
+	std::string_view Location() const noexcept { return CalStringView(m_entry->Location); }
+	std::string_view TimeZone() const noexcept { return CalStringView(m_entry->TimeZone); }
+	std::string_view Subject() const noexcept { return CalStringView(m_entry->Subject); }
+	std::string_view Content() const noexcept { return CalStringView(m_entry->Content); }
+	std::string_view ContentType() const noexcept { return CalStringView(m_entry->ContentType); }
+	CalAttachmentRange Attachments() const noexcept { return CalAttachmentRange(m_entry->Attachments); }
+
+	// The bytes of Content, for a ContentType that is not text
+	CalBytes ContentBytes() const noexcept
+	{
+		std::string_view content = Content();
+		return CalBytes((const unsigned char *)content.data(), content.size());
+	}
+
+	// NULL where the entry does not have the field
+	const CalDate *StartDate() const noexcept { return m_entry->StartDate; }
+	const CalTime *StartTime() const noexcept { return m_entry->StartTime; }
+	const CalTime *Duration() const noexcept { return m_entry->Duration; }
+
+	// Seconds since 1970 UTC, as GetStartTimestamp and GetEndTimestamp
+	bool UtcStart(int64_t &t) const noexcept
+	{
+		if (!(m_entry->TimeFlags & CALTIME_HAS_START)) return false;
+		t = m_entry->UtcStart;
+		return true;
+	}
+
+	bool UtcEnd(int64_t &t) const noexcept
+	{
+		if (!(m_entry->TimeFlags & CALTIME_HAS_END)) return false;
+		t = m_entry->UtcEnd;
+		return true;
+	}
+
+	bool IsTimeZoneResolved() const noexcept { return (m_entry->TimeFlags & CALTIME_ZONE_KNOWN) != 0; }
+	const uint64_t *Fingerprint() const noexcept { return m_entry->Fingerprint; }
+
+private:
+	CalendarEntry *m_entry;
+};
+
+using CalEntryIterator = CalListIterator<CalendarEntry, CalEntryView, &CalendarEntry::NextEntry>;
+using CalEntryRange = CalListRange<CalEntryIterator>;
+
+// A calendar owned elsewhere: by a CalendarPtr, a parser, a parse cache
+// or a journal
+class CalendarView
+{
+public:
+	constexpr explicit CalendarView(Calendar *pCalendar = nullptr) noexcept : m_calendar(pCalendar) {}
+
+	explicit operator bool() const noexcept { return m_calendar != nullptr; }
+	Calendar *get() const noexcept { return m_calendar; }
+
+	CalEntryRange Entries() const noexcept { return CalEntryRange(CalEntryIterator(m_calendar->Entry)); }
+
+	unsigned int EntryCount() const noexcept
+	{
+		if (m_calendar->EntryTable)
+		{
+			return m_calendar->EntryTableCount;
+		}
+
+		unsigned int count = 0;
+		for (CalendarEntry *e = m_calendar->Entry; e; e = e->NextEntry)
+		{
+			count++;
+		}
+		return count;
+	}
+
+	// Entry i in file order; an empty view past the last entry
+	CalEntryView EntryAt(unsigned int i) const noexcept
+	{
+		if (m_calendar->EntryTable)
+		{
+			return CalEntryView(i < m_calendar->EntryTableCount ? m_calendar->EntryTable[i] : nullptr);
+		}
+
+		CalendarEntry *e = m_calendar->Entry;
+		while (e && i--)
+		{
+			e = e->NextEntry;
+		}
+		return CalEntryView(e);
+	}
+
+private:
+	Calendar *m_calendar;
+};
+
+// Owns a calendar and passes it to DestroyCalendar when it goes out of
+// scope, which destroys a heap calendar and unmaps a snapshot but leaves
+// one that belongs to a parser, a parse cache or a journal, or lives in
+// caller memory, to its owner.  Move-only
+class CalendarPtr
+{
+public:
+	constexpr CalendarPtr() noexcept : m_calendar(nullptr) {}
+	constexpr explicit CalendarPtr(Calendar *pCalendar) noexcept : m_calendar(pCalendar) {}
+	CalendarPtr(CalendarPtr &&other) noexcept : m_calendar(other.release()) {}
+	CalendarPtr(const CalendarPtr &) = delete;
+	~CalendarPtr() { DestroyCalendar(m_calendar); }
+
+	CalendarPtr &operator=(CalendarPtr &&other) noexcept
+	{
+		reset(other.release());
+		return *this;
+	}
+	CalendarPtr &operator=(const CalendarPtr &) = delete;
+
+	explicit operator bool() const noexcept { return m_calendar != nullptr; }
+	Calendar *get() const noexcept { return m_calendar; }
+	CalendarView View() const noexcept { return CalendarView(m_calendar); }
+
+	Calendar *release() noexcept
+	{
+		Calendar *pCalendar = m_calendar;
+		m_calendar = nullptr;
+		return pCalendar;
+	}
+
+	void reset(Calendar *pCalendar = nullptr) noexcept
+	{
+		Calendar *previous = m_calendar;
+		m_calendar = pCalendar;
+		if (previous != pCalendar)
+		{
+			DestroyCalendar(previous);
+		}
+	}
+
+	CalEntryRange Entries() const noexcept { return View().Entries(); }
+	unsigned int EntryCount() const noexcept { return View().EntryCount(); }
+	CalEntryView EntryAt(unsigned int i) const noexcept { return View().EntryAt(i); }
+
+private:
+	Calendar *m_calendar;
+};
+
+/// <summary>
+/// Parses a CAL file buffer, as ParseCalendarFileBufferEx; empty if it
+/// does not parse
+/// </summary>
+inline CalendarPtr ParseCalendar(const unsigned char *in, size_t len, const CalParseOptions *pOptions = nullptr)
+{
+	return CalendarPtr(ParseCalendarFileBufferEx(const_cast<unsigned char *>(in), len, pOptions));
+}
+
+/// <summary>
+/// Maps a snapshot file, as MapCalendarSnapshot; it is unmapped when the
+/// CalendarPtr lets it go
+/// </summary>
+inline CalendarPtr MapCalendar(const char *path)
+{
+	return CalendarPtr(MapCalendarSnapshot(path));
+}
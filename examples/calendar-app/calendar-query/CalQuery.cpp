@@ -0,0 +1,172 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalQuery.cpp : Entry point for calquery, which runs a filter query
+* over one or more calendar files and prints the matching entries
+*
+*********************************************************************/
+
+#include "stdafx.h"
+#include <stdlib.h>
+#include <Windows.h>
+#include <stdio.h>
+#include <time.h>
+#include "../calendar-reader/CalendarLib.h"
+
+/// <summary>
+/// Reads and parses a calendar file, or returns NULL
+/// </summary>
+HANDLE LoadCalendar(const char *filePath)
+{
+	HANDLE calhandle = NULL;
+	unsigned char *p = NULL;
+	size_t size;
+
+	FILE *pFile = fopen(filePath, "rb");
+	if (!pFile)
+	{
+		printf("-> ERROR: cannot open %s\n", filePath);
+		return NULL;
+	}
+
+	fseek(pFile, 0L, SEEK_END);
+	size = ftell(pFile);
+	fseek(pFile, 0L, SEEK_SET);
+
+	p = (unsigned char *)malloc(size ? size : 1);
+	if (p && fread(p, 1, size, pFile) == size)
+	{
+		calhandle = ParseCalendarFileBuffer(p, size);
+		if (!calhandle)
+		{
+			printf("-> ERROR: failure parsing %s\n", filePath);
+		}
+	}
+
+	free(p);
+	fclose(pFile);
+	return calhandle;
+}
+
+/// <summary>
+/// Prints one matching entry as file, index, UTC start, sender and subject
+/// </summary>
+void PrintMatch(const char *filePath, HANDLE cal, unsigned int index)
+{
+	HANDLE e = GetCalendarEntryAt(cal, index);
+	char when[32] = "-";
+	int64_t start;
+	struct tm t;
+
+	if (GetStartTimestamp(e, &start) == S_OK && _gmtime64_s(&t, &start) == 0)
+	{
+		strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%SZ", &t);
+	}
+
+	HANDLE sender = GetSender(e);
+	const char *email = sender ? GetContactEmail(sender) : NULL;
+	const char *subject = GetSubject(e);
+
+	printf("%s:%u  %s  %s  %s\n", filePath, index, when, email ? email : "-", subject ? subject : "-");
+}
+
+/// <summary>
+/// Entry point.  Call calquery.exe with a query and one or more calendar
+/// files; add an optional -nobugs switch after to turn off all the bugs
+/// </summary>
+int main(int argc, char* argv[])
+{
+	HANDLE query = NULL;
+	HANDLE *cals = NULL;
+	const char **paths = NULL;
+	CalQueryMatch *matches = NULL;
+	unsigned int count = 0;
+	int fileCount = argc - 2;
+	int found;
+	HRESULT hr = -1;
+
+	printf("------------------------------------------------------\n");
+	printf("Microsoft Security Risk Detection Demo: calquery\n");
+
+	if (argc >= 3 && 0 == strcmp(argv[argc - 1], "-nobugs"))
+	{
+		for (int bug = BUG_1; bug <= BUG_10; bug++)
+		{
+			DisableBug(bug);
+		}
+		fileCount--;
+	}
+
+	if (fileCount < 1)
+	{
+		goto PRINT_USAGE_EXIT;
+	}
+
+	DisableBug(TRYEXCEPT);
+
+	query = CompileCalendarQuery(argv[1]);
+	if (!query)
+	{
+		goto PRINT_USAGE_EXIT;
+	}
+
+	cals = (HANDLE *)calloc(fileCount, sizeof(HANDLE));
+	paths = (const char **)calloc(fileCount, sizeof(const char *));
+	if (!cals || !paths)
+	{
+		goto ERROR_EXIT;
+	}
+
+	for (int i = 0; i < fileCount; i++)
+	{
+		HANDLE cal = LoadCalendar(argv[2 + i]);
+		if (cal)
+		{
+			cals[count] = cal;
+			paths[count] = argv[2 + i];
+			count++;
+		}
+	}
+
+	// The first pass only counts, so the match buffer can be sized exactly
+	found = RunCalendarQueryOnMany(query, cals, count, NULL, 0);
+	if (found < 0)
+	{
+		goto ERROR_EXIT;
+	}
+
+	matches = (CalQueryMatch *)calloc(found ? found : 1, sizeof(CalQueryMatch));
+	if (!matches)
+	{
+		goto ERROR_EXIT;
+	}
+
+	found = RunCalendarQueryOnMany(query, cals, count, matches, found);
+	for (int i = 0; i < found; i++)
+	{
+		PrintMatch(paths[matches[i].Calendar], cals[matches[i].Calendar], matches[i].Entry);
+	}
+
+	printf("-> %d matching entries in %u calendars\n", found, count);
+	hr = count == (unsigned int)fileCount ? S_OK : S_FALSE;
+
+ERROR_EXIT:
+	for (unsigned int i = 0; i < count; i++)
+	{
+		DestroyCalendar(cals[i]);
+	}
+	free(matches);
+	free(paths);
+	free(cals);
+	DestroyCalendarQuery(query);
+	return hr;
+
+PRINT_USAGE_EXIT:
+	printf("Usage: calquery.exe:\n");
+	printf("    \"query\", e.g. \"type = meeting and subject contains budget and start >= 2017-07-01\"\n");
+	printf("    [one or more calendar files]\n");
+	printf("    -nobugs (optional)\n");
+	return hr;
+}
@@ -10,6 +10,7 @@
 #include <iostream>
 #include <fstream>
 #include <windows.h>
+#include <stdint.h>
 
 using namespace std;
 
@@ -33,14 +34,278 @@ using namespace std;
 
 #define DllImport   __declspec( dllimport )
 
+enum ElementType
+{
+	VERSION,        // 0x00
+	ENTRYCOUNT,     // 0x01
+	NEWENTRY,       // 0x02
+	ENTRYTYPE,      // 0x03
+	SENDER,         // 0x04
+	RECIPIENT,      // 0x05
+	LOCATION,       // 0x06
+	STARTTIME,      // 0x07
+	TIMEZONE,       // 0x08
+	DURATION,       // 0x09
+	STARTDATE,      // 0x0A
+	SUBJECT,        // 0x0B
+	CONTENT,        // 0x0C
+	ATTACHMENT,     // 0x0D
+	END,            // 0x0E
+	CONTENTTYPE,    // 0x0F
+	TEMP,           // 0x10
+	STRUCTBLOB      // 0x11
+};
+
+enum EntryType
+{
+	NONE,
+	MEETING,
+	APPOINTMENT
+};
+
+// Per-parse resource budgets; a zero field means no limit
+typedef struct _CalParseLimits
+{
+	size_t MaxAllocationBytes;
+	unsigned int MaxEntries;
+	unsigned int MaxRecipients;
+	unsigned int MaxAttachments;
+	unsigned int MaxElements;
+	unsigned int MaxMilliseconds;
+} CalParseLimits;
+
+#define CALPARSE_INTERN_STRINGS		0x00000001
+#define CALPARSE_INDEX_CONTACTS		0x00000002
+#define CALPARSE_INDEX_INTERVALS	0x00000004
+#define CALPARSE_SORT_BY_START		0x00000008
+#define CALPARSE_PROJECT_FIELDS		0x00000010
+#define CALPARSE_FILTER_TYPE		0x00000020
+#define CALPARSE_FILTER_WINDOW		0x00000040
+#define CALPARSE_INDEX_TEXT			0x00000080
+#define CALPARSE_BUILD_BLOOM		0x00000100
+#define CALPARSE_TRACK_ENTRIES		0x00000200
+#define CALPARSE_SKIP_TIME_ZONES	0x00000400
+
+#define CALFIELD(type)				(1U << (type))
+
+typedef struct _CalParseOptions
+{
+	CalParseLimits Limits;
+	unsigned int Flags;
+	unsigned int FieldMask;
+	enum EntryType EntryType;
+	int64_t WindowStart;
+	int64_t WindowEnd;
+	unsigned int BloomFields;
+	unsigned int BloomBitsPerKey;
+	unsigned int MaxZoneLoads;
+} CalParseOptions;
+
+#define CALFREEBUSY_ANY		0
+#define CALFREEBUSY_ALL		1
+
+#define CALTEXT_ALL			0
+#define CALTEXT_ANY			1
+#define CALTEXT_PHRASE		2
+
+#define CALBLOOM_DEFAULT_BITS	10
+
+typedef struct _CalParseCacheOptions
+{
+	size_t MaxMemoryBytes;
+	unsigned int MaxMemoryCalendars;
+	const char *Directory;
+	uint64_t MaxDiskBytes;
+	CalParseOptions ParseOptions;
+} CalParseCacheOptions;
+
+typedef struct _CalParseCacheStats
+{
+	uint64_t MemoryHits;
+	uint64_t DiskHits;
+	uint64_t Misses;
+	uint64_t MemoryEvictions;
+	uint64_t DiskEvictions;
+	uint64_t MemoryBytes;
+	uint64_t DiskBytes;
+	unsigned int MemoryCalendars;
+	unsigned int DiskCalendars;
+} CalParseCacheStats;
+
+#define CALJOURNAL_DEFAULT_COMPACT_BYTES	(16 * 1024 * 1024)
+
+typedef struct _CalJournalOptions
+{
+	uint64_t CompactBytes;
+	CalParseOptions ParseOptions;
+} CalJournalOptions;
+
+typedef struct _CalDate
+{
+	int Year;
+	int Month;
+	int Day;
+} CalDate;
+
+typedef struct _CalTime
+{
+	int Hour;
+	int Minute;
+	int Second;
+} CalTime;
+
+#define CALCOLUMN_NO_TIME	INT64_MIN
+
+typedef struct _CalStringRef
+{
+	const char *Value;
+	unsigned int Length;
+} CalStringRef;
+
+typedef struct _CalEntryColumns
+{
+	HANDLE *Entries;
+	int *Types;
+	unsigned int *Fields;
+	CalDate *StartDates;
+	CalTime *StartTimes;
+	CalTime *Durations;
+	int64_t *UtcStarts;
+	int64_t *UtcEnds;
+	CalStringRef *SenderNames;
+	CalStringRef *SenderEmails;
+	CalStringRef *Locations;
+	CalStringRef *TimeZones;
+	CalStringRef *Subjects;
+	CalStringRef *Contents;
+	CalStringRef *ContentTypes;
+	unsigned int *RecipientCounts;
+	unsigned int *AttachmentCounts;
+} CalEntryColumns;
+
+typedef struct _CalConflict
+{
+	unsigned int First;
+	unsigned int Second;
+} CalConflict;
+
+typedef struct _CalQueryMatch
+{
+	unsigned int Calendar;
+	unsigned int Entry;
+} CalQueryMatch;
+
+#define CALDIFF_KEY_FINGERPRINT		0
+#define CALDIFF_KEY_SENDER_START	1
+
+enum CalDiffKind
+{
+	CALDIFF_ADDED,
+	CALDIFF_REMOVED,
+	CALDIFF_CHANGED
+};
+
+typedef struct _CalDiffChange
+{
+	enum CalDiffKind Kind;
+	HANDLE OldEntry;
+	HANDLE NewEntry;
+	unsigned int OldIndex;
+	unsigned int NewIndex;
+} CalDiffChange;
+
+typedef void (*CalDiffVisitor)(const CalDiffChange *change, void *context);
+
 extern "C"
 {
 	DllImport unsigned int BugBitmask;
 
 	HANDLE *ParseCalendarFileBuffer(unsigned char *in, size_t len);
+	HANDLE ParseCalendarFileBufferEx(unsigned char *in, size_t len, const CalParseOptions *options);
+	void DestroyCalendar(HANDLE calendar);
+	HRESULT ReparseCalendarFileBuffer(HANDLE calendar, unsigned char *in, size_t len, size_t editOffset, size_t removedLength, size_t insertedLength, const CalParseOptions *options);
 	HRESULT MergeCalendars(void *dest, void *source);
+	HRESULT MergeCalendarsDedup(void *dest, void *source);
+	HRESULT MergeCalendarsSorted(void *dest, void **sources, unsigned int count);
+	int DiffCalendars(HANDLE oldCalendar, HANDLE newCalendar, unsigned int key, CalDiffVisitor visitor, void *context);
+	int DiffCalendarFileBuffers(unsigned char *oldIn, size_t oldLen, unsigned char *newIn, size_t newLen, unsigned int key, CalDiffVisitor visitor, void *context);
+
+	HANDLE CreateCalendarParser();
+	HANDLE ParseCalendarFileBufferWithParser(HANDLE parser, unsigned char *in, size_t len);
+	HRESULT SetCalendarParserOptions(HANDLE parser, const CalParseOptions *options);
+	void ResetCalendarParser(HANDLE parser);
+	void DestroyCalendarParser(HANDLE parser);
+
+	HRESULT CalendarRequiredSize(unsigned char *in, size_t len, size_t *bytes);
+	HANDLE ParseCalendarInto(unsigned char *in, size_t len, void *mem, size_t bytes);
+
+	HRESULT BuildCalendarContactIndex(HANDLE cal);
+	int FindEntriesByContact(HANDLE cal, const char *email, unsigned int *out, unsigned int n);
+
+	HRESULT BuildCalendarIntervalIndex(HANDLE cal);
+	int FindEntriesInRange(HANDLE cal, int64_t start, int64_t end, unsigned int *out, unsigned int n);
+	int FindConflictingEntries(HANDLE cal, CalConflict *out, unsigned int n);
+	int FindContactConflicts(HANDLE cal, const char *email, CalConflict *out, unsigned int n);
+
+	HRESULT SetCalendarTimeZoneDirectory(const char *path);
+	HRESULT ResolveCalendarTimeZones(HANDLE cal);
+
+	HRESULT BuildCalendarStartOrder(HANDLE cal);
+	int GetStartOrderedEntryCount(HANDLE cal);
+	HANDLE GetStartOrderedEntryAt(HANDLE cal, unsigned int i);
+	int FindFirstEntryAtOrAfter(HANDLE cal, int64_t t);
+
+	HANDLE CreateCalendarFreeBusy(HANDLE *cals, unsigned int count, int64_t start, int64_t end, unsigned int slotSeconds);
+	void DestroyCalendarFreeBusy(HANDLE map);
+	HRESULT CombineCalendarFreeBusy(HANDLE dest, HANDLE *maps, unsigned int count, int op);
+	int GetFreeBusySlotCount(HANDLE map);
+	bool IsFreeBusySlotBusy(HANDLE map, unsigned int slot);
+	HRESULT FindFirstFreeSlot(HANDLE map, unsigned int durationSeconds, int64_t *start);
+	HRESULT FindFirstCommonFreeSlot(HANDLE *cals, unsigned int count, int64_t start, int64_t end, unsigned int slotSeconds, unsigned int durationSeconds, int64_t *found);
+
+	HANDLE CompileCalendarQuery(const char *text);
+	void DestroyCalendarQuery(HANDLE query);
+	int RunCalendarQuery(HANDLE query, HANDLE cal, unsigned int *out, unsigned int n);
+	int RunCalendarQueryOnMany(HANDLE query, HANDLE *cals, unsigned int count, CalQueryMatch *out, unsigned int n);
+
+	HRESULT BuildCalendarTextIndex(HANDLE cal);
+	int SearchCalendarText(HANDLE cal, const char *text, int mode, unsigned int *out, unsigned int n);
+	HANDLE CreateCalendarTextCorpus(HANDLE *cals, unsigned int count);
+	HRESULT SaveCalendarTextCorpus(HANDLE corpus, const char *path);
+	HANDLE LoadCalendarTextCorpus(const char *path);
+	void DestroyCalendarTextCorpus(HANDLE corpus);
+	int SearchCalendarTextCorpus(HANDLE corpus, const char *text, int mode, CalQueryMatch *out, unsigned int n);
+
+	int FindEntriesContaining(HANDLE cal, const char **needles, unsigned int count, unsigned int fields, unsigned int *out, unsigned int n);
+	int FindEntriesContainingInBuffer(unsigned char *in, size_t len, const char **needles, unsigned int count, unsigned int fields, unsigned int *out, unsigned int n);
+
+	HRESULT BuildCalendarBloom(HANDLE cal, unsigned int fields, unsigned int bitsPerKey);
+	HANDLE GetCalendarBloom(HANDLE cal);
+	HRESULT SaveCalendarBloom(HANDLE bloom, const char *path);
+	HANDLE LoadCalendarBloom(const char *path);
+	void DestroyCalendarBloom(HANDLE bloom);
+	int ProbeCalendarBlooms(HANDLE *filters, unsigned int count, int type, const char *key, unsigned int *out, unsigned int n);
+
+	HRESULT SaveCalendarSnapshot(HANDLE cal, const char *path);
+	HANDLE MapCalendarSnapshot(const char *path);
+	void UnmapCalendarSnapshot(HANDLE cal);
+
+	HANDLE CreateCalendarParseCache(const CalParseCacheOptions *options);
+	HANDLE ParseCalendarFileBufferCached(HANDLE cache, unsigned char *in, size_t len);
+	HRESULT ReleaseCachedCalendar(HANDLE cache, HANDLE cal);
+	HRESULT GetCalendarParseCacheStats(HANDLE cache, CalParseCacheStats *stats);
+	void DestroyCalendarParseCache(HANDLE cache);
+
+	HANDLE OpenCalendarJournal(const char *basePath, const CalJournalOptions *options);
+	HANDLE GetCalendarJournalCalendar(HANDLE journal);
+	HRESULT AppendCalendarJournal(HANDLE journal, unsigned char *in, size_t len);
+	HRESULT CompactCalendarJournal(HANDLE journal, bool wait);
+	void CloseCalendarJournal(HANDLE journal);
 
 	int GetCalendarEntryCount(HANDLE cal);
+	HANDLE GetCalendarEntryAt(HANDLE cal, unsigned int i);
+	int GetCalendarEntryColumns(HANDLE cal, unsigned int first, unsigned int count, const CalEntryColumns *columns);
+	int GetCalendarEntryColumnsAt(HANDLE cal, const unsigned int *indexes, unsigned int count, const CalEntryColumns *columns);
 	HANDLE GetFirstCalendarEntry(HANDLE cal);
 	HANDLE GetNextCalendarEntry(HANDLE entry);
 	enum EntryType GetCalendarEntryType(HANDLE entry);
@@ -55,6 +320,10 @@ extern "C"
 	char *GetLocation(HANDLE entry);
 	
 	char *GetTimeZone(HANDLE entry);
+	HRESULT GetStartTimestamp(HANDLE entry, int64_t *t);
+	HRESULT GetEndTimestamp(HANDLE entry, int64_t *t);
+	HRESULT GetEntryFingerprint(HANDLE entry, uint64_t *fingerprint);
+	bool IsTimeZoneResolved(HANDLE entry);
 	
 	HRESULT GetStartTime(HANDLE entry, int *hours, int *minutes, int *seconds);
 	
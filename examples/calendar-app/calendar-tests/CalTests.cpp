@@ -0,0 +1,940 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalTests.cpp : Entry point for caltests, which checks the calendar
+* library's edge cases against calendars it generates
+*
+*********************************************************************/
+
+#include "stdafx.h"
+#include <stdlib.h>
+#include <string.h>
+#include <Windows.h>
+#include <stdio.h>
+#include "../calendar-reader/CalendarLib.h"
+
+#define TEST_ENTRIES		6		// Entries in each generated calendar
+#define TEST_INT_ELEMENT	9		// Type, length and value
+#define TEST_END_ELEMENT	5		// Type and length
+
+typedef struct _TestBuffer
+{
+	unsigned char *Data;
+	size_t Length;
+	size_t Capacity;
+	bool Failed;
+} TestBuffer;
+
+int Checks = 0;
+int Failures = 0;
+
+void TestViews(const unsigned char *in, size_t len);
+
+/// <summary>
+/// Counts a check, printing what failed if it did not hold
+/// </summary>
+void Check(bool ok, const char *test, const char *what)
+{
+	Checks++;
+	if (!ok)
+	{
+		printf("-> FAIL: %s: %s\n", test, what);
+		Failures++;
+	}
+}
+
+/// <summary>
+/// Appends len bytes to the buffer, growing it as needed
+/// </summary>
+void PutBytes(TestBuffer *b, const void *p, size_t len)
+{
+	if (b->Failed)
+	{
+		return;
+	}
+
+	if (b->Length + len > b->Capacity)
+	{
+		size_t capacity = b->Capacity ? b->Capacity : 1024;
+		while (capacity < b->Length + len)
+		{
+			capacity *= 2;
+		}
+
+		unsigned char *grown = (unsigned char *)realloc(b->Data, capacity);
+		if (!grown)
+		{
+			b->Failed = true;
+			return;
+		}
+		b->Data = grown;
+		b->Capacity = capacity;
+	}
+
+	memcpy(b->Data + b->Length, p, len);
+	b->Length += len;
+}
+
+void PutType(TestBuffer *b, unsigned char type)
+{
+	PutBytes(b, &type, 1);
+}
+
+void PutUInt(TestBuffer *b, uint32_t value)
+{
+	PutBytes(b, &value, sizeof(value));
+}
+
+void PutIntElement(TestBuffer *b, unsigned char type, int value)
+{
+	PutType(b, type);
+	PutUInt(b, 4);
+	PutUInt(b, (uint32_t)value);
+}
+
+void PutTripleElement(TestBuffer *b, unsigned char type, int x, int y, int z)
+{
+	PutType(b, type);
+	PutUInt(b, 12);
+	PutUInt(b, (uint32_t)x);
+	PutUInt(b, (uint32_t)y);
+	PutUInt(b, (uint32_t)z);
+}
+
+void PutShortString(TestBuffer *b, const char *s)
+{
+	uint16_t len = (uint16_t)strlen(s);
+	PutBytes(b, &len, sizeof(len));
+	PutBytes(b, s, len);
+}
+
+void PutLongElement(TestBuffer *b, unsigned char type, const char *s)
+{
+	PutType(b, type);
+	PutUInt(b, (uint32_t)strlen(s));
+	PutBytes(b, s, strlen(s));
+}
+
+void PutContactElement(TestBuffer *b, unsigned char type, int person)
+{
+	char name[32], email[48];
+	sprintf_s(name, sizeof(name), "User %d", person);
+	sprintf_s(email, sizeof(email), "user%d@contoso.com", person);
+
+	PutType(b, type);
+	PutUInt(b, (uint32_t)(1 + 2 + strlen(name) + 1 + 2 + strlen(email)));
+	PutType(b, 0);	// CONTACTNAME
+	PutShortString(b, name);
+	PutType(b, 1);	// CONTACTEMAIL
+	PutShortString(b, email);
+}
+
+/// <summary>
+/// Appends entry i with the given subject.  Senders repeat every three
+/// entries, so interned strings are shared between entries
+/// </summary>
+void PutEntry(TestBuffer *b, int i, const char *subject)
+{
+	PutType(b, NEWENTRY);
+	PutUInt(b, 0);
+	PutIntElement(b, ENTRYTYPE, MEETING);
+	PutContactElement(b, SENDER, i % 3);
+	PutContactElement(b, RECIPIENT, 3 + i % 2);
+	PutTripleElement(b, STARTTIME, 8 + i, 0, 0);
+	PutType(b, TIMEZONE);
+	PutShortString(b, "UTC");
+	PutTripleElement(b, DURATION, 1, 0, 0);
+	PutTripleElement(b, STARTDATE, 2017, 1 + i, 1 + i);
+	PutLongElement(b, SUBJECT, subject);
+}
+
+/// <summary>
+/// Generates a CAL buffer of TEST_ENTRIES entries.  offsets[i] receives
+/// where entry i begins, and offsets[TEST_ENTRIES] where END does
+/// </summary>
+unsigned char *GenerateCalendar(size_t *offsets, size_t *len)
+{
+	TestBuffer b = { 0 };
+	char subject[32];
+
+	PutIntElement(&b, VERSION, 1);
+	PutIntElement(&b, ENTRYCOUNT, TEST_ENTRIES);
+	for (int i = 0; i < TEST_ENTRIES; i++)
+	{
+		offsets[i] = b.Length;
+		sprintf_s(subject, sizeof(subject), "Weekly sync %d", i);
+		PutEntry(&b, i, subject);
+	}
+	offsets[TEST_ENTRIES] = b.Length;
+	PutType(&b, END);
+	PutUInt(&b, 0);
+
+	if (b.Failed)
+	{
+		free(b.Data);
+		return NULL;
+	}
+
+	*len = b.Length;
+	return b.Data;
+}
+
+/// <summary>
+/// Appends an ATTACHMENT element of count attachments, each a name and
+/// a short blob that differs with the entry and the attachment
+/// </summary>
+void PutAttachmentElement(TestBuffer *b, int i, int count)
+{
+	char name[32], blob[32];
+
+	PutType(b, ATTACHMENT);
+	PutUInt(b, (uint32_t)count);
+	for (int k = 0; k < count; k++)
+	{
+		sprintf_s(name, sizeof(name), "notes-%d-%d.txt", i, k);
+		sprintf_s(blob, sizeof(blob), "Agenda %d, part %d", i, k);
+		PutShortString(b, name);
+		PutUInt(b, (uint32_t)strlen(blob));
+		PutBytes(b, blob, strlen(blob));
+	}
+}
+
+/// <summary>
+/// Generates a CAL buffer of TEST_ENTRIES entries for the views, with
+/// one to three recipients and up to two attachments an entry
+/// </summary>
+unsigned char *GenerateViewCalendar(size_t *len)
+{
+	TestBuffer b = { 0 };
+	char subject[32];
+
+	PutIntElement(&b, VERSION, 1);
+	PutIntElement(&b, ENTRYCOUNT, TEST_ENTRIES);
+	for (int i = 0; i < TEST_ENTRIES; i++)
+	{
+		sprintf_s(subject, sizeof(subject), "Design review %d", i);
+		PutEntry(&b, i, subject);
+		for (int k = 0; k < i % 3; k++)
+		{
+			PutContactElement(&b, RECIPIENT, 5 + k);
+		}
+		if (i % 3)
+		{
+			PutAttachmentElement(&b, i, i % 3);
+		}
+	}
+	PutType(&b, END);
+	PutUInt(&b, 0);
+
+	if (b.Failed)
+	{
+		free(b.Data);
+		return NULL;
+	}
+
+	*len = b.Length;
+	return b.Data;
+}
+
+/// <summary>
+/// Returns in with removed bytes at offset replaced by the bytes of
+/// insert, in a buffer from malloc
+/// </summary>
+unsigned char *EditBuffer(const unsigned char *in, size_t len, size_t offset, size_t removed, const TestBuffer *insert, size_t *edited)
+{
+	*edited = len - removed + insert->Length;
+	unsigned char *out = (unsigned char *)malloc(*edited ? *edited : 1);
+	if (out)
+	{
+		memcpy(out, in, offset);
+		if (insert->Length)
+		{
+			memcpy(out + offset, insert->Data, insert->Length);
+		}
+		memcpy(out + offset + insert->Length, in + offset + removed, len - offset - removed);
+	}
+	return out;
+}
+
+/// <summary>
+/// Returns whether two calendars hold the same entries, by fingerprint
+/// and subject
+/// </summary>
+bool SameEntries(HANDLE a, HANDLE b)
+{
+	int count = GetCalendarEntryCount(a);
+	if (count < 0 || count != GetCalendarEntryCount(b))
+	{
+		return false;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		HANDLE x = GetCalendarEntryAt(a, i), y = GetCalendarEntryAt(b, i);
+		uint64_t fx[2], fy[2];
+		if (!x || !y || GetEntryFingerprint(x, fx) != S_OK || GetEntryFingerprint(y, fy) != S_OK ||
+			fx[0] != fy[0] || fx[1] != fy[1])
+		{
+			return false;
+		}
+
+		char *sx = GetSubject(x), *sy = GetSubject(y);
+		if ((sx == NULL) != (sy == NULL) || (sx && strcmp(sx, sy)))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/// <summary>
+/// Replaces removed bytes at offset of a buffer with insert, then checks
+/// that ReparseCalendarFileBuffer returns expected and agrees with a full
+/// parse of the result: the same entries if it parses, and the calendar
+/// left as it was if not.  A successful edit is then undone, as a second
+/// re-parse of the same calendar
+/// </summary>
+void CheckReparse(const char *test, const unsigned char *in, size_t len, size_t offset, size_t removed, const TestBuffer *insert, unsigned int flags, HRESULT expected)
+{
+	CalParseOptions options = { 0 };
+	HANDLE cal = NULL, full = NULL, before = NULL;
+	unsigned char *original = NULL, *edited = NULL;
+	size_t editedLen;
+	HRESULT hr;
+
+	options.Flags = flags | CALPARSE_TRACK_ENTRIES;
+
+	// The parser keeps pointers into its buffer, so each calendar gets one
+	original = (unsigned char *)malloc(len);
+	edited = EditBuffer(in, len, offset, removed, insert, &editedLen);
+	if (!original || !edited)
+	{
+		Check(false, test, "out of memory");
+		goto EXIT;
+	}
+	memcpy(original, in, len);
+
+	cal = ParseCalendarFileBufferEx(original, len, &options);
+	before = ParseCalendarFileBufferEx(original, len, &options);
+	full = ParseCalendarFileBufferEx(edited, editedLen, &options);
+	if (!cal || !before)
+	{
+		Check(false, test, "the base calendar did not parse");
+		goto EXIT;
+	}
+
+	hr = ReparseCalendarFileBuffer(cal, edited, editedLen, offset, removed, insert->Length, &options);
+	Check(hr == expected, test, "unexpected result from the re-parse");
+	Check((hr == S_OK) == (full != NULL), test, "the re-parse and a full parse disagree on whether the edit parses");
+	if (hr != S_OK)
+	{
+		Check(SameEntries(cal, before), test, "a failed re-parse changed the calendar");
+		goto EXIT;
+	}
+	Check(full && SameEntries(cal, full), test, "the re-parse and a full parse give different entries");
+
+	// Undo the edit, re-parsing against the frames the first one left
+	hr = ReparseCalendarFileBuffer(cal, original, len, offset, insert->Length, removed, &options);
+	Check(hr == S_OK, test, "undoing the edit did not re-parse");
+	Check(SameEntries(cal, before), test, "undoing the edit did not restore the entries");
+
+EXIT:
+	DestroyCalendar(cal);
+	DestroyCalendar(full);
+	DestroyCalendar(before);
+	free(original);
+	free(edited);
+}
+
+/// <summary>
+/// Checks re-parses of edits at entry boundaries, in the header and after
+/// END, plain, with a string table and with time zones left unresolved
+/// </summary>
+void TestReparse()
+{
+	size_t offsets[TEST_ENTRIES + 1], len;
+	unsigned char *in = GenerateCalendar(offsets, &len);
+	const unsigned int variants[] = { 0, CALPARSE_INTERN_STRINGS, CALPARSE_SKIP_TIME_ZONES };
+	const size_t end = offsets[TEST_ENTRIES];
+
+	if (!in)
+	{
+		Check(false, "reparse", "out of memory");
+		return;
+	}
+
+	for (unsigned int v = 0; v < sizeof(variants) / sizeof(variants[0]); v++)
+	{
+		unsigned int flags = variants[v];
+		TestBuffer b = { 0 };
+
+		// Entry 2 replaced exactly, from its first byte to the next entry's
+		PutEntry(&b, 2, "Replaced");
+		CheckReparse("boundary: replace an entry", in, len, offsets[2], offsets[3] - offsets[2], &b, flags, S_OK);
+
+		// An element inserted where entry 2 ends and entry 3 begins belongs to entry 2
+		b.Length = 0;
+		PutLongElement(&b, LOCATION, "Room 7");
+		CheckReparse("boundary: insert between entries", in, len, offsets[3], 0, &b, flags, S_OK);
+
+		// An entry inserted at the same place
+		b.Length = 0;
+		PutEntry(&b, 7, "Inserted");
+		CheckReparse("boundary: insert an entry", in, len, offsets[3], 0, &b, flags, S_FALSE);
+
+		// Entries 2 and 3 replaced by one edit that spans their boundary
+		b.Length = 0;
+		PutEntry(&b, 2, "Spans 2");
+		PutEntry(&b, 3, "Spans 3");
+		CheckReparse("boundary: span two entries", in, len, offsets[3] - 4, 8, &b, flags, S_FALSE);
+		CheckReparse("boundary: replace two entries", in, len, offsets[2], offsets[4] - offsets[2], &b, flags, S_OK);
+
+		// The first and last entries, next to the header and END
+		b.Length = 0;
+		PutEntry(&b, 0, "First");
+		CheckReparse("boundary: replace the first entry", in, len, offsets[0], offsets[1] - offsets[0], &b, flags, S_OK);
+		b.Length = 0;
+		PutLongElement(&b, LOCATION, "Room 7");
+		CheckReparse("boundary: insert before END", in, len, end, 0, &b, flags, S_OK);
+		CheckReparse("boundary: insert before the first entry", in, len, offsets[0], 0, &b, flags, S_FALSE);
+
+		// ENTRYCOUNT must still match, and VERSION cannot change
+		b.Length = 0;
+		PutIntElement(&b, ENTRYCOUNT, TEST_ENTRIES + 1);
+		CheckReparse("header: change ENTRYCOUNT", in, len, TEST_INT_ELEMENT, TEST_INT_ELEMENT, &b, flags, S_FALSE);
+		b.Length = 0;
+		PutIntElement(&b, VERSION, 2);
+		CheckReparse("header: change VERSION", in, len, 0, TEST_INT_ELEMENT, &b, flags, S_FALSE);
+
+		// One edit from ENTRYCOUNT into the first entry, adding an entry
+		b.Length = 0;
+		PutIntElement(&b, ENTRYCOUNT, TEST_ENTRIES + 1);
+		PutEntry(&b, 8, "Added");
+		PutEntry(&b, 0, "Weekly sync 0");
+		CheckReparse("header: add an entry with ENTRYCOUNT", in, len, TEST_INT_ELEMENT, TEST_INT_ELEMENT + offsets[1] - offsets[0], &b, flags, S_OK);
+
+		// An entry added after the last one, with ENTRYCOUNT in the same edit
+		b.Length = 0;
+		PutIntElement(&b, ENTRYCOUNT, TEST_ENTRIES + 1);
+		for (int i = 0; i < TEST_ENTRIES; i++)
+		{
+			char subject[32];
+			sprintf_s(subject, sizeof(subject), "Weekly sync %d", i);
+			PutEntry(&b, i, subject);
+		}
+		PutEntry(&b, 9, "Appended");
+		CheckReparse("header: append an entry with ENTRYCOUNT", in, len, TEST_INT_ELEMENT, end - TEST_INT_ELEMENT, &b, flags, S_OK);
+
+		// Bytes after END are ignored, as a parse ignores them, but END cannot go
+		b.Length = 0;
+		PutType(&b, END);
+		PutUInt(&b, 0);
+		CheckReparse("end: a second END", in, len, len, 0, &b, flags, S_OK);
+		b.Length = 0;
+		PutLongElement(&b, LOCATION, "Room 7");
+		CheckReparse("end: an element after END", in, len, len, 0, &b, flags, S_OK);
+		CheckReparse("end: an element inside END", in, len, end + 1, 0, &b, flags, S_OK);
+		b.Length = 0;
+		CheckReparse("end: remove END", in, len, end, TEST_END_ELEMENT, &b, flags, S_FALSE);
+		PutLongElement(&b, LOCATION, "Room 7");
+		CheckReparse("end: replace END", in, len, end, TEST_END_ELEMENT, &b, flags, S_FALSE);
+
+		free(b.Data);
+	}
+
+	free(in);
+}
+
+/// <summary>
+/// Reads a file into a buffer from malloc, or returns NULL
+/// </summary>
+unsigned char *ReadTestFile(const char *path, size_t *len)
+{
+	unsigned char *p = NULL;
+	FILE *pFile = fopen(path, "rb");
+	if (!pFile)
+	{
+		return NULL;
+	}
+
+	if (fseek(pFile, 0, SEEK_END) == 0)
+	{
+		long size = ftell(pFile);
+		p = size >= 0 ? (unsigned char *)malloc(size ? size : 1) : NULL;
+		if (p && (fseek(pFile, 0, SEEK_SET) != 0 || fread(p, 1, size, pFile) != (size_t)size))
+		{
+			free(p);
+			p = NULL;
+		}
+		*len = (size_t)size;
+	}
+
+	fclose(pFile);
+	return p;
+}
+
+bool WriteTestFile(const char *path, const unsigned char *p, size_t len)
+{
+	FILE *pFile = fopen(path, "wb");
+	if (!pFile)
+	{
+		return false;
+	}
+
+	bool ok = fwrite(p, 1, len, pFile) == len;
+	return fclose(pFile) == 0 && ok;
+}
+
+/// <summary>
+/// Returns the length of a file, or -1 if there is none
+/// </summary>
+long TestFileSize(const char *path)
+{
+	size_t len;
+	unsigned char *p = ReadTestFile(path, &len);
+	free(p);
+	return p ? (long)len : -1;
+}
+
+/// <summary>
+/// Writes path with suffix appended into a buffer of MAX_PATH
+/// </summary>
+const char *JournalPath(char *out, const char *path, const char *suffix)
+{
+	sprintf_s(out, MAX_PATH, "%s%s", path, suffix);
+	return out;
+}
+
+void RemoveJournalFiles(const char *path)
+{
+	const char *suffixes[] = { "", ".journal", ".journal.tmp", ".compact" };
+	char file[MAX_PATH];
+
+	for (unsigned int i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++)
+	{
+		remove(JournalPath(file, path, suffixes[i]));
+	}
+}
+
+/// <summary>
+/// Appends entries first to first + count - 1 as one batch; their subjects
+/// say which they are
+/// </summary>
+HRESULT AppendTestEntries(HANDLE journal, int first, int count)
+{
+	TestBuffer b = { 0 };
+	char subject[32];
+
+	for (int i = first; i < first + count; i++)
+	{
+		sprintf_s(subject, sizeof(subject), "Appended %d", i);
+		PutEntry(&b, i % TEST_ENTRIES, subject);
+	}
+
+	HRESULT hr = b.Failed ? S_FALSE : AppendCalendarJournal(journal, b.Data, b.Length);
+	free(b.Data);
+	return hr;
+}
+
+/// <summary>
+/// Returns whether a calendar holds the generated entries followed by
+/// appended ones, in order
+/// </summary>
+bool HasJournalEntries(HANDLE cal, int appended)
+{
+	char subject[32];
+
+	if (!cal || GetCalendarEntryCount(cal) != TEST_ENTRIES + appended)
+	{
+		return false;
+	}
+
+	for (int i = 0; i < TEST_ENTRIES + appended; i++)
+	{
+		char *actual = GetSubject(GetCalendarEntryAt(cal, i));
+		if (i < TEST_ENTRIES)
+		{
+			sprintf_s(subject, sizeof(subject), "Weekly sync %d", i);
+		}
+		else
+		{
+			sprintf_s(subject, sizeof(subject), "Appended %d", i - TEST_ENTRIES);
+		}
+		if (!actual || strcmp(actual, subject))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/// <summary>
+/// Opens the journal of path and checks that it replays to the generated
+/// entries and appended ones.  Returns the journal, or NULL
+/// </summary>
+HANDLE ReopenJournal(const char *test, const char *path, const CalJournalOptions *options, int appended)
+{
+	HANDLE journal = OpenCalendarJournal(path, options);
+	Check(journal != NULL, test, "the journal did not open");
+	if (journal)
+	{
+		Check(HasJournalEntries(GetCalendarJournalCalendar(journal), appended), test, "the journal did not replay to the entries appended");
+	}
+	return journal;
+}
+
+/// <summary>
+/// Counts the entries of a calendar by walking them; a merge leaves the
+/// ENTRYCOUNT it was parsed with
+/// </summary>
+int CountEntries(HANDLE cal)
+{
+	int count = 0;
+	for (HANDLE entry = GetFirstCalendarEntry(cal); entry; entry = GetNextCalendarEntry(entry))
+	{
+		count++;
+	}
+	return count;
+}
+
+/// <summary>
+/// Checks the calendar of a journal against the calls that change or
+/// destroy calendars: they reject it, and merging from it copies
+/// </summary>
+void TestJournalCalendar(const char *test, HANDLE journal, unsigned char *in, size_t len, int appended)
+{
+	HANDLE cal = GetCalendarJournalCalendar(journal);
+	HANDLE other = ParseCalendarFileBuffer(in, len);
+	void *sources[1];
+
+	if (!other)
+	{
+		Check(false, test, "the base calendar did not parse");
+		return;
+	}
+
+	sources[0] = other;
+	Check(MergeCalendars(cal, other) == -1, test, "MergeCalendars merged into the journal's calendar");
+	Check(MergeCalendarsDedup(cal, other) == -1, test, "MergeCalendarsDedup merged into the journal's calendar");
+	Check(MergeCalendarsSorted(cal, sources, 1) == -1, test, "MergeCalendarsSorted merged into the journal's calendar");
+	Check(BuildCalendarContactIndex(cal) != S_OK, test, "an index was built on the journal's calendar");
+	Check(ReparseCalendarFileBuffer(cal, in, len, 0, 0, 0, NULL) == -1, test, "the journal's calendar was re-parsed");
+	DestroyCalendar(cal);
+
+	sources[0] = cal;
+	Check(MergeCalendarsSorted(other, sources, 1) == S_OK, test, "MergeCalendarsSorted did not merge from the journal's calendar");
+	Check(MergeCalendars(other, cal) == S_OK, test, "MergeCalendars did not merge from the journal's calendar");
+	Check(CountEntries(other) == 3 * TEST_ENTRIES + 2 * appended, test, "merging from the journal's calendar lost entries");
+	Check(HasJournalEntries(cal, appended), test, "merging from the journal's calendar changed it");
+	DestroyCalendar(other);
+}
+
+/// <summary>
+/// Returns the fingerprints of the entries of a calendar, two words each,
+/// in a buffer from malloc
+/// </summary>
+uint64_t *ReadFingerprints(HANDLE cal, int *count)
+{
+	*count = GetCalendarEntryCount(cal);
+	uint64_t *fingerprints = (uint64_t *)calloc(*count > 0 ? 2 * *count : 1, sizeof(uint64_t));
+	for (int i = 0; fingerprints && i < *count; i++)
+	{
+		if (GetEntryFingerprint(GetCalendarEntryAt(cal, i), fingerprints + 2 * i) != S_OK)
+		{
+			free(fingerprints);
+			fingerprints = NULL;
+		}
+	}
+	return fingerprints;
+}
+
+/// <summary>
+/// Checks the parse options a journal takes: budgets it could not keep
+/// across batches are refused, MaxEntries counts the base and every batch,
+/// and entries appended with time zones left unresolved come back the same
+/// after reopening.  Removes the journal of path, which is left unchanged
+/// </summary>
+void TestJournalOptions(const char *path)
+{
+	CalJournalOptions options = { 0 };
+	CalParseOptions budgets[4];
+	char journalPath[MAX_PATH];
+	HANDLE journal = NULL;
+	uint64_t *before = NULL, *after = NULL;
+	int beforeCount, afterCount;
+
+	JournalPath(journalPath, path, ".journal");
+	options.CompactBytes = (uint64_t)1 << 40;
+
+	// A batch within these could still push the whole file past them
+	memset(budgets, 0, sizeof(budgets));
+	budgets[0].Limits.MaxElements = 1000;
+	budgets[1].Limits.MaxAllocationBytes = 1 << 30;
+	budgets[2].Limits.MaxMilliseconds = 60000;
+	budgets[3].MaxZoneLoads = 100;
+	for (unsigned int i = 0; i < sizeof(budgets) / sizeof(budgets[0]); i++)
+	{
+		options.ParseOptions = budgets[i];
+		journal = OpenCalendarJournal(path, &options);
+		Check(journal == NULL, "journal: budgets", "a journal opened with a budget it cannot keep");
+		CloseCalendarJournal(journal);
+	}
+
+	// Appends past MaxEntries are refused, so the journal reopens under it
+	memset(&options.ParseOptions, 0, sizeof(options.ParseOptions));
+	options.ParseOptions.Limits.MaxEntries = TEST_ENTRIES + 3;
+	remove(journalPath);
+	journal = ReopenJournal("journal: MaxEntries", path, &options, 0);
+	Check(journal && AppendTestEntries(journal, 0, 2) == S_OK, "journal: MaxEntries", "an append within MaxEntries failed");
+	Check(journal && AppendTestEntries(journal, 2, 2) == S_FALSE, "journal: MaxEntries", "an append past MaxEntries was taken");
+	Check(journal && AppendTestEntries(journal, 2, 1) == S_OK, "journal: MaxEntries", "an append up to MaxEntries failed");
+	CloseCalendarJournal(journal);
+	journal = ReopenJournal("journal: MaxEntries", path, &options, 3);
+	CloseCalendarJournal(journal);
+
+	// Appended entries must be fingerprinted as the reopened parse does
+	memset(&options.ParseOptions, 0, sizeof(options.ParseOptions));
+	options.ParseOptions.Flags = CALPARSE_SKIP_TIME_ZONES;
+	remove(journalPath);
+	journal = ReopenJournal("journal: unresolved time zones", path, &options, 0);
+	if (journal)
+	{
+		Check(AppendTestEntries(journal, 0, 3) == S_OK, "journal: unresolved time zones", "an append failed");
+		HANDLE cal = GetCalendarJournalCalendar(journal);
+		Check(!IsTimeZoneResolved(GetCalendarEntryAt(cal, TEST_ENTRIES)), "journal: unresolved time zones", "an appended entry had its time zone resolved");
+		before = ReadFingerprints(cal, &beforeCount);
+		CloseCalendarJournal(journal);
+	}
+	journal = ReopenJournal("journal: unresolved time zones", path, &options, 3);
+	if (journal)
+	{
+		after = ReadFingerprints(GetCalendarJournalCalendar(journal), &afterCount);
+		CloseCalendarJournal(journal);
+	}
+	Check(before && after && beforeCount == afterCount && !memcmp(before, after, 2 * afterCount * sizeof(uint64_t)),
+		"journal: unresolved time zones", "the entries changed fingerprints on reopening");
+
+	free(before);
+	free(after);
+	remove(journalPath);
+}
+
+/// <summary>
+/// Checks a journal against crashes: a batch cut short or corrupted is
+/// dropped on reopening, files a compaction left before or between its
+/// renames are cleaned up or finished, and appends that run while the
+/// compactor folds the journal all survive
+/// </summary>
+void TestJournal()
+{
+	const char *path = "caltests.cal";
+	const unsigned int indexFlags[] = { CALPARSE_INDEX_CONTACTS, CALPARSE_INDEX_INTERVALS, CALPARSE_SORT_BY_START, CALPARSE_INDEX_TEXT, CALPARSE_BUILD_BLOOM };
+	char journalPath[MAX_PATH], compactPath[MAX_PATH], tempPath[MAX_PATH];
+	CalJournalOptions options = { 0 };
+	HANDLE journal = NULL;
+	unsigned char *in = NULL, *file = NULL, *oldBase = NULL, *newBase = NULL;
+	size_t offsets[TEST_ENTRIES + 1], len, fileLen, oldLen, newLen;
+	long beforeBatch, afterBatch;
+	int appended = 0;
+
+	JournalPath(journalPath, path, ".journal");
+	JournalPath(compactPath, path, ".compact");
+	JournalPath(tempPath, path, ".journal.tmp");
+	RemoveJournalFiles(path);
+
+	in = GenerateCalendar(offsets, &len);
+	if (!in || !WriteTestFile(path, in, len))
+	{
+		Check(false, "journal", "could not write the base CAL file");
+		goto EXIT;
+	}
+
+	TestJournalOptions(path);
+
+	// Indexes would be rebuilt over the whole calendar on every append
+	for (unsigned int i = 0; i < sizeof(indexFlags) / sizeof(indexFlags[0]); i++)
+	{
+		options.ParseOptions.Flags = indexFlags[i];
+		journal = OpenCalendarJournal(path, &options);
+		Check(journal == NULL, "journal: index flags", "a journal opened with an index flag");
+		CloseCalendarJournal(journal);
+	}
+	options.ParseOptions.Flags = 0;
+	options.CompactBytes = (uint64_t)1 << 40;
+
+	journal = ReopenJournal("journal: open", path, &options, 0);
+	if (!journal)
+	{
+		goto EXIT;
+	}
+	Check(AppendTestEntries(journal, 0, 2) == S_OK && AppendTestEntries(journal, 2, 3) == S_OK, "journal: append", "an append failed");
+	appended = 5;
+	Check(HasJournalEntries(GetCalendarJournalCalendar(journal), appended), "journal: append", "the calendar does not hold the entries appended");
+
+	// The journal's calendar must keep the room its appends count on
+	TestJournalCalendar("journal: calendar", journal, in, len, appended);
+	Check(AppendTestEntries(journal, appended, 1) == S_OK, "journal: calendar", "an append after the merges failed");
+	appended++;
+	Check(HasJournalEntries(GetCalendarJournalCalendar(journal), appended), "journal: calendar", "the calendar does not hold the entries appended");
+
+	beforeBatch = TestFileSize(journalPath);
+	Check(AppendTestEntries(journal, appended, 2) == S_OK, "journal: append", "an append failed");
+	afterBatch = TestFileSize(journalPath);
+	CloseCalendarJournal(journal);
+	journal = NULL;
+
+	// A crash while the last batch was written leaves part of it
+	file = ReadTestFile(journalPath, &fileLen);
+	if (!file || (long)fileLen != afterBatch || !WriteTestFile(journalPath, file, fileLen - 7))
+	{
+		Check(false, "journal: torn batch", "could not cut the journal short");
+		goto EXIT;
+	}
+	journal = ReopenJournal("journal: torn batch", path, &options, appended);
+	Check(TestFileSize(journalPath) == beforeBatch, "journal: torn batch", "the torn batch was not cut off the journal");
+	Check(journal && AppendTestEntries(journal, appended, 2) == S_OK, "journal: torn batch", "an append after the torn batch failed");
+	CloseCalendarJournal(journal);
+	journal = ReopenJournal("journal: torn batch", path, &options, appended + 2);
+	CloseCalendarJournal(journal);
+
+	// A batch whose bytes do not match its hash is dropped the same way
+	file[fileLen - 1] ^= 0x20;
+	if (!WriteTestFile(journalPath, file, fileLen))
+	{
+		Check(false, "journal: corrupt batch", "could not write the journal");
+		goto EXIT;
+	}
+	journal = ReopenJournal("journal: corrupt batch", path, &options, appended);
+	Check(TestFileSize(journalPath) == beforeBatch, "journal: corrupt batch", "the corrupt batch was not cut off the journal");
+	Check(journal && AppendTestEntries(journal, appended, 2) == S_OK, "journal: corrupt batch", "an append after the corrupt batch failed");
+	appended += 2;
+	CloseCalendarJournal(journal);
+
+	// A crash before the renames leaves the new base and journal beside the old ones
+	if (!WriteTestFile(compactPath, in, offsets[2]) || !WriteTestFile(tempPath, in, offsets[1]))
+	{
+		Check(false, "journal: crash before the renames", "could not write the files a compaction leaves");
+		goto EXIT;
+	}
+	journal = ReopenJournal("journal: crash before the renames", path, &options, appended);
+	Check(TestFileSize(compactPath) < 0 && TestFileSize(tempPath) < 0, "journal: crash before the renames", "the files the compaction left were kept");
+
+	// A crash between the renames leaves a journal whose base is the .compact file
+	oldBase = ReadTestFile(path, &oldLen);
+	Check(journal && CompactCalendarJournal(journal, true) == S_OK, "journal: crash between the renames", "the journal did not compact");
+	CloseCalendarJournal(journal);
+	journal = NULL;
+	newBase = ReadTestFile(path, &newLen);
+	if (!oldBase || !newBase || !WriteTestFile(compactPath, newBase, newLen) || !WriteTestFile(path, oldBase, oldLen))
+	{
+		Check(false, "journal: crash between the renames", "could not put the old base back");
+		goto EXIT;
+	}
+	journal = ReopenJournal("journal: crash between the renames", path, &options, appended);
+	free(file);
+	file = ReadTestFile(path, &fileLen);
+	Check(file && fileLen == newLen && !memcmp(file, newBase, newLen), "journal: crash between the renames", "the compacted base was not put in place");
+	Check(TestFileSize(compactPath) < 0, "journal: crash between the renames", "the .compact file was kept");
+	CloseCalendarJournal(journal);
+
+	// Every append starts a compaction, so most run while one folds the
+	// journal; closing right after lets the last one finish
+	options.CompactBytes = 1;
+	for (int round = 0; round < 2; round++)
+	{
+		journal = ReopenJournal("journal: appends while compacting", path, &options, appended);
+		if (!journal)
+		{
+			goto EXIT;
+		}
+
+		for (int i = 0; i < 50; i++)
+		{
+			Check(AppendTestEntries(journal, appended, 1 + i % 3) == S_OK, "journal: appends while compacting", "an append failed");
+			appended += 1 + i % 3;
+		}
+		Check(HasJournalEntries(GetCalendarJournalCalendar(journal), appended), "journal: appends while compacting", "the calendar does not hold the entries appended");
+		if (round)
+		{
+			Check(CompactCalendarJournal(journal, true) == S_OK, "journal: appends while compacting", "the journal did not compact");
+		}
+		CloseCalendarJournal(journal);
+		journal = NULL;
+	}
+
+	// The last compaction folded every append into the base
+	free(file);
+	file = ReadTestFile(path, &fileLen);
+	{
+		HANDLE cal = file ? ParseCalendarFileBuffer(file, fileLen) : NULL;
+		Check(HasJournalEntries(cal, appended), "journal: appends while compacting", "the compacted base does not hold every entry appended");
+		DestroyCalendar(cal);
+	}
+	journal = ReopenJournal("journal: appends while compacting", path, &options, appended);
+
+EXIT:
+	CloseCalendarJournal(journal);
+	RemoveJournalFiles(path);
+	free(in);
+	free(file);
+	free(oldBase);
+	free(newBase);
+}
+
+/// <summary>
+/// Entry point.  Call caltests.exe with a test name, or none to run them
+/// all; it prints each check that failed and returns S_FALSE if any did
+/// </summary>
+int main(int argc, char* argv[])
+{
+	printf("------------------------------------------------------\n");
+	printf("Microsoft Security Risk Detection Demo: caltests\n");
+
+	for (int bug = BUG_1; bug <= BUG_10; bug++)
+	{
+		DisableBug(bug);
+	}
+	DisableBug(TRYEXCEPT);
+
+	bool all = argc < 2;
+	bool ran = false;
+
+	if (all || 0 == strcmp(argv[1], "reparse"))
+	{
+		TestReparse();
+		ran = true;
+	}
+
+	if (all || 0 == strcmp(argv[1], "journal"))
+	{
+		TestJournal();
+		ran = true;
+	}
+
+	if (all || 0 == strcmp(argv[1], "views"))
+	{
+		size_t len = 0;
+		unsigned char *in = GenerateViewCalendar(&len);
+		Check(in != NULL, "views", "the calendar could not be generated");
+		if (in)
+		{
+			TestViews(in, len);
+			free(in);
+		}
+		ran = true;
+	}
+
+	if (!ran)
+	{
+		printf("Usage: caltests.exe [test]:\n");
+		printf("    reparse    ReparseCalendarFileBuffer at entry boundaries, in the header and after END\n");
+		printf("    journal    Calendar journals cut short, corrupted, compacting or interrupted while compacting\n");
+		printf("    views      CalendarView.h entries, recipients and attachments against the C accessors\n");
+		return -1;
+	}
+
+	printf("-> %s: %d checks, %d failed\n", Failures ? "FAIL" : "PASS", Checks, Failures);
+	return Failures ? S_FALSE : S_OK;
+}
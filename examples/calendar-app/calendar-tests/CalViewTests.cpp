@@ -0,0 +1,137 @@
+/*********************************************************************
+* Microsoft Security Risk Detection
+* Developer Center Demo Application
+* (c) 2017 Microsoft Corp
+*
+* CalViewTests.cpp : checks the C++17 views of CalendarView.h against
+* the library's C accessors.  The views read the library's own
+* structures, which CalendarLib.h declares again as handles, so they
+* get a translation unit of their own
+*
+*********************************************************************/
+
+#include "stdafx.h"
+#include <string.h>
+#include <Windows.h>
+#include <utility>
+#include "../calendar-lib/CalendarView.h"
+
+extern "C"
+{
+	int GetCalendarEntryCount(Calendar *pCalendar);
+	CalendarEntry *GetCalendarEntryAt(Calendar *pCalendar, unsigned int index);
+	char *GetSubject(CalendarEntry *pEntry);
+	Contact *GetSender(CalendarEntry *pEntry);
+	Contact *GetFirstRecipient(CalendarEntry *pEntry);
+	Contact *GetNextRecipient(Contact *pContact);
+	char *GetContactName(Contact *pContact);
+	char *GetContactEmail(Contact *pContact);
+	int GetAttachmentCount(CalendarEntry *pEntry);
+	Attachment *GetFirstAttachment(CalendarEntry *pEntry);
+	Attachment *GetNextAttachment(Attachment *pAttachment);
+	char *GetAttachmentName(Attachment *pAttachment);
+	unsigned int GetAttachmentBlobLength(Attachment *pAttachment);
+	HRESULT GetAttachmentBlob(Attachment *pAttachment, void *pBlob, unsigned int len);
+}
+
+void Check(bool ok, const char *test, const char *what);
+
+/// <summary>
+/// Returns whether a view holds the same characters as a string from the
+/// C accessors, a NULL string matching an empty view
+/// </summary>
+bool SameString(std::string_view view, const char *s)
+{
+	if (!s)
+	{
+		return view.empty();
+	}
+	return view.size() == strlen(s) && !memcmp(view.data(), s, view.size());
+}
+
+/// <summary>
+/// Returns whether an attachment view has the name and blob the C
+/// accessors give for pAttachment
+/// </summary>
+bool SameAttachment(const CalAttachmentView &attachment, Attachment *pAttachment)
+{
+	unsigned char blob[64];
+
+	if (attachment.get() != pAttachment || !SameString(attachment.Name(), GetAttachmentName(pAttachment)))
+	{
+		return false;
+	}
+
+	unsigned int length = GetAttachmentBlobLength(pAttachment);
+	if (attachment.Blob().size() != length || length > sizeof(blob))
+	{
+		return false;
+	}
+
+	return GetAttachmentBlob(pAttachment, blob, sizeof(blob)) == S_OK && !memcmp(attachment.Blob().data(), blob, length);
+}
+
+/// <summary>
+/// Parses in through ParseCalendar and walks its entries, recipients and
+/// attachments through the views, each against the C accessors.  in
+/// should give some entry more than one recipient and some attachments
+/// </summary>
+void TestViews(const unsigned char *in, size_t len)
+{
+	const char *test = "views";
+
+	CalendarPtr cal = ParseCalendar(in, len);
+	if (!cal)
+	{
+		Check(false, test, "the calendar did not parse");
+		return;
+	}
+
+	Check(cal.EntryCount() == (unsigned int)GetCalendarEntryCount(cal.get()), test, "EntryCount differs from GetCalendarEntryCount");
+
+	unsigned int i = 0;
+	int recipients = 0;
+	int attachments = 0;
+	for (CalEntryView entry : cal.Entries())
+	{
+		CalendarEntry *pEntry = GetCalendarEntryAt(cal.get(), i);
+		Check(entry.get() == pEntry && cal.EntryAt(i).get() == pEntry, test, "an entry is not the one GetCalendarEntryAt gives");
+		Check(SameString(entry.Subject(), GetSubject(pEntry)), test, "a subject differs");
+		Check(SameString(entry.Sender().Email(), GetContactEmail(GetSender(pEntry))), test, "a sender differs");
+
+		Contact *pContact = GetFirstRecipient(pEntry);
+		for (CalContactView recipient : entry.Recipients())
+		{
+			Check(recipient.get() == pContact && SameString(recipient.Name(), GetContactName(pContact)) &&
+				SameString(recipient.Email(), GetContactEmail(pContact)), test, "a recipient differs");
+			pContact = pContact ? GetNextRecipient(pContact) : NULL;
+			recipients++;
+		}
+		Check(!pContact, test, "the view gave fewer recipients than the list holds");
+
+		int count = GetAttachmentCount(pEntry);
+		Check(entry.Attachments().size() == (size_t)(count < 0 ? 0 : count), test, "the attachment count differs");
+
+		Attachment *pAttachment = count > 0 ? GetFirstAttachment(pEntry) : NULL;
+		int k = 0;
+		for (CalAttachmentView attachment : entry.Attachments())
+		{
+			Check(k < count && SameAttachment(attachment, pAttachment), test, "an attachment differs");
+			Check(SameAttachment(entry.Attachments()[k], pAttachment), test, "an attachment differs by index");
+			pAttachment = ++k < count ? GetNextAttachment(pAttachment) : NULL;
+			attachments++;
+		}
+
+		i++;
+	}
+
+	Check(i == cal.EntryCount() && !cal.EntryAt(i), test, "the entries do not end where EntryCount says");
+	Check(recipients > (int)i && attachments > 0, test, "the calendar gave no extra recipients or attachments to walk");
+
+	// Moving hands the calendar over; reset destroys it through the export
+	Calendar *pCalendar = cal.get();
+	CalendarPtr moved = std::move(cal);
+	Check(!cal && moved.get() == pCalendar, test, "moving did not hand the calendar over");
+	moved.reset();
+	Check(!moved, test, "reset left the calendar in place");
+}